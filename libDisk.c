@@ -1,25 +1,175 @@
+#define _POSIX_C_SOURCE 200809L // ftruncate, fileno and fseeko under -std=c99
+#define _DEFAULT_SOURCE // preadv and pwritev
+#define _FILE_OFFSET_BITS 64 // 64 bit off_t for fseeko, ftello and ftruncate on 32 bit hosts too
 #include "libDisk.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#endif
 
 
 int diskCounter = 1; // global to keep track of number of disks opened
+long diskBlockReads = 0; // blocks read from any disk, checksum failures included, never reset
+long diskBlockWrites = 0; // blocks written to any disk, never reset
+long diskSeeks = 0; // requests that did not start at the block after the last one on their disk, never reset
+long diskSeekBlocks = 0; // how far those requests were from it, in blocks, never reset
 
 Disk *diskListHead = NULL; // global to keep track of list of disks
 
+FILE *traceFile = NULL; // trace being recorded, NULL when tracing is off
+struct timespec traceStart; // when the trace started, record times count from here
+int traceEnvChecked = 0; // 1 once DISK_TRACE_ENV has been looked at
 
-int openDisk(char *filename, int nBytes) {
-    /* This functions opens a regular UNIX file and designates the first
-    nBytes of it as space for the emulated disk. If nBytes is not exactly a
-    multiple of BLOCKSIZE then the disk size will be the closest multiple
-    of BLOCKSIZE that is lower than nByte (but greater than 0) If nBytes is
-    less than BLOCKSIZE failure should be returned. If nBytes > BLOCKSIZE
-    and there is already a file by the given filename, that file’s content
-    may be overwritten. If nBytes is 0, an existing disk is opened, and the
-    content must not be overwritten in this function. There is no requirement
-    to maintain integrity of any file content beyond nBytes. The return value
-    is negative on failure or a disk number on success. */
+void traceEvent(int event, int disk, int64_t bNum, int flags) {
+    /* appends one record to the trace, stdio buffers them so most calls are a memcpy */
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t time = (uint64_t)(now.tv_sec - traceStart.tv_sec) * 1000000000ULL + now.tv_nsec - traceStart.tv_nsec;
+    uint64_t block = (uint64_t)bNum;
+    uint16_t diskNumber = (uint16_t)disk;
+    unsigned char record[DISK_TRACE_RECORD_SIZE];
+    memset(record, 0, DISK_TRACE_RECORD_SIZE);
+    memcpy(record + DISK_TRACE_TIME_OFFSET, &time, sizeof(uint64_t));
+    memcpy(record + DISK_TRACE_BLOCK_OFFSET, &block, sizeof(uint64_t));
+    memcpy(record + DISK_TRACE_DISK_OFFSET, &diskNumber, sizeof(uint16_t));
+    record[DISK_TRACE_OP_OFFSET] = (unsigned char)event;
+    record[DISK_TRACE_FLAGS_OFFSET] = (unsigned char)flags;
+    fwrite(record, DISK_TRACE_RECORD_SIZE, 1, traceFile);
+}
+
+int startDiskTrace(char *filename) {
+    /* records every block read and write, and every disk opened and closed,
+    into 'filename' until stopDiskTrace(). Disks already open are recorded
+    as opened right away. Returns 0 on success, -1 on failure. */
+    if (traceFile != NULL) {
+        stopDiskTrace();
+    }
+    traceFile = fopen(filename, "wb");
+    if (traceFile == NULL) {
+        printf("LIBDISK: Error opening trace file\n");
+        return -1;
+    }
+    setvbuf(traceFile, NULL, _IOFBF, 1 << 16);
+    unsigned char header[DISK_TRACE_HEADER_SIZE];
+    int version = DISK_TRACE_VERSION;
+    int blockSize = BLOCKSIZE;
+    memcpy(header, DISK_TRACE_MAGIC, 8);
+    memcpy(header + 8, &version, sizeof(int));
+    memcpy(header + 12, &blockSize, sizeof(int));
+    fwrite(header, DISK_TRACE_HEADER_SIZE, 1, traceFile);
+    clock_gettime(CLOCK_MONOTONIC, &traceStart);
+    for (Disk *currentDisk = diskListHead; currentDisk != NULL; currentDisk = currentDisk->next) {
+        traceEvent(DISK_TRACE_OPEN, currentDisk->diskNumber, currentDisk->nBytes / BLOCKSIZE, 0);
+    }
+    return 0;
+}
+
+int stopDiskTrace(void) {
+    /* flushes and closes the trace, if one is being recorded */
+    if (traceFile == NULL) {
+        return 0;
+    }
+    int result = fclose(traceFile);
+    traceFile = NULL;
+    if (result != 0) {
+        printf("LIBDISK: Error closing trace file\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+void checkTraceEnv(void) {
+    /* starts the trace DISK_TRACE_ENV names, the first time a disk is opened */
+    if (!traceEnvChecked) {
+        traceEnvChecked = 1;
+        if (getenv(DISK_TRACE_ENV) != NULL) {
+            startDiskTrace(getenv(DISK_TRACE_ENV));
+        }
+    }
+}
+
+/* Disk backends
+ * A disk's blocks are moved by the diskBackend it was opened with, see
+ * libDisk.h. readBlocks and writeBlocks do the range checks, checksums,
+ * counters and tracing for all of them. */
+
+Disk *findDisk(int disk) {
+    for (Disk *currentDisk = diskListHead; currentDisk != NULL; currentDisk = currentDisk->next) {
+        if (currentDisk->diskNumber == disk) {
+            return currentDisk;
+        }
+    }
+    printf("LIBDISK: Error: Disk not found\n");
+    return NULL;
+}
+
+int addDisk(char *filename, int64_t nBytes, const diskBackend *backend, void *state, int created) {
+    /* puts a disk that 'backend' opened as 'state' on the disk list, under
+    'filename'. 'created' is 1 if the open made the disk anew. Returns the
+    disk number, or -1 and the caller closes 'state' again. */
+    Disk *newDisk = malloc(sizeof(Disk));
+    char *filenameCopy = malloc(strlen(filename) + 1);
+    if (newDisk == NULL || filenameCopy == NULL) {
+        printf("LIBDISK: Error allocating memory for new disk\n");
+        free(newDisk);
+        free(filenameCopy);
+        return -1;
+    }
+    strcpy(filenameCopy, filename);
+    newDisk->diskNumber = diskCounter++;
+    newDisk->filename = filenameCopy;
+    newDisk->nBytes = nBytes;
+    newDisk->checksums = 0;
+    newDisk->backend = backend;
+    newDisk->state = state;
+    newDisk->head = 0;
+    newDisk->next = diskListHead;
+    diskListHead = newDisk;
+    if (traceFile != NULL) {
+        traceEvent(DISK_TRACE_OPEN, newDisk->diskNumber, nBytes / BLOCKSIZE, created ? DISK_TRACE_FLAG_CREATE : 0);
+    }
+    return newDisk->diskNumber;
+}
+
+/* Plain files, read and written through stdio */
+
+int fileRead(Disk *disk, int64_t bNum, int count, char *blocks) {
+    FILE *fp = disk->state;
+    // seek to correct position, use SEEK_SET to seek from beginning of file
+    if (fseeko(fp, (off_t)bNum * BLOCKSIZE, SEEK_SET) != 0) {
+        return -1;
+    }
+    return fread(blocks, BLOCKSIZE, count, fp) == (size_t)count ? 0 : -1;
+}
+
+int fileWrite(Disk *disk, int64_t bNum, int count, char *blocks) {
+    FILE *fp = disk->state;
+    if (fseeko(fp, (off_t)bNum * BLOCKSIZE, SEEK_SET) != 0) {
+        return -1;
+    }
+    return fwrite(blocks, BLOCKSIZE, count, fp) == (size_t)count ? 0 : -1;
+}
+
+int fileClose(Disk *disk) {
+    return fclose(disk->state) == 0 ? 0 : -1;
+}
+
+const diskBackend fileBackend = { "file", fileRead, fileWrite, fileClose, NULL };
+
+int openFileDisk(char *filename, int64_t nBytes) {
+    /* openDisk of a plain file */
     if (nBytes == 0) {
         // open existing disk, can't overwirte content
         // File should already exist, open it
@@ -29,74 +179,1096 @@ int openDisk(char *filename, int nBytes) {
             return -1;
         }
         // get file size
-        fseek(fp, 0, SEEK_END);
-        int fileSize = ftell(fp);
+        fseeko(fp, 0, SEEK_END);
+        int64_t fileSize = (int64_t)ftello(fp);
         if (fileSize % BLOCKSIZE != 0) {
             printf("LIBDISK: File size is not a multiple of BLOCKSIZE\n");
+            fclose(fp);
             return -1;
         }
         // return position to the beginning
-        fseek(fp, 0, SEEK_SET);
-        // add disk to disk list
-        Disk *newDisk = malloc(sizeof(Disk));
-        if (newDisk == NULL) {
-            printf("LIBDISK: Error allocating memory for new disk\n");
-            return -1;
-        }
-        newDisk->diskNumber = diskCounter++;
-        char *filenameCopy = malloc(strlen(filename) + 1);
-        if (filenameCopy == NULL) {
-            printf("LIBDISK: Error allocating memory for filename\n");
-            return -1;
-        }
-        strcpy(filenameCopy, filename);
-        newDisk->filename = filenameCopy;
-        newDisk->nBytes = fileSize;
-        newDisk->next = diskListHead;
-        newDisk->filePointer = fp;
-        diskListHead = newDisk;
-        return newDisk->diskNumber;
+        fseeko(fp, 0, SEEK_SET);
+        int disk = addDisk(filename, fileSize, &fileBackend, fp, 0);
+        if (disk < 0) {
+            fclose(fp);
+        }
+        return disk;
+    }
+    // create new disk
+    if (nBytes < BLOCKSIZE) {
+        printf("LIBDISK: Error: nBytes must be at least BLOCKSIZE\n");
+        return -1;
+    }
+    if (nBytes % BLOCKSIZE != 0) {
+        nBytes = nBytes - (nBytes % BLOCKSIZE);
+    }
+    // create file
+    FILE *fp = fopen(filename, "w+"); // will truncate file to 0 if it exists, and can be read back
+    if (fp == NULL) {
+        printf("LIBDISK: Error opening file\n");
+        return -1;
+    }
+    // size the file to nBytes in one call, the new space reads back as 0s
+    // and the file system only stores the blocks that are ever written
+    if (ftruncate(fileno(fp), (off_t)nBytes) != 0) {
+        printf("LIBDISK: Error sizing file\n");
+        fclose(fp);
+        return -1;
+    }
+    int disk = addDisk(filename, nBytes, &fileBackend, fp, 1);
+    if (disk < 0) {
+        fclose(fp);
+    }
+    return disk;
+}
+
+/* Memory mapped files
+ * The whole file is mapped shared, so a block access is a memcpy and the
+ * kernel writes dirty pages back on its own schedule, or at closeDisk. */
+
+typedef struct mappedFile {
+    int fd;
+    char *memory;
+    size_t length;
+} mappedFile;
+
+int mappedRead(Disk *disk, int64_t bNum, int count, char *blocks) {
+    mappedFile *file = disk->state;
+    memcpy(blocks, file->memory + bNum * BLOCKSIZE, (size_t)count * BLOCKSIZE);
+    return 0;
+}
+
+int mappedWrite(Disk *disk, int64_t bNum, int count, char *blocks) {
+    mappedFile *file = disk->state;
+    memcpy(file->memory + bNum * BLOCKSIZE, blocks, (size_t)count * BLOCKSIZE);
+    return 0;
+}
+
+int mappedClose(Disk *disk) {
+    mappedFile *file = disk->state;
+    int result = munmap(file->memory, file->length) == 0 && close(file->fd) == 0 ? 0 : -1;
+    free(file);
+    return result;
+}
+
+const diskBackend mappedBackend = { "mmap", mappedRead, mappedWrite, mappedClose, NULL };
+
+int openMappedDisk(char *filename, int64_t nBytes) {
+    /* openDisk of DISK_MMAP_PREFIX and a file name, with the same sizes */
+    char *path = filename + strlen(DISK_MMAP_PREFIX);
+    if (nBytes != 0 && nBytes < BLOCKSIZE) {
+        printf("LIBDISK: Error: nBytes must be at least BLOCKSIZE\n");
+        return -1;
+    }
+    nBytes -= nBytes % BLOCKSIZE;
+    int fd = nBytes == 0 ? open(path, O_RDWR) : open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        printf("LIBDISK: Error opening file\n");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (nBytes == 0 && (info.st_size == 0 || info.st_size % BLOCKSIZE != 0)) {
+        printf("LIBDISK: File size is not a multiple of BLOCKSIZE\n");
+        close(fd);
+        return -1;
+    }
+    if (nBytes != 0 && ftruncate(fd, (off_t)nBytes) != 0) {
+        printf("LIBDISK: Error sizing file\n");
+        close(fd);
+        return -1;
+    }
+    size_t length = nBytes != 0 ? (size_t)nBytes : (size_t)info.st_size;
+    mappedFile *file = malloc(sizeof(mappedFile));
+    char *memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (file == NULL || memory == MAP_FAILED) {
+        printf("LIBDISK: Error mapping file\n");
+        if (memory != MAP_FAILED) {
+            munmap(memory, length);
+        }
+        free(file);
+        close(fd);
+        return -1;
+    }
+    file->fd = fd;
+    file->memory = memory;
+    file->length = length;
+    int disk = addDisk(filename, (int64_t)length, &mappedBackend, file, nBytes != 0);
+    if (disk < 0) {
+        munmap(memory, length);
+        free(file);
+        close(fd);
+    }
+    return disk;
+}
+
+/* RAM disks
+ * A RAM disk is one anonymous mapping, aligned and rounded up to
+ * DISK_RAM_ALIGN so the kernel can back it with huge pages, and a block
+ * access is a memcpy. Like a file, its image stays after closeDisk, until
+ * deleteRamDisk or the end of the process, so tfs_mkfs and tfs_mount can
+ * take turns on it. */
+#define DISK_RAM_ALIGN ((size_t)2 << 20) // a huge page on x86-64
+
+typedef struct ramImage {
+    char *name; // the openDisk name, prefix included
+    char *memory;
+    int64_t nBytes;
+    size_t mapped; // bytes mapped at 'memory'
+    int opens; // open disks using the image
+    struct ramImage *next;
+} ramImage;
+
+ramImage *ramImages = NULL; // every RAM disk image of the process
+
+int ramRead(Disk *disk, int64_t bNum, int count, char *blocks) {
+    ramImage *image = disk->state;
+    memcpy(blocks, image->memory + bNum * BLOCKSIZE, (size_t)count * BLOCKSIZE);
+    return 0;
+}
+
+int ramWrite(Disk *disk, int64_t bNum, int count, char *blocks) {
+    ramImage *image = disk->state;
+    memcpy(image->memory + bNum * BLOCKSIZE, blocks, (size_t)count * BLOCKSIZE);
+    return 0;
+}
+
+int ramClose(Disk *disk) {
+    ramImage *image = disk->state;
+    image->opens--;
+    return 0;
+}
+
+const diskBackend ramBackend = { "ram", ramRead, ramWrite, ramClose, NULL };
+
+char *mapRam(size_t length) {
+    /* zeroed memory for 'length' bytes, a multiple of DISK_RAM_ALIGN, that
+    starts on a DISK_RAM_ALIGN boundary. Returns NULL on failure. */
+    char *memory = mmap(NULL, length + DISK_RAM_ALIGN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+    // trim the mapping to the aligned part
+    size_t head = (DISK_RAM_ALIGN - (uintptr_t)memory % DISK_RAM_ALIGN) % DISK_RAM_ALIGN;
+    if (head > 0) {
+        munmap(memory, head);
+    }
+    munmap(memory + head + length, DISK_RAM_ALIGN - head);
+#ifdef MADV_HUGEPAGE
+    madvise(memory + head, length, MADV_HUGEPAGE);
+#endif
+    return memory + head;
+}
+
+int openRamDisk(char *filename, int64_t nBytes) {
+    /* openDisk of DISK_RAM_PREFIX and a name: nBytes 0 opens the image by
+    that name, anything else makes a new one in its place */
+    ramImage *image = ramImages;
+    while (image != NULL && strcmp(image->name, filename) != 0) {
+        image = image->next;
+    }
+    if (nBytes == 0) {
+        if (image == NULL) {
+            printf("LIBDISK: RAM disk did not exist, it should have!\n");
+            return -1;
+        }
     } else {
-        // create new disk
         if (nBytes < BLOCKSIZE) {
             printf("LIBDISK: Error: nBytes must be at least BLOCKSIZE\n");
             return -1;
         }
-        if (nBytes % BLOCKSIZE != 0) {
-            nBytes = nBytes - (nBytes % BLOCKSIZE);
+        if (image != NULL && image->opens > 0) {
+            printf("LIBDISK: Error: RAM disk is open, it cannot be made anew\n");
+            return -1;
         }
-        // create file
-        FILE *fp = fopen(filename, "w"); // will truncate file to 0 if it exists
-        if (fp == NULL) {
-            printf("LIBDISK: Error opening file\n");
+        nBytes -= nBytes % BLOCKSIZE;
+        size_t mapped = ((size_t)nBytes + DISK_RAM_ALIGN - 1) / DISK_RAM_ALIGN * DISK_RAM_ALIGN;
+        char *memory = mapRam(mapped);
+        if (memory == NULL) {
+            printf("LIBDISK: Error allocating memory for RAM disk\n");
+            return -1;
+        }
+        if (image == NULL) {
+            image = malloc(sizeof(ramImage));
+            char *name = malloc(strlen(filename) + 1);
+            if (image == NULL || name == NULL) {
+                printf("LIBDISK: Error allocating memory for RAM disk\n");
+                munmap(memory, mapped);
+                free(image);
+                free(name);
+                return -1;
+            }
+            strcpy(name, filename);
+            image->name = name;
+            image->opens = 0;
+            image->next = ramImages;
+            ramImages = image;
+        } else {
+            munmap(image->memory, image->mapped);
+        }
+        image->memory = memory;
+        image->nBytes = nBytes;
+        image->mapped = mapped;
+    }
+    int disk = addDisk(filename, image->nBytes, &ramBackend, image, nBytes != 0);
+    if (disk >= 0) {
+        image->opens++;
+    }
+    return disk;
+}
+
+int deleteRamDisk(char *filename) {
+    /* frees the RAM disk image 'filename' names, which must not be open.
+    Returns 0 on success, -1 on failure. */
+    for (ramImage **link = &ramImages; *link != NULL; link = &(*link)->next) {
+        ramImage *image = *link;
+        if (strcmp(image->name, filename) == 0) {
+            if (image->opens > 0) {
+                printf("LIBDISK: Error: RAM disk is open\n");
+                return -1;
+            }
+            *link = image->next;
+            munmap(image->memory, image->mapped);
+            free(image->name);
+            free(image);
+            return 0;
+        }
+    }
+    printf("LIBDISK: Error: RAM disk not found\n");
+    return -1;
+}
+
+/* Striped disks
+ * Logical block b is in stripe unit u = b / stripeBlocks, which is unit
+ * u / members of member u % members. So the units a member holds of any run
+ * of logical blocks follow each other in its file, and one preadv or pwritev
+ * moves them all. Every member has a thread that runs its part of a
+ * readBlocks or writeBlocks call, so the members work in parallel; a
+ * request on a single member runs on the calling thread. */
+#define DISK_IOV_MAX 1024 // iovecs per preadv and pwritev, the Linux IOV_MAX
+
+typedef struct diskSet {
+    int64_t nBytes; // size of the disk
+    int members;
+    diskMember *member;
+    int stripeBlocks; // blocks per stripe unit, 0 for a mirror set
+    int mirrored; // 1 if every member holds the whole disk
+    int64_t generation; // of a mirror set, see DISK_MIRROR_GENERATION_OFFSET
+    unsigned int readTurn; // mirror set reads rotate over the members with it
+} diskSet;
+
+struct diskMember {
+    int fd; // -1 while a mirror is missing
+    diskSet *set; // set the member belongs to
+    int index; // position in the stripe set or mirror set
+    char *filename; // mirrors only, resyncDisk reopens a missing one
+    int inSync; // mirrors only, 1 while the member holds the current copy
+    int64_t head; // mirrors only, block after the last one the member read
+    pthread_t thread;
+    pthread_mutex_t lock; // guards everything below it
+    pthread_cond_t wake; // a request was posted, or the thread should exit
+    pthread_cond_t done; // the request finished
+    int pending; // 1 while a request is posted and not finished
+    int stop; // 1 when the thread should exit
+    int64_t first; // the request: logical blocks first to first + count - 1
+    int count;
+    char *data; // their buffer
+    int write; // 1 to write them, 0 to read
+    int result; // 0, or -1 if the member's part failed
+};
+
+int transferAll(int fd, struct iovec *iov, int iovCount, off_t offset, int write) {
+    /* preadv or pwritev of all of 'iov', resumed after short transfers */
+    while (iovCount > 0) {
+        ssize_t n = write ? pwritev(fd, iov, iovCount, offset) : preadv(fd, iov, iovCount, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        offset += n;
+        while (iovCount > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovCount--;
+        }
+        if (iovCount > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+int memberTransfer(diskMember *member, int64_t first, int count, char *data, int write) {
+    /* moves the blocks of logical blocks first to first + count - 1 that live
+    on 'member' between its file and their place in 'data' */
+    diskSet *set = member->set;
+    if (set->mirrored) {
+        // a mirror has every block where the disk has it
+        struct iovec whole = { data, (size_t)count * BLOCKSIZE };
+        return transferAll(member->fd, &whole, 1, (off_t)first * BLOCKSIZE, write);
+    }
+    int64_t width = set->stripeBlocks;
+    int64_t end = first + count;
+    struct iovec iov[DISK_IOV_MAX];
+    int iovCount = 0;
+    off_t offset = 0; // member file offset of iov[0]
+    for (int64_t b = first; b < end;) {
+        int64_t unit = b / width;
+        int64_t run = width - b % width;
+        if (run > end - b) {
+            run = end - b;
+        }
+        if (unit % set->members == member->index) {
+            if (iovCount == 0) {
+                offset = (off_t)((unit / set->members) * width + b % width) * BLOCKSIZE;
+            }
+            iov[iovCount].iov_base = data + (b - first) * BLOCKSIZE;
+            iov[iovCount].iov_len = (size_t)run * BLOCKSIZE;
+            if (++iovCount == DISK_IOV_MAX) {
+                if (transferAll(member->fd, iov, iovCount, offset, write) < 0) {
+                    return -1;
+                }
+                iovCount = 0;
+            }
+        }
+        b += run;
+    }
+    return iovCount > 0 ? transferAll(member->fd, iov, iovCount, offset, write) : 0;
+}
+
+void *memberThread(void *arg) {
+    diskMember *member = (diskMember *)arg;
+    pthread_mutex_lock(&member->lock);
+    for (;;) {
+        while (!member->pending && !member->stop) {
+            pthread_cond_wait(&member->wake, &member->lock);
+        }
+        if (!member->pending) {
+            break; // stopped
+        }
+        pthread_mutex_unlock(&member->lock);
+        int result = memberTransfer(member, member->first, member->count, member->data, member->write);
+        pthread_mutex_lock(&member->lock);
+        member->result = result;
+        member->pending = 0;
+        pthread_cond_signal(&member->done);
+    }
+    pthread_mutex_unlock(&member->lock);
+    return NULL;
+}
+
+void memberPost(diskMember *member, int64_t first, int count, char *data, int write) {
+    /* hands a request to the member's thread */
+    pthread_mutex_lock(&member->lock);
+    member->first = first;
+    member->count = count;
+    member->data = data;
+    member->write = write;
+    member->pending = 1;
+    pthread_cond_signal(&member->wake);
+    pthread_mutex_unlock(&member->lock);
+}
+
+int memberWait(diskMember *member) {
+    /* waits for the request memberPost handed over, returns its result */
+    pthread_mutex_lock(&member->lock);
+    while (member->pending) {
+        pthread_cond_wait(&member->done, &member->lock);
+    }
+    int result = member->result;
+    pthread_mutex_unlock(&member->lock);
+    return result;
+}
+
+int startMember(diskMember *member, int fd) {
+    /* starts the thread of a member whose file is open as 'fd' */
+    member->pending = 0;
+    member->stop = 0;
+    pthread_mutex_init(&member->lock, NULL);
+    pthread_cond_init(&member->wake, NULL);
+    pthread_cond_init(&member->done, NULL);
+    if (pthread_create(&member->thread, NULL, memberThread, member) != 0) {
+        printf("LIBDISK: Error starting member thread\n");
+        pthread_mutex_destroy(&member->lock);
+        pthread_cond_destroy(&member->wake);
+        pthread_cond_destroy(&member->done);
+        return -1;
+    }
+    member->fd = fd;
+    return 0;
+}
+
+int stripedTransfer(diskSet *set, int64_t first, int count, char *data, int write) {
+    /* hands every member its part of the request at once, does the part of
+    the member holding 'first' itself, and waits for the others */
+    int64_t firstUnit = first / set->stripeBlocks;
+    int64_t units = (first + count - 1) / set->stripeBlocks - firstUnit + 1;
+    int involved = units < set->members ? (int)units : set->members;
+    for (int i = 1; i < involved; i++) {
+        memberPost(&set->member[(firstUnit + i) % set->members], first, count, data, write);
+    }
+    int result = memberTransfer(&set->member[firstUnit % set->members], first, count, data, write);
+    for (int i = 1; i < involved; i++) {
+        if (memberWait(&set->member[(firstUnit + i) % set->members]) < 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+void closeSet(diskSet *set) {
+    /* stops the member threads, closes the member files and frees the set */
+    for (int i = 0; i < set->members; i++) {
+        diskMember *member = &set->member[i];
+        free(member->filename);
+        if (member->fd < 0) {
+            continue; // never opened: a missing mirror, or the open failed part way
+        }
+        pthread_mutex_lock(&member->lock);
+        member->stop = 1;
+        pthread_cond_signal(&member->wake);
+        pthread_mutex_unlock(&member->lock);
+        pthread_join(member->thread, NULL);
+        pthread_mutex_destroy(&member->lock);
+        pthread_cond_destroy(&member->wake);
+        pthread_cond_destroy(&member->done);
+        close(member->fd);
+    }
+    free(set->member);
+    free(set);
+}
+
+int stripeRead(Disk *disk, int64_t bNum, int count, char *blocks) {
+    return stripedTransfer(disk->state, bNum, count, blocks, 0);
+}
+
+int stripeWrite(Disk *disk, int64_t bNum, int count, char *blocks) {
+    return stripedTransfer(disk->state, bNum, count, blocks, 1);
+}
+
+int stripeClose(Disk *disk) {
+    closeSet(disk->state);
+    return 0;
+}
+
+const diskBackend stripeBackend = { "stripe", stripeRead, stripeWrite, stripeClose, NULL };
+
+int openStripedDisk(char *filenames[], int members, int stripeBlocks, int64_t nBytes) {
+    /* opens a disk striped over the files 'filenames', 'stripeBlocks' blocks
+    at a time. Like openDisk, nBytes 0 opens an existing stripe set and
+    anything else makes a new one of at least nBytes, rounded up to whole
+    stripes, so a file system sized for nBytes fits. Returns
+    the disk number, or -1. */
+    checkTraceEnv();
+    if (members < 1 || members > DISK_MAX_MEMBERS || stripeBlocks < 1) {
+        printf("LIBDISK: Error: A stripe set needs 1 to %d members and a width of at least 1 block\n", DISK_MAX_MEMBERS);
+        return -1;
+    }
+    int64_t unitBytes = (int64_t)stripeBlocks * BLOCKSIZE;
+    int64_t memberBytes = 0;
+    if (nBytes != 0) {
+        if (nBytes < BLOCKSIZE) {
+            printf("LIBDISK: Error: nBytes must be at least BLOCKSIZE\n");
+            return -1;
+        }
+        int64_t stripeBytes = unitBytes * members;
+        memberBytes = (nBytes + stripeBytes - 1) / stripeBytes * unitBytes;
+    }
+    diskSet *set = calloc(1, sizeof(diskSet));
+    size_t nameLength = strlen(DISK_STRIPE_PREFIX) + 24;
+    for (int i = 0; i < members; i++) {
+        nameLength += strlen(filenames[i]) + 1;
+    }
+    char *name = malloc(nameLength);
+    diskMember *member = calloc(members, sizeof(diskMember));
+    if (set == NULL || name == NULL || member == NULL) {
+        printf("LIBDISK: Error allocating memory for new disk\n");
+        free(set);
+        free(name);
+        free(member);
+        return -1;
+    }
+    // the disk is named by the spec openDisk takes for it
+    int length = sprintf(name, "%s%d:", DISK_STRIPE_PREFIX, stripeBlocks);
+    for (int i = 0; i < members; i++) {
+        length += sprintf(name + length, "%s%s", i > 0 ? "," : "", filenames[i]);
+    }
+    set->members = members;
+    set->stripeBlocks = stripeBlocks;
+    set->member = member;
+    for (int i = 0; i < members; i++) {
+        member[i].fd = -1;
+        member[i].set = set;
+        member[i].index = i;
+    }
+    for (int i = 0; i < members; i++) {
+        int fd = nBytes == 0 ? open(filenames[i], O_RDWR) : open(filenames[i], O_RDWR | O_CREAT | O_TRUNC, 0666);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            printf("LIBDISK: Error opening stripe member %s\n", filenames[i]);
+            if (fd >= 0) {
+                close(fd);
+            }
+            closeSet(set);
+            free(name);
+            return -1;
+        }
+        if (nBytes == 0 && (info.st_size == 0 || info.st_size % unitBytes != 0 ||
+            (i > 0 && (int64_t)info.st_size != memberBytes))) {
+            printf("LIBDISK: Error: Stripe member %s is not a member of this stripe set\n", filenames[i]);
+            close(fd);
+            closeSet(set);
+            free(name);
+            return -1;
+        }
+        if (nBytes == 0) {
+            memberBytes = (int64_t)info.st_size;
+        } else if (ftruncate(fd, (off_t)memberBytes) != 0) {
+            printf("LIBDISK: Error sizing file\n");
+            close(fd);
+            closeSet(set);
+            free(name);
+            return -1;
+        }
+        if (startMember(&member[i], fd) < 0) {
+            close(fd);
+            closeSet(set);
+            free(name);
+            return -1;
+        }
+    }
+    set->nBytes = memberBytes * members;
+    int disk = addDisk(name, set->nBytes, &stripeBackend, set, nBytes != 0);
+    if (disk < 0) {
+        closeSet(set);
+    }
+    free(name);
+    return disk;
+}
+
+int splitMembers(char *names, char *filenames[]) {
+    /* splits a DISK_MEMBER_SEPARATOR separated list of member files in
+    place, fills in at most DISK_MAX_MEMBERS of them and returns how many
+    there are */
+    int members = 0;
+    for (char *name = names; name != NULL && members <= DISK_MAX_MEMBERS;) {
+        char *separator = strchr(name, DISK_MEMBER_SEPARATOR);
+        if (separator != NULL) {
+            *separator = '\0';
+        }
+        if (members < DISK_MAX_MEMBERS) {
+            filenames[members] = name;
+        }
+        members++;
+        name = separator != NULL ? separator + 1 : NULL;
+    }
+    return members;
+}
+
+int openStripeSpec(char *spec, int64_t nBytes) {
+    /* openStripedDisk for the part of an openDisk filename after
+    DISK_STRIPE_PREFIX: an optional width and a colon, then the members */
+    int stripeBlocks = DISK_DEFAULT_STRIPE_BLOCKS;
+    if (isdigit((unsigned char)*spec)) {
+        char *end;
+        stripeBlocks = (int)strtol(spec, &end, 10);
+        if (*end != ':') {
+            printf("LIBDISK: Error: Bad stripe set %s\n", spec);
             return -1;
         }
-        // write nBytes of 0s to file
-        char zero = 0;
-        for (int i = 0; i < nBytes; i++) {
-            fwrite(&zero, sizeof(char), 1, fp);
+        spec = end + 1;
+    }
+    char *names = malloc(strlen(spec) + 1);
+    if (names == NULL) {
+        printf("LIBDISK: Error allocating memory for filename\n");
+        return -1;
+    }
+    strcpy(names, spec);
+    char *filenames[DISK_MAX_MEMBERS];
+    int members = splitMembers(names, filenames);
+    int disk = openStripedDisk(filenames, members, stripeBlocks, nBytes);
+    free(names);
+    return disk;
+}
+
+/* Mirrored disks
+ * Every member holds the whole disk, followed by a trailer block: the
+ * set's generation and whether it was closed cleanly. Writes go to every
+ * current member, at once for a run of DISK_MIRROR_PARALLEL_BLOCKS or more,
+ * and such a run is read in one part per current member, all at the same
+ * time. A shorter read goes to the member whose last read ended right
+ * before it, so a sequential reader stays on one file, and otherwise to the
+ * next member in turn. A member that
+ * fails drops out, and the others move to a new generation so it is
+ * resynced, copied over from a current member, when the set is opened
+ * again. Opening a set that was not closed cleanly resyncs all but the
+ * first current member, as the last writes may have reached only some. */
+#define DISK_RESYNC_BLOCKS 256 // blocks copied per request by a resync
+#define DISK_MIRROR_PARALLEL_BLOCKS 32 // smaller requests stay on the calling thread, a handoff costs more than they do
+
+int writeTrailer(diskMember *member, int clean) {
+    /* writes the set's generation and 'clean' into the member's trailer */
+    diskSet *set = member->set;
+    char trailer[BLOCKSIZE];
+    memset(trailer, 0, BLOCKSIZE);
+    memcpy(trailer, DISK_MIRROR_MAGIC, 8);
+    memcpy(trailer + DISK_MIRROR_GENERATION_OFFSET, &set->generation, sizeof(int64_t));
+    trailer[DISK_MIRROR_CLEAN_OFFSET] = (char)clean;
+    uint32_t checksum = crc32c(trailer, BLOCK_CHECKSUM_OFFSET);
+    memcpy(trailer + BLOCK_CHECKSUM_OFFSET, &checksum, sizeof(uint32_t));
+    return pwrite(member->fd, trailer, BLOCKSIZE, (off_t)set->nBytes) == BLOCKSIZE ? 0 : -1;
+}
+
+int readTrailer(int fd, int64_t nBytes, int64_t *generation, int *clean) {
+    /* reads the trailer of a member holding nBytes, returns -1 if there is
+    no valid one */
+    char trailer[BLOCKSIZE];
+    uint32_t checksum;
+    if (nBytes < BLOCKSIZE || pread(fd, trailer, BLOCKSIZE, (off_t)nBytes) != BLOCKSIZE) {
+        return -1;
+    }
+    memcpy(&checksum, trailer + BLOCK_CHECKSUM_OFFSET, sizeof(uint32_t));
+    if (memcmp(trailer, DISK_MIRROR_MAGIC, 8) != 0 || checksum != crc32c(trailer, BLOCK_CHECKSUM_OFFSET)) {
+        return -1;
+    }
+    memcpy(generation, trailer + DISK_MIRROR_GENERATION_OFFSET, sizeof(int64_t));
+    *clean = trailer[DISK_MIRROR_CLEAN_OFFSET];
+    return 0;
+}
+
+void dropMirror(diskSet *set, diskMember *member) {
+    /* takes a member that failed out of the set, and moves the others to a
+    new generation so it stays out when the set is opened again */
+    printf("LIBDISK: Error: Mirror %s failed, the disk goes on without it\n", member->filename);
+    member->inSync = 0;
+    set->generation++;
+    for (int i = 0; i < set->members; i++) {
+        if (set->member[i].inSync && writeTrailer(&set->member[i], 0) < 0) {
+            dropMirror(set, &set->member[i]);
+            return;
+        }
+    }
+}
+
+int mirroredTransfer(diskSet *set, int64_t first, int count, char *data, int write) {
+    /* writes to every current member at once, or reads from one or,
+    for a run, from all of them in parts. Members that fail are dropped, a
+    read is then retried on the others. */
+    diskMember *current[DISK_MAX_MEMBERS];
+    int n = 0;
+    for (int i = 0; i < set->members; i++) {
+        if (set->member[i].inSync) {
+            current[n++] = &set->member[i];
+        }
+    }
+    if (n == 0) {
+        printf("LIBDISK: Error: No mirror is left\n");
+        return -1;
+    }
+    int parallel = count >= DISK_MIRROR_PARALLEL_BLOCKS;
+    if (write) {
+        for (int i = 1; i < n && parallel; i++) {
+            memberPost(current[i], first, count, data, 1);
+        }
+        int failed[DISK_MAX_MEMBERS];
+        for (int i = 0; i < n; i++) {
+            failed[i] = (i == 0 || !parallel ? memberTransfer(current[i], first, count, data, 1) : memberWait(current[i])) < 0;
+        }
+        int written = 0;
+        for (int i = 0; i < n; i++) {
+            if (failed[i]) {
+                dropMirror(set, current[i]);
+            } else {
+                written++;
+            }
+        }
+        return written > 0 ? 0 : -1;
+    }
+    int parts = parallel ? (n < count ? n : count) : 1;
+    if (parts == 1) {
+        diskMember *member = current[set->readTurn++ % n];
+        for (int i = 0; i < n; i++) {
+            if (current[i]->head == first) {
+                member = current[i]; // carry on where it stopped
+            }
         }
-        // add disk to disk list
-        Disk *newDisk = malloc(sizeof(Disk));
-        if (newDisk == NULL) {
-            printf("LIBDISK: Error allocating memory for new disk\n");
+        if (memberTransfer(member, first, count, data, 0) < 0) {
+            dropMirror(set, member);
+            return mirroredTransfer(set, first, count, data, 0);
+        }
+        member->head = first + count;
+        return 0;
+    }
+    unsigned int turn = set->readTurn++;
+    for (int i = 1; i < parts; i++) {
+        int64_t from = count * (int64_t)i / parts;
+        int64_t to = count * (int64_t)(i + 1) / parts;
+        memberPost(current[(turn + i) % n], first + from, (int)(to - from), data + from * BLOCKSIZE, 0);
+    }
+    int failed[DISK_MAX_MEMBERS];
+    failed[0] = memberTransfer(current[turn % n], first, count / parts, data, 0) < 0;
+    for (int i = 1; i < parts; i++) {
+        failed[i] = memberWait(current[(turn + i) % n]) < 0;
+    }
+    int result = 0;
+    for (int i = 0; i < parts; i++) {
+        int64_t from = count * (int64_t)i / parts;
+        int64_t to = count * (int64_t)(i + 1) / parts;
+        diskMember *member = current[(turn + i) % n];
+        member->head = first + to;
+        if (failed[i]) {
+            dropMirror(set, member);
+            if (mirroredTransfer(set, first + from, (int)(to - from), data + from * BLOCKSIZE, 0) < 0) {
+                result = -1;
+            }
+        }
+    }
+    return result;
+}
+
+int repairBlock(diskSet *set, int64_t bNum, char *block) {
+    /* a block of a mirrored disk failed its checksum: looks for a copy that
+    passes on the current members, puts it in 'block' and over the copies
+    that failed. Returns -1 if no copy passes. */
+    char copy[BLOCKSIZE];
+    int bad[DISK_MAX_MEMBERS];
+    diskMember *good = NULL;
+    for (int i = 0; i < set->members; i++) {
+        diskMember *member = &set->member[i];
+        bad[i] = 0;
+        if (!member->inSync) {
+            continue;
+        }
+        uint32_t stored;
+        if (pread(member->fd, copy, BLOCKSIZE, (off_t)bNum * BLOCKSIZE) != BLOCKSIZE) {
+            continue;
+        }
+        memcpy(&stored, copy + BLOCK_CHECKSUM_OFFSET, sizeof(uint32_t));
+        if (stored != crc32c(copy, BLOCK_CHECKSUM_OFFSET)) {
+            bad[i] = 1;
+        } else if (good == NULL) {
+            good = member;
+            memcpy(block, copy, BLOCKSIZE);
+        }
+    }
+    if (good == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < set->members; i++) {
+        if (bad[i]) {
+            printf("LIBDISK: Block %lld of mirror %s failed its checksum, rewritten from %s\n",
+                (long long)bNum, set->member[i].filename, good->filename);
+            if (pwrite(set->member[i].fd, block, BLOCKSIZE, (off_t)bNum * BLOCKSIZE) != BLOCKSIZE) {
+                dropMirror(set, &set->member[i]);
+            }
+        }
+    }
+    return 0;
+}
+
+int resyncMember(diskSet *set, diskMember *member) {
+    /* copies the disk from a current member onto 'member', which is out of
+    the set, and lets it back in. A missing member file is made anew. */
+    diskMember *source = NULL;
+    for (int i = 0; i < set->members && source == NULL; i++) {
+        if (set->member[i].inSync) {
+            source = &set->member[i];
+        }
+    }
+    if (source == NULL) {
+        printf("LIBDISK: Error: No mirror is left to resync from\n");
+        return -1;
+    }
+    if (member->fd < 0) {
+        int fd = open(member->filename, O_RDWR | O_CREAT, 0666);
+        if (fd < 0 || startMember(member, fd) < 0) {
+            printf("LIBDISK: Error opening mirror %s\n", member->filename);
+            if (fd >= 0) {
+                close(fd);
+            }
             return -1;
         }
-        newDisk->diskNumber = diskCounter++;
-        char *filenameCopy = malloc(strlen(filename) + 1);
-        if (filenameCopy == NULL) {
-            printf("LIBDISK: Error allocating memory for filename\n");
+    }
+    // only blocks that differ are written, so a member that is nearly in
+    // sync, or a new one that is all holes, costs reads and few writes
+    char *buffer = malloc(2 * DISK_RESYNC_BLOCKS * BLOCKSIZE);
+    if (buffer == NULL || ftruncate(member->fd, (off_t)(set->nBytes + BLOCKSIZE)) != 0) {
+        printf("LIBDISK: Error: Could not resync mirror %s\n", member->filename);
+        free(buffer);
+        return -1;
+    }
+    char *theirs = buffer + DISK_RESYNC_BLOCKS * BLOCKSIZE;
+    for (int64_t offset = 0; offset < set->nBytes; offset += DISK_RESYNC_BLOCKS * BLOCKSIZE) {
+        size_t length = set->nBytes - offset < DISK_RESYNC_BLOCKS * BLOCKSIZE ? (size_t)(set->nBytes - offset) : DISK_RESYNC_BLOCKS * BLOCKSIZE;
+        struct iovec in = { buffer, length };
+        struct iovec old = { theirs, length };
+        int result = transferAll(source->fd, &in, 1, (off_t)offset, 0) < 0 ||
+            transferAll(member->fd, &old, 1, (off_t)offset, 0) < 0 ? -1 : 0;
+        for (size_t done = 0; done < length && result == 0; done += BLOCKSIZE) {
+            char *block = buffer + done;
+            char *theirBlock = theirs + done;
+            if (memcmp(block, theirBlock, BLOCKSIZE) == 0) {
+                continue;
+            }
+            // a copy that fails its CRC-32C where the other passes is bit rot, the good one wins either way
+            uint32_t stored;
+            memcpy(&stored, block + BLOCK_CHECKSUM_OFFSET, sizeof(uint32_t));
+            int sourceGood = stored == crc32c(block, BLOCK_CHECKSUM_OFFSET);
+            memcpy(&stored, theirBlock + BLOCK_CHECKSUM_OFFSET, sizeof(uint32_t));
+            int theirsGood = stored == crc32c(theirBlock, BLOCK_CHECKSUM_OFFSET);
+            struct iovec out = { sourceGood || !theirsGood ? block : theirBlock, BLOCKSIZE };
+            result = transferAll(sourceGood || !theirsGood ? member->fd : source->fd, &out, 1, (off_t)(offset + done), 1);
+        }
+        if (result < 0) {
+            printf("LIBDISK: Error: Could not resync mirror %s\n", member->filename);
+            free(buffer);
             return -1;
         }
-        strcpy(filenameCopy, filename);
-        newDisk->filename = filenameCopy;
-        newDisk->nBytes = nBytes;
-        newDisk->next = diskListHead;
-        newDisk->filePointer = fp;
-        diskListHead = newDisk;
-        return newDisk->diskNumber;
     }
+    free(buffer);
+    if (writeTrailer(member, 0) < 0) {
+        printf("LIBDISK: Error: Could not resync mirror %s\n", member->filename);
+        return -1;
+    }
+    member->inSync = 1;
+    member->head = -1;
+    printf("LIBDISK: Mirror %s resynced from %s\n", member->filename, source->filename);
+    return 0;
+}
+
+int mirrorRead(Disk *disk, int64_t bNum, int count, char *blocks) {
+    return mirroredTransfer(disk->state, bNum, count, blocks, 0);
+}
+
+int mirrorWrite(Disk *disk, int64_t bNum, int count, char *blocks) {
+    return mirroredTransfer(disk->state, bNum, count, blocks, 1);
+}
+
+int mirrorRepair(Disk *disk, int64_t bNum, char *block) {
+    return repairBlock(disk->state, bNum, block);
+}
+
+int mirrorClose(Disk *disk) {
+    /* marks the current members clean and closes the set */
+    diskSet *set = disk->state;
+    int result = 0;
+    for (int i = 0; i < set->members; i++) {
+        if (set->member[i].inSync && writeTrailer(&set->member[i], 1) < 0) {
+            printf("LIBDISK: Error closing mirror %s\n", set->member[i].filename);
+            result = -1;
+        }
+    }
+    closeSet(set);
+    return result;
+}
+
+const diskBackend mirrorBackend = { "mirror", mirrorRead, mirrorWrite, mirrorClose, mirrorRepair };
 
+int resyncDisk(int disk) {
+    /* copies a mirrored disk onto every member that dropped out of it or
+    was missing when it was opened. Returns how many were resynced, or -1
+    if one could not be. */
+    Disk *currentDisk = findDisk(disk);
+    if (currentDisk == NULL) {
+        return -1;
+    }
+    if (currentDisk->backend != &mirrorBackend) {
+        printf("LIBDISK: Error: Not a mirrored disk\n");
+        return -1;
+    }
+    diskSet *set = currentDisk->state;
+    int resynced = 0;
+    for (int i = 0; i < set->members; i++) {
+        if (!set->member[i].inSync) {
+            if (resyncMember(set, &set->member[i]) < 0) {
+                return -1;
+            }
+            resynced++;
+        }
+    }
+    return resynced;
+}
+
+int openMirroredDisk(char *filenames[], int members, int64_t nBytes) {
+    /* opens a disk mirrored on the files 'filenames'. Like openDisk, nBytes
+    0 opens an existing mirror set and anything else makes a new one. An
+    existing set opens as long as one current member is there; the others
+    are resynced, except missing ones, which wait for resyncDisk. Returns
+    the disk number, or -1. */
+    checkTraceEnv();
+    if (members < 1 || members > DISK_MAX_MEMBERS) {
+        printf("LIBDISK: Error: A mirror set needs 1 to %d members\n", DISK_MAX_MEMBERS);
+        return -1;
+    }
+    if (nBytes != 0 && nBytes < BLOCKSIZE) {
+        printf("LIBDISK: Error: nBytes must be at least BLOCKSIZE\n");
+        return -1;
+    }
+    diskSet *set = calloc(1, sizeof(diskSet));
+    size_t nameLength = strlen(DISK_MIRROR_PREFIX) + 1;
+    for (int i = 0; i < members; i++) {
+        nameLength += strlen(filenames[i]) + 1;
+    }
+    char *name = malloc(nameLength);
+    diskMember *member = calloc(members, sizeof(diskMember));
+    if (set == NULL || name == NULL || member == NULL) {
+        printf("LIBDISK: Error allocating memory for new disk\n");
+        free(set);
+        free(name);
+        free(member);
+        return -1;
+    }
+    int length = sprintf(name, "%s", DISK_MIRROR_PREFIX);
+    for (int i = 0; i < members; i++) {
+        length += sprintf(name + length, "%s%s", i > 0 ? "," : "", filenames[i]);
+    }
+    set->members = members;
+    set->member = member;
+    set->mirrored = 1;
+    set->generation = 1;
+    set->nBytes = nBytes - nBytes % BLOCKSIZE;
+    int failed = 0;
+    for (int i = 0; i < members; i++) {
+        member[i].fd = -1;
+        member[i].set = set;
+        member[i].index = i;
+        member[i].head = -1;
+        member[i].filename = malloc(strlen(filenames[i]) + 1);
+        if (member[i].filename == NULL) {
+            failed = 1;
+        } else {
+            strcpy(member[i].filename, filenames[i]);
+        }
+    }
+    int64_t generation[DISK_MAX_MEMBERS];
+    int clean[DISK_MAX_MEMBERS];
+    int64_t size[DISK_MAX_MEMBERS];
+    for (int i = 0; i < members && !failed; i++) {
+        generation[i] = 0; // 0 for no trailer, not a member yet
+        clean[i] = 0;
+        int fd = nBytes == 0 ? open(filenames[i], O_RDWR) : open(filenames[i], O_RDWR | O_CREAT | O_TRUNC, 0666);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            printf("LIBDISK: %s mirror %s\n", nBytes == 0 ? "Missing" : "Error: Could not make", filenames[i]);
+            if (fd >= 0) {
+                close(fd);
+            }
+            failed = nBytes != 0;
+            continue;
+        }
+        if (nBytes != 0 && ftruncate(fd, (off_t)(set->nBytes + BLOCKSIZE)) != 0) {
+            printf("LIBDISK: Error sizing file\n");
+            close(fd);
+            failed = 1;
+            continue;
+        }
+        if (startMember(&member[i], fd) < 0) {
+            close(fd);
+            failed = 1;
+            continue;
+        }
+        size[i] = (int64_t)info.st_size - BLOCKSIZE;
+        if (nBytes != 0) {
+            member[i].inSync = writeTrailer(&member[i], 0) == 0;
+            failed = !member[i].inSync;
+        } else if (info.st_size % BLOCKSIZE == 0 && readTrailer(fd, size[i], &generation[i], &clean[i]) == 0) {
+            if (set->nBytes == 0 || generation[i] > set->generation) {
+                set->generation = generation[i];
+                set->nBytes = size[i];
+            }
+        }
+    }
+    if (nBytes == 0 && !failed) {
+        // the members of the newest generation are current
+        int first = -1;
+        int dirty = 0;
+        for (int i = 0; i < members; i++) {
+            if (member[i].fd >= 0 && generation[i] == set->generation && size[i] == set->nBytes) {
+                member[i].inSync = 1;
+                dirty |= !clean[i];
+                first = first < 0 ? i : first;
+            }
+        }
+        if (first < 0) {
+            printf("LIBDISK: Error: %s is not a mirror set\n", name);
+            failed = 1;
+        } else if (dirty) {
+            // the last writes may have reached only some of them, the first one wins
+            for (int i = first + 1; i < members; i++) {
+                member[i].inSync = 0;
+            }
+        }
+    }
+    if (nBytes == 0 && !failed) {
+        // a new generation leaves members out that are missing now
+        set->generation++;
+        for (int i = 0; i < members; i++) {
+            if (member[i].inSync && writeTrailer(&member[i], 0) < 0) {
+                dropMirror(set, &member[i]);
+            }
+        }
+        for (int i = 0; i < members; i++) {
+            if (member[i].fd >= 0 && !member[i].inSync) {
+                resyncMember(set, &member[i]);
+            }
+        }
+    }
+    int disk = failed ? -1 : addDisk(name, set->nBytes, &mirrorBackend, set, nBytes != 0);
+    if (disk < 0) {
+        closeSet(set);
+    }
+    free(name);
+    return disk;
+}
+
+int openMirrorSpec(char *spec, int64_t nBytes) {
+    /* openMirroredDisk for the part of an openDisk filename after
+    DISK_MIRROR_PREFIX */
+    char *names = malloc(strlen(spec) + 1);
+    if (names == NULL) {
+        printf("LIBDISK: Error allocating memory for filename\n");
+        return -1;
+    }
+    strcpy(names, spec);
+    char *filenames[DISK_MAX_MEMBERS];
+    int members = splitMembers(names, filenames);
+    int disk = openMirroredDisk(filenames, members, nBytes);
+    free(names);
+    return disk;
+}
+
+int openDisk(char *filename, int64_t nBytes) {
+    /* This functions opens a regular UNIX file and designates the first
+    nBytes of it as space for the emulated disk. If nBytes is not exactly a
+    multiple of BLOCKSIZE then the disk size will be the closest multiple
+    of BLOCKSIZE that is lower than nByte (but greater than 0) If nBytes is
+    less than BLOCKSIZE failure should be returned. If nBytes > BLOCKSIZE
+    and there is already a file by the given filename, that file’s content
+    may be overwritten. If nBytes is 0, an existing disk is opened, and the
+    content must not be overwritten in this function. There is no requirement
+    to maintain integrity of any file content beyond nBytes. The return value
+    is negative on failure or a disk number on success. A filename starting
+    with DISK_STRIPE_PREFIX, DISK_MIRROR_PREFIX, DISK_MMAP_PREFIX or
+    DISK_RAM_PREFIX picks another backend, see libDisk.h. */
+    checkTraceEnv();
+    if (strncmp(filename, DISK_STRIPE_PREFIX, strlen(DISK_STRIPE_PREFIX)) == 0) {
+        return openStripeSpec(filename + strlen(DISK_STRIPE_PREFIX), nBytes);
+    }
+    if (strncmp(filename, DISK_MIRROR_PREFIX, strlen(DISK_MIRROR_PREFIX)) == 0) {
+        return openMirrorSpec(filename + strlen(DISK_MIRROR_PREFIX), nBytes);
+    }
+    if (strncmp(filename, DISK_MMAP_PREFIX, strlen(DISK_MMAP_PREFIX)) == 0) {
+        return openMappedDisk(filename, nBytes);
+    }
+    if (strncmp(filename, DISK_RAM_PREFIX, strlen(DISK_RAM_PREFIX)) == 0) {
+        return openRamDisk(filename, nBytes);
+    }
+    return openFileDisk(filename, nBytes);
 }
 
 int closeDisk(int disk) {
@@ -108,8 +1280,11 @@ int closeDisk(int disk) {
     while (currentDisk != NULL) {
         if (currentDisk->diskNumber == disk) {
             // found disk
+            if (traceFile != NULL) {
+                traceEvent(DISK_TRACE_CLOSE, disk, 0, 0);
+            }
             // close file
-            if (fclose(currentDisk->filePointer) != 0) {
+            if (currentDisk->backend->close(currentDisk) != 0) {
                 printf("LIBDISK: Error closing file\n");
                 return -1;
             }
@@ -121,6 +1296,7 @@ int closeDisk(int disk) {
                 previousDisk->next = currentDisk->next;
             }
             // free memory
+            free(currentDisk->filename);
             free(currentDisk);
             return 0; // success
         }
@@ -133,7 +1309,99 @@ int closeDisk(int disk) {
 }
 
 
-int readBlock(int disk, int bNum, void *block) {
+#define DISK_SEAL_BLOCKS 64 // blocks writeBlocks seals per request when checksums are on, 16 KB of stack
+
+void moveHead(Disk *disk, int64_t bNum, int count) {
+    /* counts a seek for a request that does not carry on where the last one
+    on the disk ended, as if the disk had one head whatever its backend */
+    if (bNum != disk->head) {
+        diskSeeks++;
+        diskSeekBlocks += bNum > disk->head ? bNum - disk->head : disk->head - bNum;
+    }
+    disk->head = bNum + count;
+}
+
+int readBlocks(int disk, int64_t bNum, int count, void *blocks) {
+    /* reads the 'count' blocks from bNum on into 'blocks', which must hold
+    count * BLOCKSIZE bytes, with one request to the disk's backend, which
+    a striped or mirrored disk spreads over its members. Returns
+    0, -1 or DISK_CHECKSUM_ERROR like readBlock. */
+    Disk *currentDisk = findDisk(disk);
+    if (currentDisk == NULL) {
+        return -1;
+    }
+    if (bNum < 0 || count < 1 || bNum > currentDisk->nBytes / BLOCKSIZE - count) {
+        printf("LIBDISK: Error: bNum out of range\n");
+        return -1;
+    }
+    if (currentDisk->backend->read(currentDisk, bNum, count, (char *)blocks) < 0) {
+        printf("LIBDISK: Error reading block\n");
+        return -1;
+    }
+    diskBlockReads += count;
+    moveHead(currentDisk, bNum, count);
+    for (int i = 0; i < count; i++) {
+        char *block = (char *)blocks + (size_t)i * BLOCKSIZE;
+        if (traceFile != NULL) {
+            traceEvent(DISK_TRACE_READ, disk, bNum + i, 0);
+        }
+        if (currentDisk->checksums) {
+            uint32_t stored;
+            memcpy(&stored, block + BLOCK_CHECKSUM_OFFSET, sizeof(uint32_t));
+            if (stored != crc32c(block, BLOCK_CHECKSUM_OFFSET) &&
+                !(currentDisk->backend->repair != NULL && currentDisk->backend->repair(currentDisk, bNum + i, block) == 0)) {
+                printf("LIBDISK: Error: Checksum mismatch in block %lld\n", (long long)(bNum + i));
+                return DISK_CHECKSUM_ERROR;
+            }
+        }
+    }
+    return 0;
+}
+
+int writeBlocks(int disk, int64_t bNum, int count, void *blocks) {
+    /* writes 'count' blocks from 'blocks' to bNum on, the counterpart of
+    readBlocks. With checksums on they are sealed in a copy
+    DISK_SEAL_BLOCKS at a time, 'blocks' is left as it is. */
+    Disk *currentDisk = findDisk(disk);
+    if (currentDisk == NULL) {
+        return -1;
+    }
+    if (bNum < 0 || count < 1 || bNum > currentDisk->nBytes / BLOCKSIZE - count) {
+        printf("LIBDISK: Error: bNum out of range\n");
+        return -1;
+    }
+    char sealed[DISK_SEAL_BLOCKS * BLOCKSIZE];
+    for (int done = 0; done < count;) {
+        int part = count - done;
+        char *data = (char *)blocks + (size_t)done * BLOCKSIZE;
+        if (currentDisk->checksums) {
+            // the last 4 bytes of what is written are the block's CRC-32C
+            part = part < DISK_SEAL_BLOCKS ? part : DISK_SEAL_BLOCKS;
+            memcpy(sealed, data, (size_t)part * BLOCKSIZE);
+            for (int i = 0; i < part; i++) {
+                char *block = sealed + i * BLOCKSIZE;
+                uint32_t checksum = crc32c(block, BLOCK_CHECKSUM_OFFSET);
+                memcpy(block + BLOCK_CHECKSUM_OFFSET, &checksum, sizeof(uint32_t));
+            }
+            data = sealed;
+        }
+        if (currentDisk->backend->write(currentDisk, bNum + done, part, data) < 0) {
+            printf("LIBDISK: Error writing block\n");
+            return -1;
+        }
+        done += part;
+    }
+    diskBlockWrites += count;
+    moveHead(currentDisk, bNum, count);
+    if (traceFile != NULL) {
+        for (int i = 0; i < count; i++) {
+            traceEvent(DISK_TRACE_WRITE, disk, bNum + i, 0);
+        }
+    }
+    return 0;
+}
+
+int readBlock(int disk, int64_t bNum, void *block) {
     /* readBlock() reads an entire block of BLOCKSIZE bytes from the open
     disk (identified by ‘disk’) and copies the result into a local buffer
     (must be at least of BLOCKSIZE bytes). The bNum is a logical block
@@ -144,36 +1412,10 @@ int readBlock(int disk, int bNum, void *block) {
     0. -1 or smaller is returned if disk is not available (hasn’t been
     opened) or any other failures. You must define your own error code
     system. */
-    Disk *currentDisk = diskListHead;
-    while (currentDisk != NULL) {
-        if (currentDisk->diskNumber == disk) {
-            // found disk
-            if (bNum < 0 || (bNum > currentDisk->nBytes / BLOCKSIZE)) {
-                printf("LIBDISK: Error: bNum out of range\n");
-                return -1;
-            }
-            // open file
-            FILE *fp = currentDisk->filePointer;
-            // seek to correct position, use SEEK_SET to seek from beginning of file
-            if (fseek(fp, bNum * BLOCKSIZE, SEEK_SET) != 0) {
-                printf("LIBDISK: Error seeking to position\n");
-                return -1;
-            }
-            // read block
-            if (fread(block, sizeof(char), BLOCKSIZE, fp) != BLOCKSIZE) {
-                printf("LIBDISK: Error reading block\n");
-                return -1;
-            }
-            return 0;
-        }
-        currentDisk = currentDisk->next;
-    }
-    // disk not found
-    printf("LIBDISK: Error: Disk not found\n");
-    return -1;
+    return readBlocks(disk, bNum, 1, block);
 }
 
-int writeBlock(int disk, int bNum, void *block) {
+int writeBlock(int disk, int64_t bNum, void *block) {
     /* writeBlock() takes disk number ‘disk’ and logical block number ‘bNum’
     and writes the content of the buffer ‘block’ to that location. ‘block’
     must be integral with BLOCKSIZE. Just as in readBlock(), writeBlock()
@@ -181,32 +1423,91 @@ int writeBlock(int disk, int bNum, void *block) {
     the file. On success, it returns 0. -1 or smaller is returned if disk
     is not available (i.e. hasn’t been opened) or any other failures. You
     must define your own error code system. */
-    Disk *currentDisk = diskListHead;
-    while (currentDisk != NULL) {
+    return writeBlocks(disk, bNum, 1, block);
+}
+
+int setDiskChecksums(int disk, int enabled) {
+    /* switches block checksums on or off for an open disk. The disk itself
+    does not remember, whoever formats it has to record the choice. */
+    for (Disk *currentDisk = diskListHead; currentDisk != NULL; currentDisk = currentDisk->next) {
         if (currentDisk->diskNumber == disk) {
-            // found disk
-            if (bNum < 0 || (bNum > currentDisk->nBytes / BLOCKSIZE)) {
-                printf("LIBDISK: Error: bNum out of range\n");
-                return -1;
-            }
-            // open file
-            FILE *fp = currentDisk->filePointer;
-            // seek to correct position
-            if (fseek(fp, bNum * BLOCKSIZE, SEEK_SET) != 0) {
-                printf("LIBDISK: Error seeking to position\n");
-                return -1;
-            }
-            // write block
-            if (fwrite(block, sizeof(char), BLOCKSIZE, fp) != BLOCKSIZE) {
-                printf("LIBDISK: Error writing block\n");
-                return -1;
-            }
+            currentDisk->checksums = enabled ? 1 : 0;
             return 0;
         }
-        currentDisk = currentDisk->next;
     }
-    // disk not found
     printf("LIBDISK: Error: Disk not found\n");
     return -1;
 }
 
+/* CRC-32C (Castagnoli)
+ * x86-64 CPUs with SSE4.2 compute it with the crc32 instruction, 8 bytes at
+ * a time. Everything else uses slicing-by-8 tables, built on first use, which
+ * also take 8 bytes per step. */
+uint32_t crc32cTable[8][256];
+int crc32cTableReady = 0;
+int crc32cHardware = -1; // -1 until the CPU has been asked
+
+uint32_t crc32cSoftware(const void *data, size_t length) {
+    if (!crc32cTableReady) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1u)));
+            }
+            crc32cTable[0][i] = crc;
+        }
+        for (int t = 1; t < 8; t++) {
+            for (int i = 0; i < 256; i++) {
+                uint32_t crc = crc32cTable[t - 1][i];
+                crc32cTable[t][i] = (crc >> 8) ^ crc32cTable[0][crc & 0xFF];
+            }
+        }
+        crc32cTableReady = 1;
+    }
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint32_t crc = 0xFFFFFFFFu;
+    for (; length >= 8; length -= 8, bytes += 8) {
+        // little endian: the low 4 bytes fold into the running crc
+        uint32_t low = crc ^ ((uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+            (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24);
+        crc = crc32cTable[7][low & 0xFF] ^ crc32cTable[6][(low >> 8) & 0xFF] ^
+            crc32cTable[5][(low >> 16) & 0xFF] ^ crc32cTable[4][low >> 24] ^
+            crc32cTable[3][bytes[4]] ^ crc32cTable[2][bytes[5]] ^
+            crc32cTable[1][bytes[6]] ^ crc32cTable[0][bytes[7]];
+    }
+    for (; length > 0; length--) {
+        crc = crc32cTable[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+uint32_t crc32cSSE42(const void *data, size_t length) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint64_t crc = 0xFFFFFFFFu;
+    for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t), bytes += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(uint64_t));
+        crc = _mm_crc32_u64(crc, word);
+    }
+    uint32_t crc32 = (uint32_t)crc;
+    for (; length > 0; length--) {
+        crc32 = _mm_crc32_u8(crc32, *bytes++);
+    }
+    return ~crc32;
+}
+#endif
+
+uint32_t crc32c(const void *data, size_t length) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (crc32cHardware < 0) {
+        __builtin_cpu_init();
+        crc32cHardware = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    }
+    if (crc32cHardware) {
+        return crc32cSSE42(data, length);
+    }
+#endif
+    return crc32cSoftware(data, length);
+}
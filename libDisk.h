@@ -1,30 +1,116 @@
 #ifndef libDisk_h
 #define libDisk_h
 #define BLOCKSIZE 256
+#define BLOCK_CHECKSUM_OFFSET (BLOCKSIZE - 4) // CRC-32C of the bytes before it, when checksums are on
+#define DISK_CHECKSUM_ERROR -2 // readBlock found a block whose checksum does not match
+
+/* Block I/O trace. A trace file starts with DISK_TRACE_HEADER_SIZE bytes: the
+8 byte magic DISK_TRACE_MAGIC, then the trace version and BLOCKSIZE as 4 byte
+ints. Then one DISK_TRACE_RECORD_SIZE byte record follows per event, in host
+byte order. Version 1 had 16 byte records with 4 byte block numbers. */
+#define DISK_TRACE_MAGIC "TFSTRACE"
+#define DISK_TRACE_VERSION 2
+#define DISK_TRACE_HEADER_SIZE 16
+#define DISK_TRACE_RECORD_SIZE 24 // the last 4 bytes are 0
+#define DISK_TRACE_TIME_OFFSET 0 // 8 byte nanoseconds since the trace started
+#define DISK_TRACE_BLOCK_OFFSET 8 // 8 byte block number, the disk size in blocks for DISK_TRACE_OPEN
+#define DISK_TRACE_DISK_OFFSET 16 // 2 byte disk number
+#define DISK_TRACE_OP_OFFSET 18 // 1 byte DISK_TRACE_* event
+#define DISK_TRACE_FLAGS_OFFSET 19 // 1 byte DISK_TRACE_FLAG_* bits
+#define DISK_TRACE_READ 1
+#define DISK_TRACE_WRITE 2
+#define DISK_TRACE_OPEN 3
+#define DISK_TRACE_CLOSE 4
+#define DISK_TRACE_FLAG_CREATE 0x01 // the open made a new disk, its old content is gone
+#define DISK_TRACE_ENV "LIBDISK_TRACE" // names a trace file to start tracing into at the first openDisk
+
+/* Striped disks. openDisk("stripe:16:a.dsk,b.dsk,c.dsk", nBytes) spreads one
+disk over the member files a.dsk, b.dsk and c.dsk, 16 blocks at a time
+(RAID-0). The width and its colon can be left out for
+DISK_DEFAULT_STRIPE_BLOCKS. nBytes is rounded up to a whole number of
+stripes, so a file system made for nBytes fits, and an existing set has to
+be named with the same members in the same order and the same width it was
+made with. */
+#define DISK_STRIPE_PREFIX "stripe:"
+#define DISK_MEMBER_SEPARATOR ','
+#define DISK_DEFAULT_STRIPE_BLOCKS 16
+#define DISK_MAX_MEMBERS 64 // files a striped or mirrored disk can have
+
+/* Mirrored disks. openDisk("mirror:a.dsk,b.dsk", nBytes) keeps a whole copy
+of the disk in each member file (RAID-1). A member is the disk followed by
+one trailer block, so each one is also a plain disk image. The trailer
+holds DISK_MIRROR_MAGIC, the generation of the set, bumped at every open
+and whenever a member drops out, and whether the set was closed cleanly.
+It ends in its CRC-32C like any block. Members of an older generation are
+out of date and get resynced. */
+#define DISK_MIRROR_PREFIX "mirror:"
+#define DISK_MIRROR_MAGIC "TFSMIRR1"
+#define DISK_MIRROR_GENERATION_OFFSET 8 // 8 bytes
+#define DISK_MIRROR_CLEAN_OFFSET 16 // 1 byte, 1 once closed
+
+/* Memory backends. "mmap:a.dsk" maps the file a.dsk and copies blocks in
+and out of the mapping. "ram:name" is a RAM disk, made by openDisk with
+nBytes and kept by name until deleteRamDisk or the end of the process. */
+#define DISK_MMAP_PREFIX "mmap:"
+#define DISK_RAM_PREFIX "ram:"
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 
 typedef struct Disk Disk; // Forward declaration
+typedef struct diskMember diskMember; // one file of a striped or mirrored disk, private to libDisk.c
+
+/* A backend moves whole blocks for the disks it opened: 'count' blocks from
+bNum on, already range checked, returning 0 or -1. readBlocks and
+writeBlocks do checksums, counters and tracing around them. A new backend
+opens its own state and hands it to addDisk. */
+typedef struct diskBackend {
+    const char *name;
+    int (*read)(Disk *disk, int64_t bNum, int count, char *blocks);
+    int (*write)(Disk *disk, int64_t bNum, int count, char *blocks);
+    int (*close)(Disk *disk); // releases 'state'
+    int (*repair)(Disk *disk, int64_t bNum, char *block); // NULL, or finds a copy of a block that fails its checksum
+} diskBackend;
 
 // Struct to hold the disk information
 struct Disk {
     int diskNumber;    // unique disk identifier
-    int nBytes;        // Size of the disk in bytes
+    int64_t nBytes;    // Size of the disk in bytes
     char *filename;    // Name of the backing file for our disk
     Disk *next;        // Pointer to the next disk in the list
-    FILE *filePointer; // file pointer to the unix file
+    int checksums;     // 1 if every block carries a CRC-32C in its last 4 bytes
+    const diskBackend *backend; // how the blocks are stored
+    void *state;       // the backend's own, a FILE * for a plain file
+    int64_t head;      // block after the last one read or written, seeks are measured from here
 };
 
 
 // Global variables
 extern int diskCounter;
 extern Disk *diskListHead;
+extern long diskBlockReads;
+extern long diskBlockWrites;
+extern long diskSeeks;
+extern long diskSeekBlocks;
 
 // Function prototypes
 
-int openDisk(char *filename, int nBytes);
+int openDisk(char *filename, int64_t nBytes);
 int closeDisk(int disk);
-int readBlock(int disk, int bNum, void *block);
-int writeBlock(int disk, int bNum, void *block);
+int readBlock(int disk, int64_t bNum, void *block);
+int writeBlock(int disk, int64_t bNum, void *block);
+int readBlocks(int disk, int64_t bNum, int count, void *blocks);
+int writeBlocks(int disk, int64_t bNum, int count, void *blocks);
+int openStripedDisk(char *filenames[], int members, int stripeBlocks, int64_t nBytes);
+int openMirroredDisk(char *filenames[], int members, int64_t nBytes);
+int resyncDisk(int disk);
+int deleteRamDisk(char *filename);
+int addDisk(char *filename, int64_t nBytes, const diskBackend *backend, void *state, int created);
+int setDiskChecksums(int disk, int enabled);
+int startDiskTrace(char *filename);
+int stopDiskTrace(void);
+uint32_t crc32c(const void *data, size_t length);
+uint32_t crc32cSoftware(const void *data, size_t length);
 
 
 
@@ -0,0 +1,156 @@
+#include "libLZ.h"
+#include <stdint.h>
+#include <string.h>
+
+
+uint32_t lzRead32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(uint32_t));
+    return value;
+}
+
+int lzWriteLength(unsigned char **op, unsigned char *oend, int length) {
+    /* writes the part of a length that did not fit in the token's 4 bits */
+    while (length >= 255) {
+        if (*op >= oend) {
+            return -1;
+        }
+        *(*op)++ = 255;
+        length -= 255;
+    }
+    if (*op >= oend) {
+        return -1;
+    }
+    *(*op)++ = (unsigned char)length;
+    return 0;
+}
+
+int lzEmit(unsigned char **op, unsigned char *oend, const unsigned char *literals, int literalLength,
+    int offset, int matchLength) {
+    /* writes one sequence. A matchLength of 0 is the last sequence, literals only. */
+    if (*op >= oend) {
+        return -1;
+    }
+    unsigned char *token = (*op)++;
+    *token = (unsigned char)((literalLength < 15 ? literalLength : 15) << 4);
+    if (literalLength >= 15 && lzWriteLength(op, oend, literalLength - 15) < 0) {
+        return -1;
+    }
+    if (oend - *op < literalLength) {
+        return -1;
+    }
+    memcpy(*op, literals, literalLength);
+    *op += literalLength;
+    if (matchLength == 0) {
+        return 0;
+    }
+    if (oend - *op < 2) {
+        return -1;
+    }
+    *(*op)++ = (unsigned char)(offset & 0xFF);
+    *(*op)++ = (unsigned char)(offset >> 8);
+    int extra = matchLength - LZ_MIN_MATCH;
+    *token |= (unsigned char)(extra < 15 ? extra : 15);
+    if (extra >= 15 && lzWriteLength(op, oend, extra - 15) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int lzCompress(const char *src, int srcSize, char *dst, int dstCapacity) {
+    /* Compresses 'srcSize' bytes into 'dst' and returns the compressed size,
+    or -1 if it does not fit in 'dstCapacity' bytes. A hash of the next 4
+    bytes finds the last position they were seen at, and every match is
+    taken greedily. Runs without matches are skipped over faster the longer
+    they get, so incompressible data costs little. */
+    const unsigned char *input = (const unsigned char *)src;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *oend = op + dstCapacity;
+    int table[1 << LZ_HASH_BITS];
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++) {
+        table[i] = -1;
+    }
+    int ip = 0;
+    int anchor = 0; // first byte not covered by a sequence yet
+    while (ip + LZ_MIN_MATCH <= srcSize) {
+        uint32_t sequence = lzRead32(input + ip);
+        uint32_t h = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || lzRead32(input + ref) != sequence) {
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        int matchLength = LZ_MIN_MATCH;
+        while (ip + matchLength < srcSize && input[ref + matchLength] == input[ip + matchLength]) {
+            matchLength++;
+        }
+        if (lzEmit(&op, oend, input + anchor, ip - anchor, ip - ref, matchLength) < 0) {
+            return -1;
+        }
+        ip += matchLength;
+        anchor = ip;
+    }
+    if (lzEmit(&op, oend, input + anchor, srcSize - anchor, 0, 0) < 0) {
+        return -1;
+    }
+    return (int)(op - (unsigned char *)dst);
+}
+
+int lzReadLength(const unsigned char **ip, const unsigned char *iend, int *length) {
+    unsigned char byte;
+    do {
+        if (*ip >= iend) {
+            return -1;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+int lzDecompress(const char *src, int srcSize, char *dst, int dstCapacity) {
+    /* Expands 'srcSize' compressed bytes into 'dst' and returns the
+    decompressed size, or -1 if the input is corrupt or does not fit in
+    'dstCapacity' bytes. Every length and offset is checked, so bad input
+    never reads or writes out of bounds. */
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *iend = ip + srcSize;
+    unsigned char *out = (unsigned char *)dst;
+    int op = 0;
+    while (ip < iend) {
+        int token = *ip++;
+        int literalLength = token >> 4;
+        if (literalLength == 15 && lzReadLength(&ip, iend, &literalLength) < 0) {
+            return -1;
+        }
+        if (iend - ip < literalLength || dstCapacity - op < literalLength) {
+            return -1;
+        }
+        memcpy(out + op, ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+        if (ip == iend) {
+            break; // the last sequence has no match
+        }
+        if (iend - ip < 2) {
+            return -1;
+        }
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        int matchLength = token & 15;
+        if (matchLength == 15 && lzReadLength(&ip, iend, &matchLength) < 0) {
+            return -1;
+        }
+        matchLength += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || dstCapacity - op < matchLength) {
+            return -1;
+        }
+        // byte by byte, a match may overlap the bytes it is producing
+        for (int i = 0; i < matchLength; i++) {
+            out[op + i] = out[op - offset + i];
+        }
+        op += matchLength;
+    }
+    return op;
+}
@@ -0,0 +1,18 @@
+#ifndef libLZ_h
+#define libLZ_h
+
+/* A small LZ77 codec in the LZ4 block format: sequences of literals followed
+by a match of at least LZ_MIN_MATCH bytes up to 64 KB back. It favours speed
+over ratio, which suits compressing file chunks on every write. */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12 // match finder table of 4096 positions
+
+/* worst case compressed size of 'n' bytes, incompressible input grows a little */
+#define LZ_COMPRESS_BOUND(n) ((n) + (n) / 255 + 16)
+
+int lzCompress(const char *src, int srcSize, char *dst, int dstCapacity);
+int lzDecompress(const char *src, int srcSize, char *dst, int dstCapacity);
+
+#endif
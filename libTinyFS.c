@@ -1,12 +1,20 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime and localtime_r under -std=c99
 #include "libTinyFS.h"
 #include "libDisk.h"
 #include "tinyFS_errno.h"
+#include "libLZ.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <time.h>
 
+/* clock used for timestamps, the coarse clock is cheap enough for every hot path */
+#ifdef CLOCK_REALTIME_COARSE
+#define TFS_CLOCK CLOCK_REALTIME_COARSE
+#else
+#define TFS_CLOCK CLOCK_REALTIME
+#endif
 
 
 openFileTableEntry **openFileTable = NULL; // array of pointers to open file table entries, indexed by file descriptor
@@ -16,43 +24,2790 @@ int mountedDisk = 0; // currently mounted Disk, just need to keep track of disk
 
 int maxNumberOfFiles = 0; // max number of files that can be open/in the file system at once
 
-int getTimestamp(char *buffer, size_t bufferSize) {
-    time_t now;
-    time(&now);
-    struct tm *localTime = localtime(&now);
-    strftime(buffer, bufferSize, "%Y-%m-%d %H:%M:%S", localTime);
-    //printf("Current Timestamp: %s\n", buffer);
-    return 1;
+uint64_t getTimestamp(void) {
+    /* current time in nanoseconds since the epoch. The coarse clock is read
+    from the vDSO without a syscall and never touches the time zone database. */
+    struct timespec now;
+    clock_gettime(TFS_CLOCK, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
 }
 
-int tfs_mkfs(char *filename, int nBytes){
+void setTimestamp(char *inodeData, int offset, uint64_t timestamp) {
+    memcpy(inodeData + offset, &timestamp, sizeof(uint64_t));
+}
+
+void formatTimestamp(char *inodeData, int offset, char *buffer, size_t bufferSize) {
+    /* turns a stored timestamp into "YYYY-MM-DD HH:MM:SS" local time */
+    uint64_t timestamp;
+    memcpy(&timestamp, inodeData + offset, sizeof(uint64_t));
+    time_t seconds = (time_t)(timestamp / 1000000000ULL);
+    struct tm localTime;
+    localtime_r(&seconds, &localTime);
+    strftime(buffer, bufferSize, "%Y-%m-%d %H:%M:%S", &localTime);
+}
+
+/* SCRATCH MEMORY
+ * Buffers that live only for one tfs_* call, block buffers above all, come
+ * from a stack-like arena instead of the heap. scratchFree pops a buffer
+ * that is on top, or marks it to be popped once everything above it is
+ * freed, and whatever is left when the outermost tfs_* call returns (what
+ * error paths would have leaked) is dropped all at once. A request that
+ * does not fit is taken from the heap, and once no call is running the
+ * arena grows to the most a call has needed, so a steady workload stops
+ * touching the heap after its first few calls. The arena is created by
+ * tfs_mount and freed after tfs_unmount; without a mounted disk every call
+ * starts from an empty one.
+ */
+#define SCRATCH_ALIGN 16
+#define SCRATCH_NONE ((size_t)-1)
+#define SCRATCH_IN_USE 1
+#define SCRATCH_FREED 2
+#define SCRATCH_HEAP 3
+
+typedef struct scratchHeader {
+    size_t size; // bytes after the header, a multiple of SCRATCH_ALIGN
+    size_t previous; // arena offset of the buffer below this one, SCRATCH_NONE for the first
+    struct scratchHeader *nextHeap; // heap buffers: the next one in scratchHeapList
+    int state; // SCRATCH_*
+    int padding; // keeps the header a multiple of SCRATCH_ALIGN
+} scratchHeader;
+
+char *scratchArena = NULL;
+size_t scratchCapacity = 0; // bytes in scratchArena
+size_t scratchTop = 0; // arena bytes in use
+size_t scratchLast = SCRATCH_NONE; // arena offset of the top buffer
+size_t scratchHeapBytes = 0; // bytes of the heap buffers taken in the current call
+size_t scratchPeak = 0; // most bytes the current call had at once, arena and heap
+scratchHeader *scratchHeapList = NULL; // heap buffers not freed yet
+int scratchKeep = 0; // 1 while a disk is mounted, the arena is kept between calls
+long scratchHeapAllocations = 0; // requests served from the heap, reported by tfs_getStats
+
+void *scratchAlloc(size_t size) {
+    /* a buffer of 'size' bytes that goes away at the end of the current tfs_* call at the latest */
+    size = (size + SCRATCH_ALIGN - 1) / SCRATCH_ALIGN * SCRATCH_ALIGN;
+    size_t need = sizeof(scratchHeader) + (size > 0 ? size : SCRATCH_ALIGN);
+    scratchHeader *header;
+    if (scratchTop + need <= scratchCapacity) {
+        header = (scratchHeader *)(scratchArena + scratchTop);
+        header->previous = scratchLast;
+        header->state = SCRATCH_IN_USE;
+        scratchLast = scratchTop;
+        scratchTop += need;
+    } else {
+        header = (scratchHeader *)malloc(need);
+        if (header == NULL) {
+            return NULL;
+        }
+        header->state = SCRATCH_HEAP;
+        header->nextHeap = scratchHeapList;
+        scratchHeapList = header;
+        scratchHeapBytes += need;
+        scratchHeapAllocations++;
+    }
+    header->size = need - sizeof(scratchHeader);
+    if (scratchTop + scratchHeapBytes > scratchPeak) {
+        scratchPeak = scratchTop + scratchHeapBytes;
+    }
+    return header + 1;
+}
+
+char *scratchBlock(void) {
+    return (char *)scratchAlloc(BLOCKSIZE);
+}
+
+void scratchFree(void *buffer) {
+    if (buffer == NULL) {
+        return;
+    }
+    scratchHeader *header = (scratchHeader *)buffer - 1;
+    if (header->state == SCRATCH_HEAP) {
+        scratchHeader **link = &scratchHeapList;
+        while (*link != header) {
+            link = &(*link)->nextHeap;
+        }
+        *link = header->nextHeap;
+        scratchHeapBytes -= sizeof(scratchHeader) + header->size;
+        free(header);
+        return;
+    }
+    header->state = SCRATCH_FREED;
+    while (scratchLast != SCRATCH_NONE && ((scratchHeader *)(scratchArena + scratchLast))->state == SCRATCH_FREED) {
+        scratchTop = scratchLast;
+        scratchLast = ((scratchHeader *)(scratchArena + scratchLast))->previous;
+    }
+}
+
+void *scratchRealloc(void *buffer, size_t size) {
+    /* grows a scratch buffer, in place when it is the top of the arena */
+    if (buffer == NULL) {
+        return scratchAlloc(size);
+    }
+    scratchHeader *header = (scratchHeader *)buffer - 1;
+    if (size <= header->size) {
+        return buffer;
+    }
+    size = (size + SCRATCH_ALIGN - 1) / SCRATCH_ALIGN * SCRATCH_ALIGN;
+    if (header->state == SCRATCH_IN_USE && (char *)header == scratchArena + scratchLast &&
+        scratchLast + sizeof(scratchHeader) + size <= scratchCapacity) {
+        scratchTop = scratchLast + sizeof(scratchHeader) + size;
+        header->size = size;
+        if (scratchTop + scratchHeapBytes > scratchPeak) {
+            scratchPeak = scratchTop + scratchHeapBytes;
+        }
+        return buffer;
+    }
+    void *grown = scratchAlloc(size);
+    if (grown != NULL) {
+        memcpy(grown, buffer, header->size);
+        scratchFree(buffer);
+    }
+    return grown;
+}
+
+void scratchReset(void) {
+    /* drops every scratch buffer, called when the outermost tfs_* call returns */
+    while (scratchHeapList != NULL) {
+        scratchHeader *next = scratchHeapList->nextHeap;
+        free(scratchHeapList);
+        scratchHeapList = next;
+    }
+    scratchHeapBytes = 0;
+    scratchTop = 0;
+    scratchLast = SCRATCH_NONE;
+    if (!scratchKeep) {
+        free(scratchArena);
+        scratchArena = NULL;
+        scratchCapacity = 0;
+    } else if (scratchPeak > scratchCapacity && scratchCapacity < SCRATCH_MAX_SIZE) {
+        // one large call does not get to keep its memory, the arena stops at SCRATCH_MAX_SIZE
+        size_t capacity = scratchCapacity > 0 ? scratchCapacity : SCRATCH_INITIAL_SIZE;
+        while (capacity < scratchPeak && capacity < SCRATCH_MAX_SIZE) {
+            capacity *= 2;
+        }
+        if (capacity > SCRATCH_MAX_SIZE) {
+            capacity = SCRATCH_MAX_SIZE;
+        }
+        char *grown = (char *)malloc(capacity);
+        if (grown != NULL) {
+            free(scratchArena);
+            scratchArena = grown;
+            scratchCapacity = capacity;
+        }
+    }
+    scratchPeak = 0;
+}
+
+/* STATISTICS
+ * Every public tfs_* call is a thin wrapper (at the end of this file) around
+ * the function doing the work, timing it with the monotonic clock and
+ * charging it the blocks libDisk read and wrote, and the seeks it made,
+ * meanwhile. Calls made from inside another call, like tfs_writeFile from
+ * tfs_pwrite, only count towards the outermost one. Counters live until tfs_resetStats().
+ */
+typedef struct statsMark {
+    long long start; // monotonic clock at the start of the call, ns
+    long blockReads; // diskBlockReads at the start of the call
+    long blockWrites;
+    long seeks; // diskSeeks at the start of the call
+    long seekBlocks;
+} statsMark;
+
+tfsOpStats opStats[TFS_OP_COUNT];
+long statsBaseReads = 0; // diskBlockReads at the last reset
+long statsBaseWrites = 0;
+long statsBaseSeeks = 0;
+long statsBaseSeekBlocks = 0;
+long statsBaseHeapAllocations = 0; // scratchHeapAllocations at the last reset
+int statsDepth = 0; // tfs_* calls in progress, only the outermost one is counted
+
+const char *opNames[TFS_OP_COUNT] = {
+    "mkfs", "mount", "unmount", "openFile", "closeFile", "writeFile", "pwrite", "deleteFile",
+    "readByte", "seek", "read", "mkdir", "rmdir", "rename", "clone", "snapshot",
+    "setCompressed", "setDeduplicated", "readdirplus", "readFileInfo", "readdir", "openDirCursor",
+    "readv", "defrag", "defragReport", "setAllocPolicy"
+};
+
+long long monotonicNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void statsBegin(statsMark *mark) {
+    if (statsDepth++ > 0) {
+        return;
+    }
+    mark->blockReads = diskBlockReads;
+    mark->blockWrites = diskBlockWrites;
+    mark->seeks = diskSeeks;
+    mark->seekBlocks = diskSeekBlocks;
+    mark->start = monotonicNs();
+}
+
+int statsEnd(statsMark *mark, int op, int result, int bytes) {
+    /* charges the call to 'op' and passes its result through. 'bytes' only
+    counts if the call succeeded. */
+    if (--statsDepth > 0) {
+        return result;
+    }
+    long long elapsed = monotonicNs() - mark->start;
+    scratchReset();
+    tfsOpStats *stats = &opStats[op];
+    stats->calls++;
+    if (result < 0) {
+        stats->errors++;
+    } else {
+        stats->bytes += bytes;
+    }
+    stats->blockReads += diskBlockReads - mark->blockReads;
+    stats->blockWrites += diskBlockWrites - mark->blockWrites;
+    stats->seeks += diskSeeks - mark->seeks;
+    stats->seekBlocks += diskSeekBlocks - mark->seekBlocks;
+    stats->totalNs += elapsed;
+    int bucket = 0;
+    while (bucket < TFS_LATENCY_BUCKETS - 1 && (elapsed >> (bucket + 1)) != 0) {
+        bucket++;
+    }
+    stats->latency[bucket]++;
+    return result;
+}
+
+int tfs_getStats(tfsStats *stats) {
+    stats->blockReads = diskBlockReads - statsBaseReads;
+    stats->blockWrites = diskBlockWrites - statsBaseWrites;
+    stats->seeks = diskSeeks - statsBaseSeeks;
+    stats->seekBlocks = diskSeekBlocks - statsBaseSeekBlocks;
+    stats->bytesRead = stats->blockReads * BLOCKSIZE;
+    stats->bytesWritten = stats->blockWrites * BLOCKSIZE;
+    stats->heapAllocations = scratchHeapAllocations - statsBaseHeapAllocations;
+    for (int op = 0; op < TFS_OP_COUNT; op++) {
+        stats->ops[op] = opStats[op];
+        if (opStats[op].bytes > 0) {
+            stats->ops[op].amplification = (double)(opStats[op].blockReads + opStats[op].blockWrites) / opStats[op].bytes;
+        }
+    }
+    return 1; // success
+}
+
+int tfs_resetStats(void) {
+    memset(opStats, 0, sizeof(opStats));
+    statsBaseReads = diskBlockReads;
+    statsBaseWrites = diskBlockWrites;
+    statsBaseSeeks = diskSeeks;
+    statsBaseSeekBlocks = diskSeekBlocks;
+    statsBaseHeapAllocations = scratchHeapAllocations;
+    return 1; // success
+}
+
+const char *tfs_opName(int op) {
+    if (op < 0 || op >= TFS_OP_COUNT) {
+        return NULL;
+    }
+    return opNames[op];
+}
+
+/* BLOCK CACHE
+ * While a disk is mounted every block the file system touches goes through this
+ * small, fully associative, write-through cache. The least recently used entry
+ * is evicted first. Blocks fetched by read-ahead stay flagged as prefetched until
+ * a file actually reads them, which is how read-ahead hits and waste are counted.
+ * Entries that zero-copy spans point into are pinned and never evicted. */
+typedef struct cacheEntry {
+    tfsBlock blockNumber; // block held by this entry, -1 if the entry is empty
+    int prefetched; // 1 if the block was read ahead and nobody has read it yet
+    int pins; // spans handed out by tfs_readv_begin that point into this entry
+    unsigned long lastUsed; // cache clock value of the last access, for LRU eviction
+    char data[BLOCKSIZE]; // copy of the block
+} cacheEntry;
+
+cacheEntry blockCache[BLOCK_CACHE_SIZE];
+unsigned long cacheClock = 0;
+readAheadStats raStats; // read-ahead counters for the mounted disk
+int pinnedSpans = 0; // spans held by all open files together, at most TFS_READV_MAX_SPANS
+
+void cacheReset(void) {
+    /* empties the cache, any read-ahead block that was never used is waste */
+    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        if (blockCache[i].blockNumber >= 0 && blockCache[i].prefetched) {
+            raStats.waste++;
+        }
+        blockCache[i].blockNumber = -1;
+        blockCache[i].prefetched = 0;
+        blockCache[i].pins = 0;
+        blockCache[i].lastUsed = 0;
+    }
+    cacheClock = 0;
+    pinnedSpans = 0;
+}
+
+cacheEntry *cacheLookup(tfsBlock blockNum) {
+    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        if (blockCache[i].blockNumber == blockNum) {
+            blockCache[i].lastUsed = ++cacheClock;
+            return &blockCache[i];
+        }
+    }
+    return NULL;
+}
+
+cacheEntry *cacheVictim(void) {
+    /* returns an empty entry, or the least recently used one that is not
+    pinned. TFS_READV_MAX_SPANS keeps enough entries unpinned. */
+    cacheEntry *victim = NULL;
+    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        if (blockCache[i].blockNumber < 0) {
+            victim = &blockCache[i];
+            break;
+        }
+        if (blockCache[i].pins == 0 && (victim == NULL || blockCache[i].lastUsed < victim->lastUsed)) {
+            victim = &blockCache[i];
+        }
+    }
+    if (victim->blockNumber >= 0 && victim->prefetched) {
+        raStats.waste++; // read ahead but evicted before anyone used it
+    }
+    victim->blockNumber = -1;
+    victim->prefetched = 0;
+    victim->lastUsed = ++cacheClock;
+    return victim;
+}
+
+cacheEntry *cacheFetch(tfsBlock blockNum) {
+    /* the cache entry holding a block of the mounted disk, read in if needed.
+    NULL if the block could not be read. Its data stays put until the entry is
+    evicted, so callers that keep the pointer across other cache accesses pin it. */
+    cacheEntry *entry = cacheLookup(blockNum);
+    if (entry != NULL) {
+        if (entry->prefetched) {
+            raStats.hits++;
+            entry->prefetched = 0;
+        }
+        return entry;
+    }
+    entry = cacheVictim();
+    if (readBlock(mountedDisk, blockNum, entry->data) < 0) {
+        return NULL;
+    }
+    entry->blockNumber = blockNum;
+    return entry;
+}
+
+int cachedReadBlock(tfsBlock blockNum, void *block) {
+    /* readBlock() on the mounted disk, served from the cache when possible */
+    cacheEntry *entry = cacheFetch(blockNum);
+    if (entry == NULL) {
+        return -1;
+    }
+    memcpy(block, entry->data, BLOCKSIZE);
+    return 0;
+}
+
+int cachedWriteBlock(tfsBlock blockNum, void *block) {
+    /* writeBlock() on the mounted disk, the cached copy is updated as well */
+    if (writeBlock(mountedDisk, blockNum, block) < 0) {
+        return -1;
+    }
+    cacheEntry *entry = cacheLookup(blockNum);
+    if (entry == NULL) {
+        entry = cacheVictim();
+        entry->blockNumber = blockNum;
+    }
+    entry->prefetched = 0;
+    memcpy(entry->data, block, BLOCKSIZE);
+    return 0;
+}
+
+char *prefetchBlock(tfsBlock blockNum) {
+    /* brings a block into the cache for read-ahead without counting it as used.
+    Returns the cached copy, or NULL if the block could not be read. */
+    cacheEntry *entry = cacheLookup(blockNum);
+    if (entry != NULL) {
+        return entry->data; // already cached, nothing to fetch
+    }
+    entry = cacheVictim();
+    if (readBlock(mountedDisk, blockNum, entry->data) < 0) {
+        return NULL;
+    }
+    entry->blockNumber = blockNum;
+    entry->prefetched = 1;
+    raStats.issued++;
+    return entry->data;
+}
+
+void resetReadCursor(openFileTableEntry *entry) {
+    /* forget the chain position and read-ahead state of a file, e.g. after its
+    data blocks have been replaced */
+    entry->lastBlockIndex = -1;
+    entry->lastBlockNumber = 0;
+    entry->seqCount = 0;
+    entry->raWindow = 0;
+    entry->raNextIndex = 0;
+    entry->raNextBlock = 0;
+    entry->raContiguous = 1; // until a chain step shows otherwise
+    entry->lastMappedIndex = -1;
+    // the chunk index and the decompressed chunk describe the old content, their buffers are kept
+    entry->chunkCount = -1;
+    entry->cachedChunk = -1;
+}
+
+void releaseSpans(openFileTableEntry *entry) {
+    /* unpins the cache blocks behind the spans a file holds */
+    for (int i = 0; i < entry->spanCount; i++) {
+        if (entry->spanSlots[i] >= 0) {
+            blockCache[entry->spanSlots[i]].pins--;
+            pinnedSpans--;
+        }
+    }
+    entry->spanCount = 0;
+}
+
+openFileTableEntry *spareOpenFileEntries = NULL; // closed entries, with their chunk buffers, for the next open
+
+void freeOpenFileEntry(openFileTableEntry *entry) {
+    /* keeps the entry of a closed file for the next open instead of freeing it */
+    releaseSpans(entry);
+    entry->nextSpare = spareOpenFileEntries;
+    spareOpenFileEntries = entry;
+}
+
+void freeSpareOpenFileEntries(void) {
+    while (spareOpenFileEntries != NULL) {
+        openFileTableEntry *next = spareOpenFileEntries->nextSpare;
+        free(spareOpenFileEntries->chunkOffsets);
+        free(spareOpenFileEntries->chunkData);
+        free(spareOpenFileEntries);
+        spareOpenFileEntries = next;
+    }
+}
+
+int prefetchRun(openFileTableEntry *entry, int64_t *nextIndex, tfsBlock *nextBlock, int64_t count) {
+    /* read-ahead of a chain laid out in consecutive blocks: reads up to 'count'
+    blocks from '*nextBlock' on, stopping at the free watermark, with one
+    readBlocks, which a striped disk spreads over its members, and caches
+    them for as long as the chain really runs through them. Moves
+    '*nextIndex' and '*nextBlock' past what it cached, returns -1 if the run
+    could not be read. */
+    tfsBlock first = *nextBlock;
+    cacheEntry *super = cacheFetch(SUPER_BLOCK);
+    if (super == NULL) {
+        return -1;
+    }
+    tfsBlock watermark; // blocks past it were never written and fail their checksum
+    memcpy(&watermark, super->data + SUPER_FREE_WATERMARK_OFFSET, sizeof(tfsBlock));
+    if (count > watermark - first) {
+        count = watermark - first;
+    }
+    if (count < 2) {
+        return -1;
+    }
+    char *run = (char *)scratchAlloc((size_t)count * BLOCKSIZE);
+    if (run == NULL || readBlocks(mountedDisk, first, (int)count, run) < 0) {
+        scratchFree(run);
+        return -1;
+    }
+    raStats.issued += count;
+    int64_t cached = 0; // blocks of the run that went into the cache
+    int64_t i = 0;
+    for (; i < count && *nextBlock == first + i; i++) {
+        cacheEntry *slot = cacheLookup(first + i);
+        if (slot == NULL) {
+            slot = cacheVictim();
+            memcpy(slot->data, run + i * BLOCKSIZE, BLOCKSIZE);
+            slot->blockNumber = first + i;
+            slot->prefetched = 1;
+            cached++;
+        }
+        if (slot->data[BLOCK_NUMBER_OFFSET] != DATA_BLOCK_TYPE) {
+            *nextBlock = 0; // stop at anything that does not look like our chain
+            break;
+        }
+        memcpy(nextBlock, slot->data + DATA_NEXT_BLOCK_OFFSET, sizeof(tfsBlock));
+        (*nextIndex)++;
+    }
+    raStats.waste += count - cached; // read for nothing, past the end of the run or cached already
+    entry->raContiguous = i == count && *nextBlock == first + count;
+    scratchFree(run);
+    return 0;
+}
+
+void readAhead(openFileTableEntry *entry, int64_t index, char *blockData) {
+    /* Adaptive read-ahead. 'index' is the chain index of the block that was just
+    read into 'blockData'. Sequential steps open a window of READAHEAD_MIN_WINDOW
+    blocks that doubles every time the reader gets within half a window of the
+    read-ahead mark, up to READAHEAD_MAX_WINDOW. The blocks are fetched as one
+    batch by following the chain pointers, or with one request for the whole
+    window while the chain runs through consecutive blocks. */
+    if (entry->raWindow == 0) {
+        return;
+    }
+    if (entry->raNextIndex > index && entry->raNextBlock == 0) {
+        return; // already read ahead to the end of the chain
+    }
+    if (entry->raNextIndex > index + entry->raWindow / 2) {
+        return; // still far enough ahead
+    }
+    int64_t nextIndex = entry->raNextIndex;
+    tfsBlock nextBlock = entry->raNextBlock;
+    if (nextIndex <= index) {
+        // nothing is read ahead past this block, continue right after it
+        nextIndex = index + 1;
+        memcpy(&nextBlock, blockData + DATA_NEXT_BLOCK_OFFSET, sizeof(tfsBlock));
+    } else {
+        // the previous window is about to be used up, so grow the next one
+        entry->raWindow *= 2;
+        if (entry->raWindow > READAHEAD_MAX_WINDOW) {
+            entry->raWindow = READAHEAD_MAX_WINDOW;
+        }
+    }
+    while (nextBlock != 0 && nextIndex <= index + entry->raWindow) {
+        if (entry->raContiguous && prefetchRun(entry, &nextIndex, &nextBlock, index + entry->raWindow - nextIndex + 1) == 0) {
+            continue;
+        }
+        tfsBlock previous = nextBlock;
+        char *cached = prefetchBlock(nextBlock);
+        if (cached == NULL || cached[BLOCK_NUMBER_OFFSET] != DATA_BLOCK_TYPE) {
+            nextBlock = 0; // stop at anything that does not look like our chain
+            break;
+        }
+        memcpy(&nextBlock, cached + DATA_NEXT_BLOCK_OFFSET, sizeof(tfsBlock));
+        entry->raContiguous = nextBlock == previous + 1;
+        nextIndex++;
+    }
+    entry->raNextIndex = nextIndex;
+    entry->raNextBlock = nextBlock;
+}
+
+int getDataBlock(openFileTableEntry *entry, tfsBlock dataHead, int64_t index, char **blockData) {
+    /* Points 'blockData' at the block cache copy of the data block at position
+    'index' of a file's data chain, valid until the next cache access. The walk
+    resumes from the last block this file read when it can, so sequential reads
+    cost one block step instead of a walk from the head, and it copies nothing.
+    Also detects sequential access and drives read-ahead. */
+    int64_t currentIndex = 0;
+    tfsBlock currentBlock = dataHead;
+    if (entry->lastBlockIndex >= 0 && index >= entry->lastBlockIndex) {
+        currentIndex = entry->lastBlockIndex;
+        currentBlock = entry->lastBlockNumber;
+    }
+    // sequential detection, only block to block steps count
+    if (index != entry->lastBlockIndex) {
+        if (entry->lastBlockIndex >= 0 && index == entry->lastBlockIndex + 1) {
+            entry->seqCount++;
+            if (entry->raWindow == 0 && entry->seqCount >= READAHEAD_SEQ_THRESHOLD) {
+                entry->raWindow = READAHEAD_MIN_WINDOW;
+            }
+        } else {
+            // random access, shrink the window and drop the read-ahead mark
+            entry->seqCount = 0;
+            entry->raWindow /= 2;
+            if (entry->raWindow < READAHEAD_MIN_WINDOW) {
+                entry->raWindow = 0;
+            }
+            entry->raNextIndex = 0;
+            entry->raNextBlock = 0;
+        }
+    }
+    cacheEntry *cached;
+    while (1) {
+        if (currentBlock == 0) {
+            printf("LIBTINYFS: Error: Data chain ended early. (getDataBlock)\n");
+            return EFREAD; // error
+        }
+        cached = cacheFetch(currentBlock);
+        if (cached == NULL) {
+            printf("LIBTINYFS: Error: Issue with data read. (getDataBlock)\n");
+            return EFREAD; // error
+        }
+        if (currentIndex == index) {
+            break;
+        }
+        memcpy(&currentBlock, cached->data + DATA_NEXT_BLOCK_OFFSET, sizeof(tfsBlock)); // get the next data block
+        currentIndex++;
+    }
+    entry->lastBlockIndex = index;
+    entry->lastBlockNumber = currentBlock;
+    cached->pins++; // read-ahead must not evict the block we return
+    readAhead(entry, index, cached->data);
+    cached->pins--;
+    *blockData = cached->data;
+    return 1; // success
+}
+
+int getMappedBlock(openFileTableEntry *entry, tfsBlock mapHead, int64_t index, char **blockData) {
+    /* Points 'blockData' at the cached copy of block 'index' of a deduplicated
+    file, like getDataBlock does for chains. The block map
+    is walked like a data chain, resuming from the map block this file used
+    last. Shared blocks are wherever the first file to hold their bytes put
+    them, so sequential reads prefetch the blocks the map lists next rather
+    than following a chain. */
+    int64_t mapIndex = index / MAP_MAX_ENTRIES;
+    int64_t currentIndex = 0;
+    tfsBlock currentBlock = mapHead;
+    if (entry->lastBlockIndex >= 0 && mapIndex >= entry->lastBlockIndex) {
+        currentIndex = entry->lastBlockIndex;
+        currentBlock = entry->lastBlockNumber;
+    }
+    char mapData[BLOCKSIZE];
+    while (1) {
+        if (currentBlock == 0 || cachedReadBlock(currentBlock, mapData) < 0) {
+            printf("LIBTINYFS: Error: Issue with block map read. (getMappedBlock)\n");
+            return EFREAD; // error
+        }
+        if (currentIndex == mapIndex) {
+            break;
+        }
+        memcpy(&currentBlock, mapData + MAP_NEXT_BLOCK_OFFSET, sizeof(tfsBlock));
+        currentIndex++;
+    }
+    entry->lastBlockIndex = mapIndex;
+    entry->lastBlockNumber = currentBlock;
+    int count = (unsigned char)mapData[MAP_COUNT_OFFSET];
+    int slot = (int)(index % MAP_MAX_ENTRIES);
+    if (slot >= count) {
+        printf("LIBTINYFS: Error: Block map ended early. (getMappedBlock)\n");
+        return EFREAD; // error
+    }
+    // sequential detection, the same way getDataBlock does it for chains
+    if (index != entry->lastMappedIndex) {
+        if (entry->lastMappedIndex >= 0 && index == entry->lastMappedIndex + 1) {
+            entry->seqCount++;
+        } else {
+            entry->seqCount = 0;
+            entry->raNextIndex = 0;
+        }
+        entry->lastMappedIndex = index;
+    }
+    if (entry->seqCount >= READAHEAD_SEQ_THRESHOLD && entry->raNextIndex <= index + READAHEAD_MAX_WINDOW / 2) {
+        int64_t next = entry->raNextIndex > index ? entry->raNextIndex : index + 1;
+        int64_t end = index + READAHEAD_MAX_WINDOW;
+        if (end > mapIndex * MAP_MAX_ENTRIES + count) {
+            end = mapIndex * MAP_MAX_ENTRIES + count; // the next map block takes over from there
+        }
+        for (; next < end; next++) {
+            tfsBlock block;
+            memcpy(&block, mapData + MAP_ENTRIES_OFFSET + (next % MAP_MAX_ENTRIES) * sizeof(tfsBlock), sizeof(tfsBlock));
+            if (prefetchBlock(block) == NULL) {
+                break;
+            }
+        }
+        entry->raNextIndex = next;
+    }
+    tfsBlock block;
+    memcpy(&block, mapData + MAP_ENTRIES_OFFSET + slot * sizeof(tfsBlock), sizeof(tfsBlock));
+    cacheEntry *cached = cacheFetch(block);
+    if (cached == NULL) {
+        printf("LIBTINYFS: Error: Issue with shared block read. (getMappedBlock)\n");
+        return EFREAD; // error
+    }
+    *blockData = cached->data;
+    return 1; // success
+}
+
+int getFileBlock(openFileTableEntry *entry, char *inodeData, int64_t index, char **blockData) {
+    /* finds block 'index' of a file stored outside its inode, whether it is a
+    chain or a block map, and points 'blockData' at its copy in the block cache */
+    tfsBlock dataHead;
+    memcpy(&dataHead, inodeData + INODE_DATA_BLOCK_OFFSET, sizeof(tfsBlock));
+    if (inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_DEDUP) {
+        return getMappedBlock(entry, dataHead, index, blockData);
+    }
+    return getDataBlock(entry, dataHead, index, blockData);
+}
+
+int tfs_getReadAheadStats(readAheadStats *stats) {
+    if (mountedDisk == INT_NULL) {
+        printf("LIBTINYFS: Error: No disk mounted. (getReadAheadStats)\n");
+        return EMOUNTFS; // error
+    }
+    *stats = raStats;
+    return 1; // success
+}
+
+/* COMPRESSED FILES
+ * A file with INODE_FLAG_COMPRESSED that does not fit in its inode is kept as
+ * a stream: the stored length of each TFS_CHUNK_SIZE chunk of the file (4
+ * bytes each), then the chunks one after another. A chunk that lzCompress
+ * cannot shrink is stored as is, which is what a stored length equal to the
+ * chunk's own length means. The stream is stored like the content of any
+ * other file, in the inode if it fits and in a data block chain otherwise,
+ * while the inode's file size stays the uncompressed size. Reads go through
+ * the chunk index, so only the chunks a read touches are fetched and
+ * decompressed, and each open file keeps its last decompressed chunk. */
+int compressFile(char *buffer, int size, char **stream) {
+    /* builds the stream for 'size' bytes, returns its size and sets 'stream' */
+    int chunkCount = (size + TFS_CHUNK_SIZE - 1) / TFS_CHUNK_SIZE;
+    int headerSize = chunkCount * (int)sizeof(uint32_t);
+    *stream = (char *)scratchAlloc(headerSize + (size_t)chunkCount * LZ_COMPRESS_BOUND(TFS_CHUNK_SIZE));
+    if (*stream == NULL) {
+        printf("LIBTINYFS: Error: Could not allocate memory for compression. (compressFile)\n");
+        return EFWRITE; // error
+    }
+    int streamSize = headerSize;
+    for (int chunk = 0; chunk < chunkCount; chunk++) {
+        char *source = buffer + chunk * TFS_CHUNK_SIZE;
+        int length = size - chunk * TFS_CHUNK_SIZE < TFS_CHUNK_SIZE ? size - chunk * TFS_CHUNK_SIZE : TFS_CHUNK_SIZE;
+        // anything that does not come out shorter is stored as is
+        int stored = lzCompress(source, length, *stream + streamSize, length - 1);
+        if (stored < 0) {
+            memcpy(*stream + streamSize, source, length);
+            stored = length;
+        }
+        uint32_t storedLength = (uint32_t)stored;
+        memcpy(*stream + chunk * sizeof(uint32_t), &storedLength, sizeof(uint32_t));
+        streamSize += stored;
+    }
+    return streamSize;
+}
+
+int readStream(openFileTableEntry *entry, char *inodeData, int offset, char *buffer, int length) {
+    /* copies 'length' stored bytes of a file, starting at 'offset', wherever they live */
+    if (inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_INLINE) {
+        if (offset + length > INODE_INLINE_CAPACITY) {
+            return EFREAD; // error
+        }
+        memcpy(buffer, inodeData + INODE_INLINE_DATA_OFFSET + offset, length);
+        return 1;
+    }
+    char *blockData;
+    while (length > 0) {
+        int byteNumber = offset % USEABLE_DATA_SIZE;
+        if (getFileBlock(entry, inodeData, offset / USEABLE_DATA_SIZE, &blockData) < 0) {
+            return EFREAD; // error
+        }
+        int piece = USEABLE_DATA_SIZE - byteNumber < length ? USEABLE_DATA_SIZE - byteNumber : length;
+        memcpy(buffer, blockData + DATA_BLOCK_DATA_OFFSET + byteNumber, piece);
+        buffer += piece;
+        offset += piece;
+        length -= piece;
+    }
+    return 1; // success
+}
+
+int loadChunk(openFileTableEntry *entry, char *inodeData, int fileSize, int chunk) {
+    /* makes 'chunk' of a compressed file the one held in entry->chunkData */
+    if (entry->cachedChunk == chunk) {
+        return 1;
+    }
+    if (entry->chunkCount < 0) {
+        // first read since open or the last write, fetch the chunk index
+        int chunkCount = (fileSize + TFS_CHUNK_SIZE - 1) / TFS_CHUNK_SIZE;
+        uint32_t *offsets = entry->chunkOffsets;
+        if (chunkCount + 1 > entry->chunkCapacity) {
+            offsets = (uint32_t *)realloc(entry->chunkOffsets, (chunkCount + 1) * sizeof(uint32_t));
+            if (offsets == NULL) {
+                return EFREAD; // error
+            }
+            entry->chunkOffsets = offsets;
+            entry->chunkCapacity = chunkCount + 1;
+        }
+        if (readStream(entry, inodeData, 0, (char *)offsets, chunkCount * sizeof(uint32_t)) < 0) {
+            return EFREAD; // error
+        }
+        // stored lengths to offsets, the first chunk starts right after the index
+        uint32_t offset = chunkCount * sizeof(uint32_t);
+        for (int i = 0; i <= chunkCount; i++) {
+            uint32_t length = i < chunkCount ? offsets[i] : 0;
+            offsets[i] = offset;
+            offset += length;
+        }
+        entry->chunkCount = chunkCount;
+    }
+    if (chunk < 0 || chunk >= entry->chunkCount) {
+        printf("LIBTINYFS: Error: Chunk %d is outside the file. (loadChunk)\n", chunk);
+        return EFREAD; // error
+    }
+    if (entry->chunkData == NULL) {
+        entry->chunkData = (char *)malloc(TFS_CHUNK_SIZE);
+        if (entry->chunkData == NULL) {
+            return EFREAD; // error
+        }
+    }
+    int length = fileSize - chunk * TFS_CHUNK_SIZE < TFS_CHUNK_SIZE ? fileSize - chunk * TFS_CHUNK_SIZE : TFS_CHUNK_SIZE;
+    int stored = (int)(entry->chunkOffsets[chunk + 1] - entry->chunkOffsets[chunk]);
+    if (stored > length) {
+        printf("LIBTINYFS: Error: Corrupt chunk index. (loadChunk)\n");
+        return EFREAD; // error
+    }
+    entry->cachedChunk = -1;
+    if (stored == length) {
+        // stored as is
+        if (readStream(entry, inodeData, entry->chunkOffsets[chunk], entry->chunkData, length) < 0) {
+            return EFREAD; // error
+        }
+        entry->cachedChunk = chunk;
+        return 1;
+    }
+    char compressed[TFS_CHUNK_SIZE];
+    if (readStream(entry, inodeData, entry->chunkOffsets[chunk], compressed, stored) < 0) {
+        return EFREAD; // error
+    }
+    if (lzDecompress(compressed, stored, entry->chunkData, TFS_CHUNK_SIZE) != length) {
+        printf("LIBTINYFS: Error: Corrupt compressed chunk %d. (loadChunk)\n", chunk);
+        return EFREAD; // error
+    }
+    entry->cachedChunk = chunk;
+    return 1; // success
+}
+
+int readCompressed(openFileTableEntry *entry, char *inodeData, int fileSize, int offset, char *buffer, int length) {
+    /* copies 'length' bytes of a compressed file from 'offset' into 'buffer' */
+    if (offset < 0 || length > fileSize - offset) {
+        printf("LIBTINYFS: Error: Read outside the file. (readCompressed)\n");
+        return EFREAD; // error
+    }
+    while (length > 0) {
+        int chunk = offset / TFS_CHUNK_SIZE;
+        int byteNumber = offset % TFS_CHUNK_SIZE;
+        if (loadChunk(entry, inodeData, fileSize, chunk) < 0) {
+            return EFREAD; // error
+        }
+        int piece = TFS_CHUNK_SIZE - byteNumber < length ? TFS_CHUNK_SIZE - byteNumber : length;
+        memcpy(buffer, entry->chunkData + byteNumber, piece);
+        buffer += piece;
+        offset += piece;
+        length -= piece;
+    }
+    return 1; // success
+}
+
+int isCompressedStream(char *inodeData) {
+    /* 1 if the stored content of a file is a compressed chunk stream */
+    int64_t fileSize;
+    memcpy(&fileSize, inodeData + INODE_FILE_SIZE_OFFSET, sizeof(int64_t));
+    return (inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_COMPRESSED) && fileSize > INODE_INLINE_CAPACITY;
+}
+
+/* SUPER BLOCK CHECKSUM
+ * The super block ends in a CRC-32C of everything before it, whether or not
+ * block checksums are on for the rest of the disk. tfs_mount refuses a super
+ * block that does not match, so every write of it goes through
+ * writeSuperBlock. */
+void sealSuperBlock(char *superData) {
+    uint32_t checksum = crc32c(superData, SUPER_CHECKSUM_OFFSET);
+    memcpy(superData + SUPER_CHECKSUM_OFFSET, &checksum, sizeof(uint32_t));
+}
+
+int superBlockValid(char *superData) {
+    uint32_t checksum;
+    memcpy(&checksum, superData + SUPER_CHECKSUM_OFFSET, sizeof(uint32_t));
+    return superData[BLOCK_NUMBER_OFFSET] == SUPER_BLOCK_TYPE &&
+        superData[MAGIC_NUMBER_OFFSET] == MAGIC_NUMBER &&
+        checksum == crc32c(superData, SUPER_CHECKSUM_OFFSET);
+}
+
+int writeSuperBlock(char *superData) {
+    sealSuperBlock(superData);
+    return cachedWriteBlock(SUPER_BLOCK, superData);
+}
+
+/* ALLOCATION POLICIES
+ * Where takeFreeBlock finds a block. TFS_ALLOC_LIFO takes the head of the
+ * free block LL, the block freed last, wherever that is. The other policies
+ * look at the free space as runs of consecutive blocks, so while one of
+ * them is in use every free block below the free watermark has a bit in a
+ * bitmap, built from the free block LL at mount, and the space past the
+ * watermark is one more run at the end. A writer about to take a number of
+ * blocks for one file says so with allocHint. The policy picks the run the
+ * first of them goes to and the rest follow it for as long as the next
+ * block is free. The free block LL on disk is not kept up to date
+ * meanwhile: a freed block gets its free block header, pointing at the next
+ * free block, but which free block points at which is only put right, in
+ * block order, when the disk is unmounted or goes back to TFS_ALLOC_LIFO.
+ * A second bitmap marks the free blocks whose next pointer went stale, so
+ * only those are written then. After a crash the disk is dirty and the next
+ * mount relinks the free blocks from their headers. */
+typedef struct allocState {
+    int policy; // TFS_ALLOC_* of the mounted disk
+    uint64_t *freeMap; // a bit for every free block below the watermark, NULL under TFS_ALLOC_LIFO
+    uint64_t *staleMap; // free blocks whose next pointer on disk is not the next free block
+    tfsBlock numBlocks;
+    tfsBlock cursor; // TFS_ALLOC_NEXT_FIT looks from here on
+    tfsBlock near; // the next run goes close to this block, 0 to carry on from the last one
+    tfsBlock want; // blocks the run being taken still needs
+    tfsBlock last; // block taken last
+} allocState;
+
+allocState alloc;
+
+int allocBit(uint64_t *map, tfsBlock block) {
+    return (int)((map[block >> 6] >> (block & 63)) & 1);
+}
+
+void allocSetBit(uint64_t *map, tfsBlock block, int set) {
+    if (set) {
+        map[block >> 6] |= (uint64_t)1 << (block & 63);
+    } else {
+        map[block >> 6] &= ~((uint64_t)1 << (block & 63));
+    }
+}
+
+tfsBlock allocNextBit(uint64_t *map, tfsBlock from, tfsBlock end, int set) {
+    /* the first block in [from, end) whose bit in 'map' is 'set', or end */
+    while (from < end) {
+        uint64_t word = (set ? map[from >> 6] : ~map[from >> 6]) >> (from & 63);
+        if (word == 0) {
+            from = (from | 63) + 1;
+            continue;
+        }
+        while (!(word & 1)) {
+            word >>= 1;
+            from++;
+        }
+        return from < end ? from : end;
+    }
+    return end;
+}
+
+tfsBlock allocPrevFree(tfsBlock block) {
+    /* the last free block before 'block', or 0 */
+    tfsBlock b = block - 1;
+    while (b > SUPER_BLOCK) {
+        uint64_t word = alloc.freeMap[b >> 6] << (63 - (b & 63));
+        if (word == 0) {
+            b = (b & ~(tfsBlock)63) - 1;
+            continue;
+        }
+        while (!(word >> 63)) {
+            word <<= 1;
+            b--;
+        }
+        return b;
+    }
+    return 0;
+}
+
+void allocFree(void) {
+    /* drops the bitmaps and the run being taken, the policy stays */
+    int policy = alloc.policy;
+    free(alloc.freeMap);
+    free(alloc.staleMap);
+    memset(&alloc, 0, sizeof(allocState));
+    alloc.policy = policy;
+}
+
+void allocTake(tfsBlock block) {
+    /* a free block below the watermark is taken, the free block before it pointed at it */
+    allocSetBit(alloc.freeMap, block, 0);
+    allocSetBit(alloc.staleMap, block, 0);
+    tfsBlock before = allocPrevFree(block);
+    if (before != 0) {
+        allocSetBit(alloc.staleMap, before, 1);
+    }
+}
+
+int allocRelease(tfsBlock block, char *data) {
+    /* writes the free block header in 'data' to 'block', pointing at the next
+    free block, and puts the block in the free bitmap */
+    tfsBlock next = allocNextBit(alloc.freeMap, block + 1, alloc.numBlocks, 1);
+    next = next < alloc.numBlocks ? next : 0;
+    memcpy(data + FREE_NEXT_BLOCK_OFFSET, &next, sizeof(tfsBlock));
+    if (cachedWriteBlock(block, data) < 0) {
+        return EFWRITE; // error
+    }
+    allocSetBit(alloc.freeMap, block, 1);
+    allocSetBit(alloc.staleMap, block, 0);
+    tfsBlock before = allocPrevFree(block);
+    if (before != 0) {
+        allocSetBit(alloc.staleMap, before, 1); // it pointed past the block
+    }
+    return 1; // success
+}
+
+tfsBlock allocRunAt(tfsBlock from, tfsBlock watermark, tfsBlock *length) {
+    /* the first block of the first free run at or after 'from', 0 if there is
+    none. A run reaching the watermark goes on to the end of the disk. */
+    tfsBlock start = allocNextBit(alloc.freeMap, from, watermark, 1);
+    if (start < watermark) {
+        tfsBlock end = allocNextBit(alloc.freeMap, start, watermark, 0);
+        *length = end - start + (end == watermark ? alloc.numBlocks - watermark : 0);
+        return start;
+    }
+    if (from <= watermark && watermark < alloc.numBlocks) {
+        *length = alloc.numBlocks - watermark;
+        return watermark;
+    }
+    return 0;
+}
+
+tfsBlock allocFirstFit(tfsBlock from, tfsBlock count, tfsBlock watermark) {
+    /* the first run of at least 'count' free blocks from 'from' on, wrapping
+    around to the start of the disk */
+    from = from <= SUPER_BLOCK ? SUPER_BLOCK + 1 : from;
+    from = from > watermark ? watermark : from;
+    tfsBlock length;
+    tfsBlock start;
+    for (tfsBlock b = from; (start = allocRunAt(b, watermark, &length)) != 0; b = start + length) {
+        if (length >= count) {
+            return start;
+        }
+    }
+    for (tfsBlock b = SUPER_BLOCK + 1; (start = allocRunAt(b, watermark, &length)) != 0 && start < from; b = start + length) {
+        if (length >= count) {
+            return start;
+        }
+    }
+    return 0;
+}
+
+tfsBlock allocBestFit(tfsBlock count, tfsBlock watermark) {
+    /* the smallest run of at least 'count' free blocks, the lowest of equal
+    ones, or the largest run if none is big enough */
+    tfsBlock best = 0;
+    tfsBlock bestLength = 0;
+    tfsBlock largest = 0;
+    tfsBlock largestLength = 0;
+    tfsBlock length;
+    tfsBlock start;
+    for (tfsBlock b = SUPER_BLOCK + 1; (start = allocRunAt(b, watermark, &length)) != 0; b = start + length) {
+        if (length >= count && (best == 0 || length < bestLength)) {
+            best = start;
+            bestLength = length;
+            if (length == count) {
+                break; // nothing fits better
+            }
+        }
+        if (length > largestLength) {
+            largest = start;
+            largestLength = length;
+        }
+    }
+    return best != 0 ? best : largest;
+}
+
+void allocHint(tfsBlock near, tfsBlock count) {
+    /* the next 'count' blocks taken are one run, placed close to 'near' */
+    alloc.near = near;
+    alloc.want = count;
+}
+
+tfsBlock allocTakeNext(char *superData) {
+    /* takeFreeBlock under a placement policy */
+    tfsBlock watermark;
+    memcpy(&watermark, superData + SUPER_FREE_WATERMARK_OFFSET, sizeof(tfsBlock));
+    tfsBlock count = alloc.want > 0 ? alloc.want : 1;
+    tfsBlock block = alloc.last + 1;
+    int follows = alloc.near == 0 && alloc.want > 0 && alloc.last != 0 &&
+        (block < watermark ? allocBit(alloc.freeMap, block) : block == watermark && watermark < alloc.numBlocks);
+    if (!follows) {
+        if (alloc.policy == TFS_ALLOC_NEXT_FIT) {
+            block = allocFirstFit(alloc.cursor, count, watermark);
+            block = block != 0 ? block : allocFirstFit(alloc.cursor, 1, watermark);
+        } else if (alloc.policy == TFS_ALLOC_NEAR_INODE) {
+            tfsBlock near = alloc.near != 0 ? alloc.near : alloc.last;
+            block = allocFirstFit(near, count, watermark);
+            block = block != 0 ? block : allocFirstFit(near, 1, watermark);
+        } else {
+            block = allocBestFit(count, watermark);
+        }
+    }
+    if (block == 0) {
+        return ENOSPC; // error
+    }
+    if (block == watermark) {
+        tfsBlock newWatermark = watermark + 1;
+        memcpy(superData + SUPER_FREE_WATERMARK_OFFSET, &newWatermark, sizeof(tfsBlock));
+    } else {
+        allocTake(block);
+    }
+    alloc.near = 0;
+    alloc.last = block;
+    alloc.cursor = block + 1;
+    if (alloc.want > 0) {
+        alloc.want--;
+    }
+    return block;
+}
+
+int allocLoad(char *superData) {
+    /* builds the free bitmap from the free block LL, reading MOUNT_IO_BLOCKS
+    at a time from the block the list goes to when it leaves the last ones
+    read, so a list in block order is read front to back. Returns 0 if the
+    list does not add up. */
+    tfsBlock numBlocks;
+    tfsBlock watermark;
+    tfsBlock block;
+    memcpy(&numBlocks, superData + SUPER_NUM_BLOCKS_OFFSET, sizeof(tfsBlock));
+    memcpy(&watermark, superData + SUPER_FREE_WATERMARK_OFFSET, sizeof(tfsBlock));
+    memcpy(&block, superData + FB_OFFSET, sizeof(tfsBlock));
+    allocFree();
+    alloc.numBlocks = numBlocks;
+    alloc.cursor = SUPER_BLOCK + 1;
+    alloc.freeMap = (uint64_t *)calloc((size_t)(numBlocks + 63) / 64, sizeof(uint64_t));
+    alloc.staleMap = (uint64_t *)calloc((size_t)(numBlocks + 63) / 64, sizeof(uint64_t));
+    char *chunk = (char *)scratchAlloc(MOUNT_IO_BLOCKS * BLOCKSIZE);
+    if (alloc.freeMap == NULL || alloc.staleMap == NULL || chunk == NULL) {
+        scratchFree(chunk);
+        allocFree();
+        printf("LIBTINYFS: Error: No memory for the free bitmap. (allocLoad)\n");
+        return EMOUNTFS; // error
+    }
+    tfsBlock chunkStart = 0;
+    int chunkBlocks = 0;
+    int inOrder = 1;
+    while (block != 0) {
+        // a block off the disk or seen before means the list is broken or loops
+        if (block <= SUPER_BLOCK || block >= watermark || allocBit(alloc.freeMap, block)) {
+            break;
+        }
+        if (block < chunkStart || block >= chunkStart + chunkBlocks) {
+            chunkBlocks = watermark - block < MOUNT_IO_BLOCKS ? (int)(watermark - block) : MOUNT_IO_BLOCKS;
+            chunkStart = block;
+            if (readBlocks(mountedDisk, block, chunkBlocks, chunk) < 0) {
+                break;
+            }
+        }
+        char *data = chunk + (block - chunkStart) * BLOCKSIZE;
+        if (data[BLOCK_NUMBER_OFFSET] != FREE_BLOCK_TYPE || data[MAGIC_NUMBER_OFFSET] != MAGIC_NUMBER) {
+            break;
+        }
+        allocSetBit(alloc.freeMap, block, 1);
+        tfsBlock next;
+        memcpy(&next, data + FREE_NEXT_BLOCK_OFFSET, sizeof(tfsBlock));
+        inOrder = inOrder && (next == 0 || next > block);
+        block = next;
+    }
+    scratchFree(chunk);
+    if (block != 0) {
+        allocFree();
+        return 0;
+    }
+    if (!inOrder) {
+        // every next pointer is rewritten in block order when the list is put back
+        memcpy(alloc.staleMap, alloc.freeMap, (size_t)(numBlocks + 63) / 64 * sizeof(uint64_t));
+    }
+    return 1; // success
+}
+
+int allocStore(char *superData) {
+    /* puts the free block LL on disk right, in block order, by rewriting the
+    free blocks with a stale next pointer, and sets its head in 'superData' */
+    char data[BLOCKSIZE];
+    tfsBlock numBlocks = alloc.numBlocks;
+    for (tfsBlock b = allocNextBit(alloc.staleMap, SUPER_BLOCK + 1, numBlocks, 1); b < numBlocks;
+        b = allocNextBit(alloc.staleMap, b + 1, numBlocks, 1)) {
+        tfsBlock next = allocNextBit(alloc.freeMap, b + 1, numBlocks, 1);
+        next = next < numBlocks ? next : 0;
+        memset(data, 0, BLOCKSIZE);
+        data[BLOCK_NUMBER_OFFSET] = FREE_BLOCK_TYPE;
+        data[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+        memcpy(data + FREE_NEXT_BLOCK_OFFSET, &next, sizeof(tfsBlock));
+        if (cachedWriteBlock(b, data) < 0) {
+            printf("LIBTINYFS: Error: Issue with free block write. (allocStore)\n");
+            return EFWRITE; // error
+        }
+        allocSetBit(alloc.staleMap, b, 0);
+    }
+    tfsBlock head = allocNextBit(alloc.freeMap, SUPER_BLOCK + 1, numBlocks, 1);
+    head = head < numBlocks ? head : 0;
+    memcpy(superData + FB_OFFSET, &head, sizeof(tfsBlock));
+    return 1; // success
+}
+
+tfsBlock freeBlockCount = 0; // free blocks on the mounted disk, free block LL plus everything past the watermark
+long layoutChanges = 0; // blocks taken or freed since mount, tfs_defrag rescans the disk when it moved on
+
+tfsBlock takeFreeBlock(char *superData) {
+    /* Takes a block off the free space described by 'superData' and returns
+    its number, or ENOSPC. Blocks that were freed sit on the free block LL and
+    are reused first. Past that, every block from the free watermark up to the
+    end of the disk has never been used and is free without any free block
+    header, so taking one is just moving the watermark. Only 'superData' is
+    changed, the caller writes it back. A placement policy other than
+    TFS_ALLOC_LIFO picks the block from the free bitmap instead. */
+    if (alloc.policy != TFS_ALLOC_LIFO) {
+        tfsBlock block = allocTakeNext(superData);
+        if (block > 0) {
+            freeBlockCount--;
+            layoutChanges++;
+        }
+        return block;
+    }
+    tfsBlock freeBlockHead;
+    memcpy(&freeBlockHead, superData + FB_OFFSET, sizeof(tfsBlock));
+    if (freeBlockHead != 0) {
+        char freeBlockData[BLOCKSIZE];
+        if (cachedReadBlock(freeBlockHead, freeBlockData) < 0) {
+            printf("LIBTINYFS: Error: Invalid pointer to free block. (takeFreeBlock)\n");
+            return EFREAD; // error
+        }
+        // unlink the block from the free block LL
+        memcpy(superData + FB_OFFSET, freeBlockData + FREE_NEXT_BLOCK_OFFSET, sizeof(tfsBlock));
+        freeBlockCount--;
+        layoutChanges++;
+        return freeBlockHead;
+    }
+    tfsBlock watermark;
+    tfsBlock numBlocks;
+    memcpy(&watermark, superData + SUPER_FREE_WATERMARK_OFFSET, sizeof(tfsBlock));
+    memcpy(&numBlocks, superData + SUPER_NUM_BLOCKS_OFFSET, sizeof(tfsBlock));
+    if (watermark == 0 || watermark >= numBlocks) {
+        return ENOSPC; // error
+    }
+    tfsBlock newWatermark = watermark + 1;
+    memcpy(superData + SUPER_FREE_WATERMARK_OFFSET, &newWatermark, sizeof(tfsBlock));
+    freeBlockCount--;
+    layoutChanges++;
+    return watermark;
+}
+
+tfsBlock allocateBlock(void) {
+    /* takes one free block and returns its number. The caller turns it into
+    whatever block type it needs. */
+    char *superData = scratchBlock();
+    int success = cachedReadBlock(SUPER_BLOCK, superData);
+    if (success < 0) {
+        scratchFree(superData);
+        printf("LIBTINYFS-allocateBlock: Issue with super block read when allocating block\n");
+        return EFREAD; // error
+    }
+    tfsBlock block = takeFreeBlock(superData);
+    if (block < 0) {
+        scratchFree(superData);
+        printf("LIBTINYFS-allocateBlock: No free blocks\n");
+        return block; // error
+    }
+    success = writeSuperBlock(superData);
+    scratchFree(superData);
+    if (success < 0) {
+        printf("LIBTINYFS-allocateBlock: Issue with super block write when allocating block\n");
+        return EFWRITE; // error
+    }
+    return block;
+}
+
+int deallocateBlock(tfsBlock blockNum) {
+    /* This function takes a block number of an 
+    inode or data block and deallocates it, and 
+    adds it to the free block list */
+    // read in the block
+    char *data = scratchBlock();
+    int success = cachedReadBlock(blockNum, data);
+    if (success < 0) {
+        printf("LIBTINYFS-deallocateBlock: Invalid pointer to block\n");
+        return EDEALLOC; // error
+    }
+    // zero out the data buffer
+    memset(data, 0, BLOCKSIZE);
+    // prep the data buffer to be written as a free block
+    data[BLOCK_NUMBER_OFFSET] = FREE_BLOCK_TYPE; // block type -> free block
+    data[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+    if (alloc.policy != TFS_ALLOC_LIFO) {
+        // into the free bitmap, the free block LL and the super block are put right at unmount
+        if (allocRelease(blockNum, data) < 0) {
+            printf("LIBTINYFS-deallocateBlock: Issue with free block write when deallocating block\n");
+            return EDEALLOC; // error
+        }
+        freeBlockCount++;
+        layoutChanges++;
+        return 1; // success
+    }
+    // read in the super block
+    char *superData = scratchBlock();
+    success = cachedReadBlock(SUPER_BLOCK, superData);
+    if (success < 0) {
+        printf("LIBTINYFS-deallocateBlock: Issue with super block read when deallocating block\n");
+        return EDEALLOC; // error
+    }
+    // get the free block LL head pointer
+    tfsBlock freeBlockHead;
+    memcpy(&freeBlockHead, superData + FB_OFFSET, sizeof(tfsBlock));
+    // set the next free block pointer to the current free block LL head pointer
+    memcpy(data + FREE_NEXT_BLOCK_OFFSET, &freeBlockHead, sizeof(tfsBlock));
+    // update the super block to point to the new free block
+    memcpy(superData + FB_OFFSET, &blockNum, sizeof(tfsBlock));
+    // write the super block back to disk
+    int writeSuccess = writeSuperBlock(superData);
+    if (writeSuccess < 0) {
+        printf("LIBTINYFS-deallocateBlock: Issue with super block write when deallocating block\n");
+        return EDEALLOC; // error
+    }
+    // write the free block back to disk
+    writeSuccess = cachedWriteBlock(blockNum, data);
+    if (writeSuccess < 0) {
+        printf("LIBTINYFS-deallocateBlock: Issue with free block write when deallocating block\n");
+        return EDEALLOC; // error
+    }
+    freeBlockCount++;
+    layoutChanges++;
+    return 1; // success
+}
+
+int tfsSetAllocPolicy(int policy) {
+    if (mountedDisk == INT_NULL) {
+        printf("LIBTINYFS: Error: No disk mounted. (setAllocPolicy)\n");
+        return EMOUNTFS; // error
+    }
+    if (policy < 0 || policy >= TFS_ALLOC_POLICIES) {
+        printf("LIBTINYFS: Error: Unknown allocation policy %d. (setAllocPolicy)\n", policy);
+        return EMOUNTFS; // error
+    }
+    char superData[BLOCKSIZE];
+    if (cachedReadBlock(SUPER_BLOCK, superData) < 0) {
+        printf("LIBTINYFS: Error: Issue with super block read. (setAllocPolicy)\n");
+        return EFREAD; // error
+    }
+    // the free space moves between the free block LL and the free bitmap
+    int success = 1;
+    if (policy == TFS_ALLOC_LIFO && alloc.policy != TFS_ALLOC_LIFO) {
+        success = allocStore(superData);
+        if (success > 0) {
+            allocFree();
+        }
+    } else if (policy != TFS_ALLOC_LIFO && alloc.policy == TFS_ALLOC_LIFO) {
+        alloc.policy = policy;
+        success = allocLoad(superData);
+        if (success <= 0) {
+            alloc.policy = TFS_ALLOC_LIFO;
+            printf("LIBTINYFS: Error: Free block list unreadable. (setAllocPolicy)\n");
+            return success < 0 ? success : EFREAD; // error
+        }
+    }
+    if (success < 0) {
+        return success; // error
+    }
+    alloc.policy = policy;
+    layoutChanges++; // tfs_defrag sees the free space anew
+    superData[SUPER_ALLOC_POLICY_OFFSET] = policy;
+    if (writeSuperBlock(superData) < 0) {
+        printf("LIBTINYFS: Error: Issue with super block write. (setAllocPolicy)\n");
+        return EFWRITE; // error
+    }
+    return 1; // success
+}
+
+int tfs_getAllocPolicy(void) {
+    if (mountedDisk == INT_NULL) {
+        printf("LIBTINYFS: Error: No disk mounted. (getAllocPolicy)\n");
+        return EMOUNTFS; // error
+    }
+    return alloc.policy;
+}
+
+/* DIRECTORIES
+ * Every directory is a B+ tree keyed by nameHash(). Leaves hold up to
+ * DIR_LEAF_MAX_ENTRIES (inode, name) entries sorted by hash and are chained
+ * in hash order, so a listing is a walk along the leaves. Index blocks hold
+ * up to DIR_INDEX_MAX_ENTRIES (lowest hash, child) pairs, child i covers the
+ * hashes from its own lowest hash up to the next entry's. A lookup reads one
+ * block per level, a directory of 100k files is an index of two levels over
+ * its leaves. All entries with the same hash always sit in one leaf, splits
+ * only happen at hash boundaries. Empty directories have no blocks, the tree
+ * root lives in the directory inode's data block pointer and the number of
+ * entries in its file size. Blocks are never merged when entries go away. */
+
+uint32_t nameHash(char *name) {
+    /* FNV-1a with a final avalanche so similar names spread over the tree */
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < MAX_FILE_NAME_SIZE && name[i] != '\0'; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/* NAME CACHE
+ * Every (parent directory, name) -> inode pair on the mounted disk. It is
+ * filled by tfs_mount from the unmount checkpoint, or from a full scan after
+ * an unclean shutdown, and dirInsert and dirRemove keep it in step with the
+ * directory trees. Since it is complete, dirLookup answers from memory and a
+ * miss means the name does not exist. Each inode but the root is in it once,
+ * which makes it the list of where all the inodes are as well. */
+typedef struct nameCacheEntry {
+    tfsBlock parentInode;
+    tfsBlock inode;
+    char name[MAX_FILE_NAME_SIZE];
+    struct nameCacheEntry *next; // next entry in the same bucket
+} nameCacheEntry;
+
+nameCacheEntry **nameCache = NULL; // hash buckets, NULL while no disk is mounted
+#define NAME_CACHE_MAX_INITIAL_BUCKETS (1 << 22) // a scan of a large disk only guesses the count, past this the table grows as it fills
+
+int nameCacheBuckets = 0; // always a power of two
+int nameCacheCount = 0;
+
+tfsBlock dedupIndexInode = 0; // the dedup hash index is a directory outside the namespace, the name cache leaves it out
+
+uint32_t nameCacheSlot(tfsBlock parentInode, char *name, int buckets) {
+    return (nameHash(name) ^ ((uint32_t)parentInode * 0x9E3779B1u)) & (uint32_t)(buckets - 1);
+}
+
+int nameCacheInit(int64_t expected) {
+    nameCacheBuckets = 64;
+    while (nameCacheBuckets < expected && nameCacheBuckets < NAME_CACHE_MAX_INITIAL_BUCKETS) {
+        nameCacheBuckets *= 2;
+    }
+    nameCacheCount = 0;
+    nameCache = (nameCacheEntry **)calloc(nameCacheBuckets, sizeof(nameCacheEntry *));
+    return nameCache == NULL ? EMOUNTFS : 1;
+}
+
+nameCacheEntry *nameCacheSpare = NULL; // removed entries, reused by nameCacheAdd
+
+void nameCacheFree(void) {
+    for (int i = 0; i < nameCacheBuckets && nameCache != NULL; i++) {
+        while (nameCache[i] != NULL) {
+            nameCacheEntry *next = nameCache[i]->next;
+            free(nameCache[i]);
+            nameCache[i] = next;
+        }
+    }
+    while (nameCacheSpare != NULL) {
+        nameCacheEntry *next = nameCacheSpare->next;
+        free(nameCacheSpare);
+        nameCacheSpare = next;
+    }
+    free(nameCache);
+    nameCache = NULL;
+    nameCacheBuckets = 0;
+    nameCacheCount = 0;
+}
+
+int nameCacheAdd(tfsBlock parentInode, char *name, tfsBlock inode) {
+    if (nameCacheCount >= nameCacheBuckets) {
+        // keep chains short, double the buckets and move every entry over
+        int buckets = nameCacheBuckets * 2;
+        nameCacheEntry **grown = (nameCacheEntry **)calloc(buckets, sizeof(nameCacheEntry *));
+        if (grown != NULL) {
+            for (int i = 0; i < nameCacheBuckets; i++) {
+                while (nameCache[i] != NULL) {
+                    nameCacheEntry *entry = nameCache[i];
+                    nameCache[i] = entry->next;
+                    uint32_t slot = nameCacheSlot(entry->parentInode, entry->name, buckets);
+                    entry->next = grown[slot];
+                    grown[slot] = entry;
+                }
+            }
+            free(nameCache);
+            nameCache = grown;
+            nameCacheBuckets = buckets;
+        }
+    }
+    nameCacheEntry *entry = nameCacheSpare;
+    if (entry != NULL) {
+        nameCacheSpare = entry->next;
+    } else {
+        entry = (nameCacheEntry *)malloc(sizeof(nameCacheEntry));
+    }
+    if (entry == NULL) {
+        printf("LIBTINYFS: Error: Could not allocate memory for name cache. (nameCacheAdd)\n");
+        return EDIR; // error
+    }
+    entry->parentInode = parentInode;
+    entry->inode = inode;
+    memset(entry->name, 0, MAX_FILE_NAME_SIZE);
+    strncpy(entry->name, name, MAX_FILE_NAME_SIZE - 1);
+    uint32_t slot = nameCacheSlot(parentInode, name, nameCacheBuckets);
+    entry->next = nameCache[slot];
+    nameCache[slot] = entry;
+    nameCacheCount++;
+    return 1; // success
+}
+
+nameCacheEntry **nameCacheFind(tfsBlock parentInode, char *name) {
+    /* returns the link pointing at the entry, or at the NULL ending its bucket */
+    nameCacheEntry **link = &nameCache[nameCacheSlot(parentInode, name, nameCacheBuckets)];
+    while (*link != NULL && ((*link)->parentInode != parentInode ||
+        strncmp((*link)->name, name, MAX_FILE_NAME_SIZE) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+void nameCacheRemove(tfsBlock parentInode, char *name) {
+    nameCacheEntry **link = nameCacheFind(parentInode, name);
+    if (*link != NULL) {
+        nameCacheEntry *entry = *link;
+        *link = entry->next;
+        entry->next = nameCacheSpare;
+        nameCacheSpare = entry;
+        nameCacheCount--;
+    }
+}
+
+uint32_t leafEntryHash(char *leafData, int i) {
+    return nameHash(leafData + DIR_ENTRIES_OFFSET + i * DIR_ENTRY_SIZE + DIR_ENTRY_NAME_OFFSET);
+}
+
+void initDirBlock(char *data, int type, int level) {
+    memset(data, 0, BLOCKSIZE);
+    data[BLOCK_NUMBER_OFFSET] = type;
+    data[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+    data[DIR_LEVEL_OFFSET] = level;
+    data[DIR_COUNT_OFFSET] = 0;
+}
+
+int indexFindChild(char *indexData, uint32_t hash) {
+    /* binary search for the last index entry whose lowest hash is <= hash */
+    int count = (unsigned char)indexData[DIR_COUNT_OFFSET];
+    int low = 0;
+    int high = count - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        uint32_t midHash;
+        memcpy(&midHash, indexData + DIR_ENTRIES_OFFSET + mid * DIR_INDEX_ENTRY_SIZE, sizeof(uint32_t));
+        if (midHash <= hash) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+tfsBlock dirFindLeaf(tfsBlock dirInode, uint32_t hash, tfsBlock *path, int *depth, char *leafData) {
+    /* walks from the root of a directory down to the leaf that covers 'hash'.
+    Returns the leaf block number and leaves it in 'leafData', 0 if the
+    directory has no blocks. The index blocks passed on the way are recorded in
+    'path' (root first) when it is not NULL. */
+    char inodeData[BLOCKSIZE]; // on the stack, tfs_readdirplus must not allocate
+    if (cachedReadBlock(dirInode, inodeData) < 0) {
+        printf("LIBTINYFS: Error: Issue with directory inode read. (dirFindLeaf)\n");
+        return EFREAD; // error
+    }
+    tfsBlock block;
+    memcpy(&block, inodeData + INODE_DATA_BLOCK_OFFSET, sizeof(tfsBlock));
+    if (depth != NULL) {
+        *depth = 0;
+    }
+    while (block != 0) {
+        if (cachedReadBlock(block, leafData) < 0) {
+            printf("LIBTINYFS: Error: Issue with directory block read. (dirFindLeaf)\n");
+            return EFREAD; // error
+        }
+        if (leafData[BLOCK_NUMBER_OFFSET] == DIR_LEAF_BLOCK_TYPE) {
+            return block;
+        }
+        if (leafData[BLOCK_NUMBER_OFFSET] != DIR_INDEX_BLOCK_TYPE || (depth != NULL && *depth >= DIR_MAX_DEPTH)) {
+            printf("LIBTINYFS: Error: Corrupt directory tree at block %lld. (dirFindLeaf)\n", (long long)block);
+            return EDIR; // error
+        }
+        if (path != NULL) {
+            path[(*depth)++] = block;
+        }
+        int child = indexFindChild(leafData, hash);
+        memcpy(&block, leafData + DIR_ENTRIES_OFFSET + child * DIR_INDEX_ENTRY_SIZE + sizeof(uint32_t), sizeof(tfsBlock));
+    }
+    return 0;
+}
+
+int leafFindEntry(char *leafData, char *name) {
+    /* returns the slot holding 'name' in a leaf, -1 if it is not there */
+    int count = (unsigned char)leafData[DIR_COUNT_OFFSET];
+    for (int i = 0; i < count; i++) {
+        char *entry = leafData + DIR_ENTRIES_OFFSET + i * DIR_ENTRY_SIZE;
+        if (strncmp(entry + DIR_ENTRY_NAME_OFFSET, name, MAX_FILE_NAME_SIZE) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+tfsBlock dirLookup(tfsBlock dirInode, char *name) {
+    /* returns the inode of 'name' in a directory, 0 if there is no such entry */
+    if (nameCache != NULL && dirInode != dedupIndexInode) {
+        nameCacheEntry *entry = *nameCacheFind(dirInode, name);
+        return entry == NULL ? 0 : entry->inode;
+    }
+    char *leafData = scratchBlock();
+    tfsBlock leaf = dirFindLeaf(dirInode, nameHash(name), NULL, NULL, leafData);
+    if (leaf <= 0) {
+        scratchFree(leafData);
+        return leaf; // error, or an empty directory
+    }
+    int slot = leafFindEntry(leafData, name);
+    tfsBlock inode = 0;
+    if (slot >= 0) {
+        memcpy(&inode, leafData + DIR_ENTRIES_OFFSET + slot * DIR_ENTRY_SIZE, sizeof(tfsBlock));
+    }
+    scratchFree(leafData);
+    return inode;
+}
+
+int setDirRoot(tfsBlock dirInode, tfsBlock root, int entryDelta) {
+    /* stores a new tree root (a negative 'root' keeps the current one) and
+    adjusts the entry count of a directory inode */
+    char *inodeData = scratchBlock();
+    if (cachedReadBlock(dirInode, inodeData) < 0) {
+        scratchFree(inodeData);
+        printf("LIBTINYFS: Error: Issue with directory inode read. (setDirRoot)\n");
+        return EFREAD; // error
+    }
+    int64_t entries;
+    memcpy(&entries, inodeData + INODE_FILE_SIZE_OFFSET, sizeof(int64_t));
+    entries += entryDelta;
+    memcpy(inodeData + INODE_FILE_SIZE_OFFSET, &entries, sizeof(int64_t));
+    if (root >= 0) {
+        memcpy(inodeData + INODE_DATA_BLOCK_OFFSET, &root, sizeof(tfsBlock));
+    }
+    setTimestamp(inodeData, INODE_MOD_TIME_STAMP_OFFSET, getTimestamp());
+    int success = cachedWriteBlock(dirInode, inodeData);
+    scratchFree(inodeData);
+    if (success < 0) {
+        printf("LIBTINYFS: Error: Issue with directory inode write. (setDirRoot)\n");
+        return EFWRITE; // error
+    }
+    return 1; // success
+}
+
+int splitPoint(uint32_t *hashes, int count) {
+    /* picks where to split 'count' sorted hashes, as close to the middle as
+    possible without separating equal hashes. Returns 0 if they are all equal. */
+    for (int offset = 0; offset < count / 2; offset++) {
+        int up = count / 2 + offset;
+        int down = count / 2 - offset;
+        if (up < count && hashes[up] != hashes[up - 1]) {
+            return up;
+        }
+        if (down > 0 && hashes[down] != hashes[down - 1]) {
+            return down;
+        }
+    }
+    return 0;
+}
+
+int dirTreeInsert(tfsBlock dirInode, char *name, tfsBlock inode) {
+    /* adds (name, inode) to the tree of a directory that does not hold 'name' yet */
+    uint32_t hash = nameHash(name);
+    tfsBlock path[DIR_MAX_DEPTH];
+    int depth = 0;
+    char *leafData = scratchBlock();
+    tfsBlock leaf = dirFindLeaf(dirInode, hash, path, &depth, leafData);
+    if (leaf < 0) {
+        scratchFree(leafData);
+        return (int)leaf; // error
+    }
+    if (leaf == 0) {
+        // first entry of an empty directory, it gets a single leaf as its root
+        leaf = allocateBlock();
+        if (leaf < 0) {
+            scratchFree(leafData);
+            return (int)leaf; // error
+        }
+        initDirBlock(leafData, DIR_LEAF_BLOCK_TYPE, 0);
+        if (setDirRoot(dirInode, leaf, 0) < 0) {
+            scratchFree(leafData);
+            return EDIR; // error
+        }
+    }
+
+    // gather the leaf entries plus the new one, in hash order
+    char entries[(DIR_LEAF_MAX_ENTRIES + 1) * DIR_ENTRY_SIZE];
+    uint32_t hashes[DIR_LEAF_MAX_ENTRIES + 1];
+    int count = (unsigned char)leafData[DIR_COUNT_OFFSET];
+    int position = 0;
+    while (position < count && leafEntryHash(leafData, position) <= hash) {
+        position++;
+    }
+    for (int i = 0; i < count; i++) {
+        int to = i < position ? i : i + 1;
+        memcpy(entries + to * DIR_ENTRY_SIZE, leafData + DIR_ENTRIES_OFFSET + i * DIR_ENTRY_SIZE, DIR_ENTRY_SIZE);
+        hashes[to] = leafEntryHash(leafData, i);
+    }
+    char *newEntry = entries + position * DIR_ENTRY_SIZE;
+    memset(newEntry, 0, DIR_ENTRY_SIZE);
+    memcpy(newEntry, &inode, sizeof(tfsBlock));
+    strncpy(newEntry + DIR_ENTRY_NAME_OFFSET, name, MAX_FILE_NAME_SIZE - 1);
+    hashes[position] = hash;
+    count++;
+
+    if (count <= DIR_LEAF_MAX_ENTRIES) {
+        // fits, rewrite the leaf in place
+        memcpy(leafData + DIR_ENTRIES_OFFSET, entries, count * DIR_ENTRY_SIZE);
+        leafData[DIR_COUNT_OFFSET] = count;
+        int success = cachedWriteBlock(leaf, leafData);
+        scratchFree(leafData);
+        if (success < 0) {
+            printf("LIBTINYFS: Error: Issue with directory leaf write. (dirTreeInsert)\n");
+            return EFWRITE; // error
+        }
+        return setDirRoot(dirInode, -1, 1) < 0 ? EDIR : 1;
+    }
+
+    // the leaf is full, split it in two at a hash boundary
+    int split = splitPoint(hashes, count);
+    if (split == 0) {
+        scratchFree(leafData);
+        printf("LIBTINYFS: Error: Too many names with the same hash. (dirTreeInsert)\n");
+        return EDIR; // error
+    }
+    // take every block the split needs before writing anything, so running out
+    // of space leaves the tree as it was: the new leaf, one for each full index
+    // block above it, and a new root when the split reaches the top
+    int needed = 1;
+    char *newLeafData = scratchBlock();
+    while (needed <= depth) {
+        if (cachedReadBlock(path[depth - needed], newLeafData) < 0) {
+            scratchFree(leafData);
+            scratchFree(newLeafData);
+            printf("LIBTINYFS: Error: Issue with directory index read. (dirTreeInsert)\n");
+            return EFREAD; // error
+        }
+        if ((unsigned char)newLeafData[DIR_COUNT_OFFSET] < DIR_INDEX_MAX_ENTRIES) {
+            break;
+        }
+        needed++;
+    }
+    if (needed > depth) {
+        needed++;
+    }
+    tfsBlock spare[DIR_MAX_DEPTH + 2];
+    for (int i = 0; i < needed; i++) {
+        spare[i] = allocateBlock();
+        if (spare[i] < 0) {
+            int error = (int)spare[i];
+            while (i-- > 0) {
+                deallocateBlock(spare[i]);
+            }
+            scratchFree(leafData);
+            scratchFree(newLeafData);
+            return error; // error
+        }
+    }
+    int spareUsed = 0;
+    tfsBlock newLeaf = spare[spareUsed++];
+    initDirBlock(newLeafData, DIR_LEAF_BLOCK_TYPE, 0);
+    memcpy(newLeafData + DIR_NEXT_BLOCK_OFFSET, leafData + DIR_NEXT_BLOCK_OFFSET, sizeof(tfsBlock));
+    memcpy(newLeafData + DIR_ENTRIES_OFFSET, entries + split * DIR_ENTRY_SIZE, (count - split) * DIR_ENTRY_SIZE);
+    newLeafData[DIR_COUNT_OFFSET] = count - split;
+    memset(leafData + DIR_ENTRIES_OFFSET, 0, BLOCKSIZE - DIR_ENTRIES_OFFSET);
+    memcpy(leafData + DIR_ENTRIES_OFFSET, entries, split * DIR_ENTRY_SIZE);
+    leafData[DIR_COUNT_OFFSET] = split;
+    memcpy(leafData + DIR_NEXT_BLOCK_OFFSET, &newLeaf, sizeof(tfsBlock)); // keep the leaves in hash order
+    if (cachedWriteBlock(newLeaf, newLeafData) < 0 || cachedWriteBlock(leaf, leafData) < 0) {
+        scratchFree(leafData);
+        scratchFree(newLeafData);
+        printf("LIBTINYFS: Error: Issue with directory leaf write. (dirTreeInsert)\n");
+        return EFWRITE; // error
+    }
+    scratchFree(newLeafData);
+
+    // hand (split hash, new block) up the tree, splitting full index blocks on the way
+    uint32_t splitHash = hashes[split];
+    tfsBlock newChild = newLeaf;
+    tfsBlock oldChild = leaf;
+    int level = 0;
+    char *indexData = leafData; // reuse the buffer for the index blocks
+    char indexEntries[(DIR_INDEX_MAX_ENTRIES + 1) * DIR_INDEX_ENTRY_SIZE];
+    while (1) {
+        level++;
+        if (depth == 0) {
+            // the root was split, grow the tree by one level
+            tfsBlock newRoot = spare[spareUsed++];
+            initDirBlock(indexData, DIR_INDEX_BLOCK_TYPE, level);
+            uint32_t zero = 0;
+            memcpy(indexData + DIR_ENTRIES_OFFSET, &zero, sizeof(uint32_t));
+            memcpy(indexData + DIR_ENTRIES_OFFSET + sizeof(uint32_t), &oldChild, sizeof(tfsBlock));
+            memcpy(indexData + DIR_ENTRIES_OFFSET + DIR_INDEX_ENTRY_SIZE, &splitHash, sizeof(uint32_t));
+            memcpy(indexData + DIR_ENTRIES_OFFSET + DIR_INDEX_ENTRY_SIZE + sizeof(uint32_t), &newChild, sizeof(tfsBlock));
+            indexData[DIR_COUNT_OFFSET] = 2;
+            int success = cachedWriteBlock(newRoot, indexData);
+            scratchFree(indexData);
+            if (success < 0) {
+                printf("LIBTINYFS: Error: Issue with directory index write. (dirTreeInsert)\n");
+                return EFWRITE; // error
+            }
+            return setDirRoot(dirInode, newRoot, 1) < 0 ? EDIR : 1;
+        }
+        tfsBlock indexBlock = path[--depth];
+        if (cachedReadBlock(indexBlock, indexData) < 0) {
+            scratchFree(indexData);
+            printf("LIBTINYFS: Error: Issue with directory index read. (dirTreeInsert)\n");
+            return EFREAD; // error
+        }
+        int indexCount = (unsigned char)indexData[DIR_COUNT_OFFSET];
+        int at = indexFindChild(indexData, splitHash) + 1;
+        memcpy(indexEntries, indexData + DIR_ENTRIES_OFFSET, at * DIR_INDEX_ENTRY_SIZE);
+        memcpy(indexEntries + at * DIR_INDEX_ENTRY_SIZE, &splitHash, sizeof(uint32_t));
+        memcpy(indexEntries + at * DIR_INDEX_ENTRY_SIZE + sizeof(uint32_t), &newChild, sizeof(tfsBlock));
+        memcpy(indexEntries + (at + 1) * DIR_INDEX_ENTRY_SIZE, indexData + DIR_ENTRIES_OFFSET + at * DIR_INDEX_ENTRY_SIZE,
+            (indexCount - at) * DIR_INDEX_ENTRY_SIZE);
+        indexCount++;
+        if (indexCount <= DIR_INDEX_MAX_ENTRIES) {
+            memcpy(indexData + DIR_ENTRIES_OFFSET, indexEntries, indexCount * DIR_INDEX_ENTRY_SIZE);
+            indexData[DIR_COUNT_OFFSET] = indexCount;
+            int success = cachedWriteBlock(indexBlock, indexData);
+            scratchFree(indexData);
+            if (success < 0) {
+                printf("LIBTINYFS: Error: Issue with directory index write. (dirTreeInsert)\n");
+                return EFWRITE; // error
+            }
+            return setDirRoot(dirInode, -1, 1) < 0 ? EDIR : 1;
+        }
+        // the index block is full as well, split it down the middle
+        tfsBlock newIndex = spare[spareUsed++];
+        int half = indexCount / 2;
+        char *newIndexData = scratchBlock();
+        initDirBlock(newIndexData, DIR_INDEX_BLOCK_TYPE, level);
+        memcpy(newIndexData + DIR_ENTRIES_OFFSET, indexEntries + half * DIR_INDEX_ENTRY_SIZE, (indexCount - half) * DIR_INDEX_ENTRY_SIZE);
+        newIndexData[DIR_COUNT_OFFSET] = indexCount - half;
+        memset(indexData + DIR_ENTRIES_OFFSET, 0, BLOCKSIZE - DIR_ENTRIES_OFFSET);
+        memcpy(indexData + DIR_ENTRIES_OFFSET, indexEntries, half * DIR_INDEX_ENTRY_SIZE);
+        indexData[DIR_COUNT_OFFSET] = half;
+        if (cachedWriteBlock(newIndex, newIndexData) < 0 || cachedWriteBlock(indexBlock, indexData) < 0) {
+            scratchFree(indexData);
+            scratchFree(newIndexData);
+            printf("LIBTINYFS: Error: Issue with directory index write. (dirTreeInsert)\n");
+            return EFWRITE; // error
+        }
+        scratchFree(newIndexData);
+        memcpy(&splitHash, indexEntries + half * DIR_INDEX_ENTRY_SIZE, sizeof(uint32_t));
+        newChild = newIndex;
+        oldChild = indexBlock;
+    }
+}
+
+int dirTreeRemove(tfsBlock dirInode, char *name) {
+    /* removes 'name' from the tree of a directory */
+    char *leafData = scratchBlock();
+    tfsBlock leaf = dirFindLeaf(dirInode, nameHash(name), NULL, NULL, leafData);
+    int slot = leaf > 0 ? leafFindEntry(leafData, name) : -1;
+    if (slot < 0) {
+        scratchFree(leafData);
+        printf("LIBTINYFS: Error: %s is not in the directory. (dirTreeRemove)\n", name);
+        return EDIR; // error
+    }
+    int count = (unsigned char)leafData[DIR_COUNT_OFFSET];
+    char *entry = leafData + DIR_ENTRIES_OFFSET + slot * DIR_ENTRY_SIZE;
+    memmove(entry, entry + DIR_ENTRY_SIZE, (count - slot - 1) * DIR_ENTRY_SIZE);
+    memset(leafData + DIR_ENTRIES_OFFSET + (count - 1) * DIR_ENTRY_SIZE, 0, DIR_ENTRY_SIZE);
+    leafData[DIR_COUNT_OFFSET] = count - 1;
+    int success = cachedWriteBlock(leaf, leafData);
+    scratchFree(leafData);
+    if (success < 0) {
+        printf("LIBTINYFS: Error: Issue with directory leaf write. (dirTreeRemove)\n");
+        return EFWRITE; // error
+    }
+    return setDirRoot(dirInode, -1, -1) < 0 ? EDIR : 1;
+}
+
+int dirInsert(tfsBlock dirInode, char *name, tfsBlock inode) {
+    /* adds (name, inode) to a directory that does not hold 'name' yet */
+    int success = dirTreeInsert(dirInode, name, inode);
+    if (success > 0 && nameCache != NULL && dirInode != dedupIndexInode) {
+        success = nameCacheAdd(dirInode, name, inode);
+    }
+    return success;
+}
+
+int dirRemove(tfsBlock dirInode, char *name) {
+    /* removes 'name' from a directory */
+    int success = dirTreeRemove(dirInode, name);
+    if (success > 0 && nameCache != NULL && dirInode != dedupIndexInode) {
+        nameCacheRemove(dirInode, name);
+    }
+    return success;
+}
+
+int dirFreeTree(tfsBlock block) {
+    /* gives every block of a directory tree back to the free list */
+    if (block == 0) {
+        return 1;
+    }
+    char *data = scratchBlock();
+    if (cachedReadBlock(block, data) < 0) {
+        scratchFree(data);
+        printf("LIBTINYFS: Error: Issue with directory block read. (dirFreeTree)\n");
+        return EFREAD; // error
+    }
+    if (data[BLOCK_NUMBER_OFFSET] == DIR_INDEX_BLOCK_TYPE) {
+        int count = (unsigned char)data[DIR_COUNT_OFFSET];
+        for (int i = 0; i < count; i++) {
+            tfsBlock child;
+            memcpy(&child, data + DIR_ENTRIES_OFFSET + i * DIR_INDEX_ENTRY_SIZE + sizeof(uint32_t), sizeof(tfsBlock));
+            if (dirFreeTree(child) < 0) {
+                scratchFree(data);
+                return EDEALLOC; // error
+            }
+        }
+    }
+    scratchFree(data);
+    return deallocateBlock(block);
+}
+
+tfsBlock dirFirstLeaf(tfsBlock dirInode, char *leafData) {
+    /* returns the leaf holding the lowest hashes of a directory, 0 if it is empty */
+    return dirFindLeaf(dirInode, 0, NULL, NULL, leafData);
+}
+
+int resolvePath(char *path, tfsBlock *parentInode, char *leafName) {
+    /* Splits 'path' into the directory holding its last component and that
+    component. Every directory on the way is looked up through its index. A
+    path without a leading slash starts at the root directory as well. */
+    char *superData = scratchBlock();
+    if (cachedReadBlock(SUPER_BLOCK, superData) < 0) {
+        scratchFree(superData);
+        printf("LIBTINYFS: Error: Issue with super block read. (resolvePath)\n");
+        return EFREAD; // error
+    }
+    tfsBlock directory;
+    memcpy(&directory, superData + ROOT_DIR_OFFSET, sizeof(tfsBlock));
+    scratchFree(superData);
+
+    char *inodeData = scratchBlock();
+    char *component = path;
+    while (*component == PATH_SEPARATOR) {
+        component++;
+    }
+    while (1) {
+        char *end = strchr(component, PATH_SEPARATOR);
+        int length = end == NULL ? (int)strlen(component) : (int)(end - component);
+        if (length == 0 || length >= MAX_FILE_NAME_SIZE) {
+            scratchFree(inodeData);
+            printf("LIBTINYFS: Error: Bad path component in %s. (resolvePath)\n", path);
+            return EDIR; // error
+        }
+        memset(leafName, 0, MAX_FILE_NAME_SIZE);
+        memcpy(leafName, component, length);
+        if (end == NULL) {
+            break; // last component
+        }
+        tfsBlock next = dirLookup(directory, leafName);
+        if (next <= 0 || cachedReadBlock(next, inodeData) < 0 ||
+            !(inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_DIRECTORY)) {
+            scratchFree(inodeData);
+            printf("LIBTINYFS: Error: %s is not a directory in %s. (resolvePath)\n", leafName, path);
+            return EDIR; // error
+        }
+        directory = next;
+        component = end + 1;
+    }
+    scratchFree(inodeData);
+    *parentInode = directory;
+    return 1; // success
+}
+
+tfsBlock createInode(tfsBlock parentInode, char *name, int flags) {
+    /* allocates an inode for a new, empty file or directory and enters it in its
+    parent directory. Returns the inode block number. */
+    allocHint(parentInode, 1);
+    tfsBlock newInode = allocateBlock();
+    if (newInode < 0) {
+        return newInode; // error
+    }
+    char *inodeData = scratchBlock();
+    memset(inodeData, 0, BLOCKSIZE);
+    inodeData[BLOCK_NUMBER_OFFSET] = INODE_BLOCK_TYPE; // block type -> inode block
+    inodeData[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+    memcpy(inodeData + INODE_PARENT_OFFSET, &parentInode, sizeof(tfsBlock));
+    // file size and data block pointer stay 0
+    strncpy(inodeData + INODE_FILE_NAME_OFFSET, name, MAX_FILE_NAME_SIZE - 1);
+    uint64_t now = getTimestamp();
+    setTimestamp(inodeData, INODE_CR8_TIME_STAMP_OFFSET, now);
+    setTimestamp(inodeData, INODE_MOD_TIME_STAMP_OFFSET, now);
+    setTimestamp(inodeData, INODE_ACC_TIME_STAMP_OFFSET, now);
+    inodeData[INODE_FLAGS_OFFSET] = flags;
+    int success = cachedWriteBlock(newInode, inodeData);
+    scratchFree(inodeData);
+    if (success < 0) {
+        deallocateBlock(newInode);
+        printf("LIBTINYFS: Error: Issue with inode block write. (createInode)\n");
+        return EFWRITE; // error
+    }
+    success = dirInsert(parentInode, name, newInode);
+    if (success < 0) {
+        deallocateBlock(newInode);
+        return success; // error
+    }
+    return newInode;
+}
+
+/* DEDUPLICATED FILES
+ * A file with INODE_FLAG_DEDUP that does not fit in its inode keeps its
+ * content in shared blocks of USEABLE_DATA_SIZE bytes, each counting the
+ * block map entries that point at it. A shared block can not hold the next
+ * pointer of every file it is in, so the inode's data block pointer is the
+ * head of a chain of block maps listing the file's shared blocks in order.
+ * The dedup hash index is a directory that is not in the namespace, its
+ * entries are named after the content hash of a shared block and point at
+ * that block, so it is a persistent hashed B+ tree with no code of its own.
+ * An index hit is compared byte for byte before the block is shared, a hash
+ * collision only means the new block is not indexed. A block leaves the
+ * index when the last file using it lets go. */
+uint64_t contentHash(char *data, int length) {
+    /* a fast 64 bit hash taking 8 bytes per step, with the final avalanche of MurmurHash3 */
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ (uint64_t)length;
+    int i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(uint64_t));
+        word *= 0x87C37B91114253D5ull;
+        word = (word << 31) | (word >> 33);
+        hash ^= word * 0x4CF5AD432745937Full;
+        hash = ((hash << 27) | (hash >> 37)) * 5 + 0x52DCE729;
+    }
+    for (; i < length; i++) {
+        hash ^= (unsigned char)data[i] * 0x9E3779B97F4A7C15ull;
+        hash = ((hash << 11) | (hash >> 53)) * 0x87C37B91114253D5ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+void dedupKey(char *blockData, char *key) {
+    /* names a shared block in the index, 6 bits of its content hash per character */
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+-";
+    uint64_t hash = contentHash(blockData + DATA_BLOCK_DATA_OFFSET, USEABLE_DATA_SIZE);
+    memset(key, 0, MAX_FILE_NAME_SIZE);
+    for (int i = 0; i < DEDUP_KEY_LENGTH; i++) {
+        key[i] = digits[hash & 63];
+        hash >>= 6;
+    }
+}
+
+tfsBlock dedupIndex(void) {
+    /* returns the inode of the dedup hash index, creating it on first use */
+    if (dedupIndexInode != 0) {
+        return dedupIndexInode;
+    }
+    tfsBlock inode = allocateBlock();
+    if (inode < 0) {
+        return inode; // error
+    }
+    char data[BLOCKSIZE];
+    memset(data, 0, BLOCKSIZE);
+    data[BLOCK_NUMBER_OFFSET] = INODE_BLOCK_TYPE;
+    data[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+    data[INODE_FLAGS_OFFSET] = INODE_FLAG_DIRECTORY; // no parent and no name, nothing can look it up
+    uint64_t now = getTimestamp();
+    setTimestamp(data, INODE_CR8_TIME_STAMP_OFFSET, now);
+    setTimestamp(data, INODE_MOD_TIME_STAMP_OFFSET, now);
+    setTimestamp(data, INODE_ACC_TIME_STAMP_OFFSET, now);
+    if (cachedWriteBlock(inode, data) < 0) {
+        deallocateBlock(inode);
+        printf("LIBTINYFS: Error: Issue with inode block write. (dedupIndex)\n");
+        return EFWRITE; // error
+    }
+    if (cachedReadBlock(SUPER_BLOCK, data) < 0) {
+        deallocateBlock(inode);
+        printf("LIBTINYFS: Error: Issue with super block read. (dedupIndex)\n");
+        return EFREAD; // error
+    }
+    memcpy(data + SUPER_DEDUP_INDEX_OFFSET, &inode, sizeof(tfsBlock));
+    if (writeSuperBlock(data) < 0) {
+        deallocateBlock(inode);
+        printf("LIBTINYFS: Error: Issue with super block write. (dedupIndex)\n");
+        return EFWRITE; // error
+    }
+    dedupIndexInode = inode;
+    return inode;
+}
+
+tfsBlock shareBlock(tfsBlock index, char *data, int length) {
+    /* Stores 'length' bytes as a shared block and returns its number. A block
+    in the index with the same bytes gets one more reference instead. */
+    char blockData[BLOCKSIZE];
+    memset(blockData, 0, BLOCKSIZE);
+    blockData[BLOCK_NUMBER_OFFSET] = SHARED_BLOCK_TYPE;
+    blockData[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+    memcpy(blockData + DATA_BLOCK_DATA_OFFSET, data, length);
+    char key[MAX_FILE_NAME_SIZE];
+    dedupKey(blockData, key);
+    tfsBlock candidate = dirLookup(index, key);
+    if (candidate < 0) {
+        return candidate; // error
+    }
+    uint32_t references;
+    if (candidate > 0) {
+        char candidateData[BLOCKSIZE];
+        if (cachedReadBlock(candidate, candidateData) < 0) {
+            printf("LIBTINYFS: Error: Issue with shared block read. (shareBlock)\n");
+            return EFREAD; // error
+        }
+        if (candidateData[BLOCK_NUMBER_OFFSET] == SHARED_BLOCK_TYPE &&
+            memcmp(candidateData + DATA_BLOCK_DATA_OFFSET, blockData + DATA_BLOCK_DATA_OFFSET, USEABLE_DATA_SIZE) == 0) {
+            memcpy(&references, candidateData + SHARED_REFCOUNT_OFFSET, sizeof(uint32_t));
+            references++;
+            memcpy(candidateData + SHARED_REFCOUNT_OFFSET, &references, sizeof(uint32_t));
+            if (cachedWriteBlock(candidate, candidateData) < 0) {
+                printf("LIBTINYFS: Error: Issue with shared block write. (shareBlock)\n");
+                return EFWRITE; // error
+            }
+            return candidate;
+        }
+    }
+    tfsBlock block = allocateBlock();
+    if (block < 0) {
+        return block; // error
+    }
+    references = 1;
+    memcpy(blockData + SHARED_REFCOUNT_OFFSET, &references, sizeof(uint32_t));
+    if (cachedWriteBlock(block, blockData) < 0) {
+        deallocateBlock(block);
+        printf("LIBTINYFS: Error: Issue with shared block write. (shareBlock)\n");
+        return EFWRITE; // error
+    }
+    // after a collision the indexed block stays, and if the index is full this one is just not shared
+    if (candidate == 0) {
+        dirInsert(index, key, block);
+    }
+    return block;
+}
+
+int releaseSharedBlock(tfsBlock block) {
+    /* drops one reference to a shared block, the last one frees it and takes it out of the index */
+    char blockData[BLOCKSIZE];
+    if (cachedReadBlock(block, blockData) < 0 || blockData[BLOCK_NUMBER_OFFSET] != SHARED_BLOCK_TYPE) {
+        printf("LIBTINYFS: Error: Block map points at something other than a shared block. (releaseSharedBlock)\n");
+        return EDEALLOC; // error
+    }
+    uint32_t references;
+    memcpy(&references, blockData + SHARED_REFCOUNT_OFFSET, sizeof(uint32_t));
+    if (references > 1) {
+        references--;
+        memcpy(blockData + SHARED_REFCOUNT_OFFSET, &references, sizeof(uint32_t));
+        return cachedWriteBlock(block, blockData) < 0 ? EDEALLOC : 1;
+    }
+    char key[MAX_FILE_NAME_SIZE];
+    dedupKey(blockData, key);
+    if (dedupIndexInode != 0 && dirLookup(dedupIndexInode, key) == block &&
+        dirRemove(dedupIndexInode, key) < 0) {
+        return EDEALLOC; // error
+    }
+    return deallocateBlock(block);
+}
+
+int releaseChain(tfsBlock head, int blockMap) {
+    /* Frees a file's data block chain, or its block map if 'blockMap' is set.
+    A block map may be shared from any block on, so the walk stops at the
+    first one that another file still points at once this pointer is gone.
+    Every map block that is freed drops a reference to each shared block it
+    lists. */
+    char blockData[BLOCKSIZE];
+    tfsBlock block = head;
+    while (block != 0) {
+        if (cachedReadBlock(block, blockData) < 0) {
+            printf("LIBTINYFS: Error: Data block could not be read. (releaseChain)\n");
+            return EFREAD; // error
+        }
+        if (blockMap) {
+            uint32_t references;
+            memcpy(&references, blockData + MAP_REFCOUNT_OFFSET, sizeof(uint32_t));
+            if (references > 1) {
+                references--;
+                memcpy(blockData + MAP_REFCOUNT_OFFSET, &references, sizeof(uint32_t));
+                return cachedWriteBlock(block, blockData) < 0 ? EFWRITE : 1;
+            }
+            int count = (unsigned char)blockData[MAP_COUNT_OFFSET];
+            for (int i = 0; i < count; i++) {
+                tfsBlock shared;
+                memcpy(&shared, blockData + MAP_ENTRIES_OFFSET + i * sizeof(tfsBlock), sizeof(tfsBlock));
+                if (releaseSharedBlock(shared) < 0) {
+                    return EDEALLOC; // error
+                }
+            }
+        }
+        tfsBlock nextBlock;
+        memcpy(&nextBlock, blockData + DATA_NEXT_BLOCK_OFFSET, sizeof(tfsBlock));
+        if (deallocateBlock(block) < 0) {
+            printf("LIBTINYFS: Error: Could not deallocate data block. (releaseChain)\n");
+            return EDEALLOC; // error
+        }
+        block = nextBlock;
+    }
+    return 1; // success
+}
+
+int writeBlockMap(char *buffer, int size, tfsBlock *mapHead) {
+    /* Stores 'size' bytes as shared blocks listed by a new block map and sets
+    'mapHead' to its first block, 0 if nothing was stored. Returns the number of
+    bytes stored, which is less than 'size' once the disk is full. */
+    *mapHead = 0;
+    tfsBlock index = dedupIndex();
+    if (index < 0) {
+        return 0;
+    }
+    char mapData[BLOCKSIZE];
+    tfsBlock mapBlock = 0;
+    int count = 0;
+    int stored = 0;
+    while (stored < size) {
+        int length = size - stored < USEABLE_DATA_SIZE ? size - stored : USEABLE_DATA_SIZE;
+        tfsBlock block = shareBlock(index, buffer + stored, length);
+        if (block < 0) {
+            break;
+        }
+        if (mapBlock == 0 || count == MAP_MAX_ENTRIES) {
+            // this map block is full, link a new one after it before writing it
+            tfsBlock newMap = allocateBlock();
+            if (newMap < 0) {
+                releaseSharedBlock(block);
+                break;
+            }
+            if (mapBlock == 0) {
+                *mapHead = newMap;
+            } else {
+                memcpy(mapData + MAP_NEXT_BLOCK_OFFSET, &newMap, sizeof(tfsBlock));
+                if (cachedWriteBlock(mapBlock, mapData) < 0) {
+                    mapBlock = -1;
+                    break;
+                }
+            }
+            memset(mapData, 0, BLOCKSIZE);
+            mapData[BLOCK_NUMBER_OFFSET] = MAP_BLOCK_TYPE;
+            mapData[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+            uint32_t references = 1;
+            memcpy(mapData + MAP_REFCOUNT_OFFSET, &references, sizeof(uint32_t));
+            mapBlock = newMap;
+            count = 0;
+        }
+        memcpy(mapData + MAP_ENTRIES_OFFSET + count * sizeof(tfsBlock), &block, sizeof(tfsBlock));
+        mapData[MAP_COUNT_OFFSET] = ++count;
+        stored += length;
+    }
+    if (mapBlock < 0 || (mapBlock != 0 && cachedWriteBlock(mapBlock, mapData) < 0)) {
+        // without its map the file can not claim any of the blocks, they leak
+        printf("LIBTINYFS: Error: Issue with block map write. (writeBlockMap)\n");
+        *mapHead = 0;
+        return 0;
+    }
+    return stored;
+}
+
+/* CLONES AND SNAPSHOTS
+ * A clone shares a file's block map instead of copying it: the new inode
+ * points at the same first map block, which gains a reference. Writing to
+ * either file copies the map blocks it goes through up to the one it
+ * changes, from the first one the other file still uses, and every block it
+ * writes becomes a new shared block, so the other file keeps the old bytes.
+ * Files stored as a data block chain are turned into a block map the first
+ * time they are cloned. A snapshot is a directory of clones of everything
+ * on the disk, so it costs an inode per file and directory. */
+int addReference(tfsBlock block, int offset) {
+    /* counts one more pointer to a shared block or block map, 'offset' is where its count is kept */
+    char blockData[BLOCKSIZE];
+    if (cachedReadBlock(block, blockData) < 0) {
+        printf("LIBTINYFS: Error: Issue with block read. (addReference)\n");
+        return EFREAD; // error
+    }
+    uint32_t references;
+    memcpy(&references, blockData + offset, sizeof(uint32_t));
+    references++;
+    memcpy(blockData + offset, &references, sizeof(uint32_t));
+    if (cachedWriteBlock(block, blockData) < 0) {
+        printf("LIBTINYFS: Error: Issue with block write. (addReference)\n");
+        return EFWRITE; // error
+    }
+    return 1; // success
+}
+
+openFileTableEntry *openEntryOf(tfsBlock inode) {
+    /* the open file table entry of an inode, NULL if it is not open */
+    for (int i = 0; i < maxNumberOfFiles; i++) {
+        if (openFileTable[i] != NULL && openFileTable[i]->inodeNumber == inode) {
+            return openFileTable[i];
+        }
+    }
+    return NULL;
+}
+
+int convertToBlockMap(tfsBlock inode, char *inodeData) {
+    /* Turns the data block chain of a file into shared blocks listed by a new
+    block map and sets INODE_FLAG_DEDUP. Shared blocks keep their bytes where
+    data blocks do, so each block only gets a new header and no data moves.
+    The map blocks are all allocated before anything is changed. */
+    tfsBlock head;
+    memcpy(&head, inodeData + INODE_DATA_BLOCK_OFFSET, sizeof(tfsBlock));
+    int count = 0;
+    int capacity = 64;
+    tfsBlock *blocks = (tfsBlock *)scratchAlloc(capacity * sizeof(tfsBlock));
+    char blockData[BLOCKSIZE];
+    for (tfsBlock block = head; block != 0; memcpy(&block, blockData + DATA_NEXT_BLOCK_OFFSET, sizeof(tfsBlock))) {
+        if (cachedReadBlock(block, blockData) < 0) {
+            scratchFree(blocks);
+            printf("LIBTINYFS: Error: Data block could not be read. (convertToBlockMap)\n");
+            return EFREAD; // error
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            blocks = (tfsBlock *)scratchRealloc(blocks, capacity * sizeof(tfsBlock));
+        }
+        blocks[count++] = block;
+    }
+    int mapCount = (count + MAP_MAX_ENTRIES - 1) / MAP_MAX_ENTRIES;
+    tfsBlock *maps = (tfsBlock *)scratchAlloc((mapCount > 0 ? mapCount : 1) * sizeof(tfsBlock));
+    for (int m = 0; m < mapCount; m++) {
+        maps[m] = allocateBlock();
+        if (maps[m] < 0) {
+            int error = (int)maps[m];
+            while (m-- > 0) {
+                deallocateBlock(maps[m]);
+            }
+            scratchFree(blocks);
+            scratchFree(maps);
+            return error; // error
+        }
+    }
+    int success = 1;
+    uint32_t references = 1;
+    for (int m = 0; m < mapCount && success >= 0; m++) {
+        int entries = count - m * MAP_MAX_ENTRIES < MAP_MAX_ENTRIES ? count - m * MAP_MAX_ENTRIES : MAP_MAX_ENTRIES;
+        tfsBlock next = m + 1 < mapCount ? maps[m + 1] : 0;
+        memset(blockData, 0, BLOCKSIZE);
+        blockData[BLOCK_NUMBER_OFFSET] = MAP_BLOCK_TYPE;
+        blockData[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+        memcpy(blockData + MAP_NEXT_BLOCK_OFFSET, &next, sizeof(tfsBlock));
+        blockData[MAP_COUNT_OFFSET] = entries;
+        memcpy(blockData + MAP_REFCOUNT_OFFSET, &references, sizeof(uint32_t));
+        memcpy(blockData + MAP_ENTRIES_OFFSET, blocks + m * MAP_MAX_ENTRIES, entries * sizeof(tfsBlock));
+        success = cachedWriteBlock(maps[m], blockData);
+    }
+    for (int i = 0; i < count && success >= 0; i++) {
+        success = cachedReadBlock(blocks[i], blockData);
+        if (success >= 0) {
+            blockData[BLOCK_NUMBER_OFFSET] = SHARED_BLOCK_TYPE;
+            memcpy(blockData + SHARED_REFCOUNT_OFFSET, &references, sizeof(uint32_t));
+            success = cachedWriteBlock(blocks[i], blockData);
+        }
+    }
+    if (success >= 0) {
+        tfsBlock mapHead = mapCount > 0 ? maps[0] : 0;
+        memcpy(inodeData + INODE_DATA_BLOCK_OFFSET, &mapHead, sizeof(tfsBlock));
+        inodeData[INODE_FLAGS_OFFSET] |= INODE_FLAG_DEDUP;
+        success = cachedWriteBlock(inode, inodeData);
+    }
+    scratchFree(blocks);
+    scratchFree(maps);
+    if (success < 0) {
+        printf("LIBTINYFS: Error: Could not convert the file to a block map. (convertToBlockMap)\n");
+        return EFWRITE; // error
+    }
+    // the chain this file was reading along is gone
+    openFileTableEntry *entry = openEntryOf(inode);
+    if (entry != NULL) {
+        resetReadCursor(entry);
+    }
+    return 1; // success
+}
+
+tfsBlock cloneInode(tfsBlock srcInode, tfsBlock parentInode, char *name) {
+    /* creates 'name' in a directory as a clone of a file, returns its inode */
+    char *inodeData = scratchBlock();
+    if (cachedReadBlock(srcInode, inodeData) < 0) {
+        scratchFree(inodeData);
+        printf("LIBTINYFS: Error: Issue with inode read. (cloneInode)\n");
+        return EFREAD; // error
+    }
+    tfsBlock head;
+    memcpy(&head, inodeData + INODE_DATA_BLOCK_OFFSET, sizeof(tfsBlock));
+    int success = 1;
+    if (head != 0 && !(inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_DEDUP)) {
+        success = convertToBlockMap(srcInode, inodeData);
+        memcpy(&head, inodeData + INODE_DATA_BLOCK_OFFSET, sizeof(tfsBlock));
+    }
+    tfsBlock newInode = success < 0 ? success : createInode(parentInode, name, inodeData[INODE_FLAGS_OFFSET]);
+    if (newInode < 0) {
+        scratchFree(inodeData);
+        return newInode; // error
+    }
+    // the clone is the source with its own name, parent and creation time
+    char *cloneData = scratchBlock();
+    int referenced = 0;
+    success = cachedReadBlock(newInode, cloneData);
+    if (success >= 0 && head != 0) {
+        success = addReference(head, MAP_REFCOUNT_OFFSET);
+        referenced = success >= 0;
+    }
+    if (success >= 0) {
+        memcpy(cloneData + INODE_FILE_SIZE_OFFSET, inodeData + INODE_FILE_SIZE_OFFSET, sizeof(tfsBlock));
+        memcpy(cloneData + INODE_DATA_BLOCK_OFFSET, &head, sizeof(tfsBlock));
+        memcpy(cloneData + INODE_MOD_TIME_STAMP_OFFSET, inodeData + INODE_MOD_TIME_STAMP_OFFSET, TIMESTAMP_SIZE);
+        memcpy(cloneData + INODE_INLINE_DATA_OFFSET, inodeData + INODE_INLINE_DATA_OFFSET, INODE_INLINE_CAPACITY);
+        success = cachedWriteBlock(newInode, cloneData);
+    }
+    scratchFree(inodeData);
+    scratchFree(cloneData);
+    if (success < 0) {
+        // the new inode goes again, the source keeps its block map to itself
+        if (referenced) {
+            releaseChain(head, 1);
+        }
+        dirRemove(parentInode, name);
+        deallocateBlock(newInode);
+        printf("LIBTINYFS: Error: Issue with clone inode write. (cloneInode)\n");
+        return EFWRITE; // error
+    }
+    return newInode;
+}
+
+int removeTree(tfsBlock inode) {
+    /* frees an inode and, for a directory, everything in it, the way a
+    failed snapshot gives back what it took. The caller takes the inode out
+    of its parent directory. */
+    char *inodeData = scratchBlock();
+    if (cachedReadBlock(inode, inodeData) < 0) {
+        scratchFree(inodeData);
+        printf("LIBTINYFS: Error: Issue with inode read. (removeTree)\n");
+        return EFREAD; // error
+    }
+    tfsBlock head;
+    memcpy(&head, inodeData + INODE_DATA_BLOCK_OFFSET, sizeof(tfsBlock));
+    int flags = inodeData[INODE_FLAGS_OFFSET];
+    scratchFree(inodeData);
+    int success = 1;
+    if (flags & INODE_FLAG_DIRECTORY) {
+        char *leafData = scratchBlock();
+        tfsBlock leaf = dirFirstLeaf(inode, leafData);
+        while (leaf > 0 && success >= 0) {
+            int count = (unsigned char)leafData[DIR_COUNT_OFFSET];
+            for (int i = 0; i < count && success >= 0; i++) {
+                char *entry = leafData + DIR_ENTRIES_OFFSET + i * DIR_ENTRY_SIZE;
+                tfsBlock entryInode;
+                memcpy(&entryInode, entry, sizeof(tfsBlock));
+                if (nameCache != NULL) {
+                    nameCacheRemove(inode, entry + DIR_ENTRY_NAME_OFFSET);
+                }
+                success = removeTree(entryInode);
+            }
+            memcpy(&leaf, leafData + DIR_NEXT_BLOCK_OFFSET, sizeof(tfsBlock));
+            if (leaf != 0 && cachedReadBlock(leaf, leafData) < 0) {
+                leaf = EFREAD;
+            }
+        }
+        scratchFree(leafData);
+        if (leaf < 0) {
+            success = (int)leaf;
+        }
+        if (success >= 0) {
+            success = dirFreeTree(head);
+        }
+    } else if (head != 0 && !(flags & INODE_FLAG_INLINE)) {
+        success = releaseChain(head, flags & INODE_FLAG_DEDUP);
+    }
+    if (success >= 0) {
+        success = deallocateBlock(inode);
+    }
+    return success < 0 ? EDEALLOC : 1;
+}
+
+int cloneTree(tfsBlock srcDir, tfsBlock destDir) {
+    /* clones every entry of a directory into another one, directories
+    recursively. Snapshot directories are skipped, so snapshots never nest. */
+    char *leafData = scratchBlock();
+    char *inodeData = scratchBlock();
+    tfsBlock leaf = dirFirstLeaf(srcDir, leafData);
+    while (leaf > 0) {
+        int count = (unsigned char)leafData[DIR_COUNT_OFFSET];
+        for (int i = 0; i < count && leaf > 0; i++) {
+            char *entry = leafData + DIR_ENTRIES_OFFSET + i * DIR_ENTRY_SIZE;
+            tfsBlock entryInode;
+            memcpy(&entryInode, entry, sizeof(tfsBlock));
+            if (cachedReadBlock(entryInode, inodeData) < 0) {
+                leaf = EFREAD;
+            } else if (!(inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_DIRECTORY)) {
+                tfsBlock clone = cloneInode(entryInode, destDir, entry + DIR_ENTRY_NAME_OFFSET);
+                if (clone < 0) {
+                    leaf = clone; // error
+                }
+            } else if (!(inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_SNAPSHOT)) {
+                tfsBlock newDir = createInode(destDir, entry + DIR_ENTRY_NAME_OFFSET, INODE_FLAG_DIRECTORY);
+                int success = newDir < 0 ? (int)newDir : cloneTree(entryInode, newDir);
+                if (success < 0) {
+                    leaf = success; // error
+                }
+            }
+        }
+        if (leaf < 0) {
+            break;
+        }
+        memcpy(&leaf, leafData + DIR_NEXT_BLOCK_OFFSET, sizeof(tfsBlock));
+        if (leaf != 0 && cachedReadBlock(leaf, leafData) < 0) {
+            leaf = EFREAD;
+        }
+    }
+    scratchFree(leafData);
+    scratchFree(inodeData);
+    return leaf < 0 ? (int)leaf : 1;
+}
+
+typedef struct blockReference {
+    tfsBlock block;
+    int offset; // where its count is kept, SHARED_REFCOUNT_OFFSET or MAP_REFCOUNT_OFFSET, 0 for a block only allocated
+} blockReference;
+
+int releaseReferences(blockReference *references, int count) {
+    /* drops references taken by shareBlock, addReference or allocateBlock, the last one first */
+    int success = 1;
+    while (count-- > 0) {
+        blockReference *reference = &references[count];
+        int result;
+        if (reference->offset == SHARED_REFCOUNT_OFFSET) {
+            result = releaseSharedBlock(reference->block);
+        } else if (reference->offset == MAP_REFCOUNT_OFFSET) {
+            result = releaseChain(reference->block, 1);
+        } else {
+            result = deallocateBlock(reference->block);
+        }
+        if (result < 0) {
+            success = EDEALLOC;
+        }
+    }
+    return success;
+}
+
+int writeMappedBlocks(openFileTableEntry *entry, char *inodeData, int64_t offset, char *buffer, int size) {
+    /* Writes over bytes of a file stored as a block map, without copying
+    anything another file still uses. Map blocks are copied from the first
+    one shared with another file down to the last one written. Every block
+    written is stored through shareBlock and the old one loses a reference.
+    The map blocks that change are edited in memory while every new block
+    and reference is taken, and running out of space gives all of those
+    back. Then the copies are written, the blocks that link them in after
+    them, and the inode if its data block pointer changed, and only then do
+    the blocks the file used before lose its references. */
+    tfsBlock index = dedupIndex();
+    if (index < 0) {
+        return (int)index; // error
+    }
+    int64_t first = offset / USEABLE_DATA_SIZE;
+    int64_t last = (offset + size - 1) / USEABLE_DATA_SIZE;
+    int64_t firstMap = first / MAP_MAX_ENTRIES;
+    int64_t lastMap = last / MAP_MAX_ENTRIES;
+    // walk to the last map block written, keeping the ones from the first written or shared on
+    int64_t sharedFrom = -1; // first map block another file uses as well, -1 if none
+    int64_t heldFrom = -1; // first map block kept in 'maps'
+    int held = 0;
+    int capacity = 4;
+    char *maps = (char *)scratchAlloc((size_t)capacity * BLOCKSIZE);
+    tfsBlock *targets = (tfsBlock *)scratchAlloc(capacity * sizeof(tfsBlock)); // where each kept map block is written
+    char linkData[BLOCKSIZE]; // map block before the kept ones
+    tfsBlock link = 0; // its number, 0 while the inode points at the first kept one
+    int success = 1;
+    tfsBlock block;
+    memcpy(&block, inodeData + INODE_DATA_BLOCK_OFFSET, sizeof(tfsBlock));
+    for (int64_t m = 0; m <= lastMap; m++) {
+        if (held == capacity) {
+            capacity *= 2;
+            maps = (char *)scratchRealloc(maps, (size_t)capacity * BLOCKSIZE);
+            targets = (tfsBlock *)scratchRealloc(targets, capacity * sizeof(tfsBlock));
+        }
+        char *mapData = maps + (size_t)held * BLOCKSIZE;
+        if (block == 0 || cachedReadBlock(block, mapData) < 0) {
+            printf("LIBTINYFS: Error: Issue with block map read. (writeMappedBlocks)\n");
+            success = EFREAD; // error
+            break;
+        }
+        uint32_t references;
+        memcpy(&references, mapData + MAP_REFCOUNT_OFFSET, sizeof(uint32_t));
+        if (sharedFrom < 0 && references > 1) {
+            sharedFrom = m;
+        }
+        if (m < firstMap && sharedFrom < 0) {
+            link = block;
+            memcpy(linkData, mapData, BLOCKSIZE);
+        } else {
+            if (heldFrom < 0) {
+                heldFrom = m;
+            }
+            targets[held++] = block;
+        }
+        memcpy(&block, mapData + MAP_NEXT_BLOCK_OFFSET, sizeof(tfsBlock));
+    }
+    // every reference taken is undone on failure, every one dropped only once the new blocks are in place
+    int takenCapacity = held * (2 * MAP_MAX_ENTRIES + 1) + 1;
+    blockReference *taken = (blockReference *)scratchAlloc(takenCapacity * sizeof(blockReference));
+    blockReference *dropped = (blockReference *)scratchAlloc((held * MAP_MAX_ENTRIES + 1) * sizeof(blockReference));
+    int takenCount = 0;
+    int droppedCount = 0;
+    char blockData[BLOCKSIZE];
+    for (int h = 0; h < held && success >= 0; h++) {
+        int64_t m = heldFrom + h;
+        char *mapData = maps + (size_t)h * BLOCKSIZE;
+        int count = (unsigned char)mapData[MAP_COUNT_OFFSET];
+        if (sharedFrom >= 0 && m >= sharedFrom) {
+            // a private copy takes the map block's place, its entries are new references
+            tfsBlock copy = allocateBlock();
+            if (copy < 0) {
+                success = (int)copy;
+                break;
+            }
+            taken[takenCount++] = (blockReference){copy, 0};
+            for (int slot = 0; slot < count && success >= 0; slot++) {
+                tfsBlock sharedBlock;
+                memcpy(&sharedBlock, mapData + MAP_ENTRIES_OFFSET + slot * sizeof(tfsBlock), sizeof(tfsBlock));
+                success = addReference(sharedBlock, SHARED_REFCOUNT_OFFSET);
+                if (success >= 0) {
+                    taken[takenCount++] = (blockReference){sharedBlock, SHARED_REFCOUNT_OFFSET};
+                }
+            }
+            tfsBlock next;
+            memcpy(&next, mapData + MAP_NEXT_BLOCK_OFFSET, sizeof(tfsBlock));
+            if (success >= 0 && h == held - 1 && next != 0) {
+                // the rest of the map stays shared, the last copy points at it too
+                success = addReference(next, MAP_REFCOUNT_OFFSET);
+                if (success >= 0) {
+                    taken[takenCount++] = (blockReference){next, MAP_REFCOUNT_OFFSET};
+                }
+            }
+            if (m == sharedFrom) {
+                // from here on the chain belongs to others as well, this file lets go of it
+                dropped[droppedCount++] = (blockReference){targets[h], MAP_REFCOUNT_OFFSET};
+            }
+            uint32_t references = 1;
+            memcpy(mapData + MAP_REFCOUNT_OFFSET, &references, sizeof(uint32_t));
+            targets[h] = copy;
+        }
+        // replace the shared blocks this map block lists in the written range
+        for (int slot = 0; slot < count && success >= 0; slot++) {
+            int64_t position = m * MAP_MAX_ENTRIES + slot;
+            if (position < first || position > last) {
+                continue;
+            }
+            tfsBlock oldBlock;
+            memcpy(&oldBlock, mapData + MAP_ENTRIES_OFFSET + slot * sizeof(tfsBlock), sizeof(tfsBlock));
+            if (cachedReadBlock(oldBlock, blockData) < 0) {
+                success = EFREAD; // error
+                break;
+            }
+            int start = position == first ? (int)(offset % USEABLE_DATA_SIZE) : 0;
+            int end = position == last ? (int)((offset + size - 1) % USEABLE_DATA_SIZE) + 1 : USEABLE_DATA_SIZE;
+            memcpy(blockData + DATA_BLOCK_DATA_OFFSET + start, buffer + position * USEABLE_DATA_SIZE + start - offset, end - start);
+            tfsBlock newBlock = shareBlock(index, blockData + DATA_BLOCK_DATA_OFFSET, USEABLE_DATA_SIZE);
+            if (newBlock < 0) {
+                success = (int)newBlock; // error
+                break;
+            }
+            taken[takenCount++] = (blockReference){newBlock, SHARED_REFCOUNT_OFFSET};
+            dropped[droppedCount++] = (blockReference){oldBlock, SHARED_REFCOUNT_OFFSET};
+            memcpy(mapData + MAP_ENTRIES_OFFSET + slot * sizeof(tfsBlock), &newBlock, sizeof(tfsBlock));
+        }
+    }
+    // chain the copies and point the block before them, or the inode, at the first one
+    int copiesFrom = sharedFrom >= 0 ? (int)(sharedFrom - heldFrom) : held;
+    if (success >= 0 && copiesFrom < held) {
+        for (int h = copiesFrom; h + 1 < held; h++) {
+            memcpy(maps + (size_t)h * BLOCKSIZE + MAP_NEXT_BLOCK_OFFSET, &targets[h + 1], sizeof(tfsBlock));
+        }
+        if (copiesFrom > 0) {
+            memcpy(maps + (size_t)(copiesFrom - 1) * BLOCKSIZE + MAP_NEXT_BLOCK_OFFSET, &targets[copiesFrom], sizeof(tfsBlock));
+        } else if (link != 0) {
+            memcpy(linkData + MAP_NEXT_BLOCK_OFFSET, &targets[copiesFrom], sizeof(tfsBlock));
+        } else {
+            memcpy(inodeData + INODE_DATA_BLOCK_OFFSET, &targets[copiesFrom], sizeof(tfsBlock));
+        }
+    }
+    // the copies first, nothing points at them yet, then the blocks the file already reaches
+    int visible = 0; // set once a block the file can reach was written
+    for (int h = held - 1; h >= 0 && success >= 0; h--) {
+        if (cachedWriteBlock(targets[h], maps + (size_t)h * BLOCKSIZE) < 0) {
+            success = EFWRITE; // error
+        } else if (h < copiesFrom) {
+            visible = 1;
+        }
+    }
+    if (success >= 0 && copiesFrom == 0 && held > 0) {
+        if (link != 0) {
+            success = cachedWriteBlock(link, linkData);
+        } else {
+            success = cachedWriteBlock(entry->inodeNumber, inodeData);
+        }
+    }
+    if (success < 0 && !visible) {
+        releaseReferences(taken, takenCount);
+    } else if (success < 0) {
+        // part of the new map is in place, keeping every reference only leaks blocks
+        printf("LIBTINYFS: Error: Block map partly written, blocks may leak. (writeMappedBlocks)\n");
+    } else {
+        success = releaseReferences(dropped, droppedCount);
+    }
+    scratchFree(dropped);
+    scratchFree(taken);
+    scratchFree(targets);
+    scratchFree(maps);
+    resetReadCursor(entry); // map blocks it was following may have been replaced
+    return success;
+}
+
+int tfsMkfs(char *filename, int64_t nBytes, int features, int policy){
     /******************** BLOCK STRUCTURE DOCUMENTATION ****************************/
     /* 
     * BLOCKSIZE = 256 bytes
     * The documentation below assumes you are starting at position 0 in each block:
     * Pointers to blocks are their block numbers, not their addresses.
-    * Since we use 4 byte pointers, we can address 2^31 - 1 blocks.
+    * Since we use 8 byte pointers, we can address 2^63 - 1 blocks. File sizes take 8 bytes as well.
+    * The last 4 bytes of every block are its CRC-32C. libDisk writes and checks it when the
+    * super block has SUPER_FEATURE_CHECKSUMS set, otherwise they are unused (except in the
+    * super block, which always carries its checksum). The layouts below all end before them.
 
 
     ***SUPER BLOCK***
-    | block number = 1 | MAGIC_NUMBER | free block LL head pointer | Root inode LL head pointer | Max number of files |
-    | 1 byte           | 1 byte       | 4 bytes                    | 4 bytes                    |     4 bytes
+    | block number = 1 | MAGIC_NUMBER | free block LL head pointer | Max number of files | format version | Root directory inode pointer |
+    | 1 byte           | 1 byte       | 8 bytes                    |     4 bytes         |    4 bytes     | 8 bytes                      |
     
+    | total number of blocks | free watermark | state  | first checkpoint block | checkpoint blocks | free blocks | features | dedup index inode | allocation policy | ... | CRC-32C |
+    | 8 bytes                | 8 bytes        | 1 byte | 8 bytes                | 8 bytes           | 8 bytes     | 1 byte   | 8 bytes           | 1 byte            |     | 4 bytes |
+    The state is SUPER_STATE_DIRTY from mount to a clean unmount. The checkpoint and the
+    free block count only describe the disk while it is SUPER_STATE_CLEAN, and so does the
+    free block LL head under an allocation policy other than TFS_ALLOC_LIFO. The CRC-32C in
+    the last 4 bytes covers every byte before it. The dedup index inode is 0 until the first
+    deduplicated file is written.
+
     ***FREE BLOCKS***
     | block number = 4 | MAGIC_NUMBER | next free block pointer    |
-    | 1 byte           | 1 byte       | 4 bytes                    |
+    | 1 byte           | 1 byte       | 8 bytes                    |
+    Only blocks that were used and freed again carry this header. Blocks from the free
+    watermark up to the end of the disk have never been used and are implicitly free.
     
     ***INODE BLOCKS***
-    | block number = 2 | MAGIC_NUMBER | next inode pointer    | file size | data block pointer | file name | time stamp - creation | time stamp - last modified | time stamp - last accessed |
-    | 1 byte           | 1 byte       | 4 bytes               | 4 bytes   | 4 bytes            | 9 bytes   |       25 bytes        |           25 bytes         |           25 bytes         |
+    | block number = 2 | MAGIC_NUMBER | parent directory pointer | file size | data block pointer | file name | time stamp - creation | time stamp - last modified | time stamp - last accessed |
+    | 1 byte           | 1 byte       | 8 bytes                  | 8 bytes   | 8 bytes            | 9 bytes   |       8 bytes         |           8 bytes          |           8 bytes          |
+    Time stamps are nanoseconds since the epoch, they are only turned into text by tfs_readFileInfo.
+    | flags  | inline data |
+    | 1 byte | 192 bytes   |
+    Files of up to INODE_INLINE_CAPACITY bytes are stored in the inline data area with
+    INODE_FLAG_INLINE set and no data blocks. Larger files use a data block chain.
+    Directories have INODE_FLAG_DIRECTORY set, their data block pointer is the root of
+    their directory tree and their file size is their number of entries.
+    Files with INODE_FLAG_DEDUP set that are not inline point at a block map instead.
+    Directories made by tfs_snapshot also have INODE_FLAG_SNAPSHOT set.
     
     ***DATA BLOCKS***
     | block number = 3 | MAGIC_NUMBER | pointer to next data block | data            |
-    | 1 byte           | 1 byte       | 4 bytes                    |  250 bytes max  |
+    | 1 byte           | 1 byte       | 8 bytes                    |  242 bytes max  |
+
+    ***DIRECTORY LEAF BLOCKS***
+    | block number = 5 | MAGIC_NUMBER | next leaf pointer | level = 0 | entry count | entries: inode pointer + file name |
+    | 1 byte           | 1 byte       | 8 bytes           | 1 byte    | 1 byte      | 17 bytes each, 14 max              |
+
+    ***DIRECTORY INDEX BLOCKS***
+    | block number = 6 | MAGIC_NUMBER | unused  | level  | entry count | entries: lowest name hash + child pointer |
+    | 1 byte           | 1 byte       | 8 bytes | 1 byte | 1 byte      | 12 bytes each, 20 max                     |
+
+    ***CHECKPOINT BLOCKS***
+    | block number = 7 | MAGIC_NUMBER | entry count | unused | entries: inode pointer + parent pointer + file name |
+    | 1 byte           | 1 byte       | 1 byte      | 1 byte | 25 bytes each, 9 max                                |
+    Only found in the never used blocks past the free watermark, written at unmount.
+
+    ***BLOCK MAP BLOCKS***
+    | block number = 8 | MAGIC_NUMBER | pointer to next block map | entry count | unused | reference count | entries: shared block pointer |
+    | 1 byte           | 1 byte       | 8 bytes                   | 1 byte      | 1 byte | 4 bytes         | 8 bytes each, 29 max          |
+    The reference count is the number of inodes and block maps pointing at the block, clones share
+    the rest of the chain from any block map on.
+
+    ***SHARED BLOCKS***
+    | block number = 9 | MAGIC_NUMBER | reference count | data      |
+    | 1 byte           | 1 byte       | 4 bytes         | 4 unused | 242 bytes |
+    The reference count is the number of block map entries pointing at the block.
     
     */
 
-    int numBlocks = (nBytes / BLOCKSIZE) - 1; 
+    if (features & ~SUPER_FEATURES_KNOWN) {
+        printf("LIBTINYFS-mkfs: Unknown features 0x%x\n", features & ~SUPER_FEATURES_KNOWN);
+        return ECREATFS; // error
+    }
+    if (policy < 0 || policy >= TFS_ALLOC_POLICIES) {
+        printf("LIBTINYFS-mkfs: Unknown allocation policy %d\n", policy);
+        return ECREATFS; // error
+    }
+    tfsBlock numBlocks = (nBytes / BLOCKSIZE) - 1; 
     if (numBlocks < 3) {
         printf("LIBTINYFS-mkfs: File system size too small\n");
         return ECREATFS; // error
@@ -68,55 +2823,793 @@ int tfs_mkfs(char *filename, int nBytes){
         return ECREATFS; // error 
     }
     /* Set max number of files constant */
-    maxNumberOfFiles = numBlocks / 2; // 2 blocks per file (inode block and data block)
+    maxNumberOfFiles = numBlocks / 2 < MAX_OPEN_FILES ? (int)(numBlocks / 2) : MAX_OPEN_FILES; // 2 blocks per file (inode block and data block)
     if (maxNumberOfFiles < 1) {
+        closeDisk(diskNum);
         printf("LIBTINYFS-mkfs: File system size too small\n");
         return ECREATFS; // error
     }
 
-    /* SUPERBLOCK INIT */
-    char *data = (char *)malloc(BLOCKSIZE);
+    /* SUPERBLOCK INIT
+    Free space is initialized lazily: the free block LL starts out empty and
+    every block from the free watermark to the end of the disk is free without
+    being touched. Formatting writes two blocks whatever the disk size. */
+    char data[BLOCKSIZE];
     memset(data, 0, BLOCKSIZE); // zero out the data buffer
-    data[BLOCK_NUMBER_OFFSET] = 1; // block type -> super block
+    data[BLOCK_NUMBER_OFFSET] = SUPER_BLOCK_TYPE; // block type -> super block
     data[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
-    uint32_t freeBlockHead = 1; // always 1
-    *((uint32_t *)(data + 2)) = freeBlockHead; // free block LL head pointer
+    tfsBlock freeBlockHead = 0; // nothing has been freed yet
+    memcpy(data + FB_OFFSET, &freeBlockHead, sizeof(tfsBlock)); // free block LL head pointer
+    tfsBlock rootDirectory = 1;
+    memcpy(data + ROOT_DIR_OFFSET, &rootDirectory, sizeof(tfsBlock));
     // write max number of files into super block
     memcpy(data + SUPER_MAX_NUM_FILES_OFFSET, &maxNumberOfFiles, sizeof(int));
+    int formatVersion = TFS_FORMAT_VERSION;
+    memcpy(data + SUPER_FORMAT_VERSION_OFFSET, &formatVersion, sizeof(int));
+    tfsBlock totalBlocks = numBlocks + 1; // including the super block
+    memcpy(data + SUPER_NUM_BLOCKS_OFFSET, &totalBlocks, sizeof(tfsBlock));
+    tfsBlock freeWatermark = rootDirectory + 1; // first block never handed out
+    memcpy(data + SUPER_FREE_WATERMARK_OFFSET, &freeWatermark, sizeof(tfsBlock));
+    // an empty file system is clean, its checkpoint has no entries
+    data[SUPER_STATE_OFFSET] = SUPER_STATE_CLEAN;
+    data[SUPER_FEATURES_OFFSET] = features;
+    data[SUPER_ALLOC_POLICY_OFFSET] = (char)policy;
+    setDiskChecksums(diskNum, features & SUPER_FEATURE_CHECKSUMS);
+    memcpy(data + SUPER_CHECKPOINT_OFFSET, &freeWatermark, sizeof(tfsBlock));
+    tfsBlock freeBlocks = totalBlocks - freeWatermark;
+    memcpy(data + SUPER_FREE_COUNT_OFFSET, &freeBlocks, sizeof(tfsBlock));
+    sealSuperBlock(data);
     // write the super block to the disk
-    int writeSuccess = writeBlock(diskNum, 0, data);
+    int writeSuccess = writeBlock(diskNum, SUPER_BLOCK, data);
     if (writeSuccess < 0) {
+        closeDisk(diskNum);
         printf("LIBTINYFS-mkfs: Error writing super block to disk\n");
         return ECREATFS; // error
     }
-    free(data); // deallocate the data buffer
 
-    /* FREEBLOCK INITIALIZATION: */
-    for (int i = 1; i <= numBlocks; i++) {
-        // setup each free block
-        char *data = (char *) malloc(BLOCKSIZE);
-        memset(data, 0, BLOCKSIZE); // zero out the data buffer
-        data[BLOCK_NUMBER_OFFSET] = 4; // block type -> free block
-        data[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
-        // set up linked list chain for free blocks
-        if (i < numBlocks) {
-            uint32_t nextFreeBlock = i + 1;
-            *((uint32_t *)(data + 2)) = nextFreeBlock; // next free block pointer
-        } else {
-            *((uint32_t *)(data + 2)) = 0; // no more free blocks, 0 means end of list
+    /* ROOT DIRECTORY INIT, an empty directory has no tree blocks yet */
+    memset(data, 0, BLOCKSIZE);
+    data[BLOCK_NUMBER_OFFSET] = INODE_BLOCK_TYPE;
+    data[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+    data[INODE_FLAGS_OFFSET] = INODE_FLAG_DIRECTORY;
+    uint64_t now = getTimestamp();
+    setTimestamp(data, INODE_CR8_TIME_STAMP_OFFSET, now);
+    setTimestamp(data, INODE_MOD_TIME_STAMP_OFFSET, now);
+    setTimestamp(data, INODE_ACC_TIME_STAMP_OFFSET, now);
+    writeSuccess = writeBlock(diskNum, rootDirectory, data);
+    if (writeSuccess < 0) {
+        closeDisk(diskNum);
+        printf("LIBTINYFS-mkfs: Error writing root directory to disk\n");
+        return ECREATFS; // error
+    }
+
+    // close the disk so everything is on the unix file before it is mounted
+    if (closeDisk(diskNum) < 0) {
+        printf("LIBTINYFS-mkfs: Error closing disk\n");
+        return ECREATFS; // error
+    }
+    return 1; // success
+}
+
+/* DEFRAGMENTATION
+ * tfs_defrag goes through the files stored in data block chains in inode
+ * order and moves each chain block to the lowest block that is free or holds
+ * a chain not done yet, so every file ends up in ascending consecutive
+ * blocks, broken only by the blocks that stay put: inodes, directory trees,
+ * block maps and shared blocks, which can have more than one pointer to
+ * them. A chain block in the way is first moved out to free space, past the
+ * free watermark while there is any. A move writes the copy, points the
+ * block before it at the copy and only then frees the old block, so a crash
+ * leaks at most one block. Once every file is done the free block LL is
+ * relinked in block order and the free watermark comes down to the last
+ * block in use, which leaves the free space in one piece at the end of the
+ * disk. What every block is and what points at it is kept in memory, 17
+ * bytes per block, from a scan like the one tfs_mount does after a crash. It
+ * is scanned again when blocks were taken or freed since the last call, so
+ * the disk can be used between calls; the file being moved then starts over,
+ * what was moved stays where it is. */
+#define DEFRAG_FIXED 0 // stays where it is
+#define DEFRAG_FILE 1 // inode of a file stored in a data block chain
+#define DEFRAG_CHAIN 2 // block of a data block chain
+#define DEFRAG_FREE 3 // on the free block LL
+#define DEFRAG_UNUSED 4 // past the free watermark
+
+typedef struct defragState {
+    char *kind; // DEFRAG_* of every block, NULL until the first scan
+    tfsBlock *prev; // what points at a chain or free block, SUPER_BLOCK for the free block LL head, -1 if nothing does
+    tfsBlock *next; // what an inode, chain or free block points at, 0 for nothing
+    tfsBlock numBlocks;
+    long layout; // layoutChanges the maps are right for, -1 after an error
+    tfsBlock dest; // lowest block a chain block may still be moved to
+    tfsBlock nextFile; // files whose inode is here or after it are not done yet
+    tfsBlock file; // inode of the file being moved, 0 between files
+    tfsBlock last; // its block placed last, or its inode
+    tfsBlock walked; // its blocks walked so far, more than the disk has is a cycle
+    int finished; // 1 once a pass over every file is complete
+    int64_t moved; // blocks moved since the disk was mounted
+} defragState;
+
+defragState defrag;
+
+void defragFree(void) {
+    free(defrag.kind);
+    free(defrag.prev);
+    free(defrag.next);
+    memset(&defrag, 0, sizeof(defragState));
+}
+
+void defragDemote(tfsBlock block) {
+    /* a block whose pointers do not add up stays put, and so does the rest of its chain */
+    while (block != 0 && defrag.kind[block] != DEFRAG_FIXED) {
+        defrag.kind[block] = DEFRAG_FIXED;
+        block = defrag.next[block];
+    }
+}
+
+int defragScan(void) {
+    /* builds the block maps from the disk, reading every block below the free
+    watermark once, MOUNT_IO_BLOCKS per request. The cache is write-through,
+    so the disk is current. */
+    char superData[BLOCKSIZE];
+    if (cachedReadBlock(SUPER_BLOCK, superData) < 0) {
+        printf("LIBTINYFS: Error: Issue with super block read. (defrag)\n");
+        return EFREAD; // error
+    }
+    tfsBlock numBlocks;
+    tfsBlock watermark;
+    tfsBlock freeHead;
+    memcpy(&numBlocks, superData + SUPER_NUM_BLOCKS_OFFSET, sizeof(tfsBlock));
+    memcpy(&watermark, superData + SUPER_FREE_WATERMARK_OFFSET, sizeof(tfsBlock));
+    memcpy(&freeHead, superData + FB_OFFSET, sizeof(tfsBlock));
+    if (defrag.kind == NULL) {
+        defrag.kind = (char *)malloc((size_t)numBlocks);
+        defrag.prev = (tfsBlock *)malloc((size_t)numBlocks * sizeof(tfsBlock));
+        defrag.next = (tfsBlock *)malloc((size_t)numBlocks * sizeof(tfsBlock));
+        if (defrag.kind == NULL || defrag.prev == NULL || defrag.next == NULL) {
+            defragFree();
+            printf("LIBTINYFS: Error: No memory for the block maps. (defrag)\n");
+            return EFREAD; // error
+        }
+        defrag.numBlocks = numBlocks;
+    }
+    memset(defrag.kind, DEFRAG_UNUSED, (size_t)numBlocks);
+    memset(defrag.next, 0, (size_t)numBlocks * sizeof(tfsBlock));
+    for (tfsBlock b = 0; b < numBlocks; b++) {
+        defrag.prev[b] = -1;
+    }
+    defrag.kind[SUPER_BLOCK] = DEFRAG_FIXED;
+    char *chunk = (char *)scratchAlloc(MOUNT_IO_BLOCKS * BLOCKSIZE);
+    if (chunk == NULL) {
+        return EFREAD; // error
+    }
+    for (tfsBlock b = SUPER_BLOCK + 1; b < watermark; b++) {
+        if ((b - SUPER_BLOCK - 1) % MOUNT_IO_BLOCKS == 0) {
+            int count = watermark - b < MOUNT_IO_BLOCKS ? (int)(watermark - b) : MOUNT_IO_BLOCKS;
+            if (readBlocks(mountedDisk, b, count, chunk) < 0) {
+                scratchFree(chunk);
+                printf("LIBTINYFS: Error: Issue with block read. (defrag)\n");
+                return EFREAD; // error
+            }
+        }
+        char *data = chunk + ((b - SUPER_BLOCK - 1) % MOUNT_IO_BLOCKS) * BLOCKSIZE;
+        int kind = DEFRAG_FIXED;
+        tfsBlock pointer = 0;
+        if (data[BLOCK_NUMBER_OFFSET] == INODE_BLOCK_TYPE &&
+            !(data[INODE_FLAGS_OFFSET] & (INODE_FLAG_INLINE | INODE_FLAG_DIRECTORY | INODE_FLAG_DEDUP))) {
+            memcpy(&pointer, data + INODE_DATA_BLOCK_OFFSET, sizeof(tfsBlock));
+            kind = pointer != 0 ? DEFRAG_FILE : DEFRAG_FIXED;
+        } else if (data[BLOCK_NUMBER_OFFSET] == DATA_BLOCK_TYPE) {
+            memcpy(&pointer, data + DATA_NEXT_BLOCK_OFFSET, sizeof(tfsBlock));
+            kind = DEFRAG_CHAIN;
+        } else if (data[BLOCK_NUMBER_OFFSET] == FREE_BLOCK_TYPE && alloc.policy != TFS_ALLOC_LIFO) {
+            // the free bitmap says what is free, next pointers on disk may be stale
+            kind = allocBit(alloc.freeMap, b) ? DEFRAG_FREE : DEFRAG_FIXED;
+        } else if (data[BLOCK_NUMBER_OFFSET] == FREE_BLOCK_TYPE) {
+            memcpy(&pointer, data + FREE_NEXT_BLOCK_OFFSET, sizeof(tfsBlock));
+            kind = DEFRAG_FREE;
+        }
+        if (pointer != 0 && (pointer <= SUPER_BLOCK || pointer >= watermark)) {
+            kind = DEFRAG_FIXED; // points off the disk, nothing about it can be trusted
+            pointer = 0;
+        }
+        defrag.kind[b] = kind;
+        defrag.next[b] = pointer;
+        if (pointer != 0) {
+            defrag.prev[pointer] = b;
+        }
+    }
+    scratchFree(chunk);
+    if (alloc.policy == TFS_ALLOC_LIFO && freeHead > SUPER_BLOCK && freeHead < watermark) {
+        defrag.prev[freeHead] = SUPER_BLOCK;
+    }
+    // only blocks with exactly the pointer to them their kind expects can move or be taken
+    for (tfsBlock b = SUPER_BLOCK + 1; b < watermark; b++) {
+        tfsBlock before = defrag.prev[b];
+        if (defrag.kind[b] == DEFRAG_CHAIN && (before <= SUPER_BLOCK ||
+            (defrag.kind[before] != DEFRAG_FILE && defrag.kind[before] != DEFRAG_CHAIN))) {
+            defragDemote(b);
+        } else if (defrag.kind[b] == DEFRAG_FREE && alloc.policy == TFS_ALLOC_LIFO && (before < SUPER_BLOCK ||
+            (before > SUPER_BLOCK && defrag.kind[before] != DEFRAG_FREE))) {
+            defragDemote(b);
+        }
+    }
+    defrag.layout = layoutChanges;
+    return 1; // success
+}
+
+int defragRefresh(void) {
+    /* rescans the disk if blocks were taken or freed since the maps were right */
+    if (defrag.kind != NULL && defrag.layout == layoutChanges) {
+        return 1;
+    }
+    int newPass = defrag.kind == NULL || defrag.finished;
+    int success = defragScan();
+    if (success < 0) {
+        return success; // error
+    }
+    if (newPass) {
+        defrag.dest = SUPER_BLOCK + 1;
+        defrag.nextFile = SUPER_BLOCK + 1;
+        defrag.file = 0;
+        defrag.finished = 0;
+    } else if (defrag.file != 0) {
+        // the file being moved may have changed, it starts over
+        defrag.nextFile = defrag.file;
+        defrag.file = 0;
+    }
+    return 1; // success
+}
+
+int defragPinned(tfsBlock block) {
+    /* 1 if a span from tfs_readv_begin points into the block, it can not move */
+    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        if (blockCache[i].blockNumber == block) {
+            return blockCache[i].pins > 0;
+        }
+    }
+    return 0;
+}
+
+int defragPoint(tfsBlock block, tfsBlock target, char *superData) {
+    /* points an inode, chain or free block at 'target', SUPER_BLOCK is the
+    free block LL head in 'superData' */
+    if (block == SUPER_BLOCK) {
+        memcpy(superData + FB_OFFSET, &target, sizeof(tfsBlock));
+        return 1;
+    }
+    char data[BLOCKSIZE];
+    if (cachedReadBlock(block, data) < 0) {
+        printf("LIBTINYFS: Error: Issue with block read. (defrag)\n");
+        return EFREAD; // error
+    }
+    int offset = DATA_NEXT_BLOCK_OFFSET;
+    if (defrag.kind[block] == DEFRAG_FILE) {
+        offset = INODE_DATA_BLOCK_OFFSET;
+    } else if (defrag.kind[block] == DEFRAG_FREE) {
+        offset = FREE_NEXT_BLOCK_OFFSET;
+    }
+    memcpy(data + offset, &target, sizeof(tfsBlock));
+    if (cachedWriteBlock(block, data) < 0) {
+        printf("LIBTINYFS: Error: Issue with block write. (defrag)\n");
+        return EFWRITE; // error
+    }
+    defrag.next[block] = target;
+    return 1; // success
+}
+
+int defragTake(tfsBlock block, char *superData) {
+    /* takes a free block off the free block LL or the free bitmap, or the
+    block at the free watermark off the space past it */
+    if (defrag.kind[block] == DEFRAG_UNUSED) {
+        tfsBlock watermark = block + 1;
+        memcpy(superData + SUPER_FREE_WATERMARK_OFFSET, &watermark, sizeof(tfsBlock));
+    } else if (alloc.policy != TFS_ALLOC_LIFO) {
+        allocTake(block);
+    } else {
+        tfsBlock before = defrag.prev[block];
+        tfsBlock after = defrag.next[block];
+        int success = defragPoint(before, after, superData);
+        if (success < 0) {
+            return success; // error
+        }
+        if (after != 0) {
+            defrag.prev[after] = before;
+        }
+    }
+    defrag.kind[block] = DEFRAG_FIXED; // until something is written to it
+    defrag.prev[block] = -1;
+    defrag.next[block] = 0;
+    freeBlockCount--;
+    return 1; // success
+}
+
+int defragRelease(tfsBlock block, char *superData) {
+    /* puts a block nothing points at any more on the free block LL, or in
+    the free bitmap, like deallocateBlock */
+    tfsBlock head;
+    memcpy(&head, superData + FB_OFFSET, sizeof(tfsBlock));
+    char data[BLOCKSIZE];
+    memset(data, 0, BLOCKSIZE);
+    data[BLOCK_NUMBER_OFFSET] = FREE_BLOCK_TYPE;
+    data[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+    if (alloc.policy != TFS_ALLOC_LIFO) {
+        if (allocRelease(block, data) < 0) {
+            printf("LIBTINYFS: Error: Issue with free block write. (defrag)\n");
+            return EDEALLOC; // error
+        }
+        defrag.kind[block] = DEFRAG_FREE;
+        defrag.prev[block] = -1;
+        defrag.next[block] = 0;
+        freeBlockCount++;
+        return 1; // success
+    }
+    memcpy(data + FREE_NEXT_BLOCK_OFFSET, &head, sizeof(tfsBlock));
+    if (cachedWriteBlock(block, data) < 0) {
+        printf("LIBTINYFS: Error: Issue with free block write. (defrag)\n");
+        return EDEALLOC; // error
+    }
+    memcpy(superData + FB_OFFSET, &block, sizeof(tfsBlock));
+    defrag.kind[block] = DEFRAG_FREE;
+    defrag.prev[block] = SUPER_BLOCK;
+    defrag.next[block] = head;
+    if (head != 0) {
+        defrag.prev[head] = block;
+    }
+    freeBlockCount++;
+    return 1; // success
+}
+
+int defragMove(tfsBlock from, tfsBlock to, char *superData) {
+    /* moves chain block 'from' to 'to', which was just taken, and frees it */
+    char data[BLOCKSIZE];
+    if (cachedReadBlock(from, data) < 0 || cachedWriteBlock(to, data) < 0) {
+        printf("LIBTINYFS: Error: Could not copy block %lld. (defrag)\n", (long long)from);
+        return EFWRITE; // error
+    }
+    tfsBlock before = defrag.prev[from];
+    tfsBlock after = defrag.next[from];
+    int success = defragPoint(before, to, superData);
+    if (success < 0) {
+        return success; // error
+    }
+    defrag.kind[to] = DEFRAG_CHAIN;
+    defrag.prev[to] = before;
+    defrag.next[to] = after;
+    if (after != 0) {
+        defrag.prev[after] = to;
+    }
+    defrag.moved++;
+    return defragRelease(from, superData);
+}
+
+int defragEvict(tfsBlock block, char *superData) {
+    /* moves a chain block out of the way, past the free watermark while there
+    is space there, otherwise to the head of the free block LL, or the first
+    free block in the free bitmap */
+    tfsBlock watermark;
+    tfsBlock numBlocks;
+    tfsBlock target;
+    memcpy(&watermark, superData + SUPER_FREE_WATERMARK_OFFSET, sizeof(tfsBlock));
+    memcpy(&numBlocks, superData + SUPER_NUM_BLOCKS_OFFSET, sizeof(tfsBlock));
+    if (watermark < numBlocks) {
+        target = watermark;
+    } else if (alloc.policy != TFS_ALLOC_LIFO) {
+        target = allocNextBit(alloc.freeMap, SUPER_BLOCK + 1, numBlocks, 1);
+        if (target == numBlocks) {
+            return ENOSPC; // error
+        }
+    } else {
+        memcpy(&target, superData + FB_OFFSET, sizeof(tfsBlock));
+        if (target == 0) {
+            return ENOSPC; // error
+        }
+    }
+    int success = defragTake(target, superData);
+    if (success < 0) {
+        return success; // error
+    }
+    return defragMove(block, target, superData);
+}
+
+int defragFinish(char *superData) {
+    /* Ends a pass: brings the free watermark down to the last block in use
+    and relinks the free blocks below it in block order, so new files are
+    laid out in ascending blocks too. Only free blocks whose next pointer
+    changes are written. Under a placement policy the blocks past the new
+    watermark just leave the free bitmap, the relinking waits for unmount. */
+    tfsBlock watermark;
+    memcpy(&watermark, superData + SUPER_FREE_WATERMARK_OFFSET, sizeof(tfsBlock));
+    tfsBlock end = watermark;
+    while (end > SUPER_BLOCK + 1 && defrag.kind[end - 1] == DEFRAG_FREE) {
+        end--;
+    }
+    if (alloc.policy != TFS_ALLOC_LIFO) {
+        for (tfsBlock b = watermark - 1; b >= end; b--) {
+            allocTake(b);
+        }
+    } else {
+        tfsBlock tail = SUPER_BLOCK;
+        for (tfsBlock b = SUPER_BLOCK + 1; b < end; b++) {
+            if (defrag.kind[b] != DEFRAG_FREE) {
+                continue;
+            }
+            if (tail == SUPER_BLOCK || defrag.next[tail] != b) {
+                int success = defragPoint(tail, b, superData);
+                if (success < 0) {
+                    return success; // error
+                }
+            }
+            defrag.prev[b] = tail;
+            tail = b;
+        }
+        if (tail == SUPER_BLOCK || defrag.next[tail] != 0) {
+            int success = defragPoint(tail, 0, superData);
+            if (success < 0) {
+                return success; // error
+            }
+        }
+    }
+    for (tfsBlock b = end; b < watermark; b++) {
+        defrag.kind[b] = DEFRAG_UNUSED;
+        defrag.prev[b] = -1;
+        defrag.next[b] = 0;
+    }
+    memcpy(superData + SUPER_FREE_WATERMARK_OFFSET, &end, sizeof(tfsBlock));
+    defrag.finished = 1;
+    return writeSuperBlock(superData) < 0 ? EFWRITE : 1;
+}
+
+int tfsDefrag(int64_t maxBlocks) {
+    /* Moves up to 'maxBlocks' blocks, resuming where the last call stopped.
+    Returns 1 while the pass is not finished, 0 once it is. A block pinned by
+    a span stays where it is, and so does every block when the disk is too
+    full to move one out of the way. */
+    if (mountedDisk == INT_NULL) {
+        printf("LIBTINYFS: Error: No disk mounted. (defrag)\n");
+        return EMOUNTFS; // error
+    }
+    int success = defragRefresh();
+    if (success < 0) {
+        return success; // error
+    }
+    char superData[BLOCKSIZE];
+    if (cachedReadBlock(SUPER_BLOCK, superData) < 0) {
+        printf("LIBTINYFS: Error: Issue with super block read. (defrag)\n");
+        return EFREAD; // error
+    }
+    int64_t start = defrag.moved;
+    while (success >= 0 && !defrag.finished && defrag.moved - start < maxBlocks) {
+        if (defrag.file == 0) {
+            tfsBlock file = defrag.nextFile;
+            while (file < defrag.numBlocks && defrag.kind[file] != DEFRAG_FILE) {
+                file++;
+            }
+            if (file >= defrag.numBlocks) {
+                success = defragFinish(superData);
+                break;
+            }
+            defrag.file = file;
+            defrag.last = file;
+            defrag.walked = 0;
+            defrag.nextFile = file + 1;
+        }
+        tfsBlock block = defrag.next[defrag.last];
+        if (block == 0 || defrag.kind[block] != DEFRAG_CHAIN || ++defrag.walked > defrag.numBlocks) {
+            defrag.file = 0; // the end of the chain, or a chain that can not be followed
+            continue;
+        }
+        // everything below dest is placed or stays put, a block there is left alone
+        if (block >= defrag.dest && !defragPinned(block)) {
+            while (defrag.dest < block && (defrag.kind[defrag.dest] == DEFRAG_FIXED ||
+                defrag.kind[defrag.dest] == DEFRAG_FILE || defrag.kind[defrag.dest] == DEFRAG_UNUSED ||
+                defragPinned(defrag.dest))) {
+                defrag.dest++;
+            }
+            if (defrag.dest < block) {
+                tfsBlock target = defrag.dest;
+                if (defrag.kind[target] == DEFRAG_CHAIN) {
+                    success = defragEvict(target, superData);
+                }
+                if (success >= 0) {
+                    success = defragTake(target, superData);
+                }
+                if (success >= 0) {
+                    success = defragMove(block, target, superData);
+                    block = target;
+                }
+                if (success >= 0 && writeSuperBlock(superData) < 0) {
+                    success = EFWRITE;
+                }
+                if (success == ENOSPC) {
+                    success = 1; // no room to move anything, the block stays
+                }
+            }
+            if (block == defrag.dest) {
+                defrag.dest++;
+            }
+        }
+        defrag.last = block;
+    }
+    if (defrag.moved > start) {
+        // the chains open files were reading along may have moved
+        for (int i = 0; i < maxNumberOfFiles; i++) {
+            openFileTableEntry *entry = openFileTable[i];
+            if (entry != NULL) {
+                entry->lastBlockIndex = -1;
+                entry->lastBlockNumber = 0;
+                entry->raNextIndex = 0;
+                entry->raNextBlock = 0;
+            }
+        }
+    }
+    if (success < 0) {
+        defrag.layout = -1; // the maps may be off, the next call scans again
+        printf("LIBTINYFS: Error: Defragmentation stopped. (defrag)\n");
+        return success; // error
+    }
+    defrag.layout = layoutChanges;
+    return defrag.finished ? 0 : 1;
+}
+
+int tfsReportDefrag(tfsDefragReport *report) {
+    if (mountedDisk == INT_NULL) {
+        printf("LIBTINYFS: Error: No disk mounted. (defragReport)\n");
+        return EMOUNTFS; // error
+    }
+    int success = defragRefresh();
+    if (success < 0) {
+        return success; // error
+    }
+    memset(report, 0, sizeof(tfsDefragReport));
+    tfsBlock jumps = 0;
+    tfsBlock lastUsed = SUPER_BLOCK;
+    int inFree = 0;
+    for (tfsBlock b = SUPER_BLOCK + 1; b < defrag.numBlocks; b++) {
+        int kind = defrag.kind[b];
+        if (kind == DEFRAG_FREE || kind == DEFRAG_UNUSED) {
+            report->freeExtents += !inFree;
+            inFree = 1;
+            continue;
+        }
+        inFree = 0;
+        lastUsed = b;
+        if (kind == DEFRAG_FILE) {
+            report->files++;
+        } else if (kind == DEFRAG_CHAIN) {
+            report->dataBlocks++;
+            tfsBlock before = defrag.prev[b];
+            jumps += defrag.kind[before] == DEFRAG_CHAIN && b != before + 1;
+        }
+    }
+    report->extents = report->files + jumps;
+    if (report->dataBlocks > report->files) {
+        report->fragmentation = (double)jumps / (report->dataBlocks - report->files);
+    }
+    report->freeBlocks = freeBlockCount;
+    report->tailFree = defrag.numBlocks - 1 - lastUsed;
+    report->moved = defrag.moved;
+    return 1; // success
+}
+
+/* MOUNT STATE
+ * tfs_mount builds the name cache and the free block count. After a clean
+ * unmount they come from the checkpoint, which sits in consecutive blocks
+ * and is read in one sequential pass. Otherwise every block below the free
+ * watermark is read once, in order. */
+int relinkFreeBlock(tfsBlock block, char *blockData, tfsBlock next) {
+    /* points a free block at 'next', writing it only if that changes it */
+    tfsBlock current;
+    memcpy(&current, blockData + FREE_NEXT_BLOCK_OFFSET, sizeof(tfsBlock));
+    if (current == next) {
+        return 1;
+    }
+    memcpy(blockData + FREE_NEXT_BLOCK_OFFSET, &next, sizeof(tfsBlock));
+    if (writeBlock(mountedDisk, block, blockData) < 0) {
+        printf("LIBTINYFS-mount: Issue with free block write\n");
+        return EFWRITE; // error
+    }
+    return 1; // success
+}
+
+int loadCheckpoint(char *superData) {
+    /* fills the mount state from the checkpoint, returns 0 if it is unusable */
+    tfsBlock first;
+    tfsBlock blocks;
+    tfsBlock numBlocks;
+    memcpy(&first, superData + SUPER_CHECKPOINT_OFFSET, sizeof(tfsBlock));
+    memcpy(&blocks, superData + SUPER_CHECKPOINT_BLOCKS_OFFSET, sizeof(tfsBlock));
+    memcpy(&numBlocks, superData + SUPER_NUM_BLOCKS_OFFSET, sizeof(tfsBlock));
+    if (first <= SUPER_BLOCK || blocks < 0 || blocks > numBlocks - first) {
+        return 0;
+    }
+    if (nameCacheInit(blocks * CHECKPOINT_MAX_ENTRIES) < 0) {
+        return EMOUNTFS; // error
+    }
+    char *chunk = (char *)scratchAlloc(MOUNT_IO_BLOCKS * BLOCKSIZE);
+    if (chunk == NULL) {
+        nameCacheFree();
+        return EMOUNTFS; // error
+    }
+    for (tfsBlock b = 0; b < blocks; b++) {
+        // straight from the disk, MOUNT_IO_BLOCKS per request, nothing else is going to read these blocks
+        if (b % MOUNT_IO_BLOCKS == 0) {
+            int count = blocks - b < MOUNT_IO_BLOCKS ? (int)(blocks - b) : MOUNT_IO_BLOCKS;
+            if (readBlocks(mountedDisk, first + b, count, chunk) < 0) {
+                scratchFree(chunk);
+                nameCacheFree();
+                return 0;
+            }
+        }
+        char *data = chunk + (b % MOUNT_IO_BLOCKS) * BLOCKSIZE;
+        if (data[BLOCK_NUMBER_OFFSET] != CHECKPOINT_BLOCK_TYPE ||
+            data[MAGIC_NUMBER_OFFSET] != MAGIC_NUMBER ||
+            (unsigned char)data[CHECKPOINT_COUNT_OFFSET] > CHECKPOINT_MAX_ENTRIES) {
+            scratchFree(chunk);
+            nameCacheFree();
+            return 0;
+        }
+        int count = (unsigned char)data[CHECKPOINT_COUNT_OFFSET];
+        for (int i = 0; i < count; i++) {
+            char *entry = data + CHECKPOINT_ENTRIES_OFFSET + i * CHECKPOINT_ENTRY_SIZE;
+            tfsBlock inode;
+            tfsBlock parentInode;
+            memcpy(&inode, entry, sizeof(tfsBlock));
+            memcpy(&parentInode, entry + sizeof(tfsBlock), sizeof(tfsBlock));
+            if (nameCacheAdd(parentInode, entry + 2 * sizeof(tfsBlock), inode) < 0) {
+                scratchFree(chunk);
+                nameCacheFree();
+                return EMOUNTFS; // error
+            }
+        }
+    }
+    scratchFree(chunk);
+    memcpy(&freeBlockCount, superData + SUPER_FREE_COUNT_OFFSET, sizeof(tfsBlock));
+    return 1; // success
+}
+
+int scanDisk(char *superData) {
+    /* Rebuilds the mount state after an unclean shutdown. Every inode in the
+    namespace goes into the name cache. Free blocks are relinked into a new free block LL in block
+    order, which also finds any that a crash cut off the old list. */
+    tfsBlock watermark;
+    tfsBlock numBlocks;
+    tfsBlock rootDirectory;
+    memcpy(&watermark, superData + SUPER_FREE_WATERMARK_OFFSET, sizeof(tfsBlock));
+    memcpy(&numBlocks, superData + SUPER_NUM_BLOCKS_OFFSET, sizeof(tfsBlock));
+    memcpy(&rootDirectory, superData + ROOT_DIR_OFFSET, sizeof(tfsBlock));
+    if (watermark <= rootDirectory || watermark > numBlocks) {
+        printf("LIBTINYFS-mount: Invalid free watermark %lld\n", (long long)watermark);
+        return EMOUNTFS; // error
+    }
+    if (nameCacheInit(watermark / 2) < 0) {
+        return EMOUNTFS; // error
+    }
+    char *chunk = (char *)scratchAlloc(MOUNT_IO_BLOCKS * BLOCKSIZE);
+    char *lastFreeData = scratchBlock();
+    tfsBlock freeHead = 0;
+    tfsBlock lastFree = 0;
+    tfsBlock freeBlocks = 0;
+    int success = chunk == NULL ? -1 : 0;
+    for (tfsBlock b = SUPER_BLOCK + 1; b < watermark && success == 0; b++) {
+        // MOUNT_IO_BLOCKS per request, relinking only ever rewrites blocks already scanned
+        if ((b - SUPER_BLOCK - 1) % MOUNT_IO_BLOCKS == 0) {
+            int count = watermark - b < MOUNT_IO_BLOCKS ? (int)(watermark - b) : MOUNT_IO_BLOCKS;
+            success = readBlocks(mountedDisk, b, count, chunk);
+        }
+        char *data = chunk + ((b - SUPER_BLOCK - 1) % MOUNT_IO_BLOCKS) * BLOCKSIZE;
+        int type = data[BLOCK_NUMBER_OFFSET];
+        if (success < 0 || type <= SUPER_BLOCK_TYPE || type == CHECKPOINT_BLOCK_TYPE ||
+            type > SHARED_BLOCK_TYPE || data[MAGIC_NUMBER_OFFSET] != MAGIC_NUMBER) {
+            printf("LIBTINYFS-mount: Invalid block %lld\n", (long long)b);
+            scratchFree(chunk);
+            scratchFree(lastFreeData);
+            nameCacheFree();
+            return EMOUNTFS; // error
+        }
+        if (type == INODE_BLOCK_TYPE && b != rootDirectory && b != dedupIndexInode) {
+            tfsBlock parentInode;
+            memcpy(&parentInode, data + INODE_PARENT_OFFSET, sizeof(tfsBlock));
+            data[INODE_FILE_NAME_OFFSET + MAX_FILE_NAME_SIZE - 1] = '\0';
+            if (nameCacheAdd(parentInode, data + INODE_FILE_NAME_OFFSET, b) < 0) {
+                scratchFree(chunk);
+                scratchFree(lastFreeData);
+                nameCacheFree();
+                return EMOUNTFS; // error
+            }
+        } else if (type == FREE_BLOCK_TYPE) {
+            // link the previous free block to this one, only rewriting it if it changed
+            if (lastFree == 0) {
+                freeHead = b;
+            } else if (relinkFreeBlock(lastFree, lastFreeData, b) < 0) {
+                scratchFree(chunk);
+                scratchFree(lastFreeData);
+                nameCacheFree();
+                return EMOUNTFS; // error
+            }
+            memcpy(lastFreeData, data, BLOCKSIZE);
+            lastFree = b;
+            freeBlocks++;
         }
-        int writeSuccess = writeBlock(diskNum, i, data);
-        if (writeSuccess < 0) {
-            // print out the block number that failed to write
-            printf("LIBTINYFS-mkfs: Error writing inode block %d to disk\n", i);
-            return ECREATFS; // error
+    }
+    if (success == 0) {
+        success = lastFree == 0 ? 1 : relinkFreeBlock(lastFree, lastFreeData, 0);
+    }
+    scratchFree(chunk);
+    scratchFree(lastFreeData);
+    if (success < 0) {
+        nameCacheFree();
+        return EMOUNTFS; // error
+    }
+    memcpy(superData + FB_OFFSET, &freeHead, sizeof(tfsBlock));
+    freeBlockCount = freeBlocks + (numBlocks - watermark);
+    return 1; // success
+}
+
+int writeCheckpoint(char *superData) {
+    /* Writes the name cache into the never used blocks right past the free
+    watermark. They are still free space, nothing is allocated, and the next
+    mount reads them back before anything can be allocated over them. Returns
+    0 if they do not fit. */
+    tfsBlock watermark;
+    tfsBlock numBlocks;
+    memcpy(&watermark, superData + SUPER_FREE_WATERMARK_OFFSET, sizeof(tfsBlock));
+    memcpy(&numBlocks, superData + SUPER_NUM_BLOCKS_OFFSET, sizeof(tfsBlock));
+    tfsBlock blocks = (nameCacheCount + CHECKPOINT_MAX_ENTRIES - 1) / CHECKPOINT_MAX_ENTRIES;
+    if (blocks > numBlocks - watermark) {
+        return 0;
+    }
+    // blocks are filled in 'chunk' and written MOUNT_IO_BLOCKS at a time
+    char *chunk = (char *)scratchAlloc(MOUNT_IO_BLOCKS * BLOCKSIZE);
+    if (chunk == NULL) {
+        return 0;
+    }
+    tfsBlock block = watermark; // first block of the chunk
+    int filled = 0; // blocks in the chunk, the last one being filled
+    int count = 0;
+    char *data = chunk;
+    memset(data, 0, BLOCKSIZE);
+    for (int i = 0; i < nameCacheBuckets; i++) {
+        for (nameCacheEntry *entry = nameCache[i]; entry != NULL; entry = entry->next) {
+            char *slot = data + CHECKPOINT_ENTRIES_OFFSET + count * CHECKPOINT_ENTRY_SIZE;
+            memcpy(slot, &entry->inode, sizeof(tfsBlock));
+            memcpy(slot + sizeof(tfsBlock), &entry->parentInode, sizeof(tfsBlock));
+            memcpy(slot + 2 * sizeof(tfsBlock), entry->name, MAX_FILE_NAME_SIZE);
+            if (++count == CHECKPOINT_MAX_ENTRIES) {
+                data[BLOCK_NUMBER_OFFSET] = CHECKPOINT_BLOCK_TYPE;
+                data[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+                data[CHECKPOINT_COUNT_OFFSET] = count;
+                if (++filled == MOUNT_IO_BLOCKS) {
+                    if (writeBlocks(mountedDisk, block, filled, chunk) < 0) {
+                        scratchFree(chunk);
+                        return 0;
+                    }
+                    block += filled;
+                    filled = 0;
+                }
+                data = chunk + filled * BLOCKSIZE;
+                memset(data, 0, BLOCKSIZE);
+                count = 0;
+            }
         }
-        free(data); // deallocate the data buffer
     }
+    if (count > 0) {
+        data[BLOCK_NUMBER_OFFSET] = CHECKPOINT_BLOCK_TYPE;
+        data[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+        data[CHECKPOINT_COUNT_OFFSET] = count;
+        filled++;
+    }
+    if (filled > 0 && writeBlocks(mountedDisk, block, filled, chunk) < 0) {
+        scratchFree(chunk);
+        return 0;
+    }
+    scratchFree(chunk);
+    memcpy(superData + SUPER_CHECKPOINT_OFFSET, &watermark, sizeof(tfsBlock));
+    memcpy(superData + SUPER_CHECKPOINT_BLOCKS_OFFSET, &blocks, sizeof(tfsBlock));
+    memcpy(superData + SUPER_FREE_COUNT_OFFSET, &freeBlockCount, sizeof(tfsBlock));
     return 1; // success
 }
 
-int tfs_mount(char *diskname){
+int tfsMount(char *diskname){
     // check if there is already a disk mounted...only one disk can be mounted at a time
     if(mountedDisk != 0) { // do you want to automatically unmount the currently mounted disk or nah?
         printf("LIBTINYFS-mount: A disk is already mounted, unmount current\ndisk to mount a new disk\n");
@@ -130,29 +3623,91 @@ int tfs_mount(char *diskname){
         printf("LIBTINYFS-mount: Could not open disk\n");
         return EMOUNTFS; // error 
     }
+    // start with an empty block cache and fresh read-ahead counters
+    memset(&raStats, 0, sizeof(readAheadStats));
+    cacheReset();
     // get the max number of files value
-    char *superData = (char *)malloc(BLOCKSIZE);
-    int success = readBlock(mountedDisk, SUPER_BLOCK, superData);
+    char *superData = scratchBlock();
+    int success = cachedReadBlock(SUPER_BLOCK, superData);
     if (success < 0) {
         printf("LIBTINYFS-mount: Issue with super block read when mounting disk\n");
         return EMOUNTFS; // error 
     }
     memcpy(&maxNumberOfFiles, superData + SUPER_MAX_NUM_FILES_OFFSET, sizeof(int));
+    // refuse images written in another on disk format
+    int formatVersion;
+    memcpy(&formatVersion, superData + SUPER_FORMAT_VERSION_OFFSET, sizeof(int));
+    if (formatVersion != TFS_FORMAT_VERSION) {
+        printf("LIBTINYFS-mount: Unsupported format version %d, expected %d\n", formatVersion, TFS_FORMAT_VERSION);
+        scratchFree(superData);
+        closeDisk(mountedDisk);
+        mountedDisk = 0;
+        return EMOUNTFS; // error
+    }
+    // nothing in a super block that fails its checksum can be trusted
+    if (!superBlockValid(superData)) {
+        printf("LIBTINYFS-mount: Super block checksum mismatch\n");
+        scratchFree(superData);
+        closeDisk(mountedDisk);
+        mountedDisk = 0;
+        return EMOUNTFS; // error
+    }
+    // a feature this library does not know could change what any block means
+    int unknownFeatures = (unsigned char)superData[SUPER_FEATURES_OFFSET] & ~SUPER_FEATURES_KNOWN;
+    if (unknownFeatures) {
+        printf("LIBTINYFS-mount: Unknown features 0x%x\n", unknownFeatures);
+        scratchFree(superData);
+        closeDisk(mountedDisk);
+        mountedDisk = 0;
+        return EMOUNTFS; // error
+    }
+    // from here on libDisk checks every block read, if the disk was formatted that way
+    setDiskChecksums(mountedDisk, superData[SUPER_FEATURES_OFFSET] & SUPER_FEATURE_CHECKSUMS);
+    memcpy(&dedupIndexInode, superData + SUPER_DEDUP_INDEX_OFFSET, sizeof(tfsBlock));
 
-    // make a block sized buffer
-    char *data = (char *)malloc(BLOCKSIZE*sizeof(char));
-    // successful read? correct FS type? 
-    int i = 0;
-    while(readBlock(mountedDisk, i, data) < 0) {
-        if (data[BLOCK_NUMBER_OFFSET] <= 0 || data[BLOCK_NUMBER_OFFSET] > 4) {
-            printf("LIBTINYFS-mount: Invalid block type\n");
-            return EMOUNTFS; // error 
+    // restore the checkpoint of a clean unmount, anything else needs a full scan
+    success = 0;
+    if (superData[SUPER_STATE_OFFSET] == SUPER_STATE_CLEAN) {
+        success = loadCheckpoint(superData);
+        if (success == 0) {
+            printf("LIBTINYFS-mount: Checkpoint unreadable, scanning disk\n");
         }
-        if (data[MAGIC_NUMBER_OFFSET] != MAGIC_NUMBER) {
-            printf("LIBTINYFS-mount: Invalid magic number\n");
-            return EMOUNTFS; // error 
+    } else {
+        printf("LIBTINYFS-mount: Disk was not unmounted cleanly, scanning disk\n");
+    }
+    if (success == 0) {
+        success = scanDisk(superData);
+    }
+    // a placement policy needs the free bitmap, a free block LL that does not add up is rebuilt first
+    alloc.policy = superData[SUPER_ALLOC_POLICY_OFFSET];
+    if (alloc.policy < 0 || alloc.policy >= TFS_ALLOC_POLICIES) {
+        alloc.policy = TFS_ALLOC_LIFO;
+    }
+    if (success > 0 && alloc.policy != TFS_ALLOC_LIFO) {
+        success = allocLoad(superData);
+        if (success == 0) {
+            printf("LIBTINYFS-mount: Free block list unreadable, scanning disk\n");
+            nameCacheFree();
+            success = scanDisk(superData);
+            success = success > 0 ? allocLoad(superData) : success;
+            success = success == 0 ? EMOUNTFS : success;
         }
     }
+    // the checkpoint goes stale with the first change, until the next unmount the disk is dirty
+    if (success >= 0) {
+        superData[SUPER_STATE_OFFSET] = SUPER_STATE_DIRTY;
+        success = writeSuperBlock(superData);
+    }
+    scratchFree(superData);
+    if (success < 0) {
+        printf("LIBTINYFS-mount: Could not build mount state\n");
+        nameCacheFree();
+        allocFree();
+        alloc.policy = TFS_ALLOC_LIFO;
+        closeDisk(mountedDisk);
+        mountedDisk = 0;
+        return EMOUNTFS; // error
+    }
 
     // allocate open file table
     openFileTable = (openFileTableEntry **)malloc(maxNumberOfFiles * sizeof(openFileTableEntry *));
@@ -161,200 +3716,217 @@ int tfs_mount(char *diskname){
         return EMOUNTFS; // error
     }
     // initialize open file table
-    for (i = 0; i < maxNumberOfFiles; i++) {
+    for (int i = 0; i < maxNumberOfFiles; i++) {
         openFileTable[i] = NULL;
     }
-
-    //deallocate buffer
-    free(data);
+    scratchKeep = 1; // the scratch arena lives until unmount
     return mountedDisk; // success - will be a positive number
 }
 
-int tfs_unmount(void){
+int tfsUnmount(void){
     // is there a disk to unmount?
     if (mountedDisk == 0) {
         printf("LIBTINYFS-unmount: No disk to unmount\n");
         return EUNMOUNTFS; // error
     }
-    // unmount the currently mounted disk
-    mountedDisk = 0;
-    // reset openFileTable
+    // checkpoint the mount state, the disk is only clean if that worked
+    char *superData = scratchBlock();
+    int success = cachedReadBlock(SUPER_BLOCK, superData);
+    if (success >= 0 && alloc.policy != TFS_ALLOC_LIFO) {
+        success = allocStore(superData); // the free block LL has to be right before the disk is clean
+    }
+    if (success >= 0) {
+        if (writeCheckpoint(superData) > 0) {
+            superData[SUPER_STATE_OFFSET] = SUPER_STATE_CLEAN;
+        } else {
+            printf("LIBTINYFS-unmount: No room for a checkpoint, next mount scans the disk\n");
+        }
+        success = writeSuperBlock(superData);
+    }
+    scratchFree(superData);
+    if (success < 0) {
+        printf("LIBTINYFS-unmount: Issue with super block write when unmounting disk\n");
+    }
+    // reset openFileTable, which also releases the spans files still hold
     for (int i = 0; i < maxNumberOfFiles; i++) {
         if (openFileTable[i] != NULL) {
-            free(openFileTable[i]);
+            freeOpenFileEntry(openFileTable[i]);
             openFileTable[i] = NULL;
         }
     }
     free(openFileTable);
+    // unmount the currently mounted disk, closing it flushes everything to the unix file
+    nameCacheFree();
+    defragFree();
+    allocFree();
+    alloc.policy = TFS_ALLOC_LIFO;
+    cacheReset();
+    closeDisk(mountedDisk);
+    mountedDisk = 0;
+    dedupIndexInode = 0;
+    freeSpareOpenFileEntries();
+    scratchKeep = 0; // the arena goes when this call returns
 
     openFileTable = NULL;
     return 1; // success
 }
 
-fileDescriptor tfs_openFile(char *name){
+int addOpenFileEntry(tfsBlock inodeNumber) {
+    /* puts a file in the first free slot of the open file table and returns
+    that slot as its file descriptor */
+    int currentfd = 0;
+    while (currentfd < maxNumberOfFiles && openFileTable[currentfd] != NULL) {  // find the next empty spot in the open file table
+        currentfd++;
+    }
+    if (currentfd == maxNumberOfFiles) {
+        printf("LIBTINYFS-openFile: Open file table is full\n");
+        return EOPEN; // error
+    }
+    openFileTableEntry *newEntry = spareOpenFileEntries;
+    if (newEntry != NULL) {
+        spareOpenFileEntries = newEntry->nextSpare; // a closed file's entry, its chunk buffers are reused too
+    } else {
+        newEntry = (openFileTableEntry *)malloc(sizeof(openFileTableEntry));
+        if (newEntry == NULL) {
+            printf("LIBTINYFS-openFile: Could not allocate memory for new open file table entry\n");
+            return EOPEN; // error
+        }
+        newEntry->chunkOffsets = NULL; // compressed file buffers are allocated on first read
+        newEntry->chunkCapacity = 0;
+        newEntry->chunkData = NULL;
+    }
+    newEntry->filePointer = 0; // set file pointer to beginning of file
+    newEntry->spanCount = 0;
+    resetReadCursor(newEntry);
+    newEntry->inodeNumber = inodeNumber; // set inode number
+    openFileTable[currentfd] = newEntry; // set the entry
+    return currentfd;
+}
+
+fileDescriptor tfsOpenFile(char *name){
     // creates or opens a file for reading and writing
+    if (mountedDisk == INT_NULL) {
+        printf("LIBTINYFS-openFile: No disk mounted\n");
+        return EOPEN; // error
+    }
 
-    // search our inode list for that file name
-    // read in our inode LL head pointer from the super block
-    char *superData = (char *)malloc(BLOCKSIZE);
-    int success = readBlock(mountedDisk, SUPER_BLOCK, superData);
-    if (success < 0) {
-        printf("LIBTINYFS-openFile: Issue with super block read when opening file\n");
+    // find the directory the file lives in, and look the file up in its index
+    tfsBlock parentInode;
+    char fileName[MAX_FILE_NAME_SIZE];
+    if (resolvePath(name, &parentInode, fileName) < 0) {
+        printf("LIBTINYFS-openFile: Invalid path %s\n", name);
         return EOPEN; // error
     }
-    // get root inode LL head pointer
-    int inodeHead;
-    memcpy(&inodeHead, superData + IB_OFFSET, sizeof(int));
-    // read each inode in the linked list looking for a file name that matches ours]
-    if (inodeHead != 0) { // there exists an inode to check
-        int currentInode = inodeHead;
-        char *inodeData = (char *)malloc(BLOCKSIZE);
-        char fileName[MAX_FILE_NAME_SIZE];
-        while (1) {
-            // read in the inode
-            success = readBlock(mountedDisk, currentInode, inodeData);
-            if (success < 0) {
-                printf("LIBTINYFS-openFile: Invalid pointer to inode block\n");
-                return EOPEN; // error
-            }
-            // get file name
-            memcpy(fileName, inodeData + INODE_FILE_NAME_OFFSET, MAX_FILE_NAME_SIZE*sizeof(char));
-            // check if file name matches
-            if (strcmp(fileName, name) == 0) {
-                // found the file
-                // check if file is already open
-                for (int i = 0; i < maxNumberOfFiles; i++) {
-                    if (openFileTable[i] != NULL && openFileTable[i]->inodeNumber == currentInode) {
-                        // file is already open
-                        printf("LIBTINYFS-openFile: File is already open\n");
-                        return EOPEN; // error
-                    }
-                }
-                // file is not already open
-                // add to open file table
-                openFileTableEntry *newEntry = (openFileTableEntry *)malloc(sizeof(openFileTableEntry));
-                if (newEntry == NULL) {
-                    printf("LIBTINYFS-openFile: Could not allocate memory for new open file table entr\ny");
-                    return EOPEN; // error
-                }
-                newEntry->filePointer = 0; // set file pointer to beginning of file
-                int currentfd = 0;
-                while (openFileTable[currentfd] != NULL) {  // find the next empty spot in the open file table
-                    currentfd++;
-                }
-                newEntry->inodeNumber = currentInode; // set inode number
-                openFileTable[currentfd] = newEntry; // set the entry
-                // update the time stamps
-                char *timeStampBuffer = (char *)malloc(TIMESTAMP_BUFFER_SIZE);
-                getTimestamp(timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-                // zero out the last accessed timestamp
-                memset(inodeData + INODE_ACC_TIME_STAMP_OFFSET, 0, TIMESTAMP_BUFFER_SIZE);
-                // set the last accessed timestamp
-                memcpy(inodeData + INODE_ACC_TIME_STAMP_OFFSET, timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-                // write the inode back to disk
-                int writeSuccess = writeBlock(mountedDisk, currentInode, inodeData);
-                if (writeSuccess < 0) {
-                    printf("LIBTINYFS-openFile: Issue with inode block write when opening file\n");
-                    return EOPEN; // error
-                }
-                return currentfd; // return file descriptor
-            }
-            // clear fileName for the next iteration
-            memset(fileName, 0, MAX_FILE_NAME_SIZE*sizeof(char));
-            if (inodeData[INODE_NEXT_INODE_OFFSET] == 0) {
-                // no more inodes to check, need this pointer to our last inode
-                break;
-            }
-            // get next inode 
-            memcpy(&currentInode, inodeData + INODE_NEXT_INODE_OFFSET, sizeof(int)); 
-            // clear inodeData for the next iteration
-            memset(inodeData, 0, BLOCKSIZE);
-        }
-        free(inodeData);
+    tfsBlock currentInode = dirLookup(parentInode, fileName);
+    if (currentInode < 0) {
+        printf("LIBTINYFS-openFile: Issue with directory lookup when opening file\n");
+        return EOPEN; // error
     }
-    // if not in our list, allocate a new inode for the file
-    // read in our free block LL head pointer from the super block
-    int freeBlockHead;
-    memcpy(&freeBlockHead, superData + FB_OFFSET, sizeof(int));
-    // check if there are any free blocks
-    if (freeBlockHead == 0) {
-        printf("LIBTINYFS-openFile: No free blocks\n");
-        return ENOSPC; // error
+    if (currentInode == 0) {
+        // if not in the directory, allocate a new inode for the file
+        currentInode = createInode(parentInode, fileName, 0);
+        if (currentInode < 0) {
+            printf("LIBTINYFS-openFile: Could not create %s\n", name);
+            return currentInode == ENOSPC ? ENOSPC : EOPEN; // error
+        }
+        return addOpenFileEntry(currentInode); // return file descriptor
     }
-    // get the first free block
-    char *freeBlockData = (char *)malloc(BLOCKSIZE);
-    success = readBlock(mountedDisk, freeBlockHead, freeBlockData);
+
+    // found the file
+    char *inodeData = scratchBlock();
+    int success = cachedReadBlock(currentInode, inodeData);
     if (success < 0) {
-        printf("LIBTINYFS-openFile: Invalid pointer to free block\n");
+        scratchFree(inodeData);
+        printf("LIBTINYFS-openFile: Invalid pointer to inode block\n");
         return EOPEN; // error
     }
-
-    // get the next free block
-    int nextFreeBlock;
-    memcpy(&nextFreeBlock, freeBlockData + FREE_NEXT_BLOCK_OFFSET, sizeof(int));
-    // update the free block LL head pointer in the super block, removing the block from the free
-    // block LL
-    memcpy(superData + FB_OFFSET, &nextFreeBlock, sizeof(int));
-    // turn the free block into an inode block
-    int newInodeBlockNum = freeBlockHead;
-    freeBlockData[BLOCK_NUMBER_OFFSET] = INODE_BLOCK_TYPE; // block type -> inode block
-    freeBlockData[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
-    // set the next inode pointer
-    // get the next inode block from the super block
-    memcpy(&inodeHead, superData + IB_OFFSET, sizeof(int));
-    memcpy(freeBlockData + INODE_NEXT_INODE_OFFSET, &inodeHead, sizeof(int));
-    // update the super block to point to our new inode block
-    memcpy(superData + IB_OFFSET, &newInodeBlockNum, sizeof(int));
-    // set the file size to 0
-    int fileSize = 0;
-    memcpy(freeBlockData + INODE_FILE_SIZE_OFFSET, &fileSize, sizeof(int));
-    // set data block pointer to 0
-    int dataBlockPointer = 0;
-    memcpy(freeBlockData + INODE_DATA_BLOCK_OFFSET, &dataBlockPointer, sizeof(int));
-    // set file name
-    memset(freeBlockData + INODE_FILE_NAME_OFFSET, 0, MAX_FILE_NAME_SIZE*sizeof(char));
-    memcpy(freeBlockData + INODE_FILE_NAME_OFFSET, name, strlen(name)*sizeof(char)); 
-    // set time stamp
-    char * timeStampBuffer = (char *)malloc(TIMESTAMP_BUFFER_SIZE);
-    getTimestamp(timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-    memcpy(freeBlockData + INODE_CR8_TIME_STAMP_OFFSET, timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-    memcpy(freeBlockData + INODE_MOD_TIME_STAMP_OFFSET, timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-    memcpy(freeBlockData + INODE_ACC_TIME_STAMP_OFFSET, timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-    // write the super block back to disk
-    int writeSuccess = writeBlock(mountedDisk, SUPER_BLOCK, superData); 
-    if (writeSuccess < 0) {
-        printf("LIBTINYFS-openFile: Issue with super block write when opening file\n");
+    if (inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_DIRECTORY) {
+        scratchFree(inodeData);
+        printf("LIBTINYFS-openFile: %s is a directory\n", name);
         return EOPEN; // error
     }
-    // write the inode block back to disk
-    writeSuccess = writeBlock(mountedDisk, newInodeBlockNum, freeBlockData);
+    // check if file is already open
+    for (int i = 0; i < maxNumberOfFiles; i++) {
+        if (openFileTable[i] != NULL && openFileTable[i]->inodeNumber == currentInode) {
+            // file is already open
+            scratchFree(inodeData);
+            printf("LIBTINYFS-openFile: File is already open\n");
+            return EOPEN; // error
+        }
+    }
+    // update the time stamps
+    setTimestamp(inodeData, INODE_ACC_TIME_STAMP_OFFSET, getTimestamp());
+    // write the inode back to disk
+    int writeSuccess = cachedWriteBlock(currentInode, inodeData);
+    scratchFree(inodeData);
     if (writeSuccess < 0) {
         printf("LIBTINYFS-openFile: Issue with inode block write when opening file\n");
         return EOPEN; // error
     }
-    // add to open file table
-    openFileTableEntry *newEntry = (openFileTableEntry *)malloc(sizeof(openFileTableEntry));
-    if (newEntry == NULL) {
-        printf("LIBTINYFS-openFile: Could not allocate memory for new open file table entry\n");
-        return EOPEN; // error
+    return addOpenFileEntry(currentInode); // return file descriptor
+}
+
+int tfsMkdir(char *path) {
+    if (mountedDisk == INT_NULL) {
+        printf("LIBTINYFS-mkdir: No disk mounted\n");
+        return EMOUNTFS; // error
     }
-    newEntry->filePointer = 0; // set file pointer to beginning of file
-    // find the next empty spot in the open file table
-    int currentfd = 0;
-    while (openFileTable[currentfd] != NULL) {
-        currentfd++;
+    tfsBlock parentInode;
+    char dirName[MAX_FILE_NAME_SIZE];
+    if (resolvePath(path, &parentInode, dirName) < 0) {
+        printf("LIBTINYFS-mkdir: Invalid path %s\n", path);
+        return EDIR; // error
+    }
+    tfsBlock existing = dirLookup(parentInode, dirName);
+    if (existing != 0) {
+        printf("LIBTINYFS-mkdir: %s already exists\n", path);
+        return EDIR; // error
     }
-    newEntry->inodeNumber = newInodeBlockNum; // set inode number
-    // set the entry
-    openFileTable[currentfd] = newEntry;
-    // free everything we dont need anymore
-    free(superData);
-    free(freeBlockData);
-    free(timeStampBuffer);
-    return currentfd; // return file descriptor
+    tfsBlock newInode = createInode(parentInode, dirName, INODE_FLAG_DIRECTORY);
+    if (newInode < 0) {
+        printf("LIBTINYFS-mkdir: Could not create %s\n", path);
+        return newInode == ENOSPC ? ENOSPC : EDIR; // error
+    }
+    return 1; // success
 }
 
-int tfs_closeFile(fileDescriptor FD) {
+int tfsRmdir(char *path) {
+    if (mountedDisk == INT_NULL) {
+        printf("LIBTINYFS-rmdir: No disk mounted\n");
+        return EMOUNTFS; // error
+    }
+    tfsBlock parentInode;
+    char dirName[MAX_FILE_NAME_SIZE];
+    if (resolvePath(path, &parentInode, dirName) < 0) {
+        printf("LIBTINYFS-rmdir: Invalid path %s\n", path);
+        return EDIR; // error
+    }
+    tfsBlock dirInode = dirLookup(parentInode, dirName);
+    char *inodeData = scratchBlock();
+    if (dirInode <= 0 || cachedReadBlock(dirInode, inodeData) < 0 ||
+        !(inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_DIRECTORY)) {
+        scratchFree(inodeData);
+        printf("LIBTINYFS-rmdir: %s is not a directory\n", path);
+        return EDIR; // error
+    }
+    int64_t entries;
+    tfsBlock treeRoot;
+    memcpy(&entries, inodeData + INODE_FILE_SIZE_OFFSET, sizeof(int64_t));
+    memcpy(&treeRoot, inodeData + INODE_DATA_BLOCK_OFFSET, sizeof(tfsBlock));
+    scratchFree(inodeData);
+    if (entries != 0) {
+        printf("LIBTINYFS-rmdir: %s is not empty\n", path);
+        return EDIR; // error
+    }
+    // empty leaves can be left behind by deletes, they go back to the free list too
+    if (dirFreeTree(treeRoot) < 0 || dirRemove(parentInode, dirName) < 0 || deallocateBlock(dirInode) < 0) {
+        printf("LIBTINYFS-rmdir: Could not remove %s\n", path);
+        return EDIR; // error
+    }
+    return 1; // success
+}
+
+int tfsCloseFile(fileDescriptor FD) {
     // check if FD is valid
     if (openFileTable[FD] == NULL) {
         printf("LIBTINYFS-closeFile: Invalid file descriptor. Cannot close file\n");
@@ -371,57 +3943,63 @@ int tfs_closeFile(fileDescriptor FD) {
         return EBADFD; // error
     }
     // free the open file table entry
-    free(openFileTable[FD]);
+    freeOpenFileEntry(openFileTable[FD]);
     openFileTable[FD] = NULL;
     return 1; // success
 }
 
-int deallocateBlock(int blockNum) {
-    /* This function takes a block number of an 
-    inode or data block and deallocates it, and 
-    adds it to the free block list */
-    // read in the block
-    char *data = (char *)malloc(BLOCKSIZE);
-    int success = readBlock(mountedDisk, blockNum, data);
-    if (success < 0) {
-        printf("LIBTINYFS-deallocateBlock: Invalid pointer to block\n");
-        return EDEALLOC; // error
+int writeChain(tfsBlock fileInode, char *buffer, int size, tfsBlock *head) {
+    /* Stores 'size' bytes in a new data block chain and sets 'head' to its
+    first block, 0 if nothing was stored. Each block is linked to the next
+    before it is written, so every block is written exactly once. Returns the
+    number of bytes stored, which is less than 'size' once the disk is full. */
+    *head = 0;
+    char *superData = scratchBlock();
+    if (cachedReadBlock(SUPER_BLOCK, superData) < 0) {
+        scratchFree(superData);
+        printf("LIBTINYFS: Error: Issue with super block read. (writeChain)\n");
+        return EFREAD; // error
     }
-    // zero out the data buffer
-    memset(data, 0, BLOCKSIZE);
-    // prep the data buffer to be written as a free block
-    data[BLOCK_NUMBER_OFFSET] = FREE_BLOCK_TYPE; // block type -> free block
-    data[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
-    // read in the super block
-    char *superData = (char *)malloc(BLOCKSIZE);
-    success = readBlock(mountedDisk, SUPER_BLOCK, superData);
-    if (success < 0) {
-        printf("LIBTINYFS-deallocateBlock: Issue with super block read when deallocating block\n");
-        return EDEALLOC; // error
+    int blocksNeeded = size / USEABLE_DATA_SIZE + (size % USEABLE_DATA_SIZE > 0 ? 1 : 0);
+    int stored = 0;
+    int success = 1;
+    char *blockData = scratchBlock();
+    allocHint(fileInode, blocksNeeded);
+    tfsBlock currentBlock = takeFreeBlock(superData);
+    *head = currentBlock > 0 ? currentBlock : 0;
+    while (currentBlock > 0 && success >= 0) {
+        memset(blockData, 0, BLOCKSIZE);
+        blockData[BLOCK_NUMBER_OFFSET] = DATA_BLOCK_TYPE;
+        blockData[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+        int length = size - stored >= USEABLE_DATA_SIZE ? USEABLE_DATA_SIZE : size - stored;
+        memcpy(blockData + DATA_BLOCK_DATA_OFFSET, buffer + stored, length);
+        stored += length;
+        blocksNeeded--;
+        // 0 ends the chain, also when we ran out of space
+        tfsBlock nextBlock = 0;
+        if (blocksNeeded != 0) {
+            nextBlock = takeFreeBlock(superData);
+            if (nextBlock < 0) {
+                nextBlock = 0;
+            }
+        }
+        memcpy(blockData + DATA_NEXT_BLOCK_OFFSET, &nextBlock, sizeof(tfsBlock));
+        success = cachedWriteBlock(currentBlock, blockData);
+        currentBlock = nextBlock;
     }
-    // get the free block LL head pointer
-    int freeBlockHead;
-    memcpy(&freeBlockHead, superData + FB_OFFSET, sizeof(int));
-    // set the next free block pointer to the current free block LL head pointer
-    memcpy(data + FREE_NEXT_BLOCK_OFFSET, &freeBlockHead, sizeof(int));
-    // update the super block to point to the new free block
-    memcpy(superData + FB_OFFSET, &blockNum, sizeof(int));
-    // write the super block back to disk
-    int writeSuccess = writeBlock(mountedDisk, SUPER_BLOCK, superData);
-    if (writeSuccess < 0) {
-        printf("LIBTINYFS-deallocateBlock: Issue with super block write when deallocating block\n");
-        return EDEALLOC; // error
+    if (success >= 0) {
+        success = writeSuperBlock(superData);
     }
-    // write the free block back to disk
-    writeSuccess = writeBlock(mountedDisk, blockNum, data);
-    if (writeSuccess < 0) {
-        printf("LIBTINYFS-deallocateBlock: Issue with free block write when deallocating block\n");
-        return EDEALLOC; // error
+    scratchFree(superData);
+    scratchFree(blockData);
+    if (success < 0) {
+        printf("LIBTINYFS: Error: Data block chain could not be written. (writeChain)\n");
+        return EFWRITE; // error
     }
-    return 1; // success
+    return stored;
 }
 
-int tfs_writeFile(fileDescriptor FD,char *buffer, int size){
+int tfsWriteFile(fileDescriptor FD,char *buffer, int size){
     if (mountedDisk == 0) {
         printf("LIBTINYFS: Error: No disk mounted. Cannot find file. (writeFile)\n");
         return EMOUNTFS; // error
@@ -433,479 +4011,1021 @@ int tfs_writeFile(fileDescriptor FD,char *buffer, int size){
         printf("LIBTINYFS: Error: File has not been opened. (writeFile)\n");
         return EBADFD; // error
     }
-    int fileInode = oftEntry->inodeNumber;
-
-    // read super block
-    char *superData = (char *)malloc(BLOCKSIZE*sizeof(char));
-    int success = readBlock(mountedDisk, SUPER_BLOCK, superData);
-
-    if (success < 0) {
-        free(superData);
-        printf("LIBTINYFS: Error: Issue with super block read. (writeFile)\n");
-        return EFREAD; // error
-    }
+    tfsBlock fileInode = oftEntry->inodeNumber;
 
     // if file open
-    char *inodeData = (char *)malloc(BLOCKSIZE*sizeof(char)); // the block data of the file's inode
-    success = readBlock(mountedDisk, fileInode, inodeData);
+    char *inodeData = scratchBlock(); // the block data of the file's inode
+    int success = cachedReadBlock(fileInode, inodeData);
     if (success < 0) {
-        free(superData);
-        free(inodeData);
+        scratchFree(inodeData);
         printf("LIBTINYFS: Error: Issue with inode read. (writeFile)\n");
         return EFREAD; // error
     }
-    
-    int currentFileSize; // get file size, used for computation
-    memcpy(&currentFileSize, inodeData + INODE_FILE_SIZE_OFFSET, sizeof(int));
-    
-    int dataBlock; // are there any data blocks that are currently used by the file
-    memcpy(&dataBlock, inodeData + INODE_DATA_BLOCK_OFFSET, sizeof(int));
+
+    tfsBlock dataBlock; // are there any data blocks that are currently used by the file
+    memcpy(&dataBlock, inodeData + INODE_DATA_BLOCK_OFFSET, sizeof(tfsBlock));
 
     // IMPLEMENTATION : Overwrite current data, write until cannot write anymore, then error
-    int blocksNeeded = size / USEABLE_DATA_SIZE + (size % USEABLE_DATA_SIZE > 0 ? 1 : 0); // number of blocks needed
-    int bufferPointer = 0;
     int remainingBytes = size;
 
-    // Check if there are current data blocks under the file
-    // if new blocks are needed, get pointer on super block on disk to get next free block
-    if (currentFileSize != 0){ // free all data blocks being used right now
-        // for each data extent block
-        int blocksToDeallocate = currentFileSize/USEABLE_DATA_SIZE + (size % USEABLE_DATA_SIZE > 0 ? 1 : 0);
-        for (int i=0; i<blocksToDeallocate; i++) {
-            char *dataBuffer = (char *)malloc(BLOCKSIZE*sizeof(char)); // the block data of the file's current data extent block
-            success = readBlock(mountedDisk, dataBlock, dataBuffer);
-
-            if (success < 0) {
-                free(inodeData);
-                free(superData);
-                printf("LIBTINYFS: Error: Data block could not be read. (writeFile)\n");
-                return EFREAD; // error
-            }
-            
-            // get the next data block before deallocating
-            int nextBlock;
-            memcpy(&nextBlock, dataBuffer + DATA_NEXT_BLOCK_OFFSET, sizeof(int));
+    // free all data blocks being used right now, inline files have none
+    if (!(inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_INLINE) &&
+        releaseChain(dataBlock, inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_DEDUP) < 0) {
+        scratchFree(inodeData);
+        printf("LIBTINYFS: Error: Could not free data blocks. (writeFile)\n");
+        return EDEALLOC; // error
+    }
 
-            // deallocate the block
-            success = deallocateBlock(dataBlock);
-            if (success < 0) {
-                free(inodeData);
-                free(superData);
-                printf("LIBTINYFS: Error: Could not deallocate data block. (writeFile)\n");
-                return EDEALLOC; // error
-            }
+    // a compressed file stores its chunk stream in place of the content
+    int fileSize = size;
+    char *stream = NULL;
+    if ((inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_COMPRESSED) && size > INODE_INLINE_CAPACITY) {
+        size = compressFile(buffer, size, &stream);
+        if (size < 0) {
+            scratchFree(inodeData);
+            return EFWRITE; // error
+        }
+        buffer = stream;
+        remainingBytes = size;
+    }
 
-            dataBlock = nextBlock;
-            free(dataBuffer);
+    tfsBlock dataExtentHead = 0;
+    memset(inodeData + INODE_INLINE_DATA_OFFSET, 0, INODE_INLINE_CAPACITY);
+    if (size <= INODE_INLINE_CAPACITY) {
+        // small enough to live in the inode itself, no data blocks needed
+        memcpy(inodeData + INODE_INLINE_DATA_OFFSET, buffer, size);
+        inodeData[INODE_FLAGS_OFFSET] |= INODE_FLAG_INLINE;
+        remainingBytes = 0;
+    } else if (inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_DEDUP) {
+        // deduplicated, the content goes to shared blocks and the chain is their block map
+        inodeData[INODE_FLAGS_OFFSET] &= ~INODE_FLAG_INLINE;
+        remainingBytes = size - writeBlockMap(buffer, size, &dataExtentHead);
+    } else {
+        // too big for the inode, the content moves out to a data block chain
+        inodeData[INODE_FLAGS_OFFSET] &= ~INODE_FLAG_INLINE;
+        int written = writeChain(fileInode, buffer, size, &dataExtentHead);
+        if (written < 0) {
+            scratchFree(inodeData);
+            scratchFree(stream);
+            printf("LIBTINYFS: Error: Data blocks could not be written. (writeFile)\n");
+            return EFWRITE; // error
         }
-        
+        remainingBytes = size - written;
     }
 
-    // get free block head which is a block number
-    int freeBlock;
-    memcpy(&freeBlock, superData + FB_OFFSET, sizeof(int));
-    int dataExtentHead = freeBlock;
+    // UPDATE INODE BLOCK
+    // update file size, a compressed stream cut short is unreadable so the file ends up empty
+    int64_t finalSize = size - remainingBytes;
+    if (stream != NULL) {
+        finalSize = remainingBytes == 0 ? fileSize : 0;
+        scratchFree(stream);
+    }
+    memcpy(inodeData + INODE_FILE_SIZE_OFFSET, &finalSize, sizeof(int64_t));
 
-    // write to free blocks
-    char *freeBuffer = (char *)malloc(BLOCKSIZE*sizeof(char));
-    while (blocksNeeded != 0) { // done writing
-        success = readBlock(mountedDisk, freeBlock, freeBuffer);
+    // change head of data extent
+    memcpy(inodeData + INODE_DATA_BLOCK_OFFSET, &dataExtentHead, sizeof(tfsBlock));
 
-        if (success < 0) {
-            free(inodeData);
-            free(superData);
-            free(freeBuffer);
-            printf("LIBTINYFS: Error: Free block could not be read. (writeFile)\n");
-            return EFREAD; // error
-        }
+    // get current time to modify timestamp
+    setTimestamp(inodeData, INODE_MOD_TIME_STAMP_OFFSET, getTimestamp());
+    // write the updated inode block
+    success = cachedWriteBlock(fileInode, inodeData);
+    if (success < 0) {
+        scratchFree(inodeData);
+        printf("LIBTINYFS: Error: Inode block could not be updated. (writeFile)\n");
+        return EFWRITE; // error
+    }
 
-        // edit block buffer
-        freeBuffer[BLOCK_NUMBER_OFFSET] = DATA_BLOCK_TYPE; // change type to a data extent block
-        int writeBufferSize = (remainingBytes >= USEABLE_DATA_SIZE ? USEABLE_DATA_SIZE : remainingBytes)*sizeof(char);
-        memcpy(freeBuffer + DATA_BLOCK_DATA_OFFSET, buffer + bufferPointer, writeBufferSize); // copy the spliced buffer into the block data
-        bufferPointer = bufferPointer + writeBufferSize;
-        remainingBytes = remainingBytes - writeBufferSize;
+    oftEntry->filePointer = 0;
+    resetReadCursor(oftEntry); // the data chain was replaced
 
-        // get the next free block 
-        int dataBlock = freeBlock;
-        memcpy(&freeBlock, freeBuffer + FREE_NEXT_BLOCK_OFFSET, sizeof(int));
+    // free memory
+    scratchFree(inodeData);
 
-        // decrement blocks needed
-        blocksNeeded--;
+    // error if incomplete write
+    if (remainingBytes > 0) {
+        printf("LIBTINYFS: Error: No free blocks. Incomplete write (writeFile)\n");
+        return EFWRITE; // error
+    }
+
+    return 1; // success
+}
 
-        if (blocksNeeded == 0) { // null next block for tail of data extent, need to save the next block pointer
-            int zero = 0;
-            memcpy(freeBuffer + DATA_NEXT_BLOCK_OFFSET, &zero, sizeof(int));
+int extendChain(openFileTableEntry *entry, char *inodeData, int64_t fileSize, int64_t newSize) {
+    /* Grows the data block chain of a file to hold 'newSize' bytes without
+    reading its content, so a file can grow past what fits in memory. The new
+    blocks are zeroed and chained first, and only linked after the last block
+    once all of them are written, so running out of space changes nothing.
+    The file size in 'inodeData' is set, the caller writes it. */
+    int64_t blocks = (fileSize + USEABLE_DATA_SIZE - 1) / USEABLE_DATA_SIZE;
+    int64_t blocksNeeded = (newSize + USEABLE_DATA_SIZE - 1) / USEABLE_DATA_SIZE;
+    if (blocksNeeded > blocks) {
+        // the new blocks go after the old last one, looked up now and again to link them
+        int64_t last = blocks - 1;
+        char *cached;
+        if (getFileBlock(entry, inodeData, last, &cached) < 0) {
+            printf("LIBTINYFS: Error: Issue with data read. (extendChain)\n");
+            return EFREAD; // error
+        }
+        char *superData = scratchBlock();
+        if (cachedReadBlock(SUPER_BLOCK, superData) < 0) {
+            scratchFree(superData);
+            printf("LIBTINYFS: Error: Issue with super block read. (extendChain)\n");
+            return EFREAD; // error
         }
+        char *blockData = scratchBlock();
+        allocHint(entry->lastBlockNumber, blocksNeeded - blocks);
+        tfsBlock first = takeFreeBlock(superData);
+        tfsBlock block = first;
+        int success = block < 0 ? (int)block : 1;
+        while (block > 0) {
+            memset(blockData, 0, BLOCKSIZE);
+            blockData[BLOCK_NUMBER_OFFSET] = DATA_BLOCK_TYPE;
+            blockData[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+            tfsBlock next = 0;
+            if (++blocks < blocksNeeded) {
+                next = takeFreeBlock(superData);
+                if (next < 0) {
+                    success = (int)next;
+                    next = 0;
+                }
+            }
+            memcpy(blockData + DATA_NEXT_BLOCK_OFFSET, &next, sizeof(tfsBlock));
+            if (cachedWriteBlock(block, blockData) < 0) {
+                success = EFWRITE;
+            }
+            block = next;
+        }
+        if (writeSuperBlock(superData) < 0) {
+            success = EFWRITE;
+        }
+        scratchFree(superData);
+        // the old last block points at the new ones, or the ones written go back
+        if (success >= 0) {
+            success = getFileBlock(entry, inodeData, last, &cached);
+        }
+        if (success >= 0) {
+            memcpy(blockData, cached, BLOCKSIZE);
+            memcpy(blockData + DATA_NEXT_BLOCK_OFFSET, &first, sizeof(tfsBlock));
+            success = cachedWriteBlock(entry->lastBlockNumber, blockData);
+        }
+        scratchFree(blockData);
+        if (success < 0) {
+            if (first > 0) {
+                releaseChain(first, 0);
+            }
+            printf("LIBTINYFS: Error: Could not grow the data chain. (extendChain)\n");
+            return success == ENOSPC ? ENOSPC : EFWRITE; // error
+        }
+        // read-ahead stopped at the old end of the chain
+        entry->raNextIndex = 0;
+        entry->raNextBlock = 0;
+    }
+    memcpy(inodeData + INODE_FILE_SIZE_OFFSET, &newSize, sizeof(int64_t));
+    return 1; // success
+}
 
-        // write to block
-        success = writeBlock(mountedDisk, dataBlock, freeBuffer);
+int tfsRead(fileDescriptor FD, char *buffer, int size); // below, a rewrite reads the whole file first
 
+int tfsPwrite(fileDescriptor FD, char *buffer, int size, int64_t offset) {
+    if (mountedDisk == INT_NULL) {
+        printf("LIBTINYFS: Error: No disk mounted. (pwrite)\n");
+        return EMOUNTFS; // error
+    }
+    if (FD < 0 || FD >= maxNumberOfFiles || openFileTable[FD] == NULL) {
+        printf("LIBTINYFS: Error: File has not been opened. (pwrite)\n");
+        return EBADFD; // error
+    }
+    if (size < 0 || offset < 0 || offset > MAX_BYTES - size) {
+        printf("LIBTINYFS: Error: Bad offset or size. (pwrite)\n");
+        return EFWRITE; // error
+    }
+    if (size == 0) {
+        return 0;
+    }
+    openFileTableEntry *oftEntry = openFileTable[FD];
+    tfsBlock fileInode = oftEntry->inodeNumber;
+    char *inodeData = scratchBlock();
+    if (cachedReadBlock(fileInode, inodeData) < 0) {
+        scratchFree(inodeData);
+        printf("LIBTINYFS: Error: Issue with inode read. (pwrite)\n");
+        return EFREAD; // error
+    }
+    int64_t fileSize;
+    tfsBlock dataHead;
+    memcpy(&fileSize, inodeData + INODE_FILE_SIZE_OFFSET, sizeof(int64_t));
+    memcpy(&dataHead, inodeData + INODE_DATA_BLOCK_OFFSET, sizeof(tfsBlock));
+    int success = 1;
+    if (offset + size > fileSize && dataHead != 0 && !isCompressedStream(inodeData) &&
+        !(inodeData[INODE_FLAGS_OFFSET] & (INODE_FLAG_INLINE | INODE_FLAG_DEDUP))) {
+        // a data block chain grows at its end, the bytes already in it stay where they are
+        success = extendChain(oftEntry, inodeData, fileSize, offset + size);
         if (success < 0) {
-            free(inodeData);
-            free(superData);
-            free(freeBuffer);
-            printf("LIBTINYFS: Error: Free block could not be written to. (writeFile)\n");
+            scratchFree(inodeData);
+            return success; // error
+        }
+        fileSize = offset + size;
+    }
+    if (offset + size > fileSize || isCompressedStream(inodeData)) {
+        // growing any other file or changing a compressed stream rewrites the whole content
+        scratchFree(inodeData);
+        if (offset + size > MAX_BUFFER_BYTES) {
+            printf("LIBTINYFS: Error: File too large to rewrite in memory. (pwrite)\n");
             return EFWRITE; // error
         }
-
-        // did we run out of free blocks before finishing?
-        if (freeBlock == 0 && blocksNeeded != 0) {
-            break;
+        int newSize = (int)(offset + size > fileSize ? offset + size : fileSize);
+        char *content = (char *)scratchAlloc(newSize);
+        if (content != NULL) {
+            memset(content, 0, newSize);
+        }
+        int64_t filePointer = oftEntry->filePointer;
+        oftEntry->filePointer = 0;
+        if (tfsRead(FD, content, (int)fileSize) != fileSize) {
+            success = EFREAD; // error
+        } else {
+            memcpy(content + offset, buffer, size);
+            success = tfsWriteFile(FD, content, newSize);
+        }
+        oftEntry->filePointer = filePointer;
+        scratchFree(content);
+        return success < 0 ? success : size;
+    }
+    if (inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_INLINE) {
+        memcpy(inodeData + INODE_INLINE_DATA_OFFSET + offset, buffer, size);
+    } else if (inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_DEDUP) {
+        // blocks may be shared with clones, they are copied rather than changed
+        success = writeMappedBlocks(oftEntry, inodeData, offset, buffer, size);
+    } else {
+        // a data block chain belongs to this file alone, its blocks are changed in place
+        char blockData[BLOCKSIZE];
+        int written = 0;
+        while (written < size && success >= 0) {
+            int64_t position = offset + written;
+            char *cached;
+            success = getFileBlock(oftEntry, inodeData, position / USEABLE_DATA_SIZE, &cached);
+            if (success < 0) {
+                break;
+            }
+            memcpy(blockData, cached, BLOCKSIZE);
+            int byteNumber = (int)(position % USEABLE_DATA_SIZE);
+            int piece = USEABLE_DATA_SIZE - byteNumber < size - written ? USEABLE_DATA_SIZE - byteNumber : size - written;
+            memcpy(blockData + DATA_BLOCK_DATA_OFFSET + byteNumber, buffer + written, piece);
+            success = cachedWriteBlock(oftEntry->lastBlockNumber, blockData);
+            written += piece;
         }
+    }
+    if (success >= 0) {
+        setTimestamp(inodeData, INODE_MOD_TIME_STAMP_OFFSET, getTimestamp());
+        success = cachedWriteBlock(fileInode, inodeData);
+    }
+    scratchFree(inodeData);
+    if (success < 0) {
+        printf("LIBTINYFS: Error: Issue with data write. (pwrite)\n");
+        return success == ENOSPC ? ENOSPC : EFWRITE; // error
+    }
+    return size;
+}
+
+int tfsDeleteFile(fileDescriptor FD) {
+    // remove the file from its directory
+    // deallocate all of its data blocks
+    // add all of the above blocks to the free block linked list
+    // remove the file from the open file table
+    if (FD < 0 || FD >= maxNumberOfFiles || openFileTable[FD] == NULL) {
+        printf("LIBTINYFS-deleteFile: invalid FD. Cannot delete file\n");
+        return EBADFD; // error
+    }
+    tfsBlock inodeToDelete = openFileTable[FD]->inodeNumber;
+    char *inodeData = scratchBlock();
+    int success = cachedReadBlock(inodeToDelete, inodeData);
+    if (success < 0) {
+        scratchFree(inodeData);
+        printf("LIBTINYFS-deleteFile: Invalid pointer to inode block\n");
+        return EDELETE; // error
+    }
+    // take the file out of its parent directory's index
+    tfsBlock parentInode;
+    char fileName[MAX_FILE_NAME_SIZE];
+    memcpy(&parentInode, inodeData + INODE_PARENT_OFFSET, sizeof(tfsBlock));
+    memcpy(fileName, inodeData + INODE_FILE_NAME_OFFSET, MAX_FILE_NAME_SIZE);
+    if (dirRemove(parentInode, fileName) < 0) {
+        scratchFree(inodeData);
+        printf("LIBTINYFS-deleteFile: Issue with directory update when deleting file\n");
+        return EDELETE; // error
+    }
+    // get the data block pointer, inline files have none
+    tfsBlock dataBlockPointer;
+    memcpy(&dataBlockPointer, inodeData + INODE_DATA_BLOCK_OFFSET, sizeof(tfsBlock));
+    if (dataBlockPointer != 0 && releaseChain(dataBlockPointer, inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_DEDUP) < 0) {
+        scratchFree(inodeData);
+        printf("LIBTINYFS-deleteFile: Invalid pointer to data block\n");
+        return EDELETE; // error
+    }
+    // deallocate the inode
+    deallocateBlock(inodeToDelete);
+    tfs_closeFile(FD);
+    scratchFree(inodeData);
+    return 1; // success
+}
+
+int64_t tfsSeek(fileDescriptor FD, int64_t offset){
+    if (mountedDisk == INT_NULL) {
+        printf("LIBTINYFS: Error: No disk mounted. Cannot find file. (seek)\n");
+        return EMOUNTFS; // error
+    }
+
+    // check if FD is in OFT
+    if (FD < 0 || FD >= maxNumberOfFiles || openFileTable[FD] == NULL) {
+        printf("LIBTINYFS: Error: File has not been opened. (seek)\n");
+        return EBADFD; // error
+    }
+    openFileTableEntry *oftEntry = openFileTable[FD];
+
+    // every read starts from the pointer, it must never go below the start of the file
+    int64_t fp = oftEntry->filePointer + offset;
+    if (fp < 0) {
+        printf("LIBTINYFS: Error: Seek to %lld is before the start of the file. (seek)\n", (long long)fp);
+        return EFSEEK; // error
+    }
+    oftEntry->filePointer = fp;
+
+    return fp; // success, returns new file pointer
+}
+
+int tfsReadByte(fileDescriptor FD, char *buffer){
+    if (mountedDisk == INT_NULL) {
+        printf("LIBTINYFS: Error: No disk mounted. Cannot find file. (readByte)\n");
+        return EMOUNTFS; // error
+    }
 
+    // check if FD is in OFT
+    openFileTableEntry *oftEntry = openFileTable[FD];
+    if (oftEntry == NULL) {
+        printf("LIBTINYFS: Error: File has not been opened. (readByte)\n");
+        return EBADFD; // error
     }
+    tfsBlock fileInode = oftEntry->inodeNumber;
+    int64_t filePointer = oftEntry->filePointer;
 
-    // UPDATE SUPER NODE
-    memcpy(superData + FB_OFFSET, &freeBlock, sizeof(int)); // was IB offset
-    success = writeBlock(mountedDisk, SUPER_BLOCK, superData);
+    // if file open
+    char *inodeData = scratchBlock(); // the block data of the file's inode
+    int success = cachedReadBlock(fileInode, inodeData);
     if (success < 0) {
-        free(inodeData);
-        free(superData);
-        free(freeBuffer);
-        printf("LIBTINYFS: Error: Super block could not be updated. (writeFile)\n");
-        return EFWRITE; // error
+        scratchFree(inodeData);
+        printf("LIBTINYFS: Error: Issue with inode read. (readByte)\n");
+        return EFREAD; // error
     }
+    
+    int64_t currentFileSize; // get file size, used for computation
+    memcpy(&currentFileSize, inodeData + INODE_FILE_SIZE_OFFSET, sizeof(int64_t));
 
-    // UPDATE INODE BLOCK
-    // update file size
-    int finalSize = size - remainingBytes;
-    memcpy(inodeData + INODE_FILE_SIZE_OFFSET, &finalSize, sizeof(int));
+    if (filePointer < 0 || filePointer >= currentFileSize) {
+        scratchFree(inodeData);
+        printf("\nLIBTINYFS: Error: File pointer out of bounds, EOF. (readByte)\n");
+        return EBREAD; // error
+    }
 
-    // change head of data extent
-    memcpy(inodeData + INODE_DATA_BLOCK_OFFSET, &dataExtentHead, sizeof(int));
+    int64_t blockNumber = filePointer / USEABLE_DATA_SIZE; // which block to seek to
+    int byteNumber = (int)(filePointer % USEABLE_DATA_SIZE); // which byte to seek to in blockNumber
+
+    char *blockData;
+    if (isCompressedStream(inodeData)) {
+        // compressed file, the byte comes out of its chunk
+        if (readCompressed(oftEntry, inodeData, (int)currentFileSize, (int)filePointer, buffer, 1) < 0) {
+            scratchFree(inodeData);
+            printf("LIBTINYFS: Error: Issue with data read. (readByte)\n");
+            return EFREAD; // error
+        }
+    } else if (inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_INLINE) {
+        // inline file, the byte is in the inode we already read
+        memcpy(buffer, inodeData + INODE_INLINE_DATA_OFFSET + filePointer, sizeof(char));
+    } else {
+        success = getFileBlock(oftEntry, inodeData, blockNumber, &blockData);
+        if (success < 0) {
+            scratchFree(inodeData);
+            printf("LIBTINYFS: Error: Issue with data read. (readByte)\n");
+            return EFREAD; // error
+        }
+
+        memcpy(buffer, blockData + DATA_BLOCK_DATA_OFFSET + byteNumber, sizeof(char)); // get byte of data at byteNumbe in blockNumber 
+    }
+
+    tfs_seek(FD, 1); // increment pointer
 
+    // UPDATE INODE BLOCK
     // get current time to modify timestamp
-    char * timeStampBuffer = (char *)malloc(TIMESTAMP_BUFFER_SIZE);
-    getTimestamp(timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-    memcpy(inodeData + INODE_MOD_TIME_STAMP_OFFSET, timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-    free(timeStampBuffer);
+    setTimestamp(inodeData, INODE_ACC_TIME_STAMP_OFFSET, getTimestamp());
     // write the updated inode block
-    success = writeBlock(mountedDisk, fileInode, inodeData);
+    success = cachedWriteBlock(fileInode, inodeData);
     if (success < 0) {
-        free(inodeData);
-        free(superData);
-        free(freeBuffer);
-        printf("LIBTINYFS: Error: Inode block could not be updated. (writeFile)\n");
+        scratchFree(inodeData);
+        printf("LIBTINYFS: Error: Inode block could not be updated. (readByte)\n");
         return EFWRITE; // error
     }
 
-    oftEntry->filePointer = 0;
-
     // free memory
-    free(inodeData);
-    free(superData);
-    free(freeBuffer);
+    scratchFree(inodeData);
 
-    // error if incomplete write
-    if (blocksNeeded > 0) {
-        printf("LIBTINYFS: Error: No free blocks. Incomplete write (writeFile)\n");
+    return 1; // success
+}
+
+int tfsRead(fileDescriptor FD, char *buffer, int size) {
+    if (mountedDisk == INT_NULL) {
+        printf("LIBTINYFS: Error: No disk mounted. Cannot find file. (read)\n");
+        return EMOUNTFS; // error
+    }
+    if (FD < 0 || FD >= maxNumberOfFiles || openFileTable[FD] == NULL) {
+        printf("LIBTINYFS: Error: File has not been opened. (read)\n");
+        return EBADFD; // error
+    }
+    if (size < 0) {
+        printf("LIBTINYFS: Error: Negative read size. (read)\n");
+        return EBREAD; // error
+    }
+    openFileTableEntry *oftEntry = openFileTable[FD];
+    tfsBlock fileInode = oftEntry->inodeNumber;
+    int64_t filePointer = oftEntry->filePointer;
+
+    char *inodeData = scratchBlock();
+    int success = cachedReadBlock(fileInode, inodeData);
+    if (success < 0) {
+        scratchFree(inodeData);
+        printf("LIBTINYFS: Error: Issue with inode read. (read)\n");
+        return EFREAD; // error
+    }
+    int64_t currentFileSize;
+    memcpy(&currentFileSize, inodeData + INODE_FILE_SIZE_OFFSET, sizeof(int64_t));
+
+    if (filePointer < 0) {
+        scratchFree(inodeData);
+        printf("LIBTINYFS: Error: File pointer before the start of the file. (read)\n");
+        return EBREAD; // error
+    }
+    if (filePointer >= currentFileSize || size == 0) {
+        scratchFree(inodeData);
+        return 0; // end of file, nothing read
+    }
+    int bytesToRead = currentFileSize - filePointer < size ? (int)(currentFileSize - filePointer) : size;
+
+    // copy a block at a time straight out of the block cache, getDataBlock keeps our place in the chain
+    char *blockData;
+    int bytesRead = 0;
+    if (isCompressedStream(inodeData)) {
+        // compressed file, only the chunks in range are decompressed
+        if (readCompressed(oftEntry, inodeData, (int)currentFileSize, (int)filePointer, buffer, bytesToRead) < 0) {
+            scratchFree(inodeData);
+            printf("LIBTINYFS: Error: Issue with data read. (read)\n");
+            return EFREAD; // error
+        }
+        bytesRead = bytesToRead;
+        filePointer += bytesToRead;
+    } else if (inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_INLINE) {
+        // inline file, everything is in the inode we already read
+        memcpy(buffer, inodeData + INODE_INLINE_DATA_OFFSET + filePointer, bytesToRead);
+        bytesRead = bytesToRead;
+        filePointer += bytesToRead;
+    }
+    while (bytesRead < bytesToRead) {
+        int64_t blockNumber = filePointer / USEABLE_DATA_SIZE;
+        int byteNumber = (int)(filePointer % USEABLE_DATA_SIZE);
+        success = getFileBlock(oftEntry, inodeData, blockNumber, &blockData);
+        if (success < 0) {
+            scratchFree(inodeData);
+            printf("LIBTINYFS: Error: Issue with data read. (read)\n");
+            return EFREAD; // error
+        }
+        int chunk = USEABLE_DATA_SIZE - byteNumber;
+        if (chunk > bytesToRead - bytesRead) {
+            chunk = bytesToRead - bytesRead;
+        }
+        memcpy(buffer + bytesRead, blockData + DATA_BLOCK_DATA_OFFSET + byteNumber, chunk);
+        bytesRead += chunk;
+        filePointer += chunk;
+    }
+    oftEntry->filePointer = filePointer;
+
+    // UPDATE INODE BLOCK, once per call rather than once per byte
+    setTimestamp(inodeData, INODE_ACC_TIME_STAMP_OFFSET, getTimestamp());
+    success = cachedWriteBlock(fileInode, inodeData);
+    scratchFree(inodeData);
+    if (success < 0) {
+        printf("LIBTINYFS: Error: Inode block could not be updated. (read)\n");
         return EFWRITE; // error
     }
+    return bytesRead;
+}
 
-    return 1; // success
+int pinSpan(openFileTableEntry *entry, tfsSpan *span, char *data, int length, char *block) {
+    /* hands out 'length' bytes at 'data' as the file's next span, pinning the
+    cache entry whose copy of a block 'block' points at, NULL for chunkData */
+    int slot = -1;
+    if (block != NULL) {
+        slot = (int)((block - (char *)blockCache) / sizeof(cacheEntry));
+        blockCache[slot].pins++;
+        pinnedSpans++;
+    }
+    entry->spanSlots[entry->spanCount++] = slot;
+    span->data = data;
+    span->length = length;
+    return length;
 }
 
-int tfs_deleteFile(fileDescriptor FD) {
-    // remove the file from the inode linked list
-    // deallocate all of its data blocks
-    // add all of the above blocks to the free block linked list- make a function for this prob
-    // remove the file from the open file table
-    if (openFileTable[FD] == NULL) {
-        printf("LIBTINYFS-deleteFile: invalid FD. Cannot delete file\n");
+int tfsReadvBegin(fileDescriptor FD, tfsSpan spans[], int max) {
+    /* Zero-copy version of tfsRead. The spans point at the payload of the
+    cached blocks, or at the file's decompressed chunk, and the cache blocks are
+    pinned until tfsReadvRelease so they can not be evicted under the caller. */
+    if (mountedDisk == INT_NULL) {
+        printf("LIBTINYFS: Error: No disk mounted. Cannot find file. (readv)\n");
+        return EMOUNTFS; // error
+    }
+    if (FD < 0 || FD >= maxNumberOfFiles || openFileTable[FD] == NULL) {
+        printf("LIBTINYFS: Error: File has not been opened. (readv)\n");
         return EBADFD; // error
     }
-    int inodeToDelete = openFileTable[FD]->inodeNumber;
-    // read in our inode LL head pointer from the super block
-    char *superData = (char *)malloc(BLOCKSIZE);
-    int success = readBlock(mountedDisk, SUPER_BLOCK, superData);   
-    if (success < 0) {
-        printf("LIBTINYFS-deleteFile: Issue with super block read when deleting file\n");
-        return EDELETE; // error
+    openFileTableEntry *oftEntry = openFileTable[FD];
+    if (oftEntry->spanCount > 0) {
+        printf("LIBTINYFS: Error: Spans of the last call have not been released. (readv)\n");
+        return EBREAD; // error
     }
-    // get root inode LL head pointer
-    int curInode;
-    char *curInodeData = (char *)malloc(BLOCKSIZE);
-    memcpy(&curInode, superData + IB_OFFSET, sizeof(int));
-    success = readBlock(mountedDisk, curInode, curInodeData);
-    if (success < 0) {
-        printf("LIBTINYFS-deleteFile: Invalid pointer to inode block\n");
-        return EDELETE; // error
+    if (max < 0) {
+        printf("LIBTINYFS: Error: Negative span count. (readv)\n");
+        return EBREAD; // error
     }
-    // check if inode to delete is the head of the inode LL
-    if (curInode == inodeToDelete) {
-        // inode to delete is the head of the inode LL
-        // update the super block to point to the next inode
-        memcpy(superData + IB_OFFSET, curInodeData + INODE_NEXT_INODE_OFFSET, sizeof(int));
-        // write the super block back to disk
-        int writeSuccess = writeBlock(mountedDisk, SUPER_BLOCK, superData); 
-        if (writeSuccess < 0) {
-            printf("LIBTINYFS-deleteFile: Issue with super block write when deleting file\n");
-            return EDELETE; // error
-        }
-    }
-    else { // inode to delete is not at the head of the linked list
-        // iterate through the inode LL until we find the inode to delete
-        int nextInode;
-        memcpy(&nextInode, curInodeData + INODE_NEXT_INODE_OFFSET, sizeof(int));
-        while (nextInode != inodeToDelete) {
-            // read in the next inode
-            success = readBlock(mountedDisk, nextInode, curInodeData);
-            if (success < 0) {
-                printf("LIBTINYFS-deleteFile: Invalid pointer to inode block\n");
-                return EDELETE; // error
-            }
-            curInode = nextInode;
-            // get the next inode
-            memcpy(&nextInode, curInodeData + INODE_NEXT_INODE_OFFSET, sizeof(int));
-        }
-        char *nextInodeData = (char *)malloc(BLOCKSIZE);
-        // read in the next inode data
-        success = readBlock(mountedDisk, nextInode, nextInodeData);
-        if (success < 0) {
-            printf("LIBTINYFS-deleteFile: Invalid pointer to inode block\n");
-            return EDELETE; // error
-        }
-        // now we have the inode before the inode to delete
-        // update the inode before the inode to delete to point to the inode after the inode to delete
-        int inodeAfterToDelete;
-        memcpy(&inodeAfterToDelete, nextInodeData + INODE_NEXT_INODE_OFFSET, sizeof(int));
-        memcpy(curInodeData + INODE_NEXT_INODE_OFFSET, &inodeAfterToDelete, sizeof(int));
-        // write the inode before the inode to delete back to disk
-        int writeSuccess = writeBlock(mountedDisk, curInode, curInodeData);
-        if (writeSuccess < 0) {
-            printf("LIBTINYFS-deleteFile: Issue with inode block write when deleting file\n");
-            return EDELETE; // error
-        }
-        free(nextInodeData);
-    }
-    // now that we have removed the inode from the inode LL, deallocate the inode and all of its data blocks
-    // read in the inode data
-    success = readBlock(mountedDisk, inodeToDelete, curInodeData);
+    if (max == 0) {
+        return 0; // nothing asked for
+    }
+    if (max > TFS_READV_MAX_SPANS - pinnedSpans) {
+        max = TFS_READV_MAX_SPANS - pinnedSpans; // other files hold the rest
+    }
+    tfsBlock fileInode = oftEntry->inodeNumber;
+    int64_t filePointer = oftEntry->filePointer;
+
+    char *inodeData = scratchBlock();
+    if (cachedReadBlock(fileInode, inodeData) < 0) {
+        scratchFree(inodeData);
+        printf("LIBTINYFS: Error: Issue with inode read. (readv)\n");
+        return EFREAD; // error
+    }
+    int64_t currentFileSize;
+    memcpy(&currentFileSize, inodeData + INODE_FILE_SIZE_OFFSET, sizeof(int64_t));
+    if (filePointer < 0) {
+        scratchFree(inodeData);
+        printf("LIBTINYFS: Error: File pointer before the start of the file. (readv)\n");
+        return EBREAD; // error
+    }
+    if (filePointer >= currentFileSize) {
+        scratchFree(inodeData);
+        return 0; // end of file, nothing read
+    }
+    if (max == 0) {
+        scratchFree(inodeData);
+        printf("LIBTINYFS: Error: All %d spans are held, release some first. (readv)\n", TFS_READV_MAX_SPANS);
+        return EBREAD; // error
+    }
+
+    // UPDATE INODE BLOCK first, an inline file's span points into the cached inode
+    setTimestamp(inodeData, INODE_ACC_TIME_STAMP_OFFSET, getTimestamp());
+    int success = cachedWriteBlock(fileInode, inodeData);
     if (success < 0) {
-        printf("LIBTINYFS-deleteFile: Invalid pointer to inode block\n");
-        return EDELETE; // error
+        scratchFree(inodeData);
+        printf("LIBTINYFS: Error: Inode block could not be updated. (readv)\n");
+        return EFWRITE; // error
     }
-    // get the data block pointer
-    int dataBlockPointer;
-    memcpy(&dataBlockPointer, curInodeData + INODE_DATA_BLOCK_OFFSET, sizeof(int));
-    if (dataBlockPointer != 0) { // need to deallocate data blocks
-        // deallocate the data blocks
-        char *dataBlock = (char *)malloc(BLOCKSIZE);
-        while (1) {
-            success = readBlock(mountedDisk, dataBlockPointer, dataBlock);
-            if (success < 0) {
-                printf("LIBTINYFS-deleteFile: Invalid pointer to data block\n");
-                return EDELETE; // error
-            }
-            // get the next data block pointer
-            int nextDataBlockPointer;
-            memcpy(&nextDataBlockPointer, dataBlock + DATA_NEXT_BLOCK_OFFSET, sizeof(int));
-            // deallocate the data block
-            deallocateBlock(dataBlockPointer);
-            // update the data block pointer
-            dataBlockPointer = nextDataBlockPointer;
-            if (dataBlockPointer == 0) {
-                // no more data blocks to deallocate
-                break;
+    if (isCompressedStream(inodeData)) {
+        // compressed file, one span over the rest of the current chunk
+        int chunk = (int)(filePointer / TFS_CHUNK_SIZE);
+        int byteNumber = (int)(filePointer % TFS_CHUNK_SIZE);
+        success = loadChunk(oftEntry, inodeData, (int)currentFileSize, chunk);
+        if (success >= 0) {
+            int length = TFS_CHUNK_SIZE - byteNumber < currentFileSize - filePointer ? TFS_CHUNK_SIZE - byteNumber : (int)(currentFileSize - filePointer);
+            filePointer += pinSpan(oftEntry, &spans[0], oftEntry->chunkData + byteNumber, length, NULL);
+        }
+    } else if (inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_INLINE) {
+        // inline file, one span over the rest of the inode
+        cacheEntry *cached = cacheFetch(fileInode);
+        success = cached == NULL ? EFREAD : 1;
+        if (success >= 0) {
+            filePointer += pinSpan(oftEntry, &spans[0], cached->data + INODE_INLINE_DATA_OFFSET + filePointer,
+                (int)(currentFileSize - filePointer), cached->data);
+        }
+    } else {
+        // a span per block, the block pinned right away so the next ones can not evict it
+        while (oftEntry->spanCount < max && filePointer < currentFileSize && success >= 0) {
+            char *blockData;
+            success = getFileBlock(oftEntry, inodeData, filePointer / USEABLE_DATA_SIZE, &blockData);
+            if (success >= 0) {
+                int byteNumber = (int)(filePointer % USEABLE_DATA_SIZE);
+                int length = USEABLE_DATA_SIZE - byteNumber < currentFileSize - filePointer ? USEABLE_DATA_SIZE - byteNumber : (int)(currentFileSize - filePointer);
+                filePointer += pinSpan(oftEntry, &spans[oftEntry->spanCount], blockData + DATA_BLOCK_DATA_OFFSET + byteNumber, length, blockData);
             }
         }
-        free(dataBlock);
     }
-    // deallocate the inode
-    deallocateBlock(inodeToDelete);
-    tfs_closeFile(FD);
-    free(superData);
-    free(curInodeData);
-    return 1; // success
+    scratchFree(inodeData);
+    if (success < 0) {
+        releaseSpans(oftEntry);
+        printf("LIBTINYFS: Error: Issue with data read. (readv)\n");
+        return EFREAD; // error
+    }
+    oftEntry->filePointer = filePointer;
+    return oftEntry->spanCount;
 }
 
-int tfs_seek(fileDescriptor FD, int offset){
+int tfs_readv_release(fileDescriptor FD) {
     if (mountedDisk == INT_NULL) {
-        printf("LIBTINYFS: Error: No disk mounted. Cannot find file. (seek)\n");
+        printf("LIBTINYFS: Error: No disk mounted. Cannot find file. (readv_release)\n");
         return EMOUNTFS; // error
     }
-
-    // check if FD is in OFT
-    openFileTableEntry *oftEntry = openFileTable[FD];
-    if (oftEntry == NULL) {
-        printf("LIBTINYFS: Error: File has not been opened. (seek)\n");
+    if (FD < 0 || FD >= maxNumberOfFiles || openFileTable[FD] == NULL) {
+        printf("LIBTINYFS: Error: File has not been opened. (readv_release)\n");
         return EBADFD; // error
     }
-
-    int fp = oftEntry->filePointer + offset;
-    oftEntry->filePointer = fp;
-
-    return fp; // success, returns new file pointer
+    releaseSpans(openFileTable[FD]);
+    return 1; // success
 }
 
-int tfs_readByte(fileDescriptor FD, char *buffer){
+int changeStorage(fileDescriptor FD, int flag, int enabled, char *caller) {
+    /* Turns one of INODE_FLAG_COMPRESSED and INODE_FLAG_DEDUP on or off. The
+    content is stored the new way first and the inode switched over to it, the
+    old blocks are freed last, so running out of space leaves the file as it was. */
     if (mountedDisk == INT_NULL) {
-        printf("LIBTINYFS: Error: No disk mounted. Cannot find file. (readByte)\n");
+        printf("LIBTINYFS: Error: No disk mounted. (%s)\n", caller);
         return EMOUNTFS; // error
     }
-
-    // check if FD is in OFT
-    openFileTableEntry *oftEntry = openFileTable[FD];
-    if (oftEntry == NULL) {
-        printf("LIBTINYFS: Error: File has not been opened. (readByte)\n");
+    if (FD < 0 || FD >= maxNumberOfFiles || openFileTable[FD] == NULL) {
+        printf("LIBTINYFS: Error: File has not been opened. (%s)\n", caller);
         return EBADFD; // error
     }
-    int fileInode = oftEntry->inodeNumber;
-    int filePointer = oftEntry->filePointer;
-
-    // if file open
-    char *inodeData = (char *)malloc(BLOCKSIZE*sizeof(char)); // the block data of the file's inode
-    int success = readBlock(mountedDisk, fileInode, inodeData);
-    if (success < 0) {
-        free(inodeData);
-        printf("LIBTINYFS: Error: Issue with inode read. (readByte)\n");
+    openFileTableEntry *oftEntry = openFileTable[FD];
+    char *inodeData = scratchBlock();
+    if (cachedReadBlock(oftEntry->inodeNumber, inodeData) < 0) {
+        scratchFree(inodeData);
+        printf("LIBTINYFS: Error: Issue with inode read. (%s)\n", caller);
         return EFREAD; // error
     }
-    
-    int currentFileSize; // get file size, used for computation
-    memcpy(&currentFileSize, inodeData + INODE_FILE_SIZE_OFFSET, sizeof(int));
-    
-    int dataBlock; // are there any data blocks that are currently used by the file
-    memcpy(&dataBlock, inodeData + INODE_DATA_BLOCK_OFFSET, sizeof(int));
-
-    if (filePointer >= currentFileSize) {
-        free(inodeData);
-        printf("\nLIBTINYFS: Error: File pointer out of bounds, EOF. (readByte)\n");
-        return EBREAD; // error
+    int64_t fileSize;
+    memcpy(&fileSize, inodeData + INODE_FILE_SIZE_OFFSET, sizeof(int64_t));
+    int flags = inodeData[INODE_FLAGS_OFFSET];
+    scratchFree(inodeData);
+    oftEntry->filePointer = 0;
+    if (((flags & flag) != 0) == (enabled != 0)) {
+        return 1; // nothing to change
     }
+    if (fileSize > MAX_BUFFER_BYTES) {
+        printf("LIBTINYFS: Error: File too large to rewrite in memory. (%s)\n", caller);
+        return EFWRITE; // error
+    }
+    char *content = (char *)scratchAlloc(fileSize > 0 ? fileSize : 1);
+    if (tfsRead(FD, content, (int)fileSize) != fileSize) {
+        scratchFree(content);
+        printf("LIBTINYFS: Error: Could not read the current content. (%s)\n", caller);
+        return EFREAD; // error
+    }
+    oftEntry->filePointer = 0;
 
-    int blockNumber = filePointer / USEABLE_DATA_SIZE; // which block to seek to
-    int byteNumber = filePointer % USEABLE_DATA_SIZE; // which byte to seek to in blockNumber
+    // store the content the new way, next to the old copy
+    int newFlags = flags ^ flag;
+    char *stream = NULL;
+    char *data = content;
+    int size = (int)fileSize;
+    if ((newFlags & INODE_FLAG_COMPRESSED) && size > INODE_INLINE_CAPACITY) {
+        size = compressFile(content, size, &stream);
+        data = stream;
+    }
+    tfsBlock head = 0;
+    int stored = size;
+    if (size > INODE_INLINE_CAPACITY) {
+        stored = (newFlags & INODE_FLAG_DEDUP) ? writeBlockMap(data, size, &head)
+                                               : writeChain(oftEntry->inodeNumber, data, size, &head);
+    }
+    int success = size < 0 ? EFWRITE : stored < 0 ? stored : stored < size ? ENOSPC : 1;
 
-    // printf("Block Num: %d, Byte Num:%d\n", blockNumber, byteNumber);
-    
-    char *blockData = (char *)malloc(BLOCKSIZE*sizeof(char));
-    success = readBlock(mountedDisk, dataBlock, blockData);
-    if (success < 0) {
-        free(inodeData);
-        free(blockData);
-        printf("LIBTINYFS: Error: Issue with data read. (readByte)\n");
-        return EFREAD; // error
+    // switch the inode over to it
+    inodeData = scratchBlock();
+    tfsBlock oldHead = 0;
+    if (success >= 0) {
+        success = cachedReadBlock(oftEntry->inodeNumber, inodeData);
     }
-    while (blockNumber != 0) {
-        memcpy(&dataBlock, blockData + DATA_NEXT_BLOCK_OFFSET, sizeof(int)); // get the next data block
-        success = readBlock(mountedDisk, dataBlock, blockData);
-        if (success < 0) {
-            free(inodeData);
-            free(blockData);
-            printf("LIBTINYFS: Error: Issue with data read. (readByte)\n");
-            return EFREAD; // error
+    if (success >= 0) {
+        memcpy(&oldHead, inodeData + INODE_DATA_BLOCK_OFFSET, sizeof(tfsBlock));
+        memset(inodeData + INODE_INLINE_DATA_OFFSET, 0, INODE_INLINE_CAPACITY);
+        if (size <= INODE_INLINE_CAPACITY) {
+            memcpy(inodeData + INODE_INLINE_DATA_OFFSET, data, size);
+            newFlags |= INODE_FLAG_INLINE;
+        } else {
+            newFlags &= ~INODE_FLAG_INLINE;
+        }
+        inodeData[INODE_FLAGS_OFFSET] = newFlags;
+        memcpy(inodeData + INODE_DATA_BLOCK_OFFSET, &head, sizeof(tfsBlock));
+        success = cachedWriteBlock(oftEntry->inodeNumber, inodeData);
+    }
+    scratchFree(inodeData);
+    scratchFree(stream);
+    scratchFree(content);
+    if (success < 0) {
+        if (head != 0) {
+            releaseChain(head, newFlags & INODE_FLAG_DEDUP);
         }
+        printf("LIBTINYFS: Error: Could not store the content the new way. (%s)\n", caller);
+        return success == ENOSPC ? ENOSPC : EFWRITE; // error
+    }
+    resetReadCursor(oftEntry); // the data chain was replaced
 
-        blockNumber--; // decrement block number
+    // the old copy goes last
+    if (!(flags & INODE_FLAG_INLINE) && releaseChain(oldHead, flags & INODE_FLAG_DEDUP) < 0) {
+        printf("LIBTINYFS: Error: Could not free the old data blocks. (%s)\n", caller);
+        return EDEALLOC; // error
     }
+    return 1; // success
+}
 
-    memcpy(buffer, blockData + DATA_BLOCK_DATA_OFFSET + byteNumber, sizeof(char)); // get byte of data at byteNumbe in blockNumber 
+int tfsSetCompressed(fileDescriptor FD, int enabled) {
+    return changeStorage(FD, INODE_FLAG_COMPRESSED, enabled, "setCompressed");
+}
 
-    tfs_seek(FD, 1); // increment pointer
+int tfsSetDeduplicated(fileDescriptor FD, int enabled) {
+    return changeStorage(FD, INODE_FLAG_DEDUP, enabled, "setDeduplicated");
+}
 
-    // UPDATE INODE BLOCK
-    // get current time to modify timestamp
-    char * timeStampBuffer = (char *)malloc(TIMESTAMP_BUFFER_SIZE);
-    getTimestamp(timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-    memcpy(inodeData + INODE_ACC_TIME_STAMP_OFFSET, timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-    free(timeStampBuffer);
-    // write the updated inode block
-    success = writeBlock(mountedDisk, fileInode, inodeData);
-    if (success < 0) {
-        free(inodeData);
-        free(blockData);
-        printf("LIBTINYFS: Error: Inode block could not be updated. (readByte)\n");
-        return EFWRITE; // error
+int tfsClone(fileDescriptor srcFD, char *newName) {
+    if (mountedDisk == INT_NULL) {
+        printf("LIBTINYFS: Error: No disk mounted. (clone)\n");
+        return EMOUNTFS; // error
     }
+    if (srcFD < 0 || srcFD >= maxNumberOfFiles || openFileTable[srcFD] == NULL) {
+        printf("LIBTINYFS: Error: File has not been opened. (clone)\n");
+        return EBADFD; // error
+    }
+    tfsBlock parentInode;
+    char leafName[MAX_FILE_NAME_SIZE];
+    if (resolvePath(newName, &parentInode, leafName) < 0) {
+        printf("LIBTINYFS: Error: Invalid path %s. (clone)\n", newName);
+        return EOPEN; // error
+    }
+    if (dirLookup(parentInode, leafName) != 0) {
+        printf("LIBTINYFS: Error: %s already exists. (clone)\n", newName);
+        return EOPEN; // error
+    }
+    tfsBlock newInode = cloneInode(openFileTable[srcFD]->inodeNumber, parentInode, leafName);
+    return newInode < 0 ? (int)newInode : 1;
+}
 
-    // free memory
-    free(inodeData);
-    free(blockData);
-
+int tfsSnapshot(char *path) {
+    if (mountedDisk == INT_NULL) {
+        printf("LIBTINYFS-snapshot: No disk mounted\n");
+        return EMOUNTFS; // error
+    }
+    tfsBlock parentInode;
+    char dirName[MAX_FILE_NAME_SIZE];
+    if (resolvePath(path, &parentInode, dirName) < 0 || dirLookup(parentInode, dirName) != 0) {
+        printf("LIBTINYFS-snapshot: Invalid path %s, or it already exists\n", path);
+        return EDIR; // error
+    }
+    char *superData = scratchBlock();
+    if (cachedReadBlock(SUPER_BLOCK, superData) < 0) {
+        scratchFree(superData);
+        printf("LIBTINYFS-snapshot: Issue with super block read\n");
+        return EFREAD; // error
+    }
+    tfsBlock rootDirectory;
+    memcpy(&rootDirectory, superData + ROOT_DIR_OFFSET, sizeof(tfsBlock));
+    scratchFree(superData);
+    // the snapshot is flagged before the walk, so it does not end up inside itself
+    tfsBlock snapshot = createInode(parentInode, dirName, INODE_FLAG_DIRECTORY | INODE_FLAG_SNAPSHOT);
+    if (snapshot < 0) {
+        printf("LIBTINYFS-snapshot: Could not create %s\n", path);
+        return (int)snapshot; // error
+    }
+    int success = cloneTree(rootDirectory, snapshot);
+    if (success < 0) {
+        // a partial snapshot is no snapshot, what it took goes back
+        if (dirRemove(parentInode, dirName) < 0 || removeTree(snapshot) < 0) {
+            printf("LIBTINYFS-snapshot: Could not remove the partial snapshot %s\n", path);
+            return EFWRITE; // error
+        }
+        printf("LIBTINYFS-snapshot: Could not snapshot into %s\n", path);
+        return success == ENOSPC ? ENOSPC : EFWRITE; // error
+    }
     return 1; // success
 }
 
-int tfs_readFileInfo(fileDescriptor FD) {
-    if (openFileTable[FD] == NULL) {
+int tfsReadFileInfo(fileDescriptor FD) {
+    if (mountedDisk == INT_NULL) {
+        printf("LIBTINYFS-readFileInfo: No disk mounted. Cannot read file info\n");
+        return EMOUNTFS; // error
+    }
+    if (FD < 0 || FD >= maxNumberOfFiles || openFileTable[FD] == NULL) {
         printf("LIBTINYFS-readFileInfo: File is not open. Cannot read file info\n");
         return EOPEN; // error
     }
     // read in the inode
-    char *inodeData = (char *)malloc(BLOCKSIZE);
-    int success = readBlock(mountedDisk, openFileTable[FD]->inodeNumber, inodeData);
+    char *inodeData = scratchBlock();
+    int success = cachedReadBlock(openFileTable[FD]->inodeNumber, inodeData);
     if (success < 0) {
         printf("LIBTINYFS-readFileInfo: Invalid pointer to inode block\n");
         return EFREAD; // error
     }
-    // get the three time stamps and display them
-    char *fileName = (char *)malloc(MAX_FILE_NAME_SIZE);
-    int fileSize;
-    char *created = (char *)malloc(TIMESTAMP_BUFFER_SIZE);
-    char *modified = (char *)malloc(TIMESTAMP_BUFFER_SIZE);
-    char *accessed = (char *)malloc(TIMESTAMP_BUFFER_SIZE);
+    // get the three time stamps, formatting only happens here
+    char fileName[MAX_FILE_NAME_SIZE];
+    int64_t fileSize;
+    char created[TIMESTAMP_BUFFER_SIZE];
+    char modified[TIMESTAMP_BUFFER_SIZE];
+    char accessed[TIMESTAMP_BUFFER_SIZE];
     memcpy(fileName, inodeData + INODE_FILE_NAME_OFFSET, MAX_FILE_NAME_SIZE);
-    memcpy(&fileSize, inodeData + INODE_FILE_SIZE_OFFSET, sizeof(int));
-    memcpy(created, inodeData + INODE_CR8_TIME_STAMP_OFFSET, TIMESTAMP_BUFFER_SIZE);
-    memcpy(modified, inodeData + INODE_MOD_TIME_STAMP_OFFSET, TIMESTAMP_BUFFER_SIZE);
-    memcpy(accessed, inodeData + INODE_ACC_TIME_STAMP_OFFSET, TIMESTAMP_BUFFER_SIZE);
+    memcpy(&fileSize, inodeData + INODE_FILE_SIZE_OFFSET, sizeof(int64_t));
+    formatTimestamp(inodeData, INODE_CR8_TIME_STAMP_OFFSET, created, TIMESTAMP_BUFFER_SIZE);
+    formatTimestamp(inodeData, INODE_MOD_TIME_STAMP_OFFSET, modified, TIMESTAMP_BUFFER_SIZE);
+    formatTimestamp(inodeData, INODE_ACC_TIME_STAMP_OFFSET, accessed, TIMESTAMP_BUFFER_SIZE);
+    scratchFree(inodeData);
     printf("\n%s Information:", fileName);
-    printf("\nFile Size: %d\n", fileSize);
+    printf("\nFile Size: %lld\n", (long long)fileSize);
     printf("Created: %s\n", created);
     printf("Modified: %s\n", modified);
     printf("Accessed: %s\n\n", accessed);
-    free(fileName);
-    free(created);
-    free(modified);
-    free(accessed);
     return 1; // success
 }
 
-int tfs_readdir() {
+int listDirectory(tfsBlock dirInode, int depth) {
+    /* prints the entries of a directory in hash order by walking its leaf
+    chain, directories are followed by a slash and listed below, indented */
+    char *leafData = scratchBlock();
+    char *inodeData = scratchBlock();
+    tfsBlock leaf = dirFirstLeaf(dirInode, leafData);
+    while (leaf > 0) {
+        int count = (unsigned char)leafData[DIR_COUNT_OFFSET];
+        for (int i = 0; i < count; i++) {
+            char *entry = leafData + DIR_ENTRIES_OFFSET + i * DIR_ENTRY_SIZE;
+            tfsBlock entryInode;
+            memcpy(&entryInode, entry, sizeof(tfsBlock));
+            if (cachedReadBlock(entryInode, inodeData) < 0) {
+                leaf = EFREAD;
+                break;
+            }
+            int isDirectory = inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_DIRECTORY;
+            printf("%*s%s%s\n", depth * 2, "", entry + DIR_ENTRY_NAME_OFFSET, isDirectory ? "/" : "");
+            if (isDirectory && listDirectory(entryInode, depth + 1) < 0) {
+                leaf = EFREAD;
+                break;
+            }
+        }
+        if (leaf < 0) {
+            break;
+        }
+        memcpy(&leaf, leafData + DIR_NEXT_BLOCK_OFFSET, sizeof(tfsBlock));
+        if (leaf != 0 && cachedReadBlock(leaf, leafData) < 0) {
+            leaf = EFREAD;
+        }
+    }
+    scratchFree(leafData);
+    scratchFree(inodeData);
+    return leaf < 0 ? EFREAD : 1;
+}
+
+int tfsReaddir(void) {
     if (mountedDisk == INT_NULL) {
         printf("LIBTINYFS: Error: No disk mounted. Cannot find file. (readdir)\n");
         return EMOUNTFS; // error
     }
 
     // read super block
-    char *superData = (char *)malloc(BLOCKSIZE*sizeof(char));
-    int success = readBlock(mountedDisk, SUPER_BLOCK, superData);
+    char *superData = scratchBlock();
+    int success = cachedReadBlock(SUPER_BLOCK, superData);
 
     if (success < 0) {
-        free(superData);
+        scratchFree(superData);
         printf("LIBTINYFS: Error: Issue with super block read. (readdir)\n");
         return EFREAD; // error
     }
 
-    // get inode head
-    int inodeHead;
-    memcpy(&inodeHead, superData + IB_OFFSET, sizeof(int));
+    // get the root directory and list everything below it
+    tfsBlock rootDirectory;
+    memcpy(&rootDirectory, superData + ROOT_DIR_OFFSET, sizeof(tfsBlock));
+    scratchFree(superData);
     printf("\nFILE SYSTEM:\nroot directory:\n");
-    char *inodeData = (char *)malloc(BLOCKSIZE*sizeof(char));
-    while (inodeHead != 0) { // make this a recursive function for hierarchical
-        success = readBlock(mountedDisk, inodeHead, inodeData);
-        if (success < 0) {
-            free(superData);
-            free(inodeData);
-            printf("LIBTINYFS: Error: Issue with inode block read. (readdir)\n");
-            return EFREAD; // error
-        }
-
-        char *fileName = (char *)malloc(MAX_FILE_NAME_SIZE*sizeof(char));
-        memcpy(fileName, inodeData + INODE_FILE_NAME_OFFSET, MAX_FILE_NAME_SIZE*sizeof(char));
-
-        printf("%s\n", fileName);
-
-        memcpy(&inodeHead, inodeData + INODE_NEXT_INODE_OFFSET, sizeof(int));
+    if (listDirectory(rootDirectory, 0) < 0) {
+        printf("LIBTINYFS: Error: Issue with directory block read. (readdir)\n");
+        return EFREAD; // error
     }
     printf("\n");
 
     return 1; // success
 }
 
-int tfs_rename(fileDescriptor FD, char* newName) {
-    if (strlen(newName) >= MAX_FILE_NAME_SIZE) {
+int tfsOpenDirCursor(char *path, dirCursor *cursor) {
+    if (mountedDisk == INT_NULL) {
+        printf("LIBTINYFS: Error: No disk mounted. (openDirCursor)\n");
+        return EMOUNTFS; // error
+    }
+    tfsBlock dirInode;
+    char *superData = scratchBlock();
+    if (cachedReadBlock(SUPER_BLOCK, superData) < 0) {
+        scratchFree(superData);
+        printf("LIBTINYFS: Error: Issue with super block read. (openDirCursor)\n");
+        return EFREAD; // error
+    }
+    memcpy(&dirInode, superData + ROOT_DIR_OFFSET, sizeof(tfsBlock));
+    scratchFree(superData);
+    if (path != NULL && strspn(path, "/") != strlen(path)) {
+        // anything but "/" names a directory below the root
+        tfsBlock parentInode;
+        char dirName[MAX_FILE_NAME_SIZE];
+        if (resolvePath(path, &parentInode, dirName) < 0) {
+            printf("LIBTINYFS: Error: Invalid path %s. (openDirCursor)\n", path);
+            return EDIR; // error
+        }
+        dirInode = dirLookup(parentInode, dirName);
+        char *inodeData = scratchBlock();
+        if (dirInode <= 0 || cachedReadBlock(dirInode, inodeData) < 0 ||
+            !(inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_DIRECTORY)) {
+            scratchFree(inodeData);
+            printf("LIBTINYFS: Error: %s is not a directory. (openDirCursor)\n", path);
+            return EDIR; // error
+        }
+        scratchFree(inodeData);
+    }
+    cursor->dirInode = dirInode;
+    cursor->hash = 0;
+    cursor->sameHashSeen = 0;
+    cursor->finished = 0;
+    return 1; // success
+}
+
+int tfsReaddirplus(dirCursor *cursor, dirEntryPlus entries[], int max) {
+    /* Lists a directory in one pass along its leaf chain, filling the caller's
+    entries straight from the leaf and inode blocks. Only stack buffers are
+    used. The walk starts at the leaf covering the cursor's hash and skips what
+    earlier calls already returned. */
+    if (mountedDisk == INT_NULL) {
+        printf("LIBTINYFS: Error: No disk mounted. (readdirplus)\n");
+        return EMOUNTFS; // error
+    }
+    // the cursor may come from a client of tfsd, so its directory is checked
+    char leafData[BLOCKSIZE];
+    char inodeData[BLOCKSIZE];
+    if (cursor == NULL || cursor->dirInode <= SUPER_BLOCK || cursor->dirInode == dedupIndexInode ||
+        cachedReadBlock(cursor->dirInode, inodeData) < 0 ||
+        inodeData[BLOCK_NUMBER_OFFSET] != INODE_BLOCK_TYPE || inodeData[MAGIC_NUMBER_OFFSET] != MAGIC_NUMBER ||
+        !(inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_DIRECTORY)) {
+        printf("LIBTINYFS: Error: Cursor does not point at a directory. (readdirplus)\n");
+        return EDIR; // error
+    }
+    if (cursor->finished || max <= 0) {
+        return 0; // nothing more to list
+    }
+    int filled = 0;
+    tfsBlock leaf = dirFindLeaf(cursor->dirInode, cursor->hash, NULL, NULL, leafData);
+    while (leaf > 0 && filled < max) {
+        int count = (unsigned char)leafData[DIR_COUNT_OFFSET];
+        uint32_t runHash = 0;
+        int runLength = 0; // entries with runHash seen so far in this leaf
+        for (int i = 0; i < count && filled < max; i++) {
+            uint32_t hash = leafEntryHash(leafData, i);
+            runLength = (i > 0 && hash == runHash) ? runLength + 1 : 1;
+            runHash = hash;
+            if (hash < cursor->hash || (hash == cursor->hash && runLength <= cursor->sameHashSeen)) {
+                continue; // returned by an earlier call
+            }
+            char *entry = leafData + DIR_ENTRIES_OFFSET + i * DIR_ENTRY_SIZE;
+            dirEntryPlus *out = &entries[filled];
+            memcpy(&out->inodeNumber, entry, sizeof(tfsBlock));
+            memcpy(out->name, entry + DIR_ENTRY_NAME_OFFSET, MAX_FILE_NAME_SIZE);
+            out->name[MAX_FILE_NAME_SIZE - 1] = '\0';
+            if (cachedReadBlock(out->inodeNumber, inodeData) < 0) {
+                printf("LIBTINYFS: Error: Issue with inode block read. (readdirplus)\n");
+                return EFREAD; // error
+            }
+            memcpy(&out->fileSize, inodeData + INODE_FILE_SIZE_OFFSET, sizeof(int64_t));
+            out->isDirectory = (inodeData[INODE_FLAGS_OFFSET] & INODE_FLAG_DIRECTORY) ? 1 : 0;
+            memcpy(&out->created, inodeData + INODE_CR8_TIME_STAMP_OFFSET, sizeof(uint64_t));
+            memcpy(&out->modified, inodeData + INODE_MOD_TIME_STAMP_OFFSET, sizeof(uint64_t));
+            memcpy(&out->accessed, inodeData + INODE_ACC_TIME_STAMP_OFFSET, sizeof(uint64_t));
+            // move the cursor past this entry
+            if (hash == cursor->hash) {
+                cursor->sameHashSeen++;
+            } else {
+                cursor->hash = hash;
+                cursor->sameHashSeen = 1;
+            }
+            filled++;
+        }
+        if (filled == max) {
+            break;
+        }
+        memcpy(&leaf, leafData + DIR_NEXT_BLOCK_OFFSET, sizeof(tfsBlock));
+        if (leaf != 0 && cachedReadBlock(leaf, leafData) < 0) {
+            printf("LIBTINYFS: Error: Issue with directory leaf read. (readdirplus)\n");
+            return EFREAD; // error
+        }
+    }
+    if (leaf < 0) {
+        return (int)leaf; // error
+    }
+    if (leaf == 0) {
+        cursor->finished = 1; // walked off the end of the leaf chain
+    }
+    return filled;
+}
+
+int tfsRename(fileDescriptor FD, char* newName) {
+    if (strchr(newName, PATH_SEPARATOR) == NULL && strlen(newName) >= MAX_FILE_NAME_SIZE) {
         printf("LIBTINYFS: Error: File name is too long, cannot be supported. (rename)\n");
         return ERENAME; // error
     }
@@ -921,39 +5041,251 @@ int tfs_rename(fileDescriptor FD, char* newName) {
         printf("LIBTINYFS: Error: File has not been opened. (rename)\n");
         return EBADFD; // error
     }
-    int fileInode = oftEntry->inodeNumber;
+    tfsBlock fileInode = oftEntry->inodeNumber;
 
     // get the inode block
-    char *inodeData = (char *)malloc(BLOCKSIZE*sizeof(char));
-    int success = readBlock(mountedDisk, fileInode, inodeData);
+    char *inodeData = scratchBlock();
+    int success = cachedReadBlock(fileInode, inodeData);
     if (success < 0) {
-        free(inodeData);
+        scratchFree(inodeData);
         printf("LIBTINYFS: Error: Issue with inode block read. (rename)\n");
         return EFREAD; // error
     }
 
-    // zero out the current file name
-    memset(inodeData + INODE_FILE_NAME_OFFSET, 0, MAX_FILE_NAME_SIZE*sizeof(char));
+    // work out which directory the file ends up in, a plain name stays put
+    tfsBlock oldParent;
+    tfsBlock newParent;
+    char oldName[MAX_FILE_NAME_SIZE];
+    char leafName[MAX_FILE_NAME_SIZE];
+    memcpy(&oldParent, inodeData + INODE_PARENT_OFFSET, sizeof(tfsBlock));
+    memcpy(oldName, inodeData + INODE_FILE_NAME_OFFSET, MAX_FILE_NAME_SIZE);
+    if (strchr(newName, PATH_SEPARATOR) != NULL) {
+        if (resolvePath(newName, &newParent, leafName) < 0) {
+            scratchFree(inodeData);
+            printf("LIBTINYFS: Error: Invalid path %s. (rename)\n", newName);
+            return ERENAME; // error
+        }
+    } else {
+        newParent = oldParent;
+        memset(leafName, 0, MAX_FILE_NAME_SIZE);
+        strcpy(leafName, newName);
+    }
+    if (dirLookup(newParent, leafName) != 0) {
+        scratchFree(inodeData);
+        printf("LIBTINYFS: Error: %s already exists. (rename)\n", newName);
+        return ERENAME; // error
+    }
+
+    // move the directory entry
+    if (dirRemove(oldParent, oldName) < 0) {
+        scratchFree(inodeData);
+        printf("LIBTINYFS: Error: Issue with directory update. (rename)\n");
+        return ERENAME; // error
+    }
+    if (dirInsert(newParent, leafName, fileInode) < 0) {
+        dirInsert(oldParent, oldName, fileInode); // put it back where it was
+        scratchFree(inodeData);
+        printf("LIBTINYFS: Error: Issue with directory update. (rename)\n");
+        return ERENAME; // error
+    }
 
     // MODIFY INODE BLOCK DATA
-    // change name
-    memcpy(inodeData + INODE_FILE_NAME_OFFSET, newName, strlen(newName)*sizeof(char)); 
+    // change name and parent
+    memcpy(inodeData + INODE_FILE_NAME_OFFSET, leafName, MAX_FILE_NAME_SIZE*sizeof(char));
+    memcpy(inodeData + INODE_PARENT_OFFSET, &newParent, sizeof(tfsBlock));
 
     // get current time to modify timestamp
-    char *timeStampBuffer = (char *)malloc(TIMESTAMP_BUFFER_SIZE);
-    getTimestamp(timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-    memcpy(inodeData + INODE_MOD_TIME_STAMP_OFFSET, timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-    free(timeStampBuffer);
+    setTimestamp(inodeData, INODE_MOD_TIME_STAMP_OFFSET, getTimestamp());
 
     // write updated inode block
-    success = writeBlock(mountedDisk, fileInode, inodeData);
+    success = cachedWriteBlock(fileInode, inodeData);
     if (success < 0) {
-        free(inodeData);
+        scratchFree(inodeData);
         printf("LIBTINYFS: Error: Issue with inode block write. (rename)\n");
         return EFREAD; // error
     }
-    free(inodeData);
+    scratchFree(inodeData);
 
     return 1; // success
 
-}
\ No newline at end of file
+}
+
+/* TIMED ENTRY POINTS
+ * The public API, each call is counted in opStats (see STATISTICS).
+ */
+
+int tfs_mkfs(char *filename, int64_t nBytes) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_MKFS, tfsMkfs(filename, nBytes, TFS_MKFS_FEATURES, TFS_ALLOC_POLICY), 0);
+}
+
+int tfs_mkfsFeatures(char *filename, int64_t nBytes, int features) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_MKFS, tfsMkfs(filename, nBytes, features, TFS_ALLOC_POLICY), 0);
+}
+
+int tfs_mkfsPolicy(char *filename, int64_t nBytes, int features, int policy) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_MKFS, tfsMkfs(filename, nBytes, features, policy), 0);
+}
+
+int tfs_mount(char *diskname) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_MOUNT, tfsMount(diskname), 0);
+}
+
+int tfs_unmount(void) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_UNMOUNT, tfsUnmount(), 0);
+}
+
+fileDescriptor tfs_openFile(char *name) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_OPEN, tfsOpenFile(name), 0);
+}
+
+int tfs_mkdir(char *path) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_MKDIR, tfsMkdir(path), 0);
+}
+
+int tfs_rmdir(char *path) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_RMDIR, tfsRmdir(path), 0);
+}
+
+int tfs_closeFile(fileDescriptor FD) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_CLOSE, tfsCloseFile(FD), 0);
+}
+
+int tfs_writeFile(fileDescriptor FD, char *buffer, int size) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_WRITE, tfsWriteFile(FD, buffer, size), size);
+}
+
+int tfs_pwrite(fileDescriptor FD, char *buffer, int size, int64_t offset) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_PWRITE, tfsPwrite(FD, buffer, size, offset), size);
+}
+
+int tfs_deleteFile(fileDescriptor FD) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_DELETE, tfsDeleteFile(FD), 0);
+}
+
+int64_t tfs_seek(fileDescriptor FD, int64_t offset) {
+    statsMark mark;
+    statsBegin(&mark);
+    int64_t result = tfsSeek(FD, offset);
+    statsEnd(&mark, TFS_OP_SEEK, result < 0 ? (int)result : 0, 0); // the file pointer may not fit in an int
+    return result;
+}
+
+int tfs_readByte(fileDescriptor FD, char *buffer) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_READ_BYTE, tfsReadByte(FD, buffer), 1);
+}
+
+int tfs_read(fileDescriptor FD, char *buffer, int size) {
+    statsMark mark;
+    statsBegin(&mark);
+    int result = tfsRead(FD, buffer, size);
+    return statsEnd(&mark, TFS_OP_READ, result, result);
+}
+
+int tfs_readv_begin(fileDescriptor FD, tfsSpan spans[], int max) {
+    statsMark mark;
+    statsBegin(&mark);
+    int result = tfsReadvBegin(FD, spans, max);
+    int bytes = 0;
+    for (int i = 0; i < result; i++) {
+        bytes += spans[i].length;
+    }
+    return statsEnd(&mark, TFS_OP_READV, result, bytes);
+}
+
+int tfs_setCompressed(fileDescriptor FD, int enabled) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_SET_COMPRESSED, tfsSetCompressed(FD, enabled), 0);
+}
+
+int tfs_setDeduplicated(fileDescriptor FD, int enabled) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_SET_DEDUPLICATED, tfsSetDeduplicated(FD, enabled), 0);
+}
+
+int tfs_clone(fileDescriptor srcFD, char *newName) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_CLONE, tfsClone(srcFD, newName), 0);
+}
+
+int tfs_snapshot(char *path) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_SNAPSHOT, tfsSnapshot(path), 0);
+}
+
+int tfs_readdirplus(dirCursor *cursor, dirEntryPlus entries[], int max) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_READDIRPLUS, tfsReaddirplus(cursor, entries, max), 0);
+}
+
+int tfs_rename(fileDescriptor FD, char *newName) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_RENAME, tfsRename(FD, newName), 0);
+}
+
+int tfs_defrag(int64_t maxBlocks) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_DEFRAG, tfsDefrag(maxBlocks), 0);
+}
+
+int tfs_readFileInfo(fileDescriptor FD) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_READ_FILE_INFO, tfsReadFileInfo(FD), 0);
+}
+
+int tfs_readdir(void) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_READDIR, tfsReaddir(), 0);
+}
+
+int tfs_openDirCursor(char *path, dirCursor *cursor) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_OPEN_DIR_CURSOR, tfsOpenDirCursor(path, cursor), 0);
+}
+
+int tfs_defragReport(tfsDefragReport *report) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_DEFRAG_REPORT, tfsReportDefrag(report), 0);
+}
+
+int tfs_setAllocPolicy(int policy) {
+    statsMark mark;
+    statsBegin(&mark);
+    return statsEnd(&mark, TFS_OP_SET_ALLOC_POLICY, tfsSetAllocPolicy(policy), 0);
+}
@@ -1,5 +1,6 @@
 #ifndef libTinyFS_h
 #define libTinyFS_h
+#include <stdint.h>
 /* The default size of the disk and file system block */
 #define BLOCKSIZE 256
 
@@ -16,25 +17,100 @@ possible values */
 #define MAGIC_NUMBER 0x44
 #define BLOCK_NUMBER_OFFSET 0
 #define MAGIC_NUMBER_OFFSET 1
-#define TIMESTAMP_BUFFER_SIZE 25
+#define BLOCK_CHECKSUM_OFFSET (BLOCKSIZE - 4) // every block ends in a CRC-32C, no layout uses these bytes
+#define TIMESTAMP_BUFFER_SIZE 25 // size of a formatted "YYYY-MM-DD HH:MM:SS" timestamp
+#define TIMESTAMP_SIZE 8 // on disk timestamps are 64 bit nanoseconds since the epoch
 
 
-/* SUPER BLOCK DEFINITIONS */
+/* block numbers, on disk and in memory. Every block pointer on disk is a
+tfsBlock, so is every count of blocks. */
+typedef int64_t tfsBlock;
+
+/* SUPER BLOCK DEFINITIONS
+ * The format version stays at byte 14 in every version, so an older image is
+ * recognized and refused however the fields around it moved. */
 #define SUPER_BLOCK_TYPE 1
 #define SUPER_BLOCK 0 // super block number
 #define FB_OFFSET 2 // offset to get free block LL head from super block
-#define IB_OFFSET 6 // offset to get inode LL head from super block
-#define SUPER_MAX_NUM_FILES_OFFSET 10 // offset to get max number of files from super block
+#define SUPER_MAX_NUM_FILES_OFFSET 10 // offset to get max number of open files (4 bytes) from super block
+#define SUPER_FORMAT_VERSION_OFFSET 14 // offset to get the on disk format version (4 bytes) from super block
+#define ROOT_DIR_OFFSET 18 // offset to get the root directory inode from super block
+#define SUPER_NUM_BLOCKS_OFFSET 26 // offset to get the total number of blocks from super block
+#define SUPER_FREE_WATERMARK_OFFSET 34 // offset to get the first never used block from super block
+#define SUPER_STATE_OFFSET 42 // offset to get the clean/dirty state (1 byte) from super block
+#define SUPER_CHECKPOINT_OFFSET 43 // offset to get the first checkpoint block from super block
+#define SUPER_CHECKPOINT_BLOCKS_OFFSET 51 // offset to get the number of checkpoint blocks from super block
+#define SUPER_FREE_COUNT_OFFSET 59 // offset to get the number of free blocks at unmount from super block
+#define SUPER_FEATURES_OFFSET 67 // offset to get the SUPER_FEATURE_* bits (1 byte) from super block
+#define SUPER_DEDUP_INDEX_OFFSET 68 // offset to get the dedup hash index directory inode (0 until first used) from super block
+#define SUPER_ALLOC_POLICY_OFFSET 76 // offset to get the TFS_ALLOC_* policy new blocks are placed by (1 byte) from super block
+#define SUPER_CHECKSUM_OFFSET BLOCK_CHECKSUM_OFFSET // always filled in for the super block
+#define SUPER_STATE_CLEAN 1 // unmounted cleanly, the checkpoint describes the disk
+#define SUPER_STATE_DIRTY 2 // mounted, or never unmounted after a crash
+#define SUPER_FEATURE_CHECKSUMS 0x01 // every block's CRC-32C is written and checked by libDisk
+#define SUPER_FEATURES_KNOWN SUPER_FEATURE_CHECKSUMS // feature bits this library understands, mount refuses any other
+
+/* tfs_mkfs turns block checksums on unless this is built as 0 */
+#ifndef TFS_BLOCK_CHECKSUMS
+#define TFS_BLOCK_CHECKSUMS 1
+#endif
+#define TFS_MKFS_FEATURES (TFS_BLOCK_CHECKSUMS ? SUPER_FEATURE_CHECKSUMS : 0) // what tfs_mkfs formats with
+
+/* where new blocks go, kept in the super block and changed with
+tfs_setAllocPolicy. Images made before the field existed read as
+TFS_ALLOC_LIFO. */
+#define TFS_ALLOC_LIFO 0 // the block freed last, wherever it is
+#define TFS_ALLOC_NEXT_FIT 1 // the first free run big enough from where the last allocation ended on
+#define TFS_ALLOC_NEAR_INODE 2 // the first free run big enough after the file's inode, or its parent's for an inode
+#define TFS_ALLOC_BEST_FIT 3 // the smallest free run big enough
+#define TFS_ALLOC_POLICIES 4
+#define TFS_ALLOC_POLICY_NAMES {"lifo", "nextfit", "nearinode", "bestfit"} // how the tools name them, in TFS_ALLOC_* order
+
+/* the policy tfs_mkfs and tfs_mkfsFeatures write */
+#ifndef TFS_ALLOC_POLICY
+#define TFS_ALLOC_POLICY TFS_ALLOC_LIFO
+#endif
+
+/* on disk format version written by tfs_mkfs, tfs_mount refuses any other.
+ * Images from before this field existed read as 0 and store 25 byte strftime
+ * timestamp strings in their inodes.
+ * version 2: inode timestamps stored as 64 bit nanosecond integers
+ * version 3: hierarchical directories, the super block points at the root
+ *            directory instead of a list of every inode
+ * version 4: lazily initialized free space, blocks past the free watermark
+ *            are free without a free block header
+ * version 5: checksummed super block with a clean/dirty state and an
+ *            unmount checkpoint of the metadata
+ * version 6: the last 4 bytes of every block are reserved for a CRC-32C
+ * version 7: per-file compression, INODE_FLAG_COMPRESSED
+ * version 8: deduplicated files, block maps, shared blocks and the dedup
+ *            hash index
+ * version 9: reference counted block maps for clones and snapshots
+ * version 10: 64 bit block pointers and file sizes */
+#define TFS_FORMAT_VERSION 10
 
 /* INODE BLOCK DEFINITIONS */
 #define INODE_BLOCK_TYPE 2
-#define INODE_NEXT_INODE_OFFSET 2 // offset to get next inode in LL
-#define INODE_FILE_SIZE_OFFSET 6 // offset to get file size from inode block
-#define INODE_DATA_BLOCK_OFFSET 10 // offset to get data block LL pointer from inode block
-#define INODE_FILE_NAME_OFFSET 14 // offset to get file name from inode block
-#define INODE_CR8_TIME_STAMP_OFFSET 23
-#define INODE_MOD_TIME_STAMP_OFFSET 48
-#define INODE_ACC_TIME_STAMP_OFFSET 73
+#define INODE_PARENT_OFFSET 2 // offset to get the inode of the directory holding this one
+#define INODE_FILE_SIZE_OFFSET 10 // offset to get the 8 byte file size from inode block
+#define INODE_DATA_BLOCK_OFFSET 18 // offset to get data block LL pointer from inode block
+#define INODE_FILE_NAME_OFFSET 26 // offset to get file name from inode block
+#define INODE_CR8_TIME_STAMP_OFFSET 35 // 8 byte creation time
+#define INODE_MOD_TIME_STAMP_OFFSET 43 // 8 byte last modified time
+#define INODE_ACC_TIME_STAMP_OFFSET 51 // 8 byte last accessed time
+#define INODE_FLAGS_OFFSET 59 // 1 byte of INODE_FLAG_* bits
+#define INODE_INLINE_DATA_OFFSET 60 // offset to get inline file content from inode block
+#define INODE_INLINE_CAPACITY (BLOCK_CHECKSUM_OFFSET - INODE_INLINE_DATA_OFFSET) // largest file kept in the inode
+
+#define INODE_FLAG_INLINE 0x01 // file content lives in the inode, no data blocks
+#define INODE_FLAG_DIRECTORY 0x02 // inode is a directory, data block pointer is its tree root
+#define INODE_FLAG_COMPRESSED 0x04 // content past INODE_INLINE_CAPACITY is stored as compressed chunks
+#define INODE_FLAG_DEDUP 0x08 // content past INODE_INLINE_CAPACITY is in shared blocks, data block pointer is a block map
+#define INODE_FLAG_SNAPSHOT 0x10 // directory made by tfs_snapshot, later snapshots leave it out
+
+/* compressed files are compressed TFS_CHUNK_SIZE bytes at a time, a read
+decompresses only the chunks it touches */
+#define TFS_CHUNK_SIZE 4096
 
 
 
@@ -45,28 +121,205 @@ possible values */
 /* DATA BLOCK DEFINITIONS */
 #define DATA_BLOCK_TYPE 3
 #define DATA_NEXT_BLOCK_OFFSET 2 // offset to get next data block from data block
-#define DATA_BLOCK_DATA_OFFSET 6 // offset to get to data section
-
-
-#define MAX_FILE_NAME_SIZE 9 // include the null terminator
+#define DATA_BLOCK_DATA_OFFSET 10 // offset to get to data section
+
+
+/* DIRECTORY BLOCK DEFINITIONS
+ * A directory is a B+ tree keyed by a 32 bit hash of the entry names. Leaf
+ * blocks hold the entries sorted by hash and are chained in hash order, index
+ * blocks hold (lowest hash, child block) pairs. */
+#define DIR_LEAF_BLOCK_TYPE 5
+#define DIR_INDEX_BLOCK_TYPE 6
+#define DIR_NEXT_BLOCK_OFFSET 2 // offset to get the next leaf in hash order from a leaf
+#define DIR_LEVEL_OFFSET 10 // 1 byte, 0 for leaves, height above the leaves for index blocks
+#define DIR_COUNT_OFFSET 11 // 1 byte, number of entries in the block
+#define DIR_ENTRIES_OFFSET 12 // offset to get to the first entry
+#define DIR_ENTRY_SIZE 17 // leaf entry: 8 byte inode pointer then the name
+#define DIR_ENTRY_NAME_OFFSET 8 // offset of the name inside a leaf entry
+#define DIR_INDEX_ENTRY_SIZE 12 // index entry: 4 byte lowest hash then 8 byte child pointer
+#define DIR_LEAF_MAX_ENTRIES ((BLOCK_CHECKSUM_OFFSET - DIR_ENTRIES_OFFSET) / DIR_ENTRY_SIZE)
+#define DIR_INDEX_MAX_ENTRIES ((BLOCK_CHECKSUM_OFFSET - DIR_ENTRIES_OFFSET) / DIR_INDEX_ENTRY_SIZE)
+#define DIR_MAX_DEPTH 8 // index levels above the leaves, far more than any disk can fill
+
+/* CHECKPOINT BLOCK DEFINITIONS
+ * Written by tfs_unmount into never used blocks past the free watermark, one
+ * entry per inode other than the root, and read back by the next mount. */
+#define CHECKPOINT_BLOCK_TYPE 7
+#define CHECKPOINT_COUNT_OFFSET 2 // 1 byte, number of entries in the block
+#define CHECKPOINT_ENTRIES_OFFSET 4 // offset to get to the first entry
+#define CHECKPOINT_ENTRY_SIZE 25 // 8 byte inode pointer, 8 byte parent pointer, name
+#define CHECKPOINT_MAX_ENTRIES ((BLOCK_CHECKSUM_OFFSET - CHECKPOINT_ENTRIES_OFFSET) / CHECKPOINT_ENTRY_SIZE)
+
+/* BLOCK MAP DEFINITIONS
+ * A deduplicated file's data block pointer is the head of a chain of block
+ * maps that list its shared blocks in file order. Clones share the chain, so
+ * a block map counts the pointers to it: inodes and the block maps before it. */
+#define MAP_BLOCK_TYPE 8
+#define MAP_NEXT_BLOCK_OFFSET DATA_NEXT_BLOCK_OFFSET // chained like data blocks, so the same free loops walk both
+#define MAP_COUNT_OFFSET 10 // 1 byte, number of entries in the block
+#define MAP_REFCOUNT_OFFSET 12 // 4 byte number of pointers to the block
+#define MAP_ENTRIES_OFFSET 16 // offset to get to the first 8 byte shared block pointer
+#define MAP_MAX_ENTRIES ((BLOCK_CHECKSUM_OFFSET - MAP_ENTRIES_OFFSET) / (int)sizeof(tfsBlock))
+
+/* SHARED BLOCK DEFINITIONS
+ * USEABLE_DATA_SIZE bytes of a deduplicated file, used by every file whose
+ * block map lists it. The data sits at DATA_BLOCK_DATA_OFFSET like in a data
+ * block, the last block of a file is zero padded. */
+#define SHARED_BLOCK_TYPE 9
+#define SHARED_REFCOUNT_OFFSET 2 // 4 byte number of block map entries pointing at the block
+#define DEDUP_KEY_LENGTH 8 // characters of content hash naming a block in the dedup hash index
+
+#define MAX_FILE_NAME_SIZE 9 // include the null terminator, applies to each path component
+#define PATH_SEPARATOR '/'
 
 #define INT_NULL 0
 #define BEGINNING_OF_FILE 0
 
-#define MAX_BYTES 2147483647
+#define MAX_BYTES INT64_MAX // largest disk and largest file
+#define MAX_BUFFER_BYTES 2147483647 // largest file tfs_writeFile, compression and deduplication handle, they keep it in memory
+#define MAX_OPEN_FILES 4194304 // open file table slots of the largest disks, what a 2 GB disk had before 64 bit pointers
+
+#define USEABLE_DATA_SIZE (BLOCK_CHECKSUM_OFFSET - DATA_BLOCK_DATA_OFFSET) // 242
 
-#define USEABLE_DATA_SIZE 250
+/* BLOCK CACHE AND READ-AHEAD DEFINITIONS */
+#define BLOCK_CACHE_SIZE 64 // number of blocks the per-mount block cache holds
+#define READAHEAD_MIN_WINDOW 2 // window a file starts with once it is read sequentially
+#define READAHEAD_MAX_WINDOW 32 // largest window, in data blocks, read ahead for one file
+#define READAHEAD_SEQ_THRESHOLD 2 // sequential block steps needed before read-ahead starts
+#define MOUNT_IO_BLOCKS 64 // blocks the checkpoint and the mount scan read or write per libDisk request
+#define TFS_READV_MAX_SPANS (BLOCK_CACHE_SIZE / 4) // spans all open files can hold at once, each pins a cache block
+#define SCRATCH_INITIAL_SIZE 65536 // bytes of scratch arena a mount starts with, it grows to what calls need
+#define SCRATCH_MAX_SIZE (1 << 20) // the arena grows no further, a call needing more takes the rest from the heap for its duration
 
 /* use as a special type to keep track of files */
 typedef int fileDescriptor;
 
 
 typedef struct openFileTableEntry {
-    int inodeNumber; // pointer the the inode
-    int filePointer; // pointer to the current location in the file
+    tfsBlock inodeNumber; // pointer the the inode
+    int64_t filePointer; // pointer to the current location in the file
+    int64_t lastBlockIndex; // index in the data chain of the last block read, -1 if none
+    tfsBlock lastBlockNumber; // disk block number of that block, lets the chain walk resume there
+    int seqCount; // number of consecutive sequential block steps
+    int raWindow; // current read-ahead window in data blocks, 0 means read-ahead is off
+    int64_t raNextIndex; // chain index of the first block that has not been read ahead yet
+    tfsBlock raNextBlock; // disk block number of that block, 0 if the chain ended
+    int raContiguous; // 1 while the chain read ahead so far sat in consecutive blocks, read-ahead then reads whole runs
+    int64_t lastMappedIndex; // deduplicated files: file block read last, lastBlockIndex and lastBlockNumber then track the block map
+    uint32_t *chunkOffsets; // compressed files: stream offset of every chunk and of the end, NULL until loaded
+    int chunkCount; // number of chunks, -1 until chunkOffsets is loaded
+    int chunkCapacity; // offsets chunkOffsets has room for
+    int cachedChunk; // chunk held in chunkData, -1 if none
+    char *chunkData; // last decompressed chunk, TFS_CHUNK_SIZE bytes
+    int spanCount; // spans handed out by tfs_readv_begin and not released yet
+    int spanSlots[TFS_READV_MAX_SPANS]; // block cache entry each span pins, -1 for a span into chunkData
+    struct openFileTableEntry *nextSpare; // closed entries kept for the next open: the next one
 } openFileTableEntry;
 
-int tfs_mkfs(char* filename, int nBytes);
+/* one directory entry returned by tfs_readdirplus */
+typedef struct dirEntryPlus {
+    char name[MAX_FILE_NAME_SIZE]; // entry name, null terminated
+    tfsBlock inodeNumber; // inode block of the entry
+    int64_t fileSize; // size in bytes, or number of entries for a directory
+    int isDirectory; // 1 for directories, 0 for files
+    uint64_t created; // nanoseconds since the epoch
+    uint64_t modified;
+    uint64_t accessed;
+} dirEntryPlus;
+
+/* position of a tfs_readdirplus listing. Entries come back in name hash
+order and the cursor only remembers the last hash returned, so it stays
+valid across calls, and across files being added or removed in between. */
+typedef struct dirCursor {
+    tfsBlock dirInode; // directory being listed
+    uint32_t hash; // hash of the last entry returned
+    int sameHashSeen; // entries with that hash already returned
+    int finished; // 1 once the whole directory has been returned
+} dirCursor;
+
+/* a piece of a file returned by tfs_readv_begin, read only */
+typedef struct tfsSpan {
+    const char *data; // points into the block cache, or the decompressed chunk of a compressed file
+    int length; // bytes at 'data'
+} tfsSpan;
+
+/* counters kept by the block cache for read-ahead */
+typedef struct readAheadStats {
+    long issued; // blocks fetched by read-ahead
+    long hits; // read-ahead blocks that were later read by the file
+    long waste; // read-ahead blocks evicted or dropped before being read
+} readAheadStats;
+
+/* layout of the files stored in data block chains, filled in by
+tfs_defragReport */
+typedef struct tfsDefragReport {
+    int64_t files; // files stored in data block chains
+    int64_t dataBlocks; // blocks of those chains
+    int64_t extents; // runs of consecutive blocks the chains are made of, at least one per file
+    double fragmentation; // share of the steps along the chains that jump, (extents - files) / (dataBlocks - files), 0 to 1
+    int64_t freeBlocks;
+    int64_t freeExtents; // runs of consecutive free blocks
+    int64_t tailFree; // free blocks after the last block in use
+    int64_t moved; // blocks tfs_defrag moved since the disk was mounted
+} tfsDefragReport;
+
+/* operations counted by tfs_getStats, indexes into tfsStats.ops */
+#define TFS_OP_MKFS 0
+#define TFS_OP_MOUNT 1
+#define TFS_OP_UNMOUNT 2
+#define TFS_OP_OPEN 3
+#define TFS_OP_CLOSE 4
+#define TFS_OP_WRITE 5
+#define TFS_OP_PWRITE 6
+#define TFS_OP_DELETE 7
+#define TFS_OP_READ_BYTE 8
+#define TFS_OP_SEEK 9
+#define TFS_OP_READ 10
+#define TFS_OP_MKDIR 11
+#define TFS_OP_RMDIR 12
+#define TFS_OP_RENAME 13
+#define TFS_OP_CLONE 14
+#define TFS_OP_SNAPSHOT 15
+#define TFS_OP_SET_COMPRESSED 16
+#define TFS_OP_SET_DEDUPLICATED 17
+#define TFS_OP_READDIRPLUS 18
+#define TFS_OP_READ_FILE_INFO 19
+#define TFS_OP_READDIR 20
+#define TFS_OP_OPEN_DIR_CURSOR 21
+#define TFS_OP_READV 22
+#define TFS_OP_DEFRAG 23
+#define TFS_OP_DEFRAG_REPORT 24
+#define TFS_OP_SET_ALLOC_POLICY 25
+#define TFS_OP_COUNT 26
+#define TFS_LATENCY_BUCKETS 32 // bucket i counts calls that took 2^i to 2^(i+1)-1 ns, the last one also everything slower
+
+/* counters of one operation. A call made from inside another tfs_* call is
+counted as part of the outer one. */
+typedef struct tfsOpStats {
+    long calls;
+    long errors; // calls that returned an error code
+    long blockReads; // blocks read from disk during the calls, cache misses and read-ahead
+    long blockWrites; // blocks written to disk during the calls
+    long seeks; // disk requests during the calls that did not start where the one before ended
+    long seekBlocks; // how far in blocks those requests had to seek, summed
+    long bytes; // file bytes read or written by the calls
+    double amplification; // (blockReads + blockWrites) / bytes, 0 when no bytes were moved
+    long long totalNs; // time spent in the calls
+    long latency[TFS_LATENCY_BUCKETS]; // log2 histogram of call latencies
+} tfsOpStats;
+
+typedef struct tfsStats {
+    long blockReads; // every block read from disk, also outside tfs_* calls
+    long blockWrites;
+    long seeks; // disk requests that did not start where the one before ended
+    long seekBlocks; // how far in blocks they had to seek, summed
+    long bytesRead; // blockReads * BLOCKSIZE
+    long bytesWritten; // blockWrites * BLOCKSIZE
+    long heapAllocations; // scratch buffers the per-mount arena had no room for and took from the heap
+    tfsOpStats ops[TFS_OP_COUNT];
+} tfsStats;
+
+int tfs_mkfs(char* filename, int64_t nBytes);
 /* Makes a blank TinyFS file system of size nBytes on the unix file
 specified by ‘filename’. This function should use the emulated disk
 library to open the specified unix file, and upon success, format the
@@ -74,6 +327,18 @@ file to be a mountable disk. This includes initializing all data to 0x00,
 setting magic numbers, initializing and writing the superblock and
 inodes, etc. Must return a specified success/error code. */
 
+int tfs_mkfsFeatures(char* filename, int64_t nBytes, int features);
+/* like tfs_mkfs, with the SUPER_FEATURE_* bits of the new file system
+chosen at run time, 0 for none. tfs_mkfs uses TFS_MKFS_FEATURES. The bits
+are kept in the super block, so every later mount and tfs_fsck use them
+too. Bits outside SUPER_FEATURES_KNOWN give ECREATFS. */
+
+int tfs_mkfsPolicy(char* filename, int64_t nBytes, int features, int policy);
+/* like tfs_mkfsFeatures, and the new file system places its blocks by
+‘policy’, one of the TFS_ALLOC_* values, instead of TFS_ALLOC_POLICY. The
+policy is kept in the super block like one set with tfs_setAllocPolicy.
+A policy outside 0 to TFS_ALLOC_POLICIES - 1 gives ECREATFS. */
+
 int tfs_mount(char* diskname);
 int tfs_unmount(void);
 /* tfs_mount(char *diskname) “mounts” a TinyFS file system located within
@@ -87,7 +352,16 @@ fileDescriptor tfs_openFile(char* name);
 /* Creates or Opens a file for reading and writing on the currently
 mounted file system. Creates a dynamic resource table entry for the file,
 and returns a file descriptor (integer) that can be used to reference
-this entry while the filesystem is mounted. */
+this entry while the filesystem is mounted. ‘name’ is a path such as
+"/a/b/c", a name without a leading slash is looked up in the root
+directory. Every directory on the path must already exist. */
+
+int tfs_mkdir(char* path);
+/* creates an empty directory at ‘path’, its parent must exist. */
+
+int tfs_rmdir(char* path);
+/* removes the empty directory at ‘path’. The root directory can not be
+removed. */
 
 int tfs_closeFile(fileDescriptor FD);
 /* Closes the file, de-allocates all system resources, and removes table
@@ -99,6 +373,12 @@ file’s content, to the file system. Previous content (if any) will be
 completely lost. Sets the file pointer to 0 (the start of file) when
 done. Returns success/error codes. */
 
+int tfs_pwrite(fileDescriptor FD, char* buffer, int size, int64_t offset);
+/* writes ‘size’ bytes of ‘buffer’ over the file starting at byte ‘offset’,
+growing the file if they reach past its end, without moving the file
+pointer. Bytes between the old end and ‘offset’ read as 0. Returns the
+number of bytes written or an error code. */
+
 int tfs_deleteFile(fileDescriptor FD);
 /* deletes a file and marks its blocks as free on disk. */
 
@@ -109,18 +389,114 @@ If the file pointer is already past the end of the file then
 tfs_readByte() should return an error and not increment the file pointer.
 */
 
-int tfs_seek(fileDescriptor FD, int offset);
+int64_t tfs_seek(fileDescriptor FD, int64_t offset);
 /* change the file pointer location to offset (absolute). Returns
-success/error codes.*/
+success/error codes. A pointer that would end up before the start of the
+file gives EFSEEK and stays where it was. */
+
+int tfs_read(fileDescriptor FD, char* buffer, int size);
+/* reads up to ‘size’ bytes from the current file pointer into ‘buffer’ a
+data block at a time, advancing the file pointer. Returns the number of
+bytes read (0 at end of file) or an error code. */
+
+int tfs_readv_begin(fileDescriptor FD, tfsSpan spans[], int max);
+int tfs_readv_release(fileDescriptor FD);
+/* zero-copy read. tfs_readv_begin fills up to ‘max’ spans with the next
+bytes of the file from the current file pointer, pointing straight into the
+block cache instead of copying them, and advances the file pointer past
+them. Each span is the rest of one data block (of the inode for an inline
+file, of the current chunk for a compressed one). Returns the number of
+spans, 0 at end of file, or an error code. The blocks stay in the cache and
+the spans valid until tfs_readv_release(FD), tfs_closeFile(FD) or unmount.
+A descriptor must release its spans before the next tfs_readv_begin, and at
+most TFS_READV_MAX_SPANS are held at a time. The spans show the blocks as
+they are, so writing the file before the release shows through them. */
+
+int tfs_setCompressed(fileDescriptor FD, int enabled);
+/* turns compression of a file on (enabled != 0) or off. Any current content
+is rewritten in the new form right away and the file pointer goes back to
+0, also when nothing changes. The old form is freed only once the new one is
+written, so a disk too full for both returns ENOSPC and leaves the file as it
+was. Files that fit in their inode are never compressed. */
+
+int tfs_setDeduplicated(fileDescriptor FD, int enabled);
+/* turns deduplication of a file on (enabled != 0) or off. Blocks of a
+deduplicated file are shared with every other deduplicated file holding the
+same bytes at a block boundary. Like tfs_setCompressed the content is
+rewritten right away. */
+
+int tfs_clone(fileDescriptor srcFD, char* newName);
+/* creates the file ‘newName’ (a name or a path) holding the same content as
+the open file ‘srcFD’ without copying it. The two share their blocks until
+either one is written, then only the blocks written are copied. A file that
+is not deduplicated yet becomes deduplicated, its blocks are relabelled in
+place and no data is copied. */
+
+int tfs_snapshot(char* path);
+/* creates the directory ‘path’ holding a clone of every file and directory
+on the disk, as of now. Earlier snapshots are left out of it. Costs one
+inode per file and directory, no data is copied. */
+
+int tfs_defrag(int64_t maxBlocks);
+/* online defragmenter. Moves up to ‘maxBlocks’ blocks towards a layout
+where every file stored in a data block chain sits in ascending consecutive
+blocks, the files in inode order from the start of the disk, and the free
+space is in one piece at the end. Inodes, directories, block maps and shared
+blocks stay where they are. Each call carries on where the last one stopped
+and any other call can be made in between, so a caller runs it while the
+disk is in use by calling it a little at a time and pacing the calls.
+Returns 1 while there is more to do, 0 once the disk is defragmented, or an
+error code. Once a pass is finished, the first call after blocks were taken
+or freed starts the next one. */
+
+int tfs_defragReport(tfsDefragReport *report);
+/* fills ‘report’ with how fragmented the mounted disk is. */
+
+int tfs_setAllocPolicy(int policy);
+/* makes ‘policy’, one of the TFS_ALLOC_* values, the way the mounted disk
+places new blocks from now on, and records it in the super block so later
+mounts use it too. Calling it right after the first mount picks the policy
+for the life of the disk. The placement policies other than TFS_ALLOC_LIFO
+keep a bitmap of the free space in memory, 2 bits per block, built from the
+free block LL when the disk is mounted. */
+
+int tfs_getAllocPolicy(void);
+/* returns the TFS_ALLOC_* policy of the mounted disk, or an error code. */
+
+int tfs_getReadAheadStats(readAheadStats *stats);
+/* copies the read-ahead counters of the mounted file system into ‘stats’.
+Counters are reset on every mount. */
+
+int tfs_getStats(tfsStats *stats);
+/* copies the block I/O counters and the per operation call counts, I/O and
+latency histograms into ‘stats’. They are always on, kept across mounts and
+only cleared by tfs_resetStats(). Works without a mounted disk. */
+
+int tfs_resetStats(void);
+/* sets every counter reported by tfs_getStats() back to 0. */
+
+const char *tfs_opName(int op);
+/* name of a TFS_OP_* operation, e.g. "readByte", or NULL if there is none. */
 
 // EXTRA CREDIT FUNCTIONS:
 
 int tfs_rename(fileDescriptor FD, char* newName); /* renames a
-file. New name should be passed in. File has to be open. */
+file. New name should be passed in. File has to be open. A name
+containing a slash is a path and moves the file to that directory. */
 
 int tfs_readdir(); /* lists all the files and directories on the disk, print the
-list to stdout -- Note: if you don’t have hierarchical directories, this just reads
-the root directory aka “all files” */
+list to stdout, starting at the root directory */
+
+int tfs_openDirCursor(char* path, dirCursor *cursor);
+/* starts a listing of the directory at ‘path’ ("/" for the root) in
+‘cursor’. */
+
+int tfs_readdirplus(dirCursor *cursor, dirEntryPlus entries[], int max);
+/* fills up to ‘max’ entries of the directory behind ‘cursor’ with their
+name, inode, size, type and timestamps, continuing where the previous call
+stopped. Returns the number of entries filled, 0 once the listing is
+complete, or an error code, EDIR when the cursor does not point at a
+directory inode. Allocates nothing. */
 
 int tfs_readFileInfo(fileDescriptor FD); /* returns the file’s
 creation time or all info (up to you if you want to make 
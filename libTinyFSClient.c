@@ -0,0 +1,468 @@
+// TinyFS client library, sends tfs_* calls to tfsd
+#define _POSIX_C_SOURCE 200809L // sockets and poll under -std=c99
+#include "libTinyFSClient.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CLIENT_RECEIVE_CHUNK 65536 // bytes the receive buffer has room for past the data it holds
+
+/* a call sent to tfsd and waiting for its response */
+typedef struct clientCall {
+    int op; // TFSD_OP_*
+    char *buffer; // TFSD_OP_READ: where the bytes go
+    int size; // bytes 'buffer' has room for
+    dirCursor *cursor; // TFSD_OP_OPENDIR and TFSD_OP_READDIR: cursor to update
+    dirEntryPlus *entries; // TFSD_OP_READDIR: where the entries go
+    int max; // entries 'entries' has room for
+    int64_t result;
+} clientCall;
+
+int clientSocket = -1;
+int clientBatching = 0; // 1 between tfsc_batchBegin and tfsc_batchEnd
+clientCall *clientCalls = NULL; // calls queued and not sent yet
+int clientCallCount = 0;
+int clientCallCapacity = 0;
+char *clientSendBuffer = NULL; // their requests
+size_t clientSendLength = 0;
+size_t clientSendCapacity = 0;
+char *clientReceiveBuffer = NULL; // responses read and not handled yet
+size_t clientReceiveLength = 0;
+size_t clientReceiveCapacity = 0;
+
+void clientDrop(void) {
+    /* forgets the connection after an error or a disconnect */
+    if (clientSocket >= 0) {
+        close(clientSocket);
+    }
+    clientSocket = -1;
+    clientBatching = 0;
+    clientCallCount = 0;
+    clientSendLength = 0;
+    clientReceiveLength = 0;
+}
+
+int clientReserve(char **buffer, size_t *capacity, size_t needed) {
+    /* grows 'buffer' to hold at least 'needed' bytes, returns -1 if out of memory */
+    if (*capacity >= needed) {
+        return 0;
+    }
+    size_t newCapacity = *capacity ? *capacity : 4096;
+    while (newCapacity < needed) {
+        newCapacity *= 2;
+    }
+    char *grown = (char *)realloc(*buffer, newCapacity);
+    if (grown == NULL) {
+        return -1;
+    }
+    *buffer = grown;
+    *capacity = newCapacity;
+    return 0;
+}
+
+int clientRequest(int op, fileDescriptor FD, int64_t argsLength, char **args, clientCall **call) {
+    /* queues a request with room for 'argsLength' bytes of arguments at '*args'
+    and its call at '*call', returns 0 or an error code */
+    if (clientSocket < 0) {
+        return TFSD_ECONN;
+    }
+    if (argsLength < 0 || argsLength > TFSD_MAX_REQUEST - TFSD_REQUEST_ARGS_OFFSET) {
+        return TFSD_EFBIG;
+    }
+    uint32_t length = (uint32_t)(TFSD_REQUEST_ARGS_OFFSET + argsLength);
+    if (clientCallCount == clientCallCapacity) {
+        int newCapacity = clientCallCapacity ? clientCallCapacity * 2 : 16;
+        clientCall *grown = (clientCall *)realloc(clientCalls, newCapacity * sizeof(clientCall));
+        if (grown == NULL) {
+            return TFSD_ECONN;
+        }
+        clientCalls = grown;
+        clientCallCapacity = newCapacity;
+    }
+    if (clientReserve(&clientSendBuffer, &clientSendCapacity, clientSendLength + length) < 0) {
+        return TFSD_ECONN;
+    }
+    char *request = clientSendBuffer + clientSendLength;
+    uint32_t tag = (uint32_t)clientCallCount; // position in the batch, responses come back in order
+    int32_t fd = FD;
+    memset(request, 0, TFSD_REQUEST_ARGS_OFFSET);
+    memcpy(request + TFSD_REQUEST_LENGTH_OFFSET, &length, sizeof(uint32_t));
+    memcpy(request + TFSD_REQUEST_TAG_OFFSET, &tag, sizeof(uint32_t));
+    request[TFSD_REQUEST_OP_OFFSET] = (char)op;
+    memcpy(request + TFSD_REQUEST_FD_OFFSET, &fd, sizeof(int32_t));
+    clientSendLength += length;
+    *args = request + TFSD_REQUEST_ARGS_OFFSET;
+    *call = &clientCalls[clientCallCount++];
+    memset(*call, 0, sizeof(clientCall));
+    (*call)->op = op;
+    return 0;
+}
+
+int clientPathRequest(int op, char *path, clientCall **call) {
+    /* queues a request whose argument is a path */
+    char *args;
+    size_t length = strlen(path) + 1;
+    int result = clientRequest(op, 0, (int64_t)length, &args, call);
+    if (result < 0) {
+        return result;
+    }
+    memcpy(args, path, length);
+    return 0;
+}
+
+void decodeCursor(char *wire, dirCursor *cursor) {
+    memcpy(&cursor->dirInode, wire + TFSD_CURSOR_INODE_OFFSET, sizeof(int64_t));
+    memcpy(&cursor->hash, wire + TFSD_CURSOR_HASH_OFFSET, sizeof(uint32_t));
+    memcpy(&cursor->sameHashSeen, wire + TFSD_CURSOR_SAME_HASH_OFFSET, sizeof(int32_t));
+    memcpy(&cursor->finished, wire + TFSD_CURSOR_FINISHED_OFFSET, sizeof(int32_t));
+}
+
+void encodeCursor(dirCursor *cursor, char *wire) {
+    memcpy(wire + TFSD_CURSOR_INODE_OFFSET, &cursor->dirInode, sizeof(int64_t));
+    memcpy(wire + TFSD_CURSOR_HASH_OFFSET, &cursor->hash, sizeof(uint32_t));
+    memcpy(wire + TFSD_CURSOR_SAME_HASH_OFFSET, &cursor->sameHashSeen, sizeof(int32_t));
+    memcpy(wire + TFSD_CURSOR_FINISHED_OFFSET, &cursor->finished, sizeof(int32_t));
+}
+
+void encodeEntry(dirEntryPlus *entry, char *wire) {
+    memset(wire, 0, TFSD_ENTRY_SIZE);
+    memcpy(wire + TFSD_ENTRY_NAME_OFFSET, entry->name, MAX_FILE_NAME_SIZE);
+    memcpy(wire + TFSD_ENTRY_INODE_OFFSET, &entry->inodeNumber, sizeof(int64_t));
+    memcpy(wire + TFSD_ENTRY_SIZE_OFFSET, &entry->fileSize, sizeof(int64_t));
+    wire[TFSD_ENTRY_DIRECTORY_OFFSET] = (char)entry->isDirectory;
+    memcpy(wire + TFSD_ENTRY_CREATED_OFFSET, &entry->created, sizeof(uint64_t));
+    memcpy(wire + TFSD_ENTRY_MODIFIED_OFFSET, &entry->modified, sizeof(uint64_t));
+    memcpy(wire + TFSD_ENTRY_ACCESSED_OFFSET, &entry->accessed, sizeof(uint64_t));
+}
+
+void decodeEntry(char *wire, dirEntryPlus *entry) {
+    memcpy(entry->name, wire + TFSD_ENTRY_NAME_OFFSET, MAX_FILE_NAME_SIZE);
+    entry->name[MAX_FILE_NAME_SIZE - 1] = '\0';
+    memcpy(&entry->inodeNumber, wire + TFSD_ENTRY_INODE_OFFSET, sizeof(int64_t));
+    memcpy(&entry->fileSize, wire + TFSD_ENTRY_SIZE_OFFSET, sizeof(int64_t));
+    entry->isDirectory = wire[TFSD_ENTRY_DIRECTORY_OFFSET];
+    memcpy(&entry->created, wire + TFSD_ENTRY_CREATED_OFFSET, sizeof(uint64_t));
+    memcpy(&entry->modified, wire + TFSD_ENTRY_MODIFIED_OFFSET, sizeof(uint64_t));
+    memcpy(&entry->accessed, wire + TFSD_ENTRY_ACCESSED_OFFSET, sizeof(uint64_t));
+}
+
+int clientHandleResponse(char *response, uint32_t length, clientCall *call) {
+    /* stores the result of 'call' and copies out its data, returns -1 if the
+    response does not fit the request */
+    char *data = response + TFSD_RESPONSE_DATA_OFFSET;
+    uint32_t dataLength = length - TFSD_RESPONSE_DATA_OFFSET;
+    memcpy(&call->result, response + TFSD_RESPONSE_RESULT_OFFSET, sizeof(int64_t));
+    if (call->result < 0) {
+        return dataLength == 0 ? 0 : -1;
+    }
+    if (call->op == TFSD_OP_READ) {
+        if (call->result > call->size || dataLength != call->result) {
+            return -1;
+        }
+        memcpy(call->buffer, data, dataLength);
+    } else if (call->op == TFSD_OP_OPENDIR) {
+        if (dataLength != TFSD_CURSOR_SIZE) {
+            return -1;
+        }
+        decodeCursor(data, call->cursor);
+    } else if (call->op == TFSD_OP_READDIR) {
+        if (call->result > call->max || dataLength != TFSD_CURSOR_SIZE + call->result * TFSD_ENTRY_SIZE) {
+            return -1;
+        }
+        decodeCursor(data, call->cursor);
+        for (int i = 0; i < call->result; i++) {
+            decodeEntry(data + TFSD_CURSOR_SIZE + i * TFSD_ENTRY_SIZE, &call->entries[i]);
+        }
+    } else if (dataLength != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int clientExchange(void) {
+    /* sends the queued requests and handles their responses. Reads responses
+    while it sends, so a batch larger than the socket buffers can not stall
+    both ends. Returns 0, or TFSD_ECONN after dropping the connection. */
+    size_t sent = 0;
+    int answered = 0;
+    while (answered < clientCallCount) {
+        struct pollfd wait = {clientSocket, POLLIN, 0};
+        if (sent < clientSendLength) {
+            wait.events |= POLLOUT;
+        }
+        if (poll(&wait, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (wait.revents & POLLOUT) {
+            ssize_t n = send(clientSocket, clientSendBuffer + sent, clientSendLength - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                break;
+            }
+            if (n > 0) {
+                sent += n;
+            }
+        }
+        if (!(wait.revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
+        if (clientReserve(&clientReceiveBuffer, &clientReceiveCapacity, clientReceiveLength + CLIENT_RECEIVE_CHUNK) < 0) {
+            break;
+        }
+        ssize_t n = recv(clientSocket, clientReceiveBuffer + clientReceiveLength,
+            clientReceiveCapacity - clientReceiveLength, MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            break; // tfsd went away
+        }
+        if (n > 0) {
+            clientReceiveLength += n;
+        }
+        size_t handled = 0;
+        int bad = 0;
+        while (clientReceiveLength - handled >= TFSD_RESPONSE_HEADER_SIZE) {
+            char *response = clientReceiveBuffer + handled;
+            uint32_t length;
+            uint32_t tag;
+            memcpy(&length, response + TFSD_RESPONSE_LENGTH_OFFSET, sizeof(uint32_t));
+            memcpy(&tag, response + TFSD_RESPONSE_TAG_OFFSET, sizeof(uint32_t));
+            if (length < TFSD_RESPONSE_HEADER_SIZE || length > TFSD_MAX_REQUEST || tag != (uint32_t)answered) {
+                bad = 1;
+                break;
+            }
+            if (clientReceiveLength - handled < length) {
+                break;
+            }
+            if (clientHandleResponse(response, length, &clientCalls[answered]) < 0) {
+                bad = 1;
+                break;
+            }
+            answered++;
+            handled += length;
+        }
+        if (bad) {
+            break;
+        }
+        memmove(clientReceiveBuffer, clientReceiveBuffer + handled, clientReceiveLength - handled);
+        clientReceiveLength -= handled;
+    }
+    if (answered < clientCallCount) {
+        for (int i = answered; i < clientCallCount; i++) {
+            clientCalls[i].result = TFSD_ECONN;
+        }
+        int count = clientCallCount;
+        clientDrop();
+        clientCallCount = count; // the results stay readable
+        return TFSD_ECONN;
+    }
+    clientSendLength = 0;
+    return 0;
+}
+
+int64_t clientFinish(void) {
+    /* outside a batch, sends the call just queued and returns its result */
+    if (clientBatching) {
+        return 0;
+    }
+    clientExchange();
+    int64_t result = clientCalls[0].result;
+    clientCallCount = 0;
+    return result;
+}
+
+int tfsc_connect(char *socketPath) {
+    if (socketPath == NULL) {
+        socketPath = TFSD_DEFAULT_SOCKET;
+    }
+    struct sockaddr_un address;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        printf("LIBTINYFSCLIENT: Error: socket path too long. (connect)\n");
+        return TFSD_ECONN;
+    }
+    if (clientSocket >= 0) {
+        tfsc_disconnect();
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketPath);
+    clientSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (clientSocket < 0 || connect(clientSocket, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        printf("LIBTINYFSCLIENT: Error: can not connect to %s. (connect)\n", socketPath);
+        clientDrop();
+        return TFSD_ECONN;
+    }
+    return 0;
+}
+
+int tfsc_disconnect(void) {
+    if (clientSocket < 0) {
+        return TFSD_ECONN;
+    }
+    clientDrop();
+    free(clientCalls);
+    free(clientSendBuffer);
+    free(clientReceiveBuffer);
+    clientCalls = NULL;
+    clientSendBuffer = NULL;
+    clientReceiveBuffer = NULL;
+    clientCallCapacity = 0;
+    clientSendCapacity = 0;
+    clientReceiveCapacity = 0;
+    return 0;
+}
+
+fileDescriptor tfsc_openFile(char *name) {
+    clientCall *call;
+    int result = clientPathRequest(TFSD_OP_OPEN, name, &call);
+    if (result < 0) {
+        return result;
+    }
+    return (fileDescriptor)clientFinish();
+}
+
+int tfsc_closeFile(fileDescriptor FD) {
+    char *args;
+    clientCall *call;
+    int result = clientRequest(TFSD_OP_CLOSE, FD, 0, &args, &call);
+    if (result < 0) {
+        return result;
+    }
+    return (int)clientFinish();
+}
+
+int tfsc_read(fileDescriptor FD, char *buffer, int size) {
+    char *args;
+    clientCall *call;
+    int result = clientRequest(TFSD_OP_READ, FD, sizeof(int32_t), &args, &call);
+    if (result < 0) {
+        return result;
+    }
+    int32_t wanted = size < TFSD_MAX_PAYLOAD ? size : TFSD_MAX_PAYLOAD;
+    memcpy(args, &wanted, sizeof(int32_t));
+    call->buffer = buffer;
+    call->size = wanted;
+    return (int)clientFinish();
+}
+
+int tfsc_writeFile(fileDescriptor FD, char *buffer, int size) {
+    if (size > TFSD_MAX_PAYLOAD) {
+        return TFSD_EFBIG;
+    }
+    char *args;
+    clientCall *call;
+    int result = clientRequest(TFSD_OP_WRITE, FD, size, &args, &call);
+    if (result < 0) {
+        return result;
+    }
+    memcpy(args, buffer, size);
+    return (int)clientFinish();
+}
+
+int tfsc_pwrite(fileDescriptor FD, char *buffer, int size, int64_t offset) {
+    if (size > TFSD_MAX_PAYLOAD) {
+        return TFSD_EFBIG;
+    }
+    char *args;
+    clientCall *call;
+    int result = clientRequest(TFSD_OP_PWRITE, FD, (int64_t)sizeof(int64_t) + size, &args, &call);
+    if (result < 0) {
+        return result;
+    }
+    memcpy(args, &offset, sizeof(int64_t));
+    memcpy(args + sizeof(int64_t), buffer, size);
+    return (int)clientFinish();
+}
+
+int64_t tfsc_seek(fileDescriptor FD, int64_t offset) {
+    char *args;
+    clientCall *call;
+    int result = clientRequest(TFSD_OP_SEEK, FD, sizeof(int64_t), &args, &call);
+    if (result < 0) {
+        return result;
+    }
+    memcpy(args, &offset, sizeof(int64_t));
+    return clientFinish();
+}
+
+int tfsc_deleteFile(fileDescriptor FD) {
+    char *args;
+    clientCall *call;
+    int result = clientRequest(TFSD_OP_DELETE, FD, 0, &args, &call);
+    if (result < 0) {
+        return result;
+    }
+    return (int)clientFinish();
+}
+
+int tfsc_mkdir(char *path) {
+    clientCall *call;
+    int result = clientPathRequest(TFSD_OP_MKDIR, path, &call);
+    if (result < 0) {
+        return result;
+    }
+    return (int)clientFinish();
+}
+
+int tfsc_rmdir(char *path) {
+    clientCall *call;
+    int result = clientPathRequest(TFSD_OP_RMDIR, path, &call);
+    if (result < 0) {
+        return result;
+    }
+    return (int)clientFinish();
+}
+
+int tfsc_openDirCursor(char *path, dirCursor *cursor) {
+    clientCall *call;
+    int result = clientPathRequest(TFSD_OP_OPENDIR, path, &call);
+    if (result < 0) {
+        return result;
+    }
+    call->cursor = cursor;
+    return (int)clientFinish();
+}
+
+int tfsc_readdirplus(dirCursor *cursor, dirEntryPlus entries[], int max) {
+    char *args;
+    clientCall *call;
+    int result = clientRequest(TFSD_OP_READDIR, 0, TFSD_CURSOR_SIZE + sizeof(int32_t), &args, &call);
+    if (result < 0) {
+        return result;
+    }
+    int32_t wanted = max < TFSD_MAX_PAYLOAD / TFSD_ENTRY_SIZE ? max : TFSD_MAX_PAYLOAD / TFSD_ENTRY_SIZE;
+    encodeCursor(cursor, args);
+    memcpy(args + TFSD_CURSOR_SIZE, &wanted, sizeof(int32_t));
+    call->cursor = cursor;
+    call->entries = entries;
+    call->max = wanted;
+    return (int)clientFinish();
+}
+
+int tfsc_batchBegin(void) {
+    if (clientSocket < 0) {
+        return TFSD_ECONN;
+    }
+    clientBatching = 1;
+    return 0;
+}
+
+int tfsc_batchEnd(int64_t results[], int max) {
+    if (clientSocket < 0) {
+        return TFSD_ECONN;
+    }
+    clientBatching = 0;
+    int count = clientCallCount;
+    int result = count > 0 ? clientExchange() : 0;
+    for (int i = 0; i < count && results != NULL && i < max; i++) {
+        results[i] = clientCalls[i].result;
+    }
+    clientCallCount = 0;
+    return result < 0 ? result : count;
+}
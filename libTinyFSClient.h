@@ -0,0 +1,110 @@
+#ifndef libTinyFSClient_h
+#define libTinyFSClient_h
+#include "libTinyFS.h"
+#include <stdint.h>
+
+/* Protocol between tfsd and its clients over a Unix domain socket. Every
+request and every response starts with a fixed header and carries its total
+length, so a client can send any number of requests without waiting and read
+the responses later (pipelining). tfsd answers the requests of a connection
+in the order they were sent. All numbers are in host byte order, both ends
+are on the same machine. */
+#define TFSD_DEFAULT_SOCKET "tfsd.sock"
+#define TFSD_MAX_PAYLOAD (1 << 24) // largest data carried by one request or response, 16 MB
+
+#define TFSD_REQUEST_HEADER_SIZE 16
+#define TFSD_REQUEST_LENGTH_OFFSET 0 // 4 byte length of the whole request, header included
+#define TFSD_REQUEST_TAG_OFFSET 4 // 4 byte number chosen by the client, echoed in the response
+#define TFSD_REQUEST_OP_OFFSET 8 // 1 byte TFSD_OP_*, the 3 bytes after it are 0
+#define TFSD_REQUEST_FD_OFFSET 12 // 4 byte file descriptor, 0 for operations without one
+#define TFSD_REQUEST_ARGS_OFFSET 16 // arguments, see the TFSD_OP_* list
+
+#define TFSD_RESPONSE_HEADER_SIZE 16
+#define TFSD_RESPONSE_LENGTH_OFFSET 0 // 4 byte length of the whole response, header included
+#define TFSD_RESPONSE_TAG_OFFSET 4 // tag of the request answered
+#define TFSD_RESPONSE_RESULT_OFFSET 8 // 8 byte return value of the tfs_* call
+#define TFSD_RESPONSE_DATA_OFFSET 16 // data returned, see the TFSD_OP_* list
+
+/* operations, with their arguments after the request header and the data
+after the response header */
+#define TFSD_OP_OPEN 1 // path, null terminated -> nothing, the result is the file descriptor
+#define TFSD_OP_CLOSE 2 // nothing -> nothing
+#define TFSD_OP_READ 3 // 4 byte size -> the bytes read, as many as the result
+#define TFSD_OP_WRITE 4 // the whole new content -> nothing
+#define TFSD_OP_PWRITE 5 // 8 byte offset, then the bytes -> nothing
+#define TFSD_OP_SEEK 6 // 8 byte offset -> nothing
+#define TFSD_OP_DELETE 7 // nothing -> nothing
+#define TFSD_OP_MKDIR 8 // path, null terminated -> nothing
+#define TFSD_OP_RMDIR 9 // path, null terminated -> nothing
+#define TFSD_OP_OPENDIR 10 // path, null terminated -> cursor
+#define TFSD_OP_READDIR 11 // cursor, then 4 byte maximum entries -> cursor, then the entries
+#define TFSD_OP_COUNT 12
+
+/* a dirCursor on the wire */
+#define TFSD_CURSOR_SIZE 20
+#define TFSD_CURSOR_INODE_OFFSET 0 // 8 byte directory inode
+#define TFSD_CURSOR_HASH_OFFSET 8 // 4 byte hash of the last entry returned
+#define TFSD_CURSOR_SAME_HASH_OFFSET 12 // 4 byte entries with that hash already returned
+#define TFSD_CURSOR_FINISHED_OFFSET 16 // 4 byte, 1 once the listing is complete
+
+/* a dirEntryPlus on the wire */
+#define TFSD_ENTRY_SIZE 50
+#define TFSD_ENTRY_NAME_OFFSET 0 // MAX_FILE_NAME_SIZE byte name, null terminated
+#define TFSD_ENTRY_INODE_OFFSET 9 // 8 byte inode block
+#define TFSD_ENTRY_SIZE_OFFSET 17 // 8 byte size in bytes, or number of entries for a directory
+#define TFSD_ENTRY_DIRECTORY_OFFSET 25 // 1 byte, 1 for directories
+#define TFSD_ENTRY_CREATED_OFFSET 26 // 8 byte timestamps, nanoseconds since the epoch
+#define TFSD_ENTRY_MODIFIED_OFFSET 34
+#define TFSD_ENTRY_ACCESSED_OFFSET 42
+
+/* converts cursors and entries to and from their wire form, used by both ends */
+void encodeCursor(dirCursor *cursor, char *wire);
+void decodeCursor(char *wire, dirCursor *cursor);
+void encodeEntry(dirEntryPlus *entry, char *wire);
+void decodeEntry(char *wire, dirEntryPlus *entry);
+
+#define TFSD_MAX_REQUEST (TFSD_REQUEST_ARGS_OFFSET + 8 + TFSD_MAX_PAYLOAD) // a TFSD_OP_PWRITE of TFSD_MAX_PAYLOAD bytes
+
+/* error codes tfsd and the client library return themselves. They are the
+values of tinyFS_errno.h, whose names clash with <errno.h>. */
+#define TFSD_EBADFD -1 // EBADFD, the descriptor is not open on this connection
+#define TFSD_EFBIG -3 // EFBIG, the data is larger than TFSD_MAX_PAYLOAD
+#define TFSD_ECONN -17 // ECONN, no connection to tfsd, or it was lost
+
+int tfsc_connect(char *socketPath);
+int tfsc_disconnect(void);
+/* tfsc_connect(socketPath) connects to the tfsd serving the socket
+‘socketPath’ (TFSD_DEFAULT_SOCKET if NULL). Like tfs_mount a process has
+one connection at a time. tfsc_disconnect() closes it, and tfsd closes the
+files still open on it. */
+
+/* The calls below work like their tfs_* counterparts on the image tfsd
+mounted. File descriptors belong to the connection that opened them. A
+call that fails returns the tfs_* error code, TFSD_EFBIG or TFSD_ECONN.
+tfsc_read returns at most TFSD_MAX_PAYLOAD bytes per call. */
+fileDescriptor tfsc_openFile(char *name);
+int tfsc_closeFile(fileDescriptor FD);
+int tfsc_read(fileDescriptor FD, char *buffer, int size);
+int tfsc_writeFile(fileDescriptor FD, char *buffer, int size);
+int tfsc_pwrite(fileDescriptor FD, char *buffer, int size, int64_t offset);
+int64_t tfsc_seek(fileDescriptor FD, int64_t offset);
+int tfsc_deleteFile(fileDescriptor FD);
+int tfsc_mkdir(char *path);
+int tfsc_rmdir(char *path);
+int tfsc_openDirCursor(char *path, dirCursor *cursor);
+int tfsc_readdirplus(dirCursor *cursor, dirEntryPlus entries[], int max);
+
+int tfsc_batchBegin(void);
+int tfsc_batchEnd(int64_t results[], int max);
+/* pipelines calls. After tfsc_batchBegin() the calls above only queue their
+request and return 0, or an error if it can not be queued. tfsc_batchEnd()
+sends them together, reads the responses and stores the result of the
+i-th call in results[i] (results may be NULL, only the first ‘max’ are
+stored). Buffers, cursors and entries given to the queued calls are filled
+in then, so they must stay valid until tfsc_batchEnd() returns. tfsd runs
+every request of a connection it has received at once, so a batch costs one
+round trip and usually one turn at the library lock. It is not atomic,
+other connections' calls may run in between. Returns the number of calls
+sent, or TFSD_ECONN. */
+
+#endif
@@ -0,0 +1,364 @@
+/* TinyFS micro-benchmark
+ *
+ * usage: tfs_bench [-q] [-o results.json] [-d scratch image]
+ *
+ * Times each public call on its own, one sample per call, across a grid of
+ * disk sizes, file counts and file sizes. For every configuration the
+ * scratch image is formatted and mounted, then the files are created
+ * (tfs_openFile of a new name), written whole, closed and looked up again
+ * (tfs_openFile of an existing name), read back byte by byte, in bulk and
+ * through zero-copy spans, seeked at random, renamed and deleted. Configurations whose files do not
+ * fit on the disk are skipped. Results go out as one JSON object with the
+ * p50, p99 and mean latency and the throughput of every operation, so runs
+ * of two builds can be compared line by line. -q runs a smaller grid.
+ */
+#define _POSIX_C_SOURCE 200809L // clock_gettime under -std=c99
+#include "libTinyFS.h"
+#include "tinyFS_errno.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_IMAGE "tfs_bench.dsk"
+#define BENCH_FORMAT_REPEATS 3 // tfs_mkfs and tfs_mount samples per configuration
+#define BENCH_READ_BYTES 1024 // tfs_readByte samples per file, from its start
+#define BENCH_SEEKS 64 // tfs_seek samples per file
+#define BENCH_BULK_SIZE 4096 // tfs_read request size
+
+typedef struct benchSamples {
+    long long *ns; // latency of every call
+    int count;
+    int capacity;
+    long long bytes; // bytes moved by all the calls, 0 if the operation moves none
+    long blockReads; // blocks read from disk by the calls, from tfs_getStats
+    long blockWrites;
+    tfsStats mark; // counters when the current batch of calls started
+} benchSamples;
+
+typedef struct benchConfig {
+    int diskBytes;
+    int files;
+    int fileBytes;
+} benchConfig;
+
+long long nowNs(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (long long)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+void addSample(benchSamples *samples, long long ns, int bytes) {
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 256;
+        samples->ns = (long long *)realloc(samples->ns, samples->capacity * sizeof(long long));
+        if (samples->ns == NULL) {
+            fprintf(stderr, "tfs_bench: out of memory\n");
+            exit(2);
+        }
+    }
+    samples->ns[samples->count++] = ns;
+    samples->bytes += bytes;
+}
+
+void beginBatch(benchSamples *samples) {
+    tfs_getStats(&samples->mark);
+}
+
+void endBatch(benchSamples *samples, int op) {
+    /* charges the batch of calls since beginBatch with the block I/O that
+    tfs_getStats put down to operation 'op' meanwhile */
+    tfsStats now;
+    tfs_getStats(&now);
+    samples->blockReads += now.ops[op].blockReads - samples->mark.ops[op].blockReads;
+    samples->blockWrites += now.ops[op].blockWrites - samples->mark.ops[op].blockWrites;
+}
+
+int compareNs(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+void printResult(FILE *out, int *first, benchConfig *config, const char *op, benchSamples *samples) {
+    /* one JSON object per operation, percentiles by nearest rank */
+    if (samples->count == 0) {
+        return;
+    }
+    qsort(samples->ns, samples->count, sizeof(long long), compareNs);
+    long long total = 0;
+    for (int i = 0; i < samples->count; i++) {
+        total += samples->ns[i];
+    }
+    long long p50 = samples->ns[(samples->count - 1) / 2];
+    long long p99 = samples->ns[(int)((samples->count - 1) * 0.99)];
+    double seconds = total / 1e9;
+    fprintf(out, "%s\n    {\"disk_bytes\": %d, \"files\": %d, \"file_bytes\": %d, \"op\": \"%s\", "
+        "\"samples\": %d, \"p50_ns\": %lld, \"p99_ns\": %lld, \"mean_ns\": %.1f, \"ops_per_sec\": %.1f",
+        *first ? "" : ",", config->diskBytes, config->files, config->fileBytes, op,
+        samples->count, p50, p99, (double)total / samples->count, seconds > 0 ? samples->count / seconds : 0.0);
+    fprintf(out, ", \"block_reads\": %ld, \"block_writes\": %ld", samples->blockReads, samples->blockWrites);
+    if (samples->bytes > 0) {
+        fprintf(out, ", \"mb_per_sec\": %.2f, \"amplification\": %.4f", seconds > 0 ? samples->bytes / seconds / 1e6 : 0.0,
+            (double)(samples->blockReads + samples->blockWrites) / samples->bytes);
+    }
+    fprintf(out, "}");
+    *first = 0;
+    samples->count = 0;
+    samples->bytes = 0;
+    samples->blockReads = 0;
+    samples->blockWrites = 0;
+}
+
+int runConfig(FILE *out, int *first, benchConfig *config, char *image, int verbose) {
+    /* runs every operation once per file on a fresh image, returns 0 or an error code */
+    benchSamples mkfsSamples = {0}, mountSamples = {0}, createSamples = {0}, writeSamples = {0};
+    benchSamples lookupSamples = {0}, readByteSamples = {0}, readSamples = {0}, seekSamples = {0};
+    benchSamples readvSamples = {0}, renameSamples = {0}, deleteSamples = {0};
+    fileDescriptor *fds = (fileDescriptor *)malloc(config->files * sizeof(fileDescriptor));
+    char *content = (char *)malloc(config->fileBytes);
+    char *buffer = (char *)malloc(BENCH_BULK_SIZE);
+    if (fds == NULL || content == NULL || buffer == NULL) {
+        fprintf(stderr, "tfs_bench: out of memory\n");
+        exit(2);
+    }
+    for (int i = 0; i < config->fileBytes; i++) {
+        content[i] = 'a' + rand() % 26;
+    }
+    char name[16]; // "b" or "r" and the file number, fits MAX_FILE_NAME_SIZE for up to 10^7 files
+    int result = 0;
+    long long start;
+
+    beginBatch(&mkfsSamples);
+    for (int i = 0; i < BENCH_FORMAT_REPEATS; i++) {
+        start = nowNs();
+        result = tfs_mkfs(image, config->diskBytes);
+        addSample(&mkfsSamples, nowNs() - start, 0);
+        if (result < 0) {
+            goto done;
+        }
+    }
+    endBatch(&mkfsSamples, TFS_OP_MKFS);
+    beginBatch(&mountSamples);
+    for (int i = 0; i < BENCH_FORMAT_REPEATS; i++) {
+        start = nowNs();
+        result = tfs_mount(image);
+        addSample(&mountSamples, nowNs() - start, 0);
+        if (result < 0 || (i < BENCH_FORMAT_REPEATS - 1 && (result = tfs_unmount()) < 0)) {
+            goto done;
+        }
+    }
+    endBatch(&mountSamples, TFS_OP_MOUNT);
+
+    beginBatch(&createSamples);
+    for (int f = 0; f < config->files; f++) {
+        sprintf(name, "b%d", f);
+        start = nowNs();
+        fds[f] = tfs_openFile(name);
+        addSample(&createSamples, nowNs() - start, 0);
+        if ((result = fds[f]) < 0) {
+            goto unmount;
+        }
+    }
+    endBatch(&createSamples, TFS_OP_OPEN);
+    beginBatch(&writeSamples);
+    for (int f = 0; f < config->files; f++) {
+        start = nowNs();
+        result = tfs_writeFile(fds[f], content, config->fileBytes);
+        addSample(&writeSamples, nowNs() - start, config->fileBytes);
+        if (result < 0) {
+            goto unmount;
+        }
+        tfs_closeFile(fds[f]);
+    }
+    endBatch(&writeSamples, TFS_OP_WRITE);
+    beginBatch(&lookupSamples);
+    for (int f = 0; f < config->files; f++) {
+        sprintf(name, "b%d", f);
+        start = nowNs();
+        fds[f] = tfs_openFile(name);
+        addSample(&lookupSamples, nowNs() - start, 0);
+        if ((result = fds[f]) < 0) {
+            goto unmount;
+        }
+    }
+    endBatch(&lookupSamples, TFS_OP_OPEN);
+    // tfs_seek moves the file pointer relative to where it is, so each loop leaves it back at 0
+    beginBatch(&readByteSamples);
+    for (int f = 0; f < config->files; f++) {
+        char byte;
+        int limit = config->fileBytes < BENCH_READ_BYTES ? config->fileBytes : BENCH_READ_BYTES;
+        for (int i = 0; i < limit; i++) {
+            start = nowNs();
+            result = tfs_readByte(fds[f], &byte);
+            addSample(&readByteSamples, nowNs() - start, 1);
+            if (result < 0) {
+                goto unmount;
+            }
+        }
+        tfs_seek(fds[f], -limit);
+    }
+    endBatch(&readByteSamples, TFS_OP_READ_BYTE);
+    beginBatch(&readSamples);
+    for (int f = 0; f < config->files; f++) {
+        int got;
+        do {
+            start = nowNs();
+            got = tfs_read(fds[f], buffer, BENCH_BULK_SIZE);
+            addSample(&readSamples, nowNs() - start, got > 0 ? got : 0);
+        } while (got > 0);
+        if ((result = got) < 0) {
+            goto unmount;
+        }
+        tfs_seek(fds[f], -config->fileBytes);
+    }
+    endBatch(&readSamples, TFS_OP_READ);
+    // a sample is one tfs_readv_begin and its tfs_readv_release, the spans are only looked at
+    beginBatch(&readvSamples);
+    for (int f = 0; f < config->files; f++) {
+        tfsSpan spans[TFS_READV_MAX_SPANS];
+        int count;
+        do {
+            start = nowNs();
+            count = tfs_readv_begin(fds[f], spans, TFS_READV_MAX_SPANS);
+            int got = 0;
+            for (int i = 0; i < count; i++) {
+                got += spans[i].length;
+            }
+            tfs_readv_release(fds[f]);
+            addSample(&readvSamples, nowNs() - start, got);
+        } while (count > 0);
+        if ((result = count) < 0) {
+            goto unmount;
+        }
+        tfs_seek(fds[f], -config->fileBytes);
+    }
+    endBatch(&readvSamples, TFS_OP_READV);
+    beginBatch(&seekSamples);
+    for (int f = 0; f < config->files; f++) {
+        int position = 0;
+        for (int i = 0; i < BENCH_SEEKS; i++) {
+            int offset = rand() % config->fileBytes;
+            start = nowNs();
+            int64_t pointer = tfs_seek(fds[f], offset - position);
+            position = offset;
+            addSample(&seekSamples, nowNs() - start, 0);
+            if (pointer < 0) {
+                result = (int)pointer;
+                goto unmount;
+            }
+        }
+    }
+    endBatch(&seekSamples, TFS_OP_SEEK);
+    beginBatch(&renameSamples);
+    for (int f = 0; f < config->files; f++) {
+        sprintf(name, "r%d", f);
+        start = nowNs();
+        result = tfs_rename(fds[f], name);
+        addSample(&renameSamples, nowNs() - start, 0);
+        if (result < 0) {
+            goto unmount;
+        }
+    }
+    endBatch(&renameSamples, TFS_OP_RENAME);
+    beginBatch(&deleteSamples);
+    for (int f = 0; f < config->files; f++) {
+        start = nowNs();
+        result = tfs_deleteFile(fds[f]);
+        addSample(&deleteSamples, nowNs() - start, 0);
+        if (result < 0) {
+            goto unmount;
+        }
+    }
+    endBatch(&deleteSamples, TFS_OP_DELETE);
+    result = 0;
+
+unmount:
+    tfs_unmount();
+done:
+    if (result < 0) {
+        fprintf(stderr, "tfs_bench: disk %d, %d files of %d bytes: failed with error %d\n",
+            config->diskBytes, config->files, config->fileBytes, result);
+    } else {
+        printResult(out, first, config, "mkfs", &mkfsSamples);
+        printResult(out, first, config, "mount", &mountSamples);
+        printResult(out, first, config, "create", &createSamples);
+        printResult(out, first, config, "write", &writeSamples);
+        printResult(out, first, config, "lookup", &lookupSamples);
+        printResult(out, first, config, "read_byte", &readByteSamples);
+        printResult(out, first, config, "read", &readSamples);
+        printResult(out, first, config, "readv", &readvSamples);
+        printResult(out, first, config, "seek", &seekSamples);
+        printResult(out, first, config, "rename", &renameSamples);
+        printResult(out, first, config, "delete", &deleteSamples);
+        if (verbose) {
+            fprintf(stderr, "tfs_bench: disk %d, %d files of %d bytes done\n",
+                config->diskBytes, config->files, config->fileBytes);
+        }
+    }
+    benchSamples *all[] = {&mkfsSamples, &mountSamples, &createSamples, &writeSamples, &lookupSamples,
+        &readByteSamples, &readSamples, &readvSamples, &seekSamples, &renameSamples, &deleteSamples};
+    for (int i = 0; i < (int)(sizeof(all) / sizeof(all[0])); i++) {
+        free(all[i]->ns);
+    }
+    free(fds);
+    free(content);
+    free(buffer);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    char *image = BENCH_DEFAULT_IMAGE;
+    char *outName = NULL;
+    int quick = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "qo:d:")) != -1) {
+        if (opt == 'q') {
+            quick = 1;
+        } else if (opt == 'o') {
+            outName = optarg;
+        } else if (opt == 'd') {
+            image = optarg;
+        } else {
+            fprintf(stderr, "usage: tfs_bench [-q] [-o results.json] [-d scratch image]\n");
+            return 2;
+        }
+    }
+    FILE *out = stdout;
+    if (outName != NULL && (out = fopen(outName, "w")) == NULL) {
+        perror(outName);
+        return 2;
+    }
+    int diskSizes[] = {1 << 20, 16 << 20};
+    int fileCounts[] = {16, 256};
+    int fileSizes[] = {100, 4096, 65536}; // inline, a short chain, a long chain
+    int numDisks = quick ? 1 : 2;
+    srand(1); // the same content and seek offsets in every run
+
+    fprintf(out, "{\"benchmark\": \"tfs_bench\", \"block_size\": %d, \"format_version\": %d, \"results\": [",
+        BLOCKSIZE, TFS_FORMAT_VERSION);
+    int first = 1;
+    int failures = 0;
+    for (int d = 0; d < numDisks; d++) {
+        for (int c = 0; c < 2; c++) {
+            for (int s = 0; s < 3; s++) {
+                benchConfig config = {diskSizes[d], fileCounts[c], fileSizes[s]};
+                // a 246 byte data block per 256 byte block, plus an inode per file and some slack
+                long long needed = (long long)config.files * (config.fileBytes / 246 + 2) * BLOCKSIZE;
+                if (needed > config.diskBytes / 10 * 9) {
+                    continue;
+                }
+                if (runConfig(out, &first, &config, image, outName != NULL) < 0) {
+                    failures++;
+                }
+            }
+        }
+    }
+    fprintf(out, "\n]}\n");
+    if (out != stdout) {
+        fclose(out);
+    }
+    remove(image);
+    return failures ? 1 : 0;
+}
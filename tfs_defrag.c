@@ -0,0 +1,103 @@
+/* TinyFS defragmenter
+ *
+ * usage: tfs_defrag [-r blocks/s] [-s blocks] [-n] image
+ *
+ * Mounts 'image', prints how fragmented it is, defragments it with
+ * tfs_defrag() and prints the same again. tfs_defrag is called for 's'
+ * blocks (256) at a time, and with -r the calls are spaced so that no more
+ * than 'blocks/s' blocks are moved per second on average, which is what
+ * leaves a disk in use room for its other work; tfsd -d does the same while
+ * it serves an image. -n only prints the report. Exit status is 0 on
+ * success, 1 if the defragmentation failed and 2 if the image could not be
+ * mounted.
+ */
+#define _POSIX_C_SOURCE 200809L // nanosleep and clock_gettime under -std=c99
+#include "libTinyFS.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#define DEFRAG_DEFAULT_STEP 256 // blocks moved per tfs_defrag call
+
+double elapsedSeconds(struct timespec *from) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - from->tv_sec) + (now.tv_nsec - from->tv_nsec) / 1e9;
+}
+
+void printReport(char *label, tfsDefragReport *report) {
+    printf("%s %lld files in %lld data blocks, %lld extents, fragmentation %.3f, "
+        "%lld free blocks in %lld extents, %lld at the end\n", label,
+        (long long)report->files, (long long)report->dataBlocks, (long long)report->extents,
+        report->fragmentation, (long long)report->freeBlocks, (long long)report->freeExtents,
+        (long long)report->tailFree);
+}
+
+int main(int argc, char *argv[]) {
+    double rate = 0; // blocks per second, 0 for as fast as possible
+    long step = DEFRAG_DEFAULT_STEP;
+    int reportOnly = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:s:n")) != -1) {
+        if (opt == 'r') {
+            rate = atof(optarg);
+        } else if (opt == 's') {
+            step = atol(optarg);
+        } else if (opt == 'n') {
+            reportOnly = 1;
+        } else {
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind != argc - 1 || rate < 0 || step < 1) {
+        printf("usage: tfs_defrag [-r blocks/s] [-s blocks] [-n] image\n");
+        return 2;
+    }
+    char *image = argv[optind];
+    if (tfs_mount(image) < 0) {
+        printf("tfs_defrag: can not mount %s\n", image);
+        return 2;
+    }
+    tfsDefragReport report;
+    if (tfs_defragReport(&report) < 0) {
+        printf("tfs_defrag: can not read the layout of %s\n", image);
+        tfs_unmount();
+        return 1;
+    }
+    printReport("before:", &report);
+    if (reportOnly) {
+        return tfs_unmount() < 0 ? 1 : 0;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int64_t moved = report.moved;
+    int result;
+    while ((result = tfs_defrag(step)) > 0) {
+        if (rate > 0) {
+            // sleep until the blocks moved so far are what the rate allows
+            if (tfs_defragReport(&report) < 0) {
+                result = -1;
+                break;
+            }
+            double ahead = (report.moved - moved) / rate - elapsedSeconds(&start);
+            if (ahead > 0) {
+                struct timespec pause = {(time_t)ahead, (long)((ahead - (time_t)ahead) * 1e9)};
+                nanosleep(&pause, NULL);
+            }
+        }
+    }
+    double seconds = elapsedSeconds(&start);
+    if (result < 0 || tfs_defragReport(&report) < 0) {
+        printf("tfs_defrag: defragmentation of %s failed\n", image);
+        tfs_unmount();
+        return 1;
+    }
+    printReport("after: ", &report);
+    printf("moved %lld blocks in %.3f s\n", (long long)(report.moved - moved), seconds);
+    return tfs_unmount() < 0 ? 1 : 0;
+}
@@ -0,0 +1,515 @@
+/* TinyFS offline file system checker
+ *
+ * usage: tfs_fsck [-j threads] image
+ *        tfs_fsck [-j threads] stripe:[width:]member,member,...
+ *
+ * Reads the image once, front to back, split into one contiguous range per
+ * thread. Every block below the free watermark must have the magic number, a
+ * matching CRC-32C if block checksums are on and a valid block type, and must
+ * be owned by exactly one pointer: the super block owns the root directory,
+ * the dedup hash index and the head of the free block LL, inodes own their
+ * data chain, block map or directory tree, data, free and block map blocks
+ * own the next block of their chain, index blocks own their children and
+ * leaves own the inodes they name. Shared blocks and block maps are the
+ * exception, they count the pointers to them: every block map entry listing
+ * a shared block (the dedup hash index may name it once more), and every
+ * inode or block map a clone shares a block map with. While scanning, each pointer sets its target's bit in a
+ * "referenced" bitmap (a second bitmap catches targets that were already set)
+ * and records who owns the target. Afterwards, without any further disk reads:
+ *   - blocks nobody references are leaked
+ *   - blocks referenced more than once are cross-linked
+ *   - shared blocks and block maps whose reference count is not the number
+ *     of pointers to them are miscounted
+ *   - blocks whose owner could not point at their type are bad links
+ *   - blocks whose chain of owners never reaches the super block are orphaned,
+ *     which is how cycles in the free block LL or a data chain show up
+ * An image left dirty under an allocation policy other than TFS_ALLOC_LIFO
+ * has a free block LL that was not kept up to date while it was mounted, the
+ * next mount rebuilds it. There every free block counts as owned by the
+ * super block and its next pointer is not followed.
+ * A stripe set (an image named "stripe:...", see libDisk.h) is read
+ * through libDisk, one request at a time, which spreads each over the
+ * members. The image is never written. Exit status is 0 for a clean image, 1 if any
+ * problem was found and 2 if the image could not be checked at all.
+ */
+#define _POSIX_C_SOURCE 200809L // pread and sysconf under -std=c99
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#define FSCK_CHUNK_BLOCKS 4096 // blocks per read, 1 MB
+#define FSCK_MAX_THREADS 64
+#define FSCK_DIRECTORY 0x80 // marks directory inodes in the block type array
+
+typedef struct fsckImage {
+    int fd; // plain image file
+    int disk; // libDisk disk of a stripe set, 0 for a plain file
+    pthread_mutex_t diskLock; // libDisk takes one request at a time
+    tfsBlock numBlocks; // total blocks from the super block
+    tfsBlock watermark; // first never used block, nothing at or past it is checked
+    tfsBlock rootDirectory;
+    int checksums; // 1 if every block carries a CRC-32C
+    int looseFree; // 1 if the free block LL is stale, free blocks belong to the super block
+    unsigned char *types; // block type of every block, FSCK_DIRECTORY set on directory inodes, 0 if invalid
+    tfsBlock *owner; // block that points at each block, 0 for the super block
+    int *balance; // reference count of each shared block and block map minus the pointers to it
+    uint64_t *named; // bitmap, block is named by a directory leaf entry
+    uint64_t *referenced; // bitmap, block is the target of at least one pointer
+    uint64_t *crossLinked; // bitmap, block is the target of more than one pointer
+    long badBlocks; // wrong magic number, block type or entry count
+    long badPointers; // pointers to 0, past the watermark or at the super block
+} fsckImage;
+
+typedef struct fsckRange {
+    fsckImage *image;
+    tfsBlock first; // first block of the range
+    tfsBlock end; // one past the last block
+    long counts[SHARED_BLOCK_TYPE + 1]; // blocks of each type in the range
+    long directories;
+} fsckRange;
+
+int testAndSetBit(uint64_t *bitmap, tfsBlock bit) {
+    uint64_t mask = (uint64_t)1 << (bit % 64);
+    return (__atomic_fetch_or(&bitmap[bit / 64], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+int testBit(uint64_t *bitmap, tfsBlock bit) {
+    return (int)((bitmap[bit / 64] >> (bit % 64)) & 1);
+}
+
+int reference(fsckImage *image, tfsBlock from, tfsBlock target) {
+    /* records that block 'from' points at block 'target', returns 0 for a bad pointer */
+    if (target <= SUPER_BLOCK || target >= image->watermark) {
+        printf("block %lld: pointer to block %lld outside the used blocks 1..%lld\n", (long long)from, (long long)target,
+            (long long)image->watermark - 1);
+        __atomic_fetch_add(&image->badPointers, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (testAndSetBit(image->referenced, target)) {
+        testAndSetBit(image->crossLinked, target);
+    }
+    __atomic_store_n(&image->owner[target], from, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&image->balance[target], 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+void badBlock(fsckImage *image, tfsBlock block, const char *problem) {
+    printf("block %lld: %s\n", (long long)block, problem);
+    __atomic_fetch_add(&image->badBlocks, 1, __ATOMIC_RELAXED);
+}
+
+void checkBlock(fsckImage *image, fsckRange *range, tfsBlock block, char *data) {
+    /* checks one block on its own and records the pointers it holds */
+    int type = data[BLOCK_NUMBER_OFFSET];
+    if (image->checksums) {
+        uint32_t checksum;
+        memcpy(&checksum, data + BLOCK_CHECKSUM_OFFSET, sizeof(uint32_t));
+        if (checksum != crc32c(data, BLOCK_CHECKSUM_OFFSET)) {
+            badBlock(image, block, "checksum mismatch");
+            return;
+        }
+    }
+    if (data[MAGIC_NUMBER_OFFSET] != MAGIC_NUMBER) {
+        badBlock(image, block, "bad magic number");
+        return;
+    }
+    tfsBlock pointer;
+    uint32_t references;
+    int count;
+    switch (type) {
+    case INODE_BLOCK_TYPE:
+        memcpy(&pointer, data + INODE_DATA_BLOCK_OFFSET, sizeof(tfsBlock));
+        if (data[INODE_FLAGS_OFFSET] & INODE_FLAG_DIRECTORY) {
+            image->types[block] = INODE_BLOCK_TYPE | FSCK_DIRECTORY;
+            range->directories++;
+        } else if (data[INODE_FLAGS_OFFSET] & INODE_FLAG_INLINE) {
+            // the file size of a compressed file is its uncompressed size
+            int64_t size;
+            memcpy(&size, data + INODE_FILE_SIZE_OFFSET, sizeof(int64_t));
+            if (pointer != 0 || size < 0 ||
+                (size > INODE_INLINE_CAPACITY && !(data[INODE_FLAGS_OFFSET] & INODE_FLAG_COMPRESSED))) {
+                badBlock(image, block, "inline inode with data blocks or an impossible size");
+                return;
+            }
+        }
+        if (image->types[block] == 0) {
+            image->types[block] = INODE_BLOCK_TYPE;
+        }
+        if (pointer != 0) {
+            reference(image, block, pointer);
+        }
+        break;
+    case DATA_BLOCK_TYPE:
+    case FREE_BLOCK_TYPE:
+        // DATA_NEXT_BLOCK_OFFSET == FREE_NEXT_BLOCK_OFFSET
+        image->types[block] = type;
+        if (type == FREE_BLOCK_TYPE && image->looseFree) {
+            reference(image, SUPER_BLOCK, block);
+            break;
+        }
+        memcpy(&pointer, data + DATA_NEXT_BLOCK_OFFSET, sizeof(tfsBlock));
+        if (pointer != 0) {
+            reference(image, block, pointer);
+        }
+        break;
+    case MAP_BLOCK_TYPE:
+        count = (unsigned char)data[MAP_COUNT_OFFSET];
+        if (count == 0 || count > MAP_MAX_ENTRIES) {
+            badBlock(image, block, "block map with a bad entry count");
+            return;
+        }
+        image->types[block] = type;
+        memcpy(&references, data + MAP_REFCOUNT_OFFSET, sizeof(uint32_t));
+        if (references == 0 || references > INT32_MAX) {
+            badBlock(image, block, "block map without references");
+            return;
+        }
+        __atomic_fetch_add(&image->balance[block], (int)references, __ATOMIC_RELAXED);
+        memcpy(&pointer, data + MAP_NEXT_BLOCK_OFFSET, sizeof(tfsBlock));
+        if (pointer != 0) {
+            reference(image, block, pointer);
+        }
+        for (int i = 0; i < count; i++) {
+            memcpy(&pointer, data + MAP_ENTRIES_OFFSET + i * sizeof(tfsBlock), sizeof(tfsBlock));
+            reference(image, block, pointer);
+        }
+        break;
+    case SHARED_BLOCK_TYPE:
+        memcpy(&references, data + SHARED_REFCOUNT_OFFSET, sizeof(uint32_t));
+        if (references == 0 || references > INT32_MAX) {
+            badBlock(image, block, "shared block without references");
+            return;
+        }
+        image->types[block] = type;
+        __atomic_fetch_add(&image->balance[block], (int)references, __ATOMIC_RELAXED);
+        break;
+    case DIR_LEAF_BLOCK_TYPE:
+        count = (unsigned char)data[DIR_COUNT_OFFSET];
+        if (count > DIR_LEAF_MAX_ENTRIES || data[DIR_LEVEL_OFFSET] != 0) {
+            badBlock(image, block, "directory leaf with a bad level or entry count");
+            return;
+        }
+        image->types[block] = type;
+        for (int i = 0; i < count; i++) {
+            memcpy(&pointer, data + DIR_ENTRIES_OFFSET + i * DIR_ENTRY_SIZE, sizeof(tfsBlock));
+            if (reference(image, block, pointer)) {
+                testAndSetBit(image->named, pointer);
+            }
+        }
+        break;
+    case DIR_INDEX_BLOCK_TYPE:
+        count = (unsigned char)data[DIR_COUNT_OFFSET];
+        if (count == 0 || count > DIR_INDEX_MAX_ENTRIES || data[DIR_LEVEL_OFFSET] == 0) {
+            badBlock(image, block, "directory index with a bad level or entry count");
+            return;
+        }
+        image->types[block] = type;
+        for (int i = 0; i < count; i++) {
+            memcpy(&pointer, data + DIR_ENTRIES_OFFSET + i * DIR_INDEX_ENTRY_SIZE + sizeof(uint32_t), sizeof(tfsBlock));
+            reference(image, block, pointer);
+        }
+        break;
+    default:
+        // super and checkpoint blocks never sit below the watermark past block 0
+        badBlock(image, block, "bad block type");
+        return;
+    }
+    range->counts[type]++;
+}
+
+int readImage(fsckImage *image, tfsBlock block, int blocks, char *buffer) {
+    /* reads 'blocks' blocks from 'block' on, returns 0 or -1 */
+    if (image->disk == 0) {
+        size_t length = (size_t)blocks * BLOCKSIZE;
+        return pread(image->fd, buffer, length, (off_t)block * BLOCKSIZE) == (ssize_t)length ? 0 : -1;
+    }
+    pthread_mutex_lock(&image->diskLock);
+    int result = readBlocks(image->disk, block, blocks, buffer);
+    pthread_mutex_unlock(&image->diskLock);
+    return result;
+}
+
+void *scanRange(void *arg) {
+    fsckRange *range = (fsckRange *)arg;
+    fsckImage *image = range->image;
+    char *chunk = (char *)malloc((size_t)FSCK_CHUNK_BLOCKS * BLOCKSIZE);
+    if (chunk == NULL) {
+        printf("tfs_fsck: out of memory\n");
+        exit(2);
+    }
+    for (tfsBlock block = range->first; block < range->end; block += FSCK_CHUNK_BLOCKS) {
+        int blocks = range->end - block < FSCK_CHUNK_BLOCKS ? (int)(range->end - block) : FSCK_CHUNK_BLOCKS;
+        if (readImage(image, block, blocks, chunk) < 0) {
+            printf("tfs_fsck: could not read blocks %lld..%lld\n", (long long)block, (long long)block + blocks - 1);
+            exit(2);
+        }
+        for (int i = 0; i < blocks; i++) {
+            checkBlock(image, range, block + i, chunk + (size_t)i * BLOCKSIZE);
+        }
+    }
+    free(chunk);
+    return NULL;
+}
+
+int ownerAllows(int ownerType, int type) {
+    /* can a block of type 'ownerType' point at a block of type 'type'? */
+    switch (ownerType) {
+    case INODE_BLOCK_TYPE:
+        return type == DATA_BLOCK_TYPE || type == MAP_BLOCK_TYPE;
+    case INODE_BLOCK_TYPE | FSCK_DIRECTORY:
+    case DIR_INDEX_BLOCK_TYPE:
+        return type == DIR_LEAF_BLOCK_TYPE || type == DIR_INDEX_BLOCK_TYPE;
+    case DIR_LEAF_BLOCK_TYPE:
+        // leaves of the dedup hash index name shared blocks
+        return (type & ~FSCK_DIRECTORY) == INODE_BLOCK_TYPE || type == SHARED_BLOCK_TYPE;
+    case MAP_BLOCK_TYPE:
+        return type == MAP_BLOCK_TYPE || type == SHARED_BLOCK_TYPE;
+    case DATA_BLOCK_TYPE:
+    case FREE_BLOCK_TYPE:
+        return type == ownerType;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        if (opt == 'j') {
+            threads = atoi(optarg);
+        } else {
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        printf("usage: tfs_fsck [-j threads] image | stripe:[width:]member,...\n");
+        return 2;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > FSCK_MAX_THREADS) {
+        threads = FSCK_MAX_THREADS;
+    }
+    char *filename = argv[optind];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    fsckImage image;
+    memset(&image, 0, sizeof(fsckImage));
+    off_t imageSize = 0;
+    if (strncmp(filename, DISK_STRIPE_PREFIX, strlen(DISK_STRIPE_PREFIX)) == 0) {
+        image.disk = openDisk(filename, 0);
+        if (image.disk < 0) {
+            printf("tfs_fsck: %s: could not open the stripe set\n", filename);
+            return 2;
+        }
+        for (Disk *disk = diskListHead; disk != NULL; disk = disk->next) {
+            if (disk->diskNumber == image.disk) {
+                imageSize = (off_t)disk->nBytes;
+            }
+        }
+        pthread_mutex_init(&image.diskLock, NULL);
+    } else {
+        image.fd = open(filename, O_RDONLY);
+        if (image.fd < 0) {
+            perror(filename);
+            return 2;
+        }
+        imageSize = lseek(image.fd, 0, SEEK_END);
+    }
+
+    /* SUPER BLOCK */
+    char superData[BLOCKSIZE];
+    if (readImage(&image, SUPER_BLOCK, 1, superData) < 0) {
+        printf("tfs_fsck: %s: could not read the super block\n", filename);
+        return 2;
+    }
+    int formatVersion;
+    tfsBlock freeHead;
+    tfsBlock dedupIndex;
+    uint32_t checksum;
+    memcpy(&formatVersion, superData + SUPER_FORMAT_VERSION_OFFSET, sizeof(int));
+    memcpy(&checksum, superData + SUPER_CHECKSUM_OFFSET, sizeof(uint32_t));
+    memcpy(&image.numBlocks, superData + SUPER_NUM_BLOCKS_OFFSET, sizeof(tfsBlock));
+    memcpy(&image.watermark, superData + SUPER_FREE_WATERMARK_OFFSET, sizeof(tfsBlock));
+    memcpy(&image.rootDirectory, superData + ROOT_DIR_OFFSET, sizeof(tfsBlock));
+    memcpy(&freeHead, superData + FB_OFFSET, sizeof(tfsBlock));
+    memcpy(&dedupIndex, superData + SUPER_DEDUP_INDEX_OFFSET, sizeof(tfsBlock));
+    image.checksums = (superData[SUPER_FEATURES_OFFSET] & SUPER_FEATURE_CHECKSUMS) != 0;
+    image.looseFree = superData[SUPER_STATE_OFFSET] != SUPER_STATE_CLEAN &&
+        superData[SUPER_ALLOC_POLICY_OFFSET] != TFS_ALLOC_LIFO;
+    if (superData[BLOCK_NUMBER_OFFSET] != SUPER_BLOCK_TYPE || superData[MAGIC_NUMBER_OFFSET] != MAGIC_NUMBER) {
+        printf("tfs_fsck: %s: not a TinyFS image\n", filename);
+        return 2;
+    }
+    if (formatVersion != TFS_FORMAT_VERSION) {
+        printf("tfs_fsck: %s: format version %d, expected %d\n", filename, formatVersion, TFS_FORMAT_VERSION);
+        return 2;
+    }
+    if (checksum != crc32c(superData, SUPER_CHECKSUM_OFFSET)) {
+        printf("tfs_fsck: %s: super block checksum mismatch\n", filename);
+        return 2;
+    }
+    if ((unsigned char)superData[SUPER_FEATURES_OFFSET] & ~SUPER_FEATURES_KNOWN) {
+        printf("tfs_fsck: %s: unknown features 0x%x\n", filename, (unsigned char)superData[SUPER_FEATURES_OFFSET] & ~SUPER_FEATURES_KNOWN);
+        return 2;
+    }
+    if (image.numBlocks < 2 || image.numBlocks > imageSize / BLOCKSIZE ||
+        image.watermark <= image.rootDirectory || image.watermark > image.numBlocks ||
+        image.rootDirectory <= SUPER_BLOCK) {
+        printf("tfs_fsck: %s: super block describes an impossible layout\n", filename);
+        return 2;
+    }
+
+    size_t words = (size_t)image.watermark / 64 + 1;
+    image.types = (unsigned char *)calloc(image.watermark, sizeof(unsigned char));
+    image.owner = (tfsBlock *)calloc(image.watermark, sizeof(tfsBlock));
+    image.balance = (int *)calloc(image.watermark, sizeof(int));
+    image.named = (uint64_t *)calloc(words, sizeof(uint64_t));
+    image.referenced = (uint64_t *)calloc(words, sizeof(uint64_t));
+    image.crossLinked = (uint64_t *)calloc(words, sizeof(uint64_t));
+    if (image.types == NULL || image.owner == NULL || image.balance == NULL || image.named == NULL ||
+        image.referenced == NULL || image.crossLinked == NULL) {
+        printf("tfs_fsck: out of memory\n");
+        return 2;
+    }
+    reference(&image, SUPER_BLOCK, image.rootDirectory);
+    if (freeHead != 0 && !image.looseFree) {
+        reference(&image, SUPER_BLOCK, freeHead);
+    }
+    if (dedupIndex != 0) {
+        reference(&image, SUPER_BLOCK, dedupIndex);
+    }
+
+    /* PARALLEL SCAN, one contiguous range of blocks per thread */
+    tfsBlock usedBlocks = image.watermark - 1;
+    if (threads > usedBlocks) {
+        threads = (int)usedBlocks;
+    }
+    fsckRange ranges[FSCK_MAX_THREADS];
+    pthread_t workers[FSCK_MAX_THREADS];
+    for (int t = 0; t < threads; t++) {
+        memset(&ranges[t], 0, sizeof(fsckRange));
+        ranges[t].image = &image;
+        ranges[t].first = 1 + usedBlocks / threads * t + usedBlocks % threads * t / threads;
+        ranges[t].end = 1 + usedBlocks / threads * (t + 1) + usedBlocks % threads * (t + 1) / threads;
+        if (pthread_create(&workers[t], NULL, scanRange, &ranges[t]) != 0) {
+            printf("tfs_fsck: could not start thread %d\n", t);
+            return 2;
+        }
+    }
+    long counts[SHARED_BLOCK_TYPE + 1] = {0};
+    long directories = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+        for (int i = 0; i <= SHARED_BLOCK_TYPE; i++) {
+            counts[i] += ranges[t].counts[i];
+        }
+        directories += ranges[t].directories;
+    }
+
+    /* OWNERSHIP, entirely in memory */
+    long leaked = 0;
+    long crossLinked = 0;
+    long badLinks = 0;
+    long orphaned = 0;
+    long miscounted = 0;
+    if ((image.types[image.rootDirectory] & FSCK_DIRECTORY) == 0) {
+        printf("block %lld: root directory is not a directory inode\n", (long long)image.rootDirectory);
+        badLinks++;
+    }
+    if (!image.looseFree && freeHead > SUPER_BLOCK && freeHead < image.watermark && image.types[freeHead] != FREE_BLOCK_TYPE) {
+        printf("block %lld: free block LL head is not a free block\n", (long long)freeHead);
+        badLinks++;
+    }
+    if (dedupIndex > SUPER_BLOCK && dedupIndex < image.watermark && (image.types[dedupIndex] & FSCK_DIRECTORY) == 0) {
+        printf("block %lld: dedup hash index is not a directory inode\n", (long long)dedupIndex);
+        badLinks++;
+    }
+    for (tfsBlock block = 1; block < image.watermark; block++) {
+        if (image.types[block] == 0) {
+            continue; // already reported as a bad block
+        }
+        if (!testBit(image.referenced, block)) {
+            printf("block %lld: leaked, nothing points at it\n", (long long)block);
+            leaked++;
+        } else if (image.types[block] == SHARED_BLOCK_TYPE || image.types[block] == MAP_BLOCK_TYPE) {
+            // a shared block in the dedup hash index has one pointer more than its count
+            int off = image.balance[block] + (image.types[block] == SHARED_BLOCK_TYPE && testBit(image.named, block));
+            if (off != 0) {
+                printf("block %lld: reference count is off by %d\n", (long long)block, off);
+                miscounted++;
+            }
+        } else if (testBit(image.crossLinked, block)) {
+            printf("block %lld: cross-linked, more than one block points at it\n", (long long)block);
+            crossLinked++;
+        } else if (image.owner[block] != SUPER_BLOCK &&
+            !ownerAllows(image.types[image.owner[block]], image.types[block])) {
+            printf("block %lld: block %lld of type %d points at it, but it has type %d\n", (long long)block,
+                (long long)image.owner[block], image.types[image.owner[block]] & ~FSCK_DIRECTORY, image.types[block] & ~FSCK_DIRECTORY);
+            badLinks++;
+        }
+    }
+    /* Every block has at most one owner recorded, so following owners from any
+    block either reaches the super block or runs into a cycle. 'reach' is 0 for
+    unknown, 1 for reaches the super block, 2 for on the current walk, 3 for
+    never reaches it. Each block is walked once. */
+    unsigned char *reach = (unsigned char *)calloc(image.watermark, sizeof(unsigned char));
+    if (reach == NULL) {
+        printf("tfs_fsck: out of memory\n");
+        return 2;
+    }
+    for (tfsBlock block = 1; block < image.watermark; block++) {
+        tfsBlock current = block;
+        while (current != SUPER_BLOCK && reach[current] == 0 && testBit(image.referenced, current)) {
+            reach[current] = 2;
+            current = image.owner[current];
+        }
+        int result = (current == SUPER_BLOCK || reach[current] == 1) ? 1 : 3;
+        for (current = block; current != SUPER_BLOCK && reach[current] == 2; current = image.owner[current]) {
+            reach[current] = result;
+        }
+        if (result == 3 && testBit(image.referenced, block)) {
+            printf("block %lld: orphaned, its owners never lead back to the super block\n", (long long)block);
+            orphaned++;
+        }
+    }
+    free(reach);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%s: %lld blocks, %lld below the free watermark, %s, block checksums %s\n", filename, (long long)image.numBlocks,
+        (long long)image.watermark, superData[SUPER_STATE_OFFSET] == SUPER_STATE_CLEAN ? "cleanly unmounted" : "not cleanly unmounted",
+        image.checksums ? "on" : "off");
+    printf("inodes %ld (directories %ld), data %ld, free %ld, directory leaf %ld, directory index %ld, "
+        "block map %ld, shared %ld\n", counts[INODE_BLOCK_TYPE], directories, counts[DATA_BLOCK_TYPE],
+        counts[FREE_BLOCK_TYPE], counts[DIR_LEAF_BLOCK_TYPE], counts[DIR_INDEX_BLOCK_TYPE],
+        counts[MAP_BLOCK_TYPE], counts[SHARED_BLOCK_TYPE]);
+    printf("bad blocks %ld, bad pointers %ld, leaked %ld, cross-linked %ld, bad links %ld, orphaned %ld, "
+        "miscounted %ld\n", image.badBlocks, image.badPointers, leaked, crossLinked, badLinks, orphaned, miscounted);
+    printf("checked in %.3f s with %d thread%s\n", seconds, threads, threads == 1 ? "" : "s");
+
+    free(image.types);
+    free(image.owner);
+    free(image.balance);
+    free(image.named);
+    free(image.referenced);
+    free(image.crossLinked);
+    if (image.disk != 0) {
+        closeDisk(image.disk);
+        pthread_mutex_destroy(&image.diskLock);
+    } else {
+        close(image.fd);
+    }
+    long problems = image.badBlocks + image.badPointers + leaked + crossLinked + badLinks + orphaned + miscounted;
+    return problems == 0 ? 0 : 1;
+}
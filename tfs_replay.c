@@ -0,0 +1,184 @@
+/* TinyFS block I/O trace replay
+ *
+ * usage: tfs_replay [-t] trace image
+ *
+ * Replays a trace recorded by libDisk (startDiskTrace(), or running any
+ * program with LIBDISK_TRACE=file set) against 'image' through libDisk.
+ * Every disk the trace opens is opened on 'image', created with the traced
+ * size when the trace created it or when 'image' does not exist yet. Reads
+ * read the traced block, writes write a filler block to it, so the content
+ * of the image means nothing afterwards. By default the events are replayed
+ * back to back at full speed; with -t each one waits until its recorded
+ * time, which reproduces the think time between requests. Prints the
+ * events replayed, the time taken and the mean latency of reads and writes.
+ * Exit status is 0 if every event replayed, 1 if some failed and 2 if the
+ * trace could not be read at all.
+ */
+#define _POSIX_C_SOURCE 200809L // nanosleep and clock_gettime under -std=c99
+#include "libDisk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#define REPLAY_CHUNK_RECORDS 4096 // records per fread, 64 KB
+#define REPLAY_MAX_DISKS 65536 // traced disk numbers are 2 bytes
+
+typedef struct replayCounts {
+    long events;
+    long failed;
+    long long totalNs; // time spent in the libDisk calls for these events
+} replayCounts;
+
+long long elapsedNs(struct timespec *from) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)(now.tv_sec - from->tv_sec) * 1000000000LL + (now.tv_nsec - from->tv_nsec);
+}
+
+int replayOpen(char *image, int64_t blocks, int flags) {
+    /* opens 'image' for a traced openDisk, returns the disk number or -1 */
+    if (!(flags & DISK_TRACE_FLAG_CREATE) && access(image, F_OK) == 0) {
+        return openDisk(image, 0);
+    }
+    return openDisk(image, blocks * BLOCKSIZE);
+}
+
+int main(int argc, char *argv[]) {
+    int realTime = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t")) != -1) {
+        if (opt == 't') {
+            realTime = 1;
+        } else {
+            break;
+        }
+    }
+    if (optind != argc - 2) {
+        printf("usage: tfs_replay [-t] trace image\n");
+        return 2;
+    }
+    char *traceName = argv[optind];
+    char *image = argv[optind + 1];
+    FILE *trace = fopen(traceName, "rb");
+    if (trace == NULL) {
+        perror(traceName);
+        return 2;
+    }
+    unsigned char header[DISK_TRACE_HEADER_SIZE];
+    int version;
+    int blockSize;
+    if (fread(header, DISK_TRACE_HEADER_SIZE, 1, trace) != 1 || memcmp(header, DISK_TRACE_MAGIC, 8) != 0) {
+        printf("tfs_replay: %s: not a block I/O trace\n", traceName);
+        return 2;
+    }
+    memcpy(&version, header + 8, sizeof(int));
+    memcpy(&blockSize, header + 12, sizeof(int));
+    if (version != DISK_TRACE_VERSION || blockSize != BLOCKSIZE) {
+        printf("tfs_replay: %s: trace version %d with %d byte blocks, expected version %d with %d byte blocks\n",
+            traceName, version, blockSize, DISK_TRACE_VERSION, BLOCKSIZE);
+        return 2;
+    }
+
+    int *disks = (int *)calloc(REPLAY_MAX_DISKS, sizeof(int)); // replayed disk of every traced disk, 0 if not open
+    unsigned char *records = (unsigned char *)malloc(REPLAY_CHUNK_RECORDS * DISK_TRACE_RECORD_SIZE);
+    if (disks == NULL || records == NULL) {
+        printf("tfs_replay: out of memory\n");
+        return 2;
+    }
+    char readData[BLOCKSIZE];
+    char writeData[BLOCKSIZE];
+    memset(writeData, 0xA5, BLOCKSIZE);
+    replayCounts reads = {0}, writes = {0}, opens = {0}, closes = {0};
+    long unknown = 0;
+    long long maxLag = 0; // how far behind its recorded time an event started, -t only
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t count;
+    while ((count = fread(records, DISK_TRACE_RECORD_SIZE, REPLAY_CHUNK_RECORDS, trace)) > 0) {
+        for (size_t r = 0; r < count; r++) {
+            unsigned char *record = records + r * DISK_TRACE_RECORD_SIZE;
+            uint64_t time;
+            int64_t block;
+            uint16_t tracedDisk;
+            memcpy(&time, record + DISK_TRACE_TIME_OFFSET, sizeof(uint64_t));
+            memcpy(&block, record + DISK_TRACE_BLOCK_OFFSET, sizeof(int64_t));
+            memcpy(&tracedDisk, record + DISK_TRACE_DISK_OFFSET, sizeof(uint16_t));
+            int event = record[DISK_TRACE_OP_OFFSET];
+            int flags = record[DISK_TRACE_FLAGS_OFFSET];
+
+            if (realTime) {
+                long long wait = (long long)time - elapsedNs(&start);
+                if (wait > 0) {
+                    struct timespec pause = {wait / 1000000000LL, wait % 1000000000LL};
+                    nanosleep(&pause, NULL);
+                } else if (-wait > maxLag) {
+                    maxLag = -wait;
+                }
+            }
+            struct timespec callStart;
+            clock_gettime(CLOCK_MONOTONIC, &callStart);
+            int disk = disks[tracedDisk];
+            replayCounts *counts;
+            int result;
+            switch (event) {
+            case DISK_TRACE_READ:
+                counts = &reads;
+                result = disk > 0 ? readBlock(disk, block, readData) : -1;
+                break;
+            case DISK_TRACE_WRITE:
+                counts = &writes;
+                memcpy(writeData, &block, sizeof(int64_t)); // so no two blocks look alike
+                result = disk > 0 ? writeBlock(disk, block, writeData) : -1;
+                break;
+            case DISK_TRACE_OPEN:
+                counts = &opens;
+                if (disk > 0) {
+                    closeDisk(disk);
+                }
+                result = replayOpen(image, block, flags);
+                disks[tracedDisk] = result > 0 ? result : 0;
+                break;
+            case DISK_TRACE_CLOSE:
+                counts = &closes;
+                result = disk > 0 ? closeDisk(disk) : -1;
+                disks[tracedDisk] = 0;
+                break;
+            default:
+                unknown++;
+                continue;
+            }
+            counts->totalNs += elapsedNs(&callStart);
+            counts->events++;
+            if (result < 0) {
+                counts->failed++;
+            }
+        }
+    }
+    long long total = elapsedNs(&start);
+    fclose(trace);
+    for (int d = 0; d < REPLAY_MAX_DISKS; d++) {
+        if (disks[d] > 0) {
+            closeDisk(disks[d]);
+        }
+    }
+
+    long events = reads.events + writes.events + opens.events + closes.events;
+    long failed = reads.failed + writes.failed + opens.failed + closes.failed + unknown;
+    printf("%ld events (%ld reads, %ld writes, %ld opens, %ld closes) in %.3f s, %.0f events/s\n",
+        events, reads.events, writes.events, opens.events, closes.events, total / 1e9,
+        total > 0 ? events / (total / 1e9) : 0.0);
+    printf("mean read %.0f ns, mean write %.0f ns\n",
+        reads.events ? (double)reads.totalNs / reads.events : 0.0,
+        writes.events ? (double)writes.totalNs / writes.events : 0.0);
+    if (realTime) {
+        printf("largest lag behind the trace %.3f ms\n", maxLag / 1e6);
+    }
+    printf("failed %ld, unknown events %ld\n", failed - unknown, unknown);
+    free(disks);
+    free(records);
+    return failed ? 1 : 0;
+}
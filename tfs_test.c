@@ -0,0 +1,1244 @@
+/* TinyFS tests
+ *
+ * usage: tfs_test [check ...]
+ *
+ * Runs each check, or the ones named, in a child process of its own, so
+ * every check starts with a fresh library. A check formats a scratch image,
+ * exercises one feature through the public calls and compares what it reads
+ * back with what it wrote. It ends by unmounting and running tfs_fsck on the
+ * image, which has to find it clean. What the library and tfs_fsck print goes
+ * to TEST_LOG, failed checks are reported on stderr. Run it from the
+ * directory tfs_fsck was built in, "make test" does. Exit status is 0 if
+ * every check passed and 1 otherwise.
+ */
+#define _POSIX_C_SOURCE 200809L // fork, waitpid, kill, nanosleep and fileno under -std=c99
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include "libTinyFSClient.h"
+#include "tinyFS_errno.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define TEST_IMAGE "tfs_test.dsk"
+#define TEST_MEMBER_A "tfs_test_a.dsk" // stripe and mirror members, and the image the trace check replays onto
+#define TEST_MEMBER_B "tfs_test_b.dsk"
+#define TEST_LOG "tfs_test.log"
+#define TEST_SOCKET "tfs_test.sock" // tfsd started by the daemon check
+#define TEST_TRACE "tfs_test.trace" // block I/O trace of the trace check
+#define TEST_DISK_SIZE 262144 // 1024 blocks
+#define TEST_SMALL_DISK_SIZE 51200 // 200 blocks, small enough to fill
+#define TEST_LARGE_DISK_SIZE 6442450944LL // past 2^32 bytes, formatted sparse
+
+#define CHECK(condition) check((condition) != 0, #condition, __LINE__)
+
+int failed = 0; // set by the first failing CHECK of the current check
+
+void check(int ok, const char *condition, int line) {
+    if (!ok) {
+        fprintf(stderr, "    line %d: %s\n", line, condition);
+        failed = 1;
+    }
+}
+
+void fillPattern(char *buffer, int size, unsigned seed, int compressible) {
+    /* deterministic content, a repeating phrase when 'compressible' is set */
+    for (int i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        buffer[i] = compressible ? "pattern of words "[(i + seed % 2) % 17] : (char)(seed >> 16);
+    }
+}
+
+fileDescriptor writeNewFile(char *name, char *content, int size) {
+    /* opens 'name' and writes 'content' as the whole file, returns the descriptor */
+    fileDescriptor FD = tfs_openFile(name);
+    if (FD < 0 || tfs_writeFile(FD, content, size) < 0) {
+        return FD < 0 ? FD : EFWRITE;
+    }
+    return FD;
+}
+
+int sameContent(fileDescriptor FD, char *expected, int size) {
+    /* reads the whole file from its start, 1 if it is exactly 'expected' */
+    char *buffer = (char *)malloc(size + 1);
+    int got = 0;
+    int result = (int)tfs_seek(FD, -tfs_seek(FD, 0)); // tfs_seek moves the file pointer by 'offset'
+    while (result >= 0 && got <= size) {
+        result = tfs_read(FD, buffer + got, size + 1 - got);
+        if (result <= 0) {
+            break;
+        }
+        got += result;
+    }
+    int same = result >= 0 && got == size && memcmp(buffer, expected, size) == 0;
+    free(buffer);
+    return same;
+}
+
+int sameFile(char *name, char *expected, int size) {
+    fileDescriptor FD = tfs_openFile(name);
+    int same = FD >= 0 && sameContent(FD, expected, size);
+    if (FD >= 0) {
+        tfs_closeFile(FD);
+    }
+    return same;
+}
+
+int fsckClean(char *image) {
+    /* runs tfs_fsck on an unmounted image, 1 if it found nothing wrong */
+    char command[256];
+    fflush(stdout);
+    snprintf(command, sizeof(command), "./tfs_fsck %s >> %s 2>&1", image, TEST_LOG);
+    int status = system(command);
+    return status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int unmountClean(char *image) {
+    return tfs_unmount() >= 0 && fsckClean(image);
+}
+
+int freshDisk(char *image, int64_t nBytes) {
+    return tfs_mkfs(image, nBytes) >= 0 && tfs_mount(image) >= 0;
+}
+
+int fillDisk(int leave) {
+    /* grows the file "fill" one block at a time until the disk is full, then
+    shortens it so that 'leave' blocks are free. Returns its size. */
+    char piece[USEABLE_DATA_SIZE];
+    fillPattern(piece, USEABLE_DATA_SIZE, 99, 0);
+    fileDescriptor FD = writeNewFile("fill", piece, USEABLE_DATA_SIZE);
+    if (FD < 0) {
+        return FD;
+    }
+    int64_t size = USEABLE_DATA_SIZE;
+    while (tfs_pwrite(FD, piece, USEABLE_DATA_SIZE, size) == USEABLE_DATA_SIZE) {
+        size += USEABLE_DATA_SIZE;
+    }
+    if (leave > 0) {
+        size -= (int64_t)leave * USEABLE_DATA_SIZE;
+        char *content = (char *)calloc(size, 1);
+        int result = tfs_writeFile(FD, content, (int)size);
+        free(content);
+        if (result < 0) {
+            return result;
+        }
+    }
+    tfs_closeFile(FD);
+    return (int)size;
+}
+
+int readAll(fileDescriptor FD, char *buffer, int size) {
+    /* reads 'size' bytes from the file pointer on through tfsd, 1 if they all came */
+    int done = 0;
+    int result = 1;
+    while (done < size && result > 0) {
+        result = tfsc_read(FD, buffer + done, size - done);
+        done += result > 0 ? result : 0;
+    }
+    return done == size;
+}
+
+/* CHECKS */
+
+int rootEntry(char *name, dirEntryPlus *entry) {
+    /* finds 'name' in the root directory with tfs_readdirplus, 1 if it is there */
+    dirCursor cursor;
+    int result = tfs_openDirCursor("/", &cursor);
+    while (result >= 0 && (result = tfs_readdirplus(&cursor, entry, 1)) == 1) {
+        if (strcmp(entry->name, name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void tick(void) {
+    /* waits long enough for the coarse clock behind the timestamps to move */
+    struct timespec pause = {0, 30000000};
+    nanosleep(&pause, NULL);
+}
+
+void testTimestamps(void) {
+    CHECK(freshDisk(TEST_IMAGE, TEST_DISK_SIZE));
+    char content[1000];
+    char buffer[100];
+    fillPattern(content, sizeof(content), 3, 0);
+    uint64_t start = (uint64_t)time(NULL) * 1000000000ULL;
+    dirEntryPlus before, after;
+    // a new file gets one time for all three
+    fileDescriptor FD = tfs_openFile("a");
+    CHECK(FD >= 0 && rootEntry("a", &before));
+    CHECK(before.created == before.modified && before.created == before.accessed);
+    CHECK(before.created + 1000000000ULL >= start && before.created <= (uint64_t)time(NULL) * 1000000000ULL + 1000000000ULL);
+    uint64_t created = before.created;
+    int subSecond = before.created % 1000000000ULL != 0;
+    // writes move the modification time, reads the access time, nothing moves the creation time
+    tick();
+    CHECK(tfs_writeFile(FD, content, sizeof(content)) >= 0);
+    CHECK(rootEntry("a", &after));
+    CHECK(after.modified > before.modified && after.accessed == before.accessed);
+    before = after;
+    tick();
+    CHECK(tfs_read(FD, buffer, sizeof(buffer)) == sizeof(buffer));
+    CHECK(rootEntry("a", &after));
+    CHECK(after.accessed > before.accessed && after.modified == before.modified);
+    before = after;
+    tick();
+    CHECK(tfs_pwrite(FD, "xyz", 3, 500) == 3);
+    CHECK(rootEntry("a", &after));
+    CHECK(after.modified > before.modified && after.accessed == before.accessed);
+    before = after;
+    tick();
+    CHECK(tfs_readByte(FD, buffer) >= 0);
+    CHECK(rootEntry("a", &after));
+    CHECK(after.accessed > before.accessed && after.modified == before.modified);
+    before = after;
+    tick();
+    CHECK(tfs_rename(FD, "b") >= 0);
+    CHECK(rootEntry("b", &after));
+    CHECK(after.modified > before.modified && after.accessed == before.accessed);
+    before = after;
+    tick();
+    CHECK(tfs_closeFile(FD) >= 0);
+    FD = tfs_openFile("b");
+    CHECK(FD >= 0 && rootEntry("b", &after));
+    CHECK(after.accessed > before.accessed && after.modified == before.modified);
+    CHECK(after.created == created);
+    subSecond |= after.modified % 1000000000ULL != 0 || after.accessed % 1000000000ULL != 0;
+    CHECK(subSecond); // nanoseconds, not whole seconds
+    CHECK(tfs_readFileInfo(FD) >= 0);
+    // the times are stored in the inode and come back after a remount
+    before = after;
+    CHECK(tfs_unmount() >= 0);
+    CHECK(tfs_mount(TEST_IMAGE) >= 0);
+    CHECK(rootEntry("b", &after));
+    CHECK(after.created == before.created && after.modified == before.modified && after.accessed == before.accessed);
+    CHECK(unmountClean(TEST_IMAGE));
+}
+
+void testInline(void) {
+    CHECK(freshDisk(TEST_IMAGE, TEST_DISK_SIZE));
+    char content[INODE_INLINE_CAPACITY];
+    fillPattern(content, sizeof(content), 1, 0);
+    fileDescriptor FD = tfs_openFile("small");
+    CHECK(FD >= 0);
+    tfsDefragReport before, after;
+    CHECK(tfs_defragReport(&before) >= 0);
+    CHECK(tfs_writeFile(FD, content, sizeof(content)) >= 0);
+    CHECK(tfs_defragReport(&after) >= 0);
+    CHECK(after.freeBlocks == before.freeBlocks); // nothing past the inode
+    CHECK(sameContent(FD, content, sizeof(content)));
+    // a seek before the start is refused, a read never reaches the inode header
+    char buffer[INODE_INLINE_CAPACITY];
+    CHECK(tfs_seek(FD, -(int64_t)sizeof(content) - 90) == EFSEEK);
+    CHECK(tfs_seek(FD, -(int64_t)sizeof(content)) == 0);
+    CHECK(tfs_read(FD, buffer, sizeof(buffer)) == sizeof(buffer) && memcmp(buffer, content, sizeof(content)) == 0);
+    // one byte more moves it out to a data block chain, one byte less brings it back
+    char bigger[INODE_INLINE_CAPACITY + 1];
+    fillPattern(bigger, sizeof(bigger), 2, 0);
+    CHECK(tfs_writeFile(FD, bigger, sizeof(bigger)) >= 0);
+    CHECK(sameContent(FD, bigger, sizeof(bigger)));
+    CHECK(tfs_defragReport(&after) >= 0);
+    CHECK(after.freeBlocks < before.freeBlocks);
+    CHECK(tfs_writeFile(FD, content, sizeof(content)) >= 0);
+    CHECK(tfs_defragReport(&after) >= 0);
+    CHECK(after.freeBlocks == before.freeBlocks);
+    CHECK(unmountClean(TEST_IMAGE));
+}
+
+void testReadAhead(void) {
+    CHECK(freshDisk(TEST_IMAGE, TEST_DISK_SIZE));
+    int size = 64 * USEABLE_DATA_SIZE;
+    char *content = (char *)malloc(size);
+    fillPattern(content, size, 3, 0);
+    CHECK(writeNewFile("seq", content, size) >= 0);
+    CHECK(tfs_unmount() >= 0);
+    CHECK(tfs_mount(TEST_IMAGE) >= 0);
+    // a cold cache read front to back in small requests is read ahead
+    fileDescriptor FD = tfs_openFile("seq");
+    char buffer[100];
+    int offset = 0;
+    int result;
+    while ((result = tfs_read(FD, buffer, sizeof(buffer))) > 0) {
+        CHECK(memcmp(buffer, content + offset, result) == 0);
+        offset += result;
+    }
+    CHECK(result == 0 && offset == size);
+    readAheadStats stats;
+    CHECK(tfs_getReadAheadStats(&stats) >= 0);
+    CHECK(stats.issued > 0 && stats.hits > 0);
+    // a seek before the start is refused and the pointer stays where it was
+    CHECK(tfs_seek(FD, -size - 1) == EFSEEK);
+    CHECK(tfs_seek(FD, 0) == size);
+    CHECK(tfs_seek(FD, -size) == 0);
+    CHECK(sameContent(FD, content, size));
+    free(content);
+    CHECK(unmountClean(TEST_IMAGE));
+}
+
+void testDirectories(void) {
+    CHECK(freshDisk(TEST_IMAGE, TEST_DISK_SIZE));
+    CHECK(tfs_mkdir("/d") >= 0);
+    CHECK(tfs_mkdir("/d/e") >= 0);
+    CHECK(tfs_mkdir("/d") < 0);
+    CHECK(tfs_mkdir("/x/y") < 0);
+    // enough entries to split leaves and grow an index level
+    int files = 200;
+    char name[32];
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/d/f%d", i);
+        fileDescriptor FD = writeNewFile(name, name, (int)strlen(name));
+        CHECK(FD >= 0);
+        tfs_closeFile(FD);
+    }
+    for (int i = 0; i < files; i += 7) {
+        snprintf(name, sizeof(name), "/d/f%d", i);
+        CHECK(sameFile(name, name, (int)strlen(name)));
+    }
+    dirCursor cursor;
+    dirEntryPlus entries[16];
+    int listed = 0;
+    int directories = 0;
+    int result;
+    CHECK(tfs_openDirCursor("/d", &cursor) >= 0);
+    while ((result = tfs_readdirplus(&cursor, entries, 16)) > 0) {
+        for (int i = 0; i < result; i++) {
+            directories += entries[i].isDirectory;
+        }
+        listed += result;
+    }
+    CHECK(result == 0 && listed == files + 1 && directories == 1);
+    // a cursor that does not point at a directory inode, as a tfsd client could send
+    dirCursor bad = cursor;
+    bad.finished = 0;
+    bad.dirInode = entries[0].isDirectory ? entries[1].inodeNumber : entries[0].inodeNumber;
+    CHECK(tfs_readdirplus(&bad, entries, 16) == EDIR);
+    bad.dirInode = 0;
+    CHECK(tfs_readdirplus(&bad, entries, 16) == EDIR);
+    bad.dirInode = TEST_DISK_SIZE / BLOCKSIZE + 10;
+    CHECK(tfs_readdirplus(&bad, entries, 16) == EDIR);
+    CHECK(tfs_rmdir("/d") < 0); // not empty
+    CHECK(tfs_rmdir("/d/e") >= 0);
+    fileDescriptor FD = tfs_openFile("/d/f3");
+    CHECK(tfs_rename(FD, "/moved") >= 0);
+    tfs_closeFile(FD);
+    CHECK(sameFile("/moved", "/d/f3", 5));
+    CHECK(unmountClean(TEST_IMAGE));
+}
+
+void testRemount(void) {
+    CHECK(freshDisk(TEST_IMAGE, TEST_DISK_SIZE));
+    char content[3000];
+    fillPattern(content, sizeof(content), 4, 0);
+    CHECK(tfs_mkdir("/d") >= 0);
+    CHECK(writeNewFile("/d/a", content, sizeof(content)) >= 0);
+    CHECK(writeNewFile("b", content, 100) >= 0);
+    // a clean unmount leaves a checkpoint the next mount reads instead of scanning
+    tfsStats stats;
+    CHECK(tfs_unmount() >= 0);
+    CHECK(tfs_resetStats() >= 0);
+    CHECK(tfs_mount(TEST_IMAGE) >= 0);
+    CHECK(tfs_getStats(&stats) >= 0);
+    long cleanReads = stats.ops[TFS_OP_MOUNT].blockReads;
+    printf("clean mount read %ld blocks\n", cleanReads);
+    CHECK(cleanReads > 0 && cleanReads <= 4); // the super block and the checkpoint
+    CHECK(sameFile("/d/a", content, sizeof(content)));
+    CHECK(sameFile("b", content, 100));
+    fileDescriptor FD = tfs_openFile("b");
+    CHECK(tfs_deleteFile(FD) >= 0);
+    CHECK(tfs_unmount() >= 0);
+    CHECK(tfs_mount(TEST_IMAGE) >= 0);
+    fileDescriptor created = tfs_openFile("/d/a");
+    CHECK(sameContent(created, content, sizeof(content)));
+    dirEntryPlus entry;
+    CHECK(!rootEntry("b", &entry));
+    CHECK(tfs_unmount() >= 0);
+    // a process that exits without unmounting leaves the disk dirty, and the next mount scans it.
+    // exit() still flushes the stdio buffers of the image, so every block written reaches it.
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0) {
+        exit(tfs_mount(TEST_IMAGE) < 0 || writeNewFile("c", content, 500) < 0);
+    }
+    int status;
+    CHECK(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(tfs_resetStats() >= 0);
+    CHECK(tfs_mount(TEST_IMAGE) >= 0);
+    CHECK(tfs_getStats(&stats) >= 0);
+    printf("dirty mount read %ld blocks\n", stats.ops[TFS_OP_MOUNT].blockReads);
+    CHECK(stats.ops[TFS_OP_MOUNT].blockReads > 4 * cleanReads);
+    CHECK(sameFile("/d/a", content, sizeof(content)));
+    CHECK(sameFile("c", content, 500));
+    CHECK(!rootEntry("b", &entry));
+    CHECK(unmountClean(TEST_IMAGE));
+}
+
+int flipDataBit(char *image, char *match) {
+    /* flips one bit of the data block holding the 16 bytes at 'match', behind the library's back */
+    FILE *file = fopen(image, "r+b");
+    char block[BLOCKSIZE];
+    long found = -1;
+    for (long b = 0; file != NULL && found < 0 && fread(block, BLOCKSIZE, 1, file) == 1; b++) {
+        if (block[BLOCK_NUMBER_OFFSET] == DATA_BLOCK_TYPE &&
+            memcmp(block + DATA_BLOCK_DATA_OFFSET, match, 16) == 0) {
+            found = b;
+        }
+    }
+    if (file != NULL && found > 0) {
+        block[DATA_BLOCK_DATA_OFFSET] ^= 1;
+        fseek(file, found * BLOCKSIZE, SEEK_SET);
+        fwrite(block, BLOCKSIZE, 1, file);
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+    return found > 0;
+}
+
+void testChecksums(void) {
+    CHECK(freshDisk(TEST_IMAGE, TEST_DISK_SIZE));
+    char content[1000];
+    fillPattern(content, sizeof(content), 5, 0);
+    CHECK(writeNewFile("a", content, sizeof(content)) >= 0);
+    CHECK(tfs_unmount() >= 0);
+    CHECK(fsckClean(TEST_IMAGE));
+    CHECK(flipDataBit(TEST_IMAGE, content + USEABLE_DATA_SIZE));
+    CHECK(tfs_mount(TEST_IMAGE) >= 0);
+    fileDescriptor FD = tfs_openFile("a");
+    char buffer[sizeof(content)];
+    CHECK(tfs_read(FD, buffer, sizeof(buffer)) < 0);
+    CHECK(tfs_unmount() >= 0);
+    CHECK(!fsckClean(TEST_IMAGE));
+    // formatted without checksums, the same damage reads back as data
+    CHECK(tfs_mkfsFeatures(TEST_IMAGE, TEST_DISK_SIZE, 0) >= 0);
+    CHECK(tfs_mount(TEST_IMAGE) >= 0);
+    CHECK(writeNewFile("a", content, sizeof(content)) >= 0);
+    CHECK(tfs_unmount() >= 0);
+    CHECK(flipDataBit(TEST_IMAGE, content + USEABLE_DATA_SIZE));
+    CHECK(tfs_mount(TEST_IMAGE) >= 0);
+    content[USEABLE_DATA_SIZE] ^= 1;
+    CHECK(sameFile("a", content, sizeof(content)));
+    CHECK(unmountClean(TEST_IMAGE));
+    // feature bits the library does not know are refused by mkfs, mount and tfs_fsck
+    CHECK(tfs_mkfsFeatures(TEST_IMAGE, TEST_DISK_SIZE, 0x80) == ECREATFS);
+    CHECK(tfs_mkfs(TEST_IMAGE, TEST_DISK_SIZE) >= 0);
+    FILE *image = fopen(TEST_IMAGE, "r+b");
+    char super[BLOCKSIZE];
+    CHECK(image != NULL && fread(super, BLOCKSIZE, 1, image) == 1);
+    if (image != NULL) {
+        super[SUPER_FEATURES_OFFSET] |= 0x80;
+        uint32_t checksum = crc32c(super, SUPER_CHECKSUM_OFFSET);
+        memcpy(super + SUPER_CHECKSUM_OFFSET, &checksum, sizeof(uint32_t));
+        fseek(image, 0, SEEK_SET);
+        fwrite(super, BLOCKSIZE, 1, image);
+        fclose(image);
+    }
+    CHECK(tfs_mount(TEST_IMAGE) == EMOUNTFS);
+    CHECK(!fsckClean(TEST_IMAGE));
+}
+
+
+void testCompression(void) {
+    CHECK(freshDisk(TEST_IMAGE, TEST_DISK_SIZE));
+    int size = 3 * TFS_CHUNK_SIZE + 100;
+    char *content = (char *)malloc(size);
+    fillPattern(content, size, 6, 1);
+    fileDescriptor FD = writeNewFile("c", content, size);
+    tfsDefragReport plain, compressed;
+    CHECK(tfs_defragReport(&plain) >= 0);
+    CHECK(tfs_setCompressed(FD, 1) >= 0);
+    CHECK(tfs_defragReport(&compressed) >= 0);
+    CHECK(compressed.freeBlocks > plain.freeBlocks + size / USEABLE_DATA_SIZE / 2);
+    CHECK(sameContent(FD, content, size));
+    // seeking back past the start is refused, the pointer stays in the file
+    CHECK(tfs_seek(FD, 100 - size) == 100);
+    CHECK(tfs_seek(FD, -TFS_CHUNK_SIZE - 100) == EFSEEK);
+    char byte;
+    CHECK(tfs_readByte(FD, &byte) >= 0 && byte == content[100]);
+    // a write in the middle of a chunk
+    memcpy(content + TFS_CHUNK_SIZE + 10, "changed", 7);
+    CHECK(tfs_pwrite(FD, "changed", 7, TFS_CHUNK_SIZE + 10) == 7);
+    CHECK(sameContent(FD, content, size));
+    // the content is read and written by the one call, not through tfs_read and tfs_writeFile
+    tfsStats stats;
+    CHECK(tfs_resetStats() >= 0);
+    CHECK(tfs_setCompressed(FD, 0) >= 0);
+    CHECK(tfs_getStats(&stats) >= 0);
+    CHECK(stats.ops[TFS_OP_READ].calls == 0 && stats.ops[TFS_OP_WRITE].calls == 0);
+    CHECK(tfs_defragReport(&compressed) >= 0 && compressed.freeBlocks == plain.freeBlocks);
+    CHECK(sameContent(FD, content, size));
+    // the file pointer goes back to 0 also when nothing changes
+    char first;
+    CHECK(tfs_seek(FD, 5) >= 0);
+    CHECK(tfs_setCompressed(FD, 0) >= 0);
+    CHECK(tfs_readByte(FD, &first) >= 0 && first == content[0]);
+    free(content);
+    CHECK(unmountClean(TEST_IMAGE));
+}
+
+void testDedup(void) {
+    CHECK(freshDisk(TEST_IMAGE, TEST_DISK_SIZE));
+    int size = 20 * USEABLE_DATA_SIZE;
+    char *content = (char *)malloc(size);
+    fillPattern(content, size, 7, 0);
+    fileDescriptor a = writeNewFile("a", content, size);
+    CHECK(tfs_setDeduplicated(a, 1) >= 0);
+    tfsDefragReport before, after;
+    CHECK(tfs_defragReport(&before) >= 0);
+    // the same bytes in a second file only take its inode and block map
+    fileDescriptor b = tfs_openFile("b");
+    CHECK(tfs_setDeduplicated(b, 1) >= 0);
+    CHECK(tfs_writeFile(b, content, size) >= 0);
+    CHECK(tfs_defragReport(&after) >= 0);
+    CHECK(after.freeBlocks == before.freeBlocks - 2);
+    CHECK(tfs_pwrite(b, "x", 1, 300) == 1);
+    CHECK(sameContent(a, content, size));
+    content[300] = 'x';
+    CHECK(sameContent(b, content, size));
+    CHECK(tfs_deleteFile(a) >= 0);
+    CHECK(sameContent(b, content, size));
+    CHECK(tfs_setDeduplicated(b, 0) >= 0);
+    CHECK(sameContent(b, content, size));
+    free(content);
+    CHECK(unmountClean(TEST_IMAGE));
+}
+
+void testDedupFull(void) {
+    // a deduplication that runs out of space gives back the blocks and references it took
+    for (int leave = 0; leave < 48; leave += 3) {
+        CHECK(freshDisk(TEST_IMAGE, TEST_SMALL_DISK_SIZE));
+        int size = 35 * USEABLE_DATA_SIZE; // two block maps
+        char *content = (char *)malloc(size);
+        fillPattern(content, size, 20, 0);
+        fileDescriptor a = writeNewFile("a", content, size);
+        fileDescriptor b = writeNewFile("b", content, size / 2);
+        CHECK(tfs_setDeduplicated(b, 1) >= 0); // half of a's blocks are in the index already
+        CHECK(fillDisk(leave) > 0);
+        int result = tfs_setDeduplicated(a, 1);
+        CHECK(result >= 0 || result == ENOSPC);
+        CHECK(sameContent(a, content, size));
+        CHECK(sameContent(b, content, size / 2));
+        // with the space back the conversion goes through, and b keeps its blocks once a is gone
+        CHECK(tfs_deleteFile(tfs_openFile("fill")) >= 0);
+        CHECK(tfs_setDeduplicated(a, 1) >= 0);
+        CHECK(sameContent(a, content, size));
+        CHECK(tfs_deleteFile(a) >= 0);
+        CHECK(sameContent(b, content, size / 2));
+        free(content);
+        CHECK(unmountClean(TEST_IMAGE));
+    }
+}
+
+void testStorageFull(void) {
+    // turning compression or deduplication on or off on a full disk leaves the files as they were
+    for (int leave = 0; leave < 24; leave++) {
+        CHECK(freshDisk(TEST_IMAGE, TEST_SMALL_DISK_SIZE));
+        char content[3000];
+        fillPattern(content, sizeof(content), 19, 0);
+        fileDescriptor a = writeNewFile("a", content, sizeof(content));
+        fileDescriptor b = writeNewFile("b", content + 1000, 2000);
+        fileDescriptor d = writeNewFile("d", content, sizeof(content));
+        fileDescriptor e = writeNewFile("e", content + 1000, 2000);
+        CHECK(tfs_setCompressed(b, 1) >= 0);
+        CHECK(tfs_setDeduplicated(e, 1) >= 0);
+        CHECK(tfs_clone(e, "c") >= 0);
+        fileDescriptor c = tfs_openFile("c");
+        CHECK(fillDisk(leave) > 0);
+        int result = tfs_setDeduplicated(d, 1);
+        CHECK(result >= 0 || result == ENOSPC);
+        CHECK(sameContent(d, content, sizeof(content)));
+        result = tfs_setDeduplicated(e, 0);
+        CHECK(result >= 0 || result == ENOSPC);
+        CHECK(sameContent(e, content + 1000, 2000));
+        CHECK(sameContent(c, content + 1000, 2000));
+        result = tfs_setCompressed(c, 1);
+        CHECK(result >= 0 || result == ENOSPC);
+        CHECK(sameContent(c, content + 1000, 2000));
+        CHECK(sameContent(e, content + 1000, 2000));
+        result = tfs_setCompressed(a, 1);
+        CHECK(result >= 0 || result == ENOSPC);
+        CHECK(sameContent(a, content, sizeof(content)));
+        result = tfs_setCompressed(b, 0);
+        CHECK(result >= 0 || result == ENOSPC);
+        CHECK(sameContent(b, content + 1000, 2000));
+        CHECK(unmountClean(TEST_IMAGE));
+    }
+}
+
+void testClone(void) {
+    CHECK(freshDisk(TEST_IMAGE, TEST_DISK_SIZE));
+    int size = 40 * USEABLE_DATA_SIZE; // two block maps
+    char *content = (char *)malloc(size);
+    char *changed = (char *)malloc(size);
+    fillPattern(content, size, 8, 0);
+    fileDescriptor a = writeNewFile("a", content, size);
+    CHECK(tfs_clone(a, "b") >= 0);
+    CHECK(tfs_clone(a, "b") < 0);
+    fileDescriptor b = tfs_openFile("b");
+    CHECK(sameContent(b, content, size));
+    // writes to either side, in the first and in the second block map, stay on that side
+    memcpy(changed, content, size);
+    memcpy(changed + 10, "clone", 5);
+    memcpy(changed + size - 20, "clone", 5);
+    CHECK(tfs_pwrite(b, "clone", 5, 10) == 5);
+    CHECK(tfs_pwrite(b, "clone", 5, size - 20) == 5);
+    CHECK(sameContent(a, content, size));
+    CHECK(sameContent(b, changed, size));
+    CHECK(tfs_pwrite(a, "orig", 4, size - 300) == 4);
+    memcpy(content + size - 300, "orig", 4);
+    CHECK(sameContent(a, content, size));
+    CHECK(sameContent(b, changed, size));
+    CHECK(tfs_deleteFile(a) >= 0);
+    CHECK(sameContent(b, changed, size));
+    free(content);
+    free(changed);
+    CHECK(unmountClean(TEST_IMAGE));
+}
+
+void testCloneFull(void) {
+    // a write to a clone that runs out of space partway leaves both files as they were
+    for (int leave = 0; leave < 6; leave++) {
+        CHECK(freshDisk(TEST_IMAGE, TEST_SMALL_DISK_SIZE));
+        char content[2000];
+        char expected[2000];
+        char junk[3000];
+        fillPattern(content, sizeof(content), 16, 0);
+        fillPattern(junk, sizeof(junk), 17, 0);
+        memcpy(expected, content, sizeof(content));
+        fileDescriptor a = writeNewFile("a", content, sizeof(content));
+        CHECK(tfs_setDeduplicated(a, 1) >= 0);
+        CHECK(tfs_clone(a, "b") >= 0);
+        CHECK(fillDisk(leave) > 0);
+        fileDescriptor b = tfs_openFile("b");
+        int result = tfs_pwrite(b, junk, 600, 300); // 3 blocks and a copy of the block map
+        if (result >= 0) {
+            memcpy(expected + 300, junk, 600);
+        }
+        CHECK(sameContent(a, content, sizeof(content)));
+        CHECK(sameContent(b, expected, sizeof(expected)));
+        // the original's blocks are reused, the clone must not lose any of its own
+        CHECK(tfs_deleteFile(a) >= 0);
+        fileDescriptor reuse = tfs_openFile("reuse");
+        tfs_writeFile(reuse, junk, sizeof(junk));
+        CHECK(sameContent(b, expected, sizeof(expected)));
+        CHECK(unmountClean(TEST_IMAGE));
+    }
+}
+
+void testSnapshot(void) {
+    CHECK(freshDisk(TEST_IMAGE, TEST_DISK_SIZE));
+    char content[2000];
+    fillPattern(content, sizeof(content), 9, 0);
+    CHECK(tfs_mkdir("/d") >= 0);
+    fileDescriptor a = writeNewFile("/d/a", content, sizeof(content));
+    CHECK(writeNewFile("b", content, 50) >= 0);
+    CHECK(tfs_snapshot("/s1") >= 0);
+    CHECK(tfs_pwrite(a, "after", 5, 1000) == 5);
+    CHECK(tfs_snapshot("/s2") >= 0);
+    CHECK(sameFile("/s1/d/a", content, sizeof(content)));
+    CHECK(sameFile("/s1/b", content, 50));
+    memcpy(content + 1000, "after", 5);
+    CHECK(sameFile("/s2/d/a", content, sizeof(content)));
+    // snapshots leave earlier snapshots out
+    CHECK(tfs_openDirCursor("/s2/s1", &(dirCursor){0}) < 0);
+    CHECK(unmountClean(TEST_IMAGE));
+}
+
+void testSnapshotFull(void) {
+    // a snapshot that runs out of space partway is taken out again, blocks and references included
+    for (int leave = 0; leave < 14; leave++) {
+        CHECK(freshDisk(TEST_IMAGE, TEST_SMALL_DISK_SIZE));
+        char content[2000];
+        fillPattern(content, sizeof(content), 18, 0);
+        CHECK(tfs_mkdir("/d") >= 0);
+        fileDescriptor a = writeNewFile("/d/a", content, sizeof(content));
+        fileDescriptor b = writeNewFile("/d/b", content, 100);
+        fileDescriptor c = writeNewFile("c", content, 1000);
+        CHECK(fillDisk(leave) > 0);
+        int result = tfs_snapshot("/s");
+        if (result < 0) {
+            CHECK(result == ENOSPC);
+            CHECK(tfs_openDirCursor("/s", &(dirCursor){0}) < 0);
+            CHECK(tfs_openDirCursor("/s/d", &(dirCursor){0}) < 0);
+            // with the space back, the same snapshot goes through
+            CHECK(tfs_deleteFile(tfs_openFile("fill")) >= 0);
+            CHECK(tfs_snapshot("/s") >= 0);
+        }
+        CHECK(sameFile("/s/d/a", content, sizeof(content)));
+        CHECK(sameFile("/s/d/b", content, 100));
+        CHECK(sameFile("/s/c", content, 1000));
+        CHECK(sameContent(a, content, sizeof(content)));
+        CHECK(sameContent(b, content, 100));
+        CHECK(sameContent(c, content, 1000));
+        CHECK(unmountClean(TEST_IMAGE));
+    }
+}
+
+int traceCounts(char *filename, long counts[]) {
+    /* counts the events of a block I/O trace into counts[DISK_TRACE_READ]
+    to counts[DISK_TRACE_CLOSE], 1 if the trace could be read */
+    FILE *trace = fopen(filename, "rb");
+    if (trace == NULL) {
+        return 0;
+    }
+    unsigned char record[DISK_TRACE_RECORD_SIZE];
+    memset(counts, 0, (DISK_TRACE_CLOSE + 1) * sizeof(long));
+    int ok = fread(record, DISK_TRACE_HEADER_SIZE, 1, trace) == 1 && memcmp(record, DISK_TRACE_MAGIC, 8) == 0;
+    while (ok && fread(record, DISK_TRACE_RECORD_SIZE, 1, trace) == 1) {
+        int event = record[DISK_TRACE_OP_OFFSET];
+        ok = event >= DISK_TRACE_READ && event <= DISK_TRACE_CLOSE;
+        if (ok) {
+            counts[event]++;
+        }
+    }
+    fclose(trace);
+    return ok;
+}
+
+int replayMatches(char *trace, char *image, long counts[]) {
+    /* replays 'trace' onto 'image' with tfs_replay, 1 if every event replayed
+    and it reports the same number of each as 'counts' */
+    char command[256];
+    char line[256];
+    long events, reads, writes, opens, closes;
+    long failed = -1, unknown = -1;
+    int parsed = 0;
+    fflush(stdout);
+    snprintf(command, sizeof(command), "./tfs_replay %s %s", trace, image);
+    FILE *output = popen(command, "r");
+    if (output == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), output) != NULL) {
+        printf("%s", line);
+        if (sscanf(line, "%ld events (%ld reads, %ld writes, %ld opens, %ld closes)",
+                &events, &reads, &writes, &opens, &closes) == 5) {
+            parsed = 1;
+        }
+        sscanf(line, "failed %ld, unknown events %ld", &failed, &unknown);
+    }
+    int status = pclose(output);
+    return status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0 && parsed && failed == 0 &&
+        unknown == 0 && reads == counts[DISK_TRACE_READ] && writes == counts[DISK_TRACE_WRITE] &&
+        opens == counts[DISK_TRACE_OPEN] && closes == counts[DISK_TRACE_CLOSE];
+}
+
+void testTrace(void) {
+    // a traced workload holds every block the file system moved, and tfs_replay replays all of it
+    long counts[DISK_TRACE_CLOSE + 1];
+    char content[2000];
+    fillPattern(content, sizeof(content), 51, 0);
+    // LIBDISK_TRACE records a program that knows nothing of tracing. It is read at the first
+    // openDisk, so the child sets it before it opens a disk.
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0) {
+        setenv(DISK_TRACE_ENV, TEST_TRACE, 1);
+        exit(!freshDisk(TEST_IMAGE, TEST_DISK_SIZE) || writeNewFile("c", content, sizeof(content)) < 0 ||
+             tfs_unmount() < 0);
+    }
+    int status;
+    CHECK(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(traceCounts(TEST_TRACE, counts));
+    CHECK(counts[DISK_TRACE_WRITE] > 0 && counts[DISK_TRACE_OPEN] == 2 && counts[DISK_TRACE_CLOSE] == 2);
+    CHECK(replayMatches(TEST_TRACE, TEST_MEMBER_A, counts));
+    remove(TEST_TRACE);
+    remove(TEST_MEMBER_A);
+    // startDiskTrace traces this process from then on
+    tfsStats stats;
+    CHECK(tfs_resetStats() >= 0);
+    CHECK(startDiskTrace(TEST_TRACE) == 0);
+    CHECK(freshDisk(TEST_IMAGE, TEST_DISK_SIZE));
+    int size = 30 * USEABLE_DATA_SIZE;
+    char *data = (char *)malloc(size);
+    fillPattern(data, size, 50, 0);
+    fileDescriptor FD = writeNewFile("a", data, size);
+    CHECK(tfs_pwrite(FD, "xyz", 3, 1000) == 3);
+    memcpy(data + 1000, "xyz", 3);
+    CHECK(tfs_mkdir("/d") >= 0);
+    CHECK(tfs_rename(FD, "b") >= 0);
+    CHECK(sameContent(FD, data, size));
+    CHECK(tfs_unmount() >= 0);
+    CHECK(tfs_getStats(&stats) >= 0);
+    CHECK(stopDiskTrace() == 0);
+    CHECK(traceCounts(TEST_TRACE, counts));
+    CHECK(counts[DISK_TRACE_READ] == stats.blockReads && counts[DISK_TRACE_WRITE] == stats.blockWrites);
+    CHECK(counts[DISK_TRACE_OPEN] == 2 && counts[DISK_TRACE_CLOSE] == 2); // tfs_mkfs and tfs_mount
+    // the replay makes a fresh image of the traced size
+    CHECK(replayMatches(TEST_TRACE, TEST_MEMBER_A, counts));
+    FILE *replayed = fopen(TEST_MEMBER_A, "rb");
+    CHECK(replayed != NULL && fseek(replayed, 0, SEEK_END) == 0 && ftell(replayed) == TEST_DISK_SIZE);
+    if (replayed != NULL) {
+        fclose(replayed);
+    }
+    CHECK(fsckClean(TEST_IMAGE));
+    free(data);
+}
+
+void testScratch(void) {
+    // once warmed up, ordinary calls take all their buffers from the per-mount arena
+    CHECK(freshDisk(TEST_IMAGE, 4 * 1024 * 1024));
+    int size = 5 * USEABLE_DATA_SIZE;
+    char *content = (char *)malloc(size);
+    char buffer[64];
+    fillPattern(content, size, 32, 0);
+    CHECK(tfs_mkdir("/d") >= 0);
+    fileDescriptor FD = writeNewFile("/d/a", content, size);
+    tfsStats stats;
+    tfsDefragReport report;
+    for (int round = 0; round < 3; round++) {
+        if (round == 1) {
+            CHECK(tfs_resetStats() >= 0);
+        }
+        dirCursor cursor;
+        dirEntryPlus entries[4];
+        CHECK(tfs_writeFile(FD, content, size) >= 0);
+        CHECK(tfs_pwrite(FD, "abc", 3, 300) == 3);
+        CHECK(tfs_read(FD, buffer, sizeof(buffer)) == sizeof(buffer));
+        CHECK(tfs_seek(FD, 10) >= 0);
+        CHECK(tfs_readByte(FD, buffer) >= 0);
+        CHECK(tfs_readFileInfo(FD) >= 0);
+        CHECK(tfs_readdir() >= 0);
+        CHECK(tfs_openDirCursor("/d", &cursor) >= 0);
+        CHECK(tfs_readdirplus(&cursor, entries, 4) == 1);
+        CHECK(tfs_defragReport(&report) >= 0);
+        CHECK(tfs_setAllocPolicy(TFS_ALLOC_POLICY) >= 0);
+        fileDescriptor other = tfs_openFile("/d/b");
+        CHECK(tfs_writeFile(other, content, size) >= 0);
+        CHECK(tfs_deleteFile(other) >= 0);
+    }
+    CHECK(tfs_getStats(&stats) >= 0);
+    CHECK(stats.heapAllocations == 0);
+    // a call needing more than SCRATCH_MAX_SIZE takes the heap each time, the arena keeps no more than the cap
+    int bigSize = SCRATCH_MAX_SIZE + 100 * USEABLE_DATA_SIZE;
+    char *big = (char *)malloc(bigSize);
+    fillPattern(big, bigSize, 33, 1);
+    fileDescriptor bigFD = writeNewFile("big", big, bigSize);
+    CHECK(tfs_setCompressed(bigFD, 1) >= 0);
+    CHECK(tfs_setCompressed(bigFD, 0) >= 0);
+    CHECK(tfs_resetStats() >= 0);
+    CHECK(tfs_setCompressed(bigFD, 1) >= 0);
+    CHECK(tfs_getStats(&stats) >= 0);
+    CHECK(stats.heapAllocations > 0);
+    CHECK(sameContent(bigFD, big, bigSize));
+    free(big);
+    free(content);
+    CHECK(unmountClean(TEST_IMAGE));
+}
+
+int readvContent(fileDescriptor FD, char *buffer, int size) {
+    /* reads the whole file from its start through tfs_readv_begin, a few spans
+    at a time, into 'buffer'. Returns the number of bytes or an error code. */
+    tfsSpan spans[4];
+    int got = 0;
+    int result = (int)tfs_seek(FD, -tfs_seek(FD, 0));
+    while (result >= 0) {
+        result = tfs_readv_begin(FD, spans, 4);
+        for (int i = 0; i < result; i++) {
+            if (got + spans[i].length > size) {
+                tfs_readv_release(FD);
+                return EFREAD;
+            }
+            memcpy(buffer + got, spans[i].data, spans[i].length);
+            got += spans[i].length;
+        }
+        if (result <= 0 || tfs_readv_release(FD) < 0) {
+            break;
+        }
+    }
+    return result < 0 ? result : got;
+}
+
+void testReadv(void) {
+    CHECK(freshDisk(TEST_IMAGE, TEST_DISK_SIZE));
+    // every way a file can be stored reads the same through spans as through tfs_read
+    char *names[] = {"plain", "inline", "lz", "dedup"};
+    int sizes[] = {10 * USEABLE_DATA_SIZE + 17, 100, 3 * TFS_CHUNK_SIZE + 50, 10 * USEABLE_DATA_SIZE};
+    int maxSize = 3 * TFS_CHUNK_SIZE + 50;
+    char *content = (char *)malloc(maxSize);
+    char *spanned = (char *)malloc(maxSize);
+    char *copied = (char *)malloc(maxSize + 1);
+    for (int f = 0; f < 4; f++) {
+        fillPattern(content, sizes[f], 40 + f, f == 2);
+        fileDescriptor FD = writeNewFile(names[f], content, sizes[f]);
+        CHECK(FD >= 0);
+        if (f == 2) {
+            CHECK(tfs_setCompressed(FD, 1) >= 0);
+        } else if (f == 3) {
+            CHECK(tfs_setDeduplicated(FD, 1) >= 0);
+        }
+        CHECK(readvContent(FD, spanned, maxSize) == sizes[f]);
+        CHECK(tfs_seek(FD, -tfs_seek(FD, 0)) == 0);
+        CHECK(tfs_read(FD, copied, maxSize + 1) == sizes[f]);
+        CHECK(memcmp(spanned, copied, sizes[f]) == 0 && memcmp(spanned, content, sizes[f]) == 0);
+        CHECK(tfs_closeFile(FD) >= 0);
+    }
+    // a file behind a hole, so the defragmenter moves its blocks to the front
+    int gapSize = 20 * USEABLE_DATA_SIZE;
+    int size = 8 * USEABLE_DATA_SIZE;
+    char *gap = (char *)calloc(gapSize, 1);
+    fileDescriptor gapFD = writeNewFile("gap", gap, gapSize);
+    fillPattern(content, size, 44, 0);
+    fileDescriptor FD = writeNewFile("moved", content, size);
+    CHECK(tfs_deleteFile(gapFD) >= 0);
+    free(gap);
+    // more blocks than the cache holds, read while the spans are held
+    int bigSize = 3 * BLOCK_CACHE_SIZE * USEABLE_DATA_SIZE;
+    char *big = (char *)malloc(bigSize);
+    fillPattern(big, bigSize, 45, 0);
+    fileDescriptor bigFD = writeNewFile("big", big, bigSize);
+    tfsSpan spans[4];
+    char held[4][USEABLE_DATA_SIZE];
+    CHECK(tfs_seek(FD, -tfs_seek(FD, 0)) == 0);
+    int count = tfs_readv_begin(FD, spans, 4);
+    CHECK(count == 4);
+    for (int i = 0; i < count; i++) {
+        CHECK(spans[i].length == USEABLE_DATA_SIZE);
+        memcpy(held[i], spans[i].data, USEABLE_DATA_SIZE);
+    }
+    CHECK(sameContent(bigFD, big, bigSize));
+    tfsDefragReport report;
+    int result;
+    while ((result = tfs_defrag(16)) > 0) {
+    }
+    CHECK(result == 0);
+    CHECK(tfs_defragReport(&report) >= 0 && report.moved > 0);
+    CHECK(sameContent(bigFD, big, bigSize));
+    // the pinned cache entries were neither evicted nor reused
+    for (int i = 0; i < count; i++) {
+        CHECK(memcmp(spans[i].data, held[i], USEABLE_DATA_SIZE) == 0);
+        CHECK(memcmp(spans[i].data, content + i * USEABLE_DATA_SIZE, USEABLE_DATA_SIZE) == 0);
+    }
+    CHECK(tfs_readv_release(FD) >= 0);
+    CHECK(sameContent(FD, content, size));
+    free(big);
+    free(copied);
+    free(spanned);
+    free(content);
+    CHECK(unmountClean(TEST_IMAGE));
+}
+
+void testLargeDisk(void) {
+    CHECK(freshDisk(TEST_IMAGE, TEST_LARGE_DISK_SIZE));
+    char content[5000];
+    fillPattern(content, sizeof(content), 10, 0);
+    CHECK(writeNewFile("a", content, sizeof(content)) >= 0);
+    tfsDefragReport report;
+    CHECK(tfs_defragReport(&report) >= 0);
+    CHECK(report.freeBlocks > ((int64_t)1 << 32) / BLOCKSIZE);
+    CHECK(tfs_unmount() >= 0);
+    CHECK(tfs_mount(TEST_IMAGE) >= 0);
+    CHECK(sameFile("a", content, sizeof(content)));
+    CHECK(unmountClean(TEST_IMAGE));
+}
+
+void testDaemon(void) {
+    // tfsd serves the image to clients, and a bad request fails only that request
+    remove(TEST_SOCKET);
+    fflush(NULL);
+    pid_t server = fork();
+    if (server == 0) {
+        execl("./tfsd", "tfsd", "-s", TEST_SOCKET, "-f", "262144", "-p", "nextfit", TEST_IMAGE, (char *)NULL);
+        _exit(127);
+    }
+    CHECK(server > 0);
+    struct timespec pause = {0, 10000000};
+    int connected = TFSD_ECONN;
+    for (int i = 0; i < 300 && connected < 0; i++) {
+        nanosleep(&pause, NULL);
+        connected = tfsc_connect(TEST_SOCKET);
+    }
+    CHECK(connected >= 0);
+    char content[3000];
+    char buffer[3000];
+    fillPattern(content, sizeof(content), 21, 0);
+    fileDescriptor FD = tfsc_openFile("a");
+    CHECK(FD >= 0);
+    CHECK(tfsc_writeFile(FD, content, sizeof(content)) >= 0);
+    CHECK(tfsc_seek(FD, -3000) == EFSEEK);
+    CHECK(readAll(FD, buffer, sizeof(buffer)) && memcmp(buffer, content, sizeof(content)) == 0);
+    // a batch runs its calls in order, one failing leaves the others alone
+    int64_t results[3];
+    CHECK(tfsc_batchBegin() >= 0);
+    tfsc_pwrite(FD, "xyz", 3, 10);
+    tfsc_seek(FD, -100000);
+    tfsc_mkdir("/d");
+    CHECK(tfsc_batchEnd(results, 3) == 3);
+    CHECK(results[0] == 3 && results[1] == EFSEEK && results[2] >= 0);
+    memcpy(content + 10, "xyz", 3);
+    dirCursor cursor;
+    dirEntryPlus entries[4];
+    CHECK(tfsc_openDirCursor("/", &cursor) >= 0);
+    CHECK(tfsc_readdirplus(&cursor, entries, 4) == 2);
+    // descriptors belong to their connection
+    CHECK(tfsc_disconnect() >= 0);
+    CHECK(tfsc_connect(TEST_SOCKET) >= 0);
+    CHECK(tfsc_read(FD, buffer, 1) == TFSD_EBADFD);
+    // tfsd closes the old connection's files once it sees it go, which can be after this open arrives
+    FD = tfsc_openFile("a");
+    for (int i = 0; i < 300 && FD == EOPEN; i++) {
+        nanosleep(&pause, NULL);
+        FD = tfsc_openFile("a");
+    }
+    CHECK(readAll(FD, buffer, sizeof(buffer)) && memcmp(buffer, content, sizeof(content)) == 0);
+    CHECK(tfsc_disconnect() >= 0);
+    // SIGTERM unmounts cleanly
+    int status = 0;
+    if (server > 0) {
+        kill(server, SIGTERM);
+        waitpid(server, &status, 0);
+    }
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(fsckClean(TEST_IMAGE));
+    remove(TEST_SOCKET);
+    // the image was formatted with the policy -p named
+    CHECK(tfs_mount(TEST_IMAGE) >= 0 && tfs_getAllocPolicy() == TFS_ALLOC_NEXT_FIT);
+    CHECK(unmountClean(TEST_IMAGE));
+}
+
+void testStripe(void) {
+    char *name = "stripe:4:" TEST_MEMBER_A "," TEST_MEMBER_B;
+    CHECK(freshDisk(name, TEST_DISK_SIZE));
+    int size = 60 * USEABLE_DATA_SIZE;
+    char *content = (char *)malloc(size);
+    fillPattern(content, size, 11, 0);
+    CHECK(writeNewFile("a", content, size) >= 0);
+    CHECK(tfs_unmount() >= 0);
+    CHECK(tfs_mount(name) >= 0);
+    CHECK(sameFile("a", content, size));
+    free(content);
+    CHECK(unmountClean(name));
+}
+
+void testMirror(void) {
+    char *name = "mirror:" TEST_MEMBER_A "," TEST_MEMBER_B;
+    CHECK(freshDisk(name, TEST_DISK_SIZE));
+    char content[3000];
+    fillPattern(content, sizeof(content), 12, 0);
+    CHECK(writeNewFile("a", content, sizeof(content)) >= 0);
+    CHECK(tfs_unmount() >= 0);
+    // each member is a whole copy, either one mounts on its own
+    CHECK(fsckClean(TEST_MEMBER_A));
+    CHECK(fsckClean(TEST_MEMBER_B));
+    CHECK(tfs_mount(TEST_MEMBER_B) >= 0);
+    CHECK(sameFile("a", content, sizeof(content)));
+    CHECK(unmountClean(TEST_MEMBER_B));
+}
+
+void testMemoryBackends(void) {
+    CHECK(freshDisk("mmap:" TEST_IMAGE, TEST_DISK_SIZE));
+    char content[3000];
+    fillPattern(content, sizeof(content), 13, 0);
+    CHECK(writeNewFile("a", content, sizeof(content)) >= 0);
+    CHECK(tfs_unmount() >= 0);
+    CHECK(fsckClean(TEST_IMAGE));
+    CHECK(tfs_mount(TEST_IMAGE) >= 0);
+    CHECK(sameFile("a", content, sizeof(content)));
+    CHECK(tfs_unmount() >= 0);
+    // a RAM disk keeps its image until it is deleted, copy it out for tfs_fsck
+    CHECK(freshDisk("ram:test", TEST_DISK_SIZE));
+    CHECK(writeNewFile("a", content, sizeof(content)) >= 0);
+    CHECK(tfs_unmount() >= 0);
+    CHECK(tfs_mount("ram:test") >= 0);
+    CHECK(sameFile("a", content, sizeof(content)));
+    CHECK(tfs_unmount() >= 0);
+    int disk = openDisk("ram:test", 0);
+    FILE *image = fopen(TEST_IMAGE, "wb");
+    char block[BLOCKSIZE];
+    int copied = disk >= 0 && image != NULL;
+    for (int64_t b = 0; copied && b < TEST_DISK_SIZE / BLOCKSIZE; b++) {
+        copied = readBlock(disk, b, block) >= 0 && fwrite(block, BLOCKSIZE, 1, image) == 1;
+    }
+    CHECK(copied);
+    if (image != NULL) {
+        fclose(image);
+    }
+    if (disk >= 0) {
+        closeDisk(disk);
+    }
+    CHECK(deleteRamDisk("ram:test") >= 0);
+    CHECK(fsckClean(TEST_IMAGE));
+}
+
+void testDefrag(void) {
+    CHECK(freshDisk(TEST_IMAGE, TEST_DISK_SIZE));
+    // appends taking turns leave every file's chain interleaved with the others
+    int files = 8;
+    int pieces = 20;
+    char name[8];
+    char *content = (char *)malloc(files * pieces * USEABLE_DATA_SIZE);
+    fillPattern(content, files * pieces * USEABLE_DATA_SIZE, 14, 0);
+    fileDescriptor FDs[8];
+    for (int f = 0; f < files; f++) {
+        // inodes stay where they are, so they all go first and no run has to step over one
+        snprintf(name, sizeof(name), "f%d", f);
+        FDs[f] = tfs_openFile(name);
+        CHECK(FDs[f] >= 0);
+    }
+    for (int f = 0; f < files; f++) {
+        CHECK(tfs_writeFile(FDs[f], content + f * pieces * USEABLE_DATA_SIZE, USEABLE_DATA_SIZE * 2) >= 0);
+    }
+    for (int p = 2; p < pieces; p++) {
+        for (int f = 0; f < files; f++) {
+            char *piece = content + (f * pieces + p) * USEABLE_DATA_SIZE;
+            CHECK(tfs_pwrite(FDs[f], piece, USEABLE_DATA_SIZE, (int64_t)p * USEABLE_DATA_SIZE) == USEABLE_DATA_SIZE);
+        }
+    }
+    tfsDefragReport report;
+    CHECK(tfs_defragReport(&report) >= 0 && report.fragmentation > 0.5);
+    int result;
+    while ((result = tfs_defrag(16)) > 0) {
+    }
+    CHECK(result == 0);
+    CHECK(tfs_defragReport(&report) >= 0);
+    CHECK(report.extents == files && report.fragmentation == 0);
+    for (int f = 0; f < files; f++) {
+        CHECK(sameContent(FDs[f], content + f * pieces * USEABLE_DATA_SIZE, pieces * USEABLE_DATA_SIZE));
+    }
+    free(content);
+    CHECK(unmountClean(TEST_IMAGE));
+}
+
+void testAllocPolicies(void) {
+    CHECK(tfs_mkfsPolicy(TEST_IMAGE, TEST_DISK_SIZE, TFS_MKFS_FEATURES, TFS_ALLOC_POLICIES) == ECREATFS);
+    CHECK(tfs_mkfsPolicy(TEST_IMAGE, TEST_DISK_SIZE, TFS_MKFS_FEATURES, -1) == ECREATFS);
+    for (int policy = TFS_ALLOC_NEXT_FIT; policy < TFS_ALLOC_POLICIES; policy++) {
+        // a policy is picked when formatting, or switched to on a mounted disk
+        if (policy % 2 == 1) {
+            CHECK(tfs_mkfsPolicy(TEST_IMAGE, TEST_DISK_SIZE, TFS_MKFS_FEATURES, policy) >= 0);
+            CHECK(tfs_mount(TEST_IMAGE) >= 0);
+        } else {
+            CHECK(freshDisk(TEST_IMAGE, TEST_DISK_SIZE));
+            CHECK(tfs_setAllocPolicy(policy) >= 0);
+        }
+        CHECK(tfs_getAllocPolicy() == policy);
+        // rewrites and deletes put holes all over the disk for the policy to fill
+        int files = 12;
+        int sizes[12]; // -1 for files that are not there
+        char name[8];
+        char *content = (char *)malloc(files * 4000);
+        fillPattern(content, files * 4000, 15 + policy, 0);
+        for (int f = 0; f < files; f++) {
+            sizes[f] = -1;
+        }
+        unsigned seed = policy;
+        for (int round = 0; round < 60; round++) {
+            seed = seed * 1103515245 + 12345;
+            int f = (seed >> 16) % files;
+            snprintf(name, sizeof(name), "f%d", f);
+            fileDescriptor FD = tfs_openFile(name);
+            CHECK(FD >= 0);
+            if (round % 5 == 4) {
+                CHECK(tfs_deleteFile(FD) >= 0);
+                sizes[f] = -1;
+                continue;
+            }
+            sizes[f] = (seed >> 8) % 4000;
+            CHECK(tfs_writeFile(FD, content + f * 4000, sizes[f]) >= 0);
+            tfs_closeFile(FD);
+        }
+        CHECK(tfs_unmount() >= 0);
+        CHECK(tfs_mount(TEST_IMAGE) >= 0);
+        CHECK(tfs_getAllocPolicy() == policy);
+        for (int f = 0; f < files; f++) {
+            snprintf(name, sizeof(name), "f%d", f);
+            if (sizes[f] >= 0) {
+                CHECK(sameFile(name, content + f * 4000, sizes[f]));
+            }
+        }
+        free(content);
+        CHECK(unmountClean(TEST_IMAGE));
+    }
+}
+
+typedef struct testCase {
+    const char *name;
+    void (*run)(void);
+} testCase;
+
+testCase tests[] = {
+    {"timestamps", testTimestamps},
+    {"inline", testInline},
+    {"readahead", testReadAhead},
+    {"directories", testDirectories},
+    {"remount", testRemount},
+    {"checksums", testChecksums},
+    {"compression", testCompression},
+    {"dedup", testDedup},
+    {"dedupfull", testDedupFull},
+    {"storagefull", testStorageFull},
+    {"clone", testClone},
+    {"clonefull", testCloneFull},
+    {"snapshot", testSnapshot},
+    {"snapshotfull", testSnapshotFull},
+    {"trace", testTrace},
+    {"scratch", testScratch},
+    {"readv", testReadv},
+    {"largedisk", testLargeDisk},
+    {"daemon", testDaemon},
+    {"stripe", testStripe},
+    {"mirror", testMirror},
+    {"memory", testMemoryBackends},
+    {"defrag", testDefrag},
+    {"policies", testAllocPolicies},
+};
+
+int runTest(testCase *test) {
+    /* runs one check in a child process, 1 if it passed */
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("tfs_test: fork");
+        return 0;
+    }
+    if (pid == 0) {
+        FILE *log = fopen(TEST_LOG, "a");
+        if (log != NULL) {
+            fprintf(log, "== %s\n", test->name);
+            fflush(log);
+            dup2(fileno(log), STDOUT_FILENO);
+        }
+        test->run();
+        fflush(stdout);
+        exit(failed ? 1 : 0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    remove(TEST_IMAGE);
+    remove(TEST_MEMBER_A);
+    remove(TEST_MEMBER_B);
+    remove(TEST_TRACE);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    int count = (int)(sizeof(tests) / sizeof(tests[0]));
+    int passed = 0;
+    int ran = 0;
+    remove(TEST_LOG);
+    for (int i = 0; i < count; i++) {
+        int wanted = argc == 1;
+        for (int a = 1; a < argc; a++) {
+            wanted |= strcmp(argv[a], tests[i].name) == 0;
+        }
+        if (!wanted) {
+            continue;
+        }
+        fprintf(stderr, "%-12s ...\n", tests[i].name);
+        int ok = runTest(&tests[i]);
+        fprintf(stderr, "%-12s %s\n", tests[i].name, ok ? "ok" : "FAILED");
+        passed += ok;
+        ran++;
+    }
+    if (ran == 0) {
+        fprintf(stderr, "usage: tfs_test [check ...]\n");
+        return 1;
+    }
+    fprintf(stderr, "%d of %d checks passed%s\n", passed, ran, passed == ran ? "" : ", details in " TEST_LOG);
+    return passed == ran ? 0 : 1;
+}
@@ -0,0 +1,464 @@
+/* TinyFS synthetic workload generator
+ *
+ * usage: tfs_workload [-n files] [-s sizes] [-m read:write:create:delete]
+ *                     [-z skew] [-t threads] [-o operations] [-D disk bytes]
+ *                     [-i image] [-S seed] [-P policy] [-k]
+ *
+ *   -n  files in the working set, all created before the timed run (1000)
+ *   -s  file size distribution: fixed:BYTES, uniform:MIN:MAX or
+ *       zipf:MAX[:THETA], where small sizes are the most likely (fixed:4096)
+ *   -m  percentages of reads, writes, creates and deletes (70:20:5:5)
+ *   -z  Zipf skew of which file each operation picks, 0 for uniform,
+ *       below 1 otherwise (0.99)
+ *   -t  threads issuing operations (1)
+ *   -o  operations in the timed run, over all threads (100000)
+ *   -D  disk size in bytes (64 MB), -i image file (tfs_workload.dsk),
+ *       -S random seed (1), -k keeps the image afterwards
+ *   -P  where new blocks go: lifo, nextfit, nearinode or bestfit (lifo),
+ *       see tfs_mkfsPolicy
+ *
+ * The populate phase creates the files one by one and reports the create
+ * rate for every tenth of them, which is where costs that grow with the
+ * number of files show up. The timed run then picks a file and an operation
+ * for every step. An operation opens the file by name, works on it and
+ * closes it: a read reads it whole in 4 KB tfs_reads, a write replaces it
+ * with a new size from the distribution, a create makes it, a delete
+ * deletes it. An operation that does not apply turns into one that does: a
+ * deleted file is created instead of read, written or deleted, and an
+ * existing file is written instead of created. The library is not thread
+ * safe, so with several threads each operation holds one lock from open to
+ * close, and the latencies include the wait for it. The report gives the
+ * rate and the p50/p90/p99/p99.9/max latency of every operation, and the
+ * block I/O and disk seeks per call from tfs_getStats. The seek distance
+ * per tfs_read of a file read whole is what the allocation policy changes.
+ */
+#define _POSIX_C_SOURCE 200809L // clock_gettime under -std=c99
+#include "libTinyFS.h"
+#include "tinyFS_errno.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#define WL_READ 0
+#define WL_WRITE 1
+#define WL_CREATE 2
+#define WL_DELETE 3
+#define WL_OPS 4
+#define WL_POPULATE_STEPS 10 // populate progress lines
+#define WL_READ_SIZE 4096 // tfs_read request size
+#define WL_MAX_THREADS 256
+
+#define SIZE_FIXED 0
+#define SIZE_UNIFORM 1
+#define SIZE_ZIPF 2
+
+const char *wlOpNames[WL_OPS] = {"read", "write", "create", "delete"};
+const char *policyNames[TFS_ALLOC_POLICIES] = TFS_ALLOC_POLICY_NAMES;
+
+/* Zipf distributed ranks 0..n-1, rank 0 the most likely, drawn in O(1)
+after an O(n) setup with the method of Gray et al., "Quickly generating
+billion-record synthetic databases" (also used by YCSB). theta < 1. */
+typedef struct zipfian {
+    long n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+} zipfian;
+
+typedef struct latencies {
+    long long *ns;
+    long count;
+    long capacity;
+} latencies;
+
+typedef struct worker {
+    pthread_t thread;
+    uint64_t rng; // xorshift64* state
+    long operations; // operations this thread issues
+    latencies done[WL_OPS]; // latency of every operation, by what it turned into
+    long errors;
+} worker;
+
+typedef struct workload {
+    long files;
+    int sizeKind;
+    long sizeMin;
+    long sizeMax;
+    double sizeTheta;
+    int mix[WL_OPS]; // percentages
+    double skew;
+    int threads;
+    long operations;
+    long diskBytes;
+    char *image;
+    zipfian pick; // which file, when skew > 0
+    zipfian sizes; // which size, for SIZE_ZIPF
+    char *content; // sizeMax bytes written from
+    unsigned char *exists; // 1 for every file currently on the disk
+    pthread_mutex_t lock; // held around every operation
+} workload;
+
+workload wl;
+
+long long nowNs(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (long long)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+double uniform01(uint64_t *state) {
+    /* xorshift64*, top 53 bits as a double in [0, 1) */
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return ((*state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void zipfianInit(zipfian *z, long n, double theta) {
+    double zeta2 = 1.0 + pow(0.5, theta);
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1.0 / (1.0 - theta);
+    z->zetan = 0;
+    for (long i = 1; i <= n; i++) {
+        z->zetan += 1.0 / pow((double)i, theta);
+    }
+    z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+long zipfianNext(zipfian *z, uint64_t *state) {
+    double u = uniform01(state);
+    double uz = u * z->zetan;
+    if (uz < 1.0) {
+        return 0;
+    }
+    if (uz < 1.0 + pow(0.5, z->theta)) {
+        return 1;
+    }
+    long rank = (long)(z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return rank < z->n ? rank : z->n - 1;
+}
+
+long nextSize(uint64_t *state) {
+    switch (wl.sizeKind) {
+    case SIZE_UNIFORM:
+        return wl.sizeMin + (long)(uniform01(state) * (wl.sizeMax - wl.sizeMin + 1));
+    case SIZE_ZIPF:
+        return 1 + zipfianNext(&wl.sizes, state);
+    default:
+        return wl.sizeMax;
+    }
+}
+
+long nextFile(uint64_t *state) {
+    if (wl.skew > 0) {
+        return zipfianNext(&wl.pick, state);
+    }
+    return (long)(uniform01(state) * wl.files);
+}
+
+void record(latencies *l, long long ns) {
+    if (l->count == l->capacity) {
+        l->capacity = l->capacity ? l->capacity * 2 : 1024;
+        l->ns = (long long *)realloc(l->ns, l->capacity * sizeof(long long));
+        if (l->ns == NULL) {
+            printf("tfs_workload: out of memory\n");
+            exit(2);
+        }
+    }
+    l->ns[l->count++] = ns;
+}
+
+int compareNs(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+void fileName(long file, char *name) {
+    sprintf(name, "w%ld", file);
+}
+
+int createFile(long file, long size) {
+    /* makes 'file' with 'size' bytes, returns 0 or an error code */
+    char name[16];
+    fileName(file, name);
+    fileDescriptor fd = tfs_openFile(name);
+    if (fd < 0) {
+        return fd;
+    }
+    int result = tfs_writeFile(fd, wl.content, (int)size);
+    tfs_closeFile(fd);
+    if (result >= 0) {
+        wl.exists[file] = 1;
+    }
+    return result < 0 ? result : 0;
+}
+
+int runOperation(worker *w, int op, long file, char *buffer) {
+    /* does 'op' on 'file', or the operation it turns into, and returns that
+    operation, or -1 - that operation if it failed. Called with the lock held. */
+    char name[16];
+    fileName(file, name);
+    if (!wl.exists[file]) {
+        return createFile(file, nextSize(&w->rng)) < 0 ? -1 - WL_CREATE : WL_CREATE;
+    }
+    if (op == WL_CREATE) {
+        op = WL_WRITE;
+    }
+    fileDescriptor fd = tfs_openFile(name);
+    if (fd < 0) {
+        return -1 - op;
+    }
+    int result = 0;
+    if (op == WL_READ) {
+        int got;
+        while ((got = tfs_read(fd, buffer, WL_READ_SIZE)) > 0) {
+        }
+        result = got;
+    } else if (op == WL_WRITE) {
+        result = tfs_writeFile(fd, wl.content, (int)nextSize(&w->rng));
+    } else {
+        result = tfs_deleteFile(fd);
+        if (result >= 0) {
+            wl.exists[file] = 0;
+            return op; // tfs_deleteFile closed it
+        }
+    }
+    tfs_closeFile(fd);
+    return result < 0 ? -1 - op : op;
+}
+
+void *workerMain(void *arg) {
+    worker *w = (worker *)arg;
+    char *buffer = (char *)malloc(WL_READ_SIZE);
+    for (long i = 0; i < w->operations; i++) {
+        int percent = (int)(uniform01(&w->rng) * 100);
+        int op = 0;
+        while (op < WL_OPS - 1 && percent >= wl.mix[op]) {
+            percent -= wl.mix[op];
+            op++;
+        }
+        long file = nextFile(&w->rng);
+        long long start = nowNs();
+        pthread_mutex_lock(&wl.lock);
+        int done = runOperation(w, op, file, buffer);
+        pthread_mutex_unlock(&wl.lock);
+        long long elapsed = nowNs() - start;
+        if (done < 0) {
+            w->errors++;
+            done = -1 - done;
+        }
+        record(&w->done[done], elapsed);
+    }
+    free(buffer);
+    return NULL;
+}
+
+void printPercentiles(const char *label, long long *ns, long count, double seconds) {
+    /* sorts 'ns' and prints the rate and latency percentiles of one operation */
+    if (count == 0) {
+        return;
+    }
+    qsort(ns, count, sizeof(long long), compareNs);
+    printf("%-8s %9ld %11.0f %9.1f %9.1f %9.1f %9.1f %10.1f\n", label, count, count / seconds,
+        ns[(long)((count - 1) * 0.50)] / 1e3, ns[(long)((count - 1) * 0.90)] / 1e3,
+        ns[(long)((count - 1) * 0.99)] / 1e3, ns[(long)((count - 1) * 0.999)] / 1e3, ns[count - 1] / 1e3);
+}
+
+int parseSizes(char *spec) {
+    if (sscanf(spec, "fixed:%ld", &wl.sizeMax) == 1) {
+        wl.sizeKind = SIZE_FIXED;
+        wl.sizeMin = wl.sizeMax;
+    } else if (sscanf(spec, "uniform:%ld:%ld", &wl.sizeMin, &wl.sizeMax) == 2) {
+        wl.sizeKind = SIZE_UNIFORM;
+    } else if (sscanf(spec, "zipf:%ld:%lf", &wl.sizeMax, &wl.sizeTheta) >= 1) {
+        wl.sizeKind = SIZE_ZIPF;
+        wl.sizeMin = 1;
+    } else {
+        return -1;
+    }
+    if (wl.sizeMin < 0 || wl.sizeMax < wl.sizeMin || wl.sizeTheta < 0 || wl.sizeTheta >= 1) {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    wl.files = 1000;
+    wl.sizeKind = SIZE_FIXED;
+    wl.sizeMin = wl.sizeMax = 4096;
+    wl.sizeTheta = 0.99;
+    wl.mix[WL_READ] = 70;
+    wl.mix[WL_WRITE] = 20;
+    wl.mix[WL_CREATE] = 5;
+    wl.mix[WL_DELETE] = 5;
+    wl.skew = 0.99;
+    wl.threads = 1;
+    wl.operations = 100000;
+    wl.diskBytes = 64L << 20;
+    wl.image = "tfs_workload.dsk";
+    unsigned long seed = 1;
+    int policy = TFS_ALLOC_LIFO;
+    int keep = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:m:z:t:o:D:i:S:P:k")) != -1) {
+        int bad = 0;
+        switch (opt) {
+        case 'n': wl.files = atol(optarg); bad = wl.files < 1 || wl.files > 9999999; break;
+        case 's': bad = parseSizes(optarg) < 0; break;
+        case 'm':
+            bad = sscanf(optarg, "%d:%d:%d:%d", &wl.mix[0], &wl.mix[1], &wl.mix[2], &wl.mix[3]) != 4 ||
+                wl.mix[0] < 0 || wl.mix[1] < 0 || wl.mix[2] < 0 || wl.mix[3] < 0 ||
+                wl.mix[0] + wl.mix[1] + wl.mix[2] + wl.mix[3] != 100;
+            break;
+        case 'z': wl.skew = atof(optarg); bad = wl.skew < 0 || wl.skew >= 1; break;
+        case 't': wl.threads = atoi(optarg); bad = wl.threads < 1 || wl.threads > WL_MAX_THREADS; break;
+        case 'o': wl.operations = atol(optarg); bad = wl.operations < 0; break;
+        case 'D': wl.diskBytes = atol(optarg); bad = wl.diskBytes < BLOCKSIZE; break;
+        case 'i': wl.image = optarg; break;
+        case 'S': seed = strtoul(optarg, NULL, 10); break;
+        case 'P':
+            policy = 0;
+            while (policy < TFS_ALLOC_POLICIES && strcmp(optarg, policyNames[policy]) != 0) {
+                policy++;
+            }
+            bad = policy == TFS_ALLOC_POLICIES;
+            break;
+        case 'k': keep = 1; break;
+        default: bad = 1;
+        }
+        if (bad) {
+            printf("usage: tfs_workload [-n files] [-s fixed:B|uniform:MIN:MAX|zipf:MAX[:THETA]]\n"
+                "                    [-m read:write:create:delete] [-z skew] [-t threads]\n"
+                "                    [-o operations] [-D disk bytes] [-i image] [-S seed]\n"
+                "                    [-P lifo|nextfit|nearinode|bestfit] [-k]\n");
+            return 2;
+        }
+    }
+
+    wl.content = (char *)malloc(wl.sizeMax + 1);
+    wl.exists = (unsigned char *)calloc(wl.files, 1);
+    worker *workers = (worker *)calloc(wl.threads, sizeof(worker));
+    if (wl.content == NULL || wl.exists == NULL || workers == NULL) {
+        printf("tfs_workload: out of memory\n");
+        return 2;
+    }
+    uint64_t rng = 0x9E3779B97F4A7C15ULL ^ seed;
+    for (long i = 0; i < wl.sizeMax; i++) {
+        wl.content[i] = 'a' + (int)(uniform01(&rng) * 26);
+    }
+    if (wl.skew > 0) {
+        zipfianInit(&wl.pick, wl.files, wl.skew);
+    }
+    if (wl.sizeKind == SIZE_ZIPF) {
+        zipfianInit(&wl.sizes, wl.sizeMax, wl.sizeTheta);
+    }
+    pthread_mutex_init(&wl.lock, NULL);
+
+    if (tfs_mkfsPolicy(wl.image, wl.diskBytes, TFS_MKFS_FEATURES, policy) < 0 || tfs_mount(wl.image) < 0) {
+        printf("tfs_workload: could not make and mount %s\n", wl.image);
+        return 2;
+    }
+    printf("allocation policy %s\n", policyNames[policy]);
+    tfs_resetStats();
+
+    /* POPULATE */
+    printf("populating %ld files\n", wl.files);
+    printf("%-8s %9s %11s %9s %9s %9s %9s %10s\n", "files", "creates", "creates/s", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+    long step = (wl.files + WL_POPULATE_STEPS - 1) / WL_POPULATE_STEPS;
+    long long *stepNs = (long long *)malloc(step * sizeof(long long));
+    for (long first = 0; first < wl.files; first += step) {
+        long last = first + step < wl.files ? first + step : wl.files;
+        long long stepStart = nowNs();
+        for (long file = first; file < last; file++) {
+            long long start = nowNs();
+            if (createFile(file, nextSize(&rng)) < 0) {
+                printf("tfs_workload: could not create file %ld, the disk is probably full\n", file);
+                return 1;
+            }
+            stepNs[file - first] = nowNs() - start;
+        }
+        char label[16];
+        sprintf(label, "%ld", last);
+        printPercentiles(label, stepNs, last - first, (nowNs() - stepStart) / 1e9);
+    }
+    free(stepNs);
+
+    /* TIMED RUN */
+    tfs_resetStats();
+    long long runStart = nowNs();
+    for (int t = 0; t < wl.threads; t++) {
+        workers[t].rng = rng ^ ((uint64_t)(t + 1) * 0xD1B54A32D192ED03ULL);
+        workers[t].operations = wl.operations / wl.threads + (t < wl.operations % wl.threads);
+        if (pthread_create(&workers[t].thread, NULL, workerMain, &workers[t]) != 0) {
+            printf("tfs_workload: could not start thread %d\n", t);
+            return 2;
+        }
+    }
+    for (int t = 0; t < wl.threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+    double seconds = (nowNs() - runStart) / 1e9;
+
+    long errors = 0;
+    long fileReads = 0;
+    printf("\n%ld operations with %d thread%s in %.3f s, %.0f ops/s\n", wl.operations, wl.threads,
+        wl.threads == 1 ? "" : "s", seconds, seconds > 0 ? wl.operations / seconds : 0.0);
+    printf("%-8s %9s %11s %9s %9s %9s %9s %10s\n", "op", "count", "ops/s", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+    for (int op = 0; op < WL_OPS; op++) {
+        long count = 0;
+        for (int t = 0; t < wl.threads; t++) {
+            count += workers[t].done[op].count;
+        }
+        long long *all = (long long *)malloc((count ? count : 1) * sizeof(long long));
+        long n = 0;
+        for (int t = 0; t < wl.threads; t++) {
+            memcpy(all + n, workers[t].done[op].ns, workers[t].done[op].count * sizeof(long long));
+            n += workers[t].done[op].count;
+            free(workers[t].done[op].ns);
+        }
+        printPercentiles(wlOpNames[op], all, count, seconds);
+        fileReads = op == WL_READ ? count : fileReads;
+        free(all);
+    }
+    for (int t = 0; t < wl.threads; t++) {
+        errors += workers[t].errors;
+    }
+
+    tfsStats stats;
+    tfs_getStats(&stats);
+    printf("\n%-16s %9s %12s %12s %14s %11s %15s\n", "tfs call", "calls", "reads/call", "writes/call",
+        "amplification", "seeks/call", "seek dist/call");
+    for (int op = 0; op < TFS_OP_COUNT; op++) {
+        tfsOpStats *s = &stats.ops[op];
+        if (s->calls == 0) {
+            continue;
+        }
+        printf("%-16s %9ld %12.2f %12.2f %14.4f %11.2f %15.1f\n", tfs_opName(op), s->calls,
+            (double)s->blockReads / s->calls, (double)s->blockWrites / s->calls, s->amplification,
+            (double)s->seeks / s->calls, (double)s->seekBlocks / s->calls);
+    }
+    if (fileReads > 0) {
+        // the tfs_reads of one read operation read one file whole, from wherever the disk was left
+        tfsOpStats *reads = &stats.ops[TFS_OP_READ];
+        printf("per file read %.2f seeks, %.1f blocks of seek distance\n",
+            (double)reads->seeks / fileReads, (double)reads->seekBlocks / fileReads);
+    }
+    printf("failed operations %ld\n", errors);
+
+    tfs_unmount();
+    if (!keep) {
+        remove(wl.image);
+    }
+    free(workers);
+    free(wl.content);
+    free(wl.exists);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,672 @@
+/* TinyFS server daemon
+ *
+ * usage: tfsd [-s socket] [-t threads] [-f bytes] [-c 0|1] [-p policy] [-d blocks/s] image
+ *
+ * Mounts 'image' and serves it over the Unix domain socket 'socket'
+ * (tfsd.sock) to programs linked with libTinyFSClient, so several processes
+ * can share one image. -f formats the image with a new file system of
+ * 'bytes' bytes first, with block checksums unless -c 0 and placing blocks
+ * by the allocation policy -p names (lifo, nextfit, nearinode or bestfit,
+ * TFS_ALLOC_POLICY by default). -d defragments the image while it is served: a
+ * thread calls tfs_defrag() TFSD_DEFRAG_STEPS times a second for a share of
+ * 'blocks/s' blocks each, under the same lock as the requests, until one
+ * pass is done. SIGINT or SIGTERM unmounts the image cleanly, removes the
+ * socket and exits.
+ *
+ * The protocol is in libTinyFSClient.h. The main thread runs an epoll loop
+ * over the listening socket, a signalfd and every connection, each one
+ * registered with EPOLLONESHOT. A readable connection goes on a queue, and
+ * one of 'threads' worker threads (4) takes it, reads every byte it can,
+ * runs all the complete requests in it as one batch, writes all the
+ * responses and re-arms the connection. So a connection is served by one
+ * worker at a time and its requests run in order, while other connections
+ * are read, decoded and answered in parallel. The library is not thread
+ * safe, so a batch holds one lock around its tfs_* calls; batching makes a
+ * pipelined client pay for it once per batch instead of once per call.
+ * Descriptors are tracked per connection, a connection can not use another
+ * one's, and the files still open when a client goes away are closed. Two
+ * connections can not have the same file open, like two tfs_openFile calls
+ * in one process.
+ */
+#define _GNU_SOURCE // accept4, MSG_NOSIGNAL
+#include "libTinyFS.h"
+#include "libTinyFSClient.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+
+#define TFSD_DEFAULT_THREADS 4
+#define TFSD_MAX_THREADS 256
+#define TFSD_READ_CHUNK 65536 // bytes a connection's input buffer has room for past the data it holds
+#define TFSD_BATCH_BYTES (1 << 20) // input read before a batch runs, the rest waits for the next one
+#define TFSD_FLUSH_BYTES (1 << 20) // output written out in the middle of a batch, outside the lock
+#define TFSD_EVENTS 64 // epoll events taken per wait
+#define TFSD_READDIR_CHUNK 64 // entries fetched per tfs_readdirplus
+#define TFSD_DEFRAG_STEPS 10 // tfs_defrag calls per second with -d
+
+typedef struct connection {
+    int socket;
+    char *input; // bytes read and not run yet
+    size_t inputLength;
+    size_t inputCapacity;
+    char *output; // responses not written yet
+    size_t outputLength;
+    size_t outputCapacity;
+    fileDescriptor *files; // descriptors opened through this connection
+    int fileCount;
+    int fileCapacity;
+    struct connection *nextReady; // next connection in the work queue
+    struct connection *prev; // neighbours in the list of all connections
+    struct connection *next;
+} connection;
+
+typedef struct server {
+    int listener;
+    int epoll;
+    int signals;
+    int threads;
+    pthread_t workers[TFSD_MAX_THREADS];
+    double defragRate; // blocks per second -d moves, 0 without -d
+    pthread_t defragThread;
+    pthread_mutex_t queueLock; // guards everything below it
+    pthread_cond_t queueReady;
+    connection *readyHead; // connections to serve, oldest first
+    connection *readyTail;
+    connection *all; // every open connection
+    int stopping; // 1 once the workers should exit
+    long connections; // connections accepted
+    long requests; // requests run
+    long batches; // batches they ran in
+    pthread_mutex_t libraryLock; // held around every tfs_* call
+} server;
+
+server srv;
+
+int reserve(char **buffer, size_t *capacity, size_t needed) {
+    /* grows 'buffer' to hold at least 'needed' bytes, returns -1 if out of memory */
+    if (*capacity >= needed) {
+        return 0;
+    }
+    size_t newCapacity = *capacity ? *capacity : 4096;
+    while (newCapacity < needed) {
+        newCapacity *= 2;
+    }
+    char *grown = (char *)realloc(*buffer, newCapacity);
+    if (grown == NULL) {
+        return -1;
+    }
+    *buffer = grown;
+    *capacity = newCapacity;
+    return 0;
+}
+
+int ownsFile(connection *conn, fileDescriptor FD) {
+    /* returns the index of FD in the connection's descriptors, or -1 */
+    for (int i = 0; i < conn->fileCount; i++) {
+        if (conn->files[i] == FD) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int addFile(connection *conn, fileDescriptor FD) {
+    if (conn->fileCount == conn->fileCapacity) {
+        int newCapacity = conn->fileCapacity ? conn->fileCapacity * 2 : 8;
+        fileDescriptor *grown = (fileDescriptor *)realloc(conn->files, newCapacity * sizeof(fileDescriptor));
+        if (grown == NULL) {
+            return -1;
+        }
+        conn->files = grown;
+        conn->fileCapacity = newCapacity;
+    }
+    conn->files[conn->fileCount++] = FD;
+    return 0;
+}
+
+void removeFile(connection *conn, int index) {
+    conn->files[index] = conn->files[--conn->fileCount];
+}
+
+void closeConnection(connection *conn) {
+    /* closes the files the connection left open, its socket, and frees it */
+    pthread_mutex_lock(&srv.libraryLock);
+    for (int i = 0; i < conn->fileCount; i++) {
+        tfs_closeFile(conn->files[i]);
+    }
+    pthread_mutex_unlock(&srv.libraryLock);
+    pthread_mutex_lock(&srv.queueLock);
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        srv.all = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    pthread_mutex_unlock(&srv.queueLock);
+    epoll_ctl(srv.epoll, EPOLL_CTL_DEL, conn->socket, NULL);
+    close(conn->socket);
+    free(conn->input);
+    free(conn->output);
+    free(conn->files);
+    free(conn);
+}
+
+int writeOutput(connection *conn) {
+    /* writes all of the connection's output, waiting while the socket is full,
+    returns -1 if the client went away */
+    size_t written = 0;
+    while (written < conn->outputLength) {
+        ssize_t n = send(conn->socket, conn->output + written, conn->outputLength - written, MSG_NOSIGNAL);
+        if (n > 0) {
+            written += n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd wait = {conn->socket, POLLOUT, 0};
+            poll(&wait, 1, -1);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return -1;
+        }
+    }
+    conn->outputLength = 0;
+    return 0;
+}
+
+char *beginResponse(connection *conn, uint32_t tag, size_t dataCapacity) {
+    /* makes room for a response with up to 'dataCapacity' bytes of data at the
+    end of the output, returns where the data goes or NULL if out of memory.
+    endResponse fills in the header. */
+    if (reserve(&conn->output, &conn->outputCapacity, conn->outputLength + TFSD_RESPONSE_DATA_OFFSET + dataCapacity) < 0) {
+        return NULL;
+    }
+    char *response = conn->output + conn->outputLength;
+    memset(response, 0, TFSD_RESPONSE_DATA_OFFSET);
+    memcpy(response + TFSD_RESPONSE_TAG_OFFSET, &tag, sizeof(uint32_t));
+    return response + TFSD_RESPONSE_DATA_OFFSET;
+}
+
+void endResponse(connection *conn, int64_t result, size_t dataLength) {
+    char *response = conn->output + conn->outputLength;
+    uint32_t length = (uint32_t)(TFSD_RESPONSE_DATA_OFFSET + dataLength);
+    memcpy(response + TFSD_RESPONSE_LENGTH_OFFSET, &length, sizeof(uint32_t));
+    memcpy(response + TFSD_RESPONSE_RESULT_OFFSET, &result, sizeof(int64_t));
+    conn->outputLength += length;
+}
+
+int runRequest(connection *conn, char *request, uint32_t length) {
+    /* runs one request and appends its response, returns -1 if the request is
+    malformed or there is no memory for the response */
+    uint32_t tag;
+    int32_t FD;
+    memcpy(&tag, request + TFSD_REQUEST_TAG_OFFSET, sizeof(uint32_t));
+    memcpy(&FD, request + TFSD_REQUEST_FD_OFFSET, sizeof(int32_t));
+    int op = (unsigned char)request[TFSD_REQUEST_OP_OFFSET];
+    char *args = request + TFSD_REQUEST_ARGS_OFFSET;
+    uint32_t argsLength = length - TFSD_REQUEST_ARGS_OFFSET;
+    int isPath = op == TFSD_OP_OPEN || op == TFSD_OP_MKDIR || op == TFSD_OP_RMDIR || op == TFSD_OP_OPENDIR;
+    int usesFD = op == TFSD_OP_CLOSE || op == TFSD_OP_READ || op == TFSD_OP_WRITE || op == TFSD_OP_PWRITE
+        || op == TFSD_OP_SEEK || op == TFSD_OP_DELETE;
+    if (op < 1 || op >= TFSD_OP_COUNT) {
+        return -1;
+    }
+    if (isPath && (argsLength == 0 || args[argsLength - 1] != '\0')) {
+        return -1;
+    }
+    if ((op == TFSD_OP_READ && argsLength != sizeof(int32_t))
+        || ((op == TFSD_OP_SEEK || op == TFSD_OP_PWRITE) && argsLength < sizeof(int64_t))
+        || (op == TFSD_OP_READDIR && argsLength != TFSD_CURSOR_SIZE + sizeof(int32_t))) {
+        return -1;
+    }
+
+    size_t dataCapacity = 0;
+    int32_t size = 0;
+    if (op == TFSD_OP_READ) {
+        memcpy(&size, args, sizeof(int32_t));
+        size = size < 0 ? 0 : size > TFSD_MAX_PAYLOAD ? TFSD_MAX_PAYLOAD : size;
+        dataCapacity = size;
+    } else if (op == TFSD_OP_OPENDIR) {
+        dataCapacity = TFSD_CURSOR_SIZE;
+    } else if (op == TFSD_OP_READDIR) {
+        memcpy(&size, args + TFSD_CURSOR_SIZE, sizeof(int32_t));
+        size = size < 0 ? 0 : size > TFSD_MAX_PAYLOAD / TFSD_ENTRY_SIZE ? TFSD_MAX_PAYLOAD / TFSD_ENTRY_SIZE : size;
+        dataCapacity = TFSD_CURSOR_SIZE + (size_t)size * TFSD_ENTRY_SIZE;
+    }
+    char *data = beginResponse(conn, tag, dataCapacity);
+    if (data == NULL) {
+        return -1;
+    }
+    int owned = usesFD ? ownsFile(conn, FD) : -1;
+    if (usesFD && owned < 0) {
+        endResponse(conn, TFSD_EBADFD, 0);
+        return 0;
+    }
+
+    int64_t result = 0;
+    size_t dataLength = 0;
+    int64_t offset;
+    dirCursor cursor;
+    switch (op) {
+    case TFSD_OP_OPEN:
+        result = tfs_openFile(args);
+        if (result >= 0 && addFile(conn, (fileDescriptor)result) < 0) {
+            tfs_closeFile((fileDescriptor)result);
+            return -1;
+        }
+        break;
+    case TFSD_OP_CLOSE:
+        result = tfs_closeFile(FD);
+        if (result >= 0) {
+            removeFile(conn, owned);
+        }
+        break;
+    case TFSD_OP_READ:
+        result = tfs_read(FD, data, size);
+        dataLength = result > 0 ? (size_t)result : 0;
+        break;
+    case TFSD_OP_WRITE:
+        result = tfs_writeFile(FD, args, (int)argsLength);
+        break;
+    case TFSD_OP_PWRITE:
+        memcpy(&offset, args, sizeof(int64_t));
+        result = tfs_pwrite(FD, args + sizeof(int64_t), (int)(argsLength - sizeof(int64_t)), offset);
+        break;
+    case TFSD_OP_SEEK:
+        memcpy(&offset, args, sizeof(int64_t));
+        result = tfs_seek(FD, offset);
+        break;
+    case TFSD_OP_DELETE:
+        result = tfs_deleteFile(FD);
+        if (result >= 0) {
+            removeFile(conn, owned); // tfs_deleteFile closes it
+        }
+        break;
+    case TFSD_OP_MKDIR:
+        result = tfs_mkdir(args);
+        break;
+    case TFSD_OP_RMDIR:
+        result = tfs_rmdir(args);
+        break;
+    case TFSD_OP_OPENDIR:
+        result = tfs_openDirCursor(args, &cursor);
+        if (result >= 0) {
+            encodeCursor(&cursor, data);
+            dataLength = TFSD_CURSOR_SIZE;
+        }
+        break;
+    case TFSD_OP_READDIR: {
+        dirEntryPlus entries[TFSD_READDIR_CHUNK];
+        decodeCursor(args, &cursor);
+        while (result < size) {
+            int wanted = size - result < TFSD_READDIR_CHUNK ? (int)(size - result) : TFSD_READDIR_CHUNK;
+            int count = tfs_readdirplus(&cursor, entries, wanted);
+            if (count < 0) {
+                result = result > 0 ? result : count; // report the entries already listed
+                break;
+            }
+            if (count == 0) {
+                break;
+            }
+            for (int i = 0; i < count; i++) {
+                encodeEntry(&entries[i], data + TFSD_CURSOR_SIZE + (result + i) * TFSD_ENTRY_SIZE);
+            }
+            result += count;
+        }
+        if (result >= 0) {
+            encodeCursor(&cursor, data);
+            dataLength = TFSD_CURSOR_SIZE + (size_t)result * TFSD_ENTRY_SIZE;
+        }
+        break;
+    }
+    }
+    endResponse(conn, result, dataLength);
+    return 0;
+}
+
+int serveConnection(connection *conn) {
+    /* reads what the client sent, runs the complete requests as one batch and
+    writes their responses. Returns -1 once the connection should be closed. */
+    int closing = 0;
+    while (conn->inputLength < TFSD_BATCH_BYTES) {
+        size_t needed = conn->inputLength + TFSD_READ_CHUNK;
+        if (conn->inputLength >= TFSD_REQUEST_HEADER_SIZE) {
+            uint32_t length;
+            memcpy(&length, conn->input + TFSD_REQUEST_LENGTH_OFFSET, sizeof(uint32_t));
+            needed = length > needed ? length : needed; // room for a whole large request
+        }
+        if (reserve(&conn->input, &conn->inputCapacity, needed) < 0) {
+            return -1;
+        }
+        ssize_t n = recv(conn->socket, conn->input + conn->inputLength, conn->inputCapacity - conn->inputLength, MSG_DONTWAIT);
+        if (n > 0) {
+            conn->inputLength += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            closing = 1; // the client is gone, or sent its last request
+            break;
+        }
+    }
+
+    size_t ran = 0;
+    long count = 0;
+    int locked = 0;
+    while (conn->inputLength - ran >= TFSD_REQUEST_HEADER_SIZE) {
+        char *request = conn->input + ran;
+        uint32_t length;
+        memcpy(&length, request + TFSD_REQUEST_LENGTH_OFFSET, sizeof(uint32_t));
+        if (length < TFSD_REQUEST_HEADER_SIZE || length > TFSD_MAX_REQUEST) {
+            closing = 1;
+            break;
+        }
+        if (conn->inputLength - ran < length) {
+            break;
+        }
+        if (!locked) {
+            pthread_mutex_lock(&srv.libraryLock);
+            locked = 1;
+        }
+        if (runRequest(conn, request, length) < 0) {
+            closing = 1;
+            break;
+        }
+        ran += length;
+        count++;
+        if (conn->outputLength >= TFSD_FLUSH_BYTES) {
+            pthread_mutex_unlock(&srv.libraryLock);
+            locked = 0;
+            if (writeOutput(conn) < 0) {
+                closing = 1;
+                break;
+            }
+        }
+    }
+    if (locked) {
+        pthread_mutex_unlock(&srv.libraryLock);
+    }
+    memmove(conn->input, conn->input + ran, conn->inputLength - ran);
+    conn->inputLength -= ran;
+    if (count > 0) {
+        pthread_mutex_lock(&srv.queueLock);
+        srv.requests += count;
+        srv.batches++;
+        pthread_mutex_unlock(&srv.queueLock);
+    }
+    if (writeOutput(conn) < 0) {
+        return -1;
+    }
+    return closing ? -1 : 0;
+}
+
+void *workerMain(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&srv.queueLock);
+        while (srv.readyHead == NULL && !srv.stopping) {
+            pthread_cond_wait(&srv.queueReady, &srv.queueLock);
+        }
+        connection *conn = srv.readyHead;
+        if (conn == NULL) {
+            pthread_mutex_unlock(&srv.queueLock);
+            return NULL;
+        }
+        srv.readyHead = conn->nextReady;
+        if (srv.readyHead == NULL) {
+            srv.readyTail = NULL;
+        }
+        pthread_mutex_unlock(&srv.queueLock);
+
+        if (serveConnection(conn) < 0) {
+            closeConnection(conn);
+            continue;
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        event.data.ptr = conn;
+        if (epoll_ctl(srv.epoll, EPOLL_CTL_MOD, conn->socket, &event) < 0) {
+            closeConnection(conn);
+        }
+    }
+}
+
+void printDefragReport(char *label) {
+    tfsDefragReport report;
+    pthread_mutex_lock(&srv.libraryLock);
+    int result = tfs_defragReport(&report);
+    pthread_mutex_unlock(&srv.libraryLock);
+    if (result >= 0) {
+        printf("tfsd: %s defragmentation: fragmentation %.3f, %lld extents for %lld files, %lld blocks moved\n", label,
+            report.fragmentation, (long long)report.extents, (long long)report.files, (long long)report.moved);
+        fflush(stdout);
+    }
+}
+
+void *defragMain(void *arg) {
+    /* one defragmentation pass, a step at a time, holding the library lock
+    for a step and sleeping in between so the workers get it */
+    long step = (long)(srv.defragRate / TFSD_DEFRAG_STEPS);
+    if (step < 1) {
+        step = 1;
+    }
+    double seconds = step / srv.defragRate;
+    struct timespec pause = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)};
+    printDefragReport("before");
+    for (;;) {
+        pthread_mutex_lock(&srv.queueLock);
+        int stopping = srv.stopping;
+        pthread_mutex_unlock(&srv.queueLock);
+        if (stopping) {
+            break;
+        }
+        pthread_mutex_lock(&srv.libraryLock);
+        int result = tfs_defrag(step);
+        pthread_mutex_unlock(&srv.libraryLock);
+        if (result <= 0) {
+            break;
+        }
+        nanosleep(&pause, NULL);
+    }
+    printDefragReport("after");
+    return NULL;
+}
+
+void acceptConnections(void) {
+    for (;;) {
+        int fd = accept4(srv.listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return; // EAGAIN once there are no more, anything else is the client's problem
+        }
+        connection *conn = (connection *)calloc(1, sizeof(connection));
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+        conn->socket = fd;
+        pthread_mutex_lock(&srv.queueLock);
+        conn->next = srv.all;
+        if (srv.all != NULL) {
+            srv.all->prev = conn;
+        }
+        srv.all = conn;
+        srv.connections++;
+        pthread_mutex_unlock(&srv.queueLock);
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        event.data.ptr = conn;
+        if (epoll_ctl(srv.epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+            closeConnection(conn);
+        }
+    }
+}
+
+int listenOn(char *path) {
+    /* makes the listening socket at 'path', replacing a stale one */
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        printf("tfsd: socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    srv.listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (srv.listener < 0) {
+        perror("tfsd: socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(srv.listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(srv.listener, SOMAXCONN) < 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char *socketPath = TFSD_DEFAULT_SOCKET;
+    long long formatBytes = 0;
+    int features = TFS_MKFS_FEATURES;
+    int policy = TFS_ALLOC_POLICY;
+    const char *policyNames[TFS_ALLOC_POLICIES] = TFS_ALLOC_POLICY_NAMES;
+    srv.threads = TFSD_DEFAULT_THREADS;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:t:f:c:p:d:")) != -1) {
+        if (opt == 's') {
+            socketPath = optarg;
+        } else if (opt == 't') {
+            srv.threads = atoi(optarg);
+        } else if (opt == 'f') {
+            formatBytes = atoll(optarg);
+        } else if (opt == 'c') {
+            features = atoi(optarg) ? SUPER_FEATURE_CHECKSUMS : 0;
+        } else if (opt == 'p') {
+            policy = 0;
+            while (policy < TFS_ALLOC_POLICIES && strcmp(optarg, policyNames[policy]) != 0) {
+                policy++;
+            }
+            if (policy == TFS_ALLOC_POLICIES) {
+                optind = argc + 1;
+                break;
+            }
+        } else if (opt == 'd') {
+            srv.defragRate = atof(optarg);
+            if (srv.defragRate <= 0) {
+                optind = argc + 1;
+                break;
+            }
+        } else {
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind != argc - 1 || srv.threads < 1 || srv.threads > TFSD_MAX_THREADS || formatBytes < 0) {
+        printf("usage: tfsd [-s socket] [-t threads (1-%d)] [-f bytes] [-c 0|1] [-p lifo|nextfit|nearinode|bestfit]\n"
+            "            [-d blocks/s] image\n", TFSD_MAX_THREADS);
+        return 2;
+    }
+    char *image = argv[optind];
+    if (formatBytes > 0 && tfs_mkfsPolicy(image, formatBytes, features, policy) < 0) {
+        printf("tfsd: can not format %s\n", image);
+        return 1;
+    }
+    if (tfs_mount(image) < 0) {
+        printf("tfsd: can not mount %s\n", image);
+        return 1;
+    }
+
+    /* the signals are taken through a signalfd, so every thread blocks them */
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+    srv.signals = signalfd(-1, &stopSignals, SFD_NONBLOCK | SFD_CLOEXEC);
+    srv.epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (srv.signals < 0 || srv.epoll < 0 || listenOn(socketPath) < 0) {
+        perror("tfsd");
+        tfs_unmount();
+        return 1;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &srv.listener;
+    epoll_ctl(srv.epoll, EPOLL_CTL_ADD, srv.listener, &event);
+    event.data.ptr = &srv.signals;
+    epoll_ctl(srv.epoll, EPOLL_CTL_ADD, srv.signals, &event);
+
+    pthread_mutex_init(&srv.queueLock, NULL);
+    pthread_cond_init(&srv.queueReady, NULL);
+    pthread_mutex_init(&srv.libraryLock, NULL);
+    for (int i = 0; i < srv.threads; i++) {
+        if (pthread_create(&srv.workers[i], NULL, workerMain, NULL) != 0) {
+            printf("tfsd: can not start worker %d\n", i);
+            srv.threads = i;
+            break;
+        }
+    }
+    printf("tfsd: serving %s on %s with %d worker threads\n", image, socketPath, srv.threads);
+    fflush(stdout);
+    int defragging = srv.defragRate > 0 && pthread_create(&srv.defragThread, NULL, defragMain, NULL) == 0;
+
+    struct epoll_event events[TFSD_EVENTS];
+    int running = srv.threads > 0;
+    while (running) {
+        int count = epoll_wait(srv.epoll, events, TFSD_EVENTS, -1);
+        if (count < 0 && errno != EINTR) {
+            perror("tfsd: epoll_wait");
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == &srv.listener) {
+                acceptConnections();
+            } else if (events[i].data.ptr == &srv.signals) {
+                running = 0;
+            } else {
+                connection *conn = (connection *)events[i].data.ptr;
+                pthread_mutex_lock(&srv.queueLock);
+                conn->nextReady = NULL;
+                if (srv.readyTail != NULL) {
+                    srv.readyTail->nextReady = conn;
+                } else {
+                    srv.readyHead = conn;
+                }
+                srv.readyTail = conn;
+                pthread_cond_signal(&srv.queueReady);
+                pthread_mutex_unlock(&srv.queueLock);
+            }
+        }
+    }
+
+    /* the workers finish the connections already queued, the rest are dropped */
+    pthread_mutex_lock(&srv.queueLock);
+    srv.stopping = 1;
+    pthread_cond_broadcast(&srv.queueReady);
+    pthread_mutex_unlock(&srv.queueLock);
+    for (int i = 0; i < srv.threads; i++) {
+        pthread_join(srv.workers[i], NULL);
+    }
+    if (defragging) {
+        pthread_join(srv.defragThread, NULL);
+    }
+    while (srv.all != NULL) {
+        closeConnection(srv.all);
+    }
+    close(srv.listener);
+    unlink(socketPath);
+    int result = tfs_unmount();
+    printf("tfsd: %ld connections, %ld requests in %ld batches\n", srv.connections, srv.requests, srv.batches);
+    return result < 0 ? 1 : 0;
+}
@@ -41,5 +41,9 @@ you might want to catch and report
 #define EFSEEK -14
 // file rename error
 #define ERENAME -15
+// directory create/remove/lookup error
+#define EDIR -16
+// no connection to tfsd, or it was lost
+#define ECONN -17
 
 #endif
\ No newline at end of file